@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdarg.h>
+#include <stdio.h>
 
 enum log_level {
   LOG_ERROR,
@@ -12,6 +13,8 @@ enum log_level {
 
 extern const char *log_prefixes[][2];
 extern int         log_verbosity;
+/* 本线程日志的输出流，NULL 表示 stderr；ktuctl_exec_script() 借此捕获命令的日志，不影响其它线程 */
+extern _Thread_local FILE *log_stream;
 
 #define _(text)       text
 #define gettext(text) _(text)
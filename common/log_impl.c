@@ -8,9 +8,11 @@ const char *log_prefixes[][2] = {
   {BOLD BLUE, N_("Debug")}, {BOLD GRAY, N_("Trace")},
 };
 
-int log_verbosity = 2;
+int                 log_verbosity = 2;
+_Thread_local FILE *log_stream;
 
 void log_any(int level, const char *fmt, ...) {
+  FILE   *fp = log_stream ? log_stream : stderr;
   va_list ap;
   va_start(ap, fmt);
 
@@ -21,13 +23,13 @@ void log_any(int level, const char *fmt, ...) {
     level = LOG_TRACE;
 
   if (log_verbosity >= level) {
-    fprintf(stderr, "%s%s " RESET, log_prefixes[level][0], gettext(log_prefixes[level][1]));
+    fprintf(fp, "%s%s " RESET, log_prefixes[level][0], gettext(log_prefixes[level][1]));
     if (level >= LOG_TRACE)
-      fputs(GRAY, stderr);
-    vfprintf(stderr, fmt, ap);
+      fputs(GRAY, fp);
+    vfprintf(fp, fmt, ap);
     if (level >= LOG_TRACE)
-      fputs(RESET, stderr);
-    fprintf(stderr, "\n");
+      fputs(RESET, fp);
+    fprintf(fp, "\n");
   }
   va_end(ap);
 }
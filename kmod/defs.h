@@ -40,4 +40,26 @@
 
 #define try2_p_ok(x, ...) try2_p_ret(x, NF_ACCEPT, ##__VA_ARGS__)
 
+// 与 try2_ok/try2_p_ok 相同，但失败时先把 hook 内的 `reason` 设为 r，
+// 供 hook 出口统计放行/丢弃原因
+#define try2_ok_reason(expr, r, ...)                                                                                           \
+  ({                                                                                                                           \
+    long _ret = (expr);                                                                                                        \
+    if (unlikely(_ret < 0)) {                                                                                                  \
+      reason = (r);                                                                                                            \
+      err_cleanup(NF_ACCEPT, ##__VA_ARGS__);                                                                                   \
+    }                                                                                                                          \
+    _ret;                                                                                                                      \
+  })
+
+#define try2_p_ok_reason(expr, r, ...)                                                                                         \
+  ({                                                                                                                           \
+    void *_ptr = (expr);                                                                                                       \
+    if (unlikely(!_ptr)) {                                                                                                     \
+      reason = (r);                                                                                                            \
+      err_cleanup(NF_ACCEPT, ##__VA_ARGS__);                                                                                   \
+    }                                                                                                                          \
+    _ptr;                                                                                                                      \
+  })
+
 // vim: set sw=2 ts=2 expandtab:
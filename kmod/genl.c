@@ -8,8 +8,10 @@
 #include <linux/version.h>
 
 #include <net/genetlink.h>
+#include <net/ipv6.h>
 
 #include "hashtab.h"
+#include "pernet.h"
 #include "tutuicmptunnel.h"
 
 /* -1 表示不启用该检查 */
@@ -22,15 +24,16 @@ MODULE_PARM_DESC(allowed_uid, "Extra allowed euid (int, -1 to disable)");
 module_param(allowed_gid, int, 0644);
 MODULE_PARM_DESC(allowed_gid, "Extra allowed egid (int, -1 to disable)");
 
-extern struct list_head tutu_ifname_list;
-extern struct mutex     tutu_ifname_lock;
-
 static bool tutu_user_allowed(const struct sk_buff *skb, const struct genl_info *info) {
   const struct scm_creds *creds;
   kuid_t                  uid;
   kgid_t                  gid;
 
-  /* 1. 只要有 CAP_NET_ADMIN 就放行（通常是 root 或带该 capability 的服务） */
+  /*
+   * 1. 只要有初始用户命名空间的 CAP_NET_ADMIN 就放行（通常是 root 或带该 capability 的服务）。
+   * 不接受 netns 所属用户命名空间的 capability：否则任何用户都能在 unshare -Urn 里激活命名空间，
+   * 注册 hook、打开 nf_defrag 并分配全部 map。
+   */
   if (netlink_capable(skb, CAP_NET_ADMIN))
     return true;
 
@@ -81,6 +84,12 @@ static const struct nla_policy tutu_genl_policy[TUTU_ATTR_MAX + 1] = {
   [TUTU_ATTR_SESSION]     = {.type = NLA_BINARY, .len = sizeof(struct tutu_session)},
   [TUTU_ATTR_USER_INFO]   = {.type = NLA_BINARY, .len = sizeof(struct tutu_user_info)},
   [TUTU_ATTR_IFNAME_NAME] = {.type = NLA_NUL_STRING, .len = IFNAMSIZ - 1},
+  [TUTU_ATTR_USER_STATS]  = {.type = NLA_BINARY, .len = sizeof(struct tutu_user_stats)},
+  [TUTU_ATTR_PEER_STATS]  = {.type = NLA_BINARY, .len = sizeof(struct tutu_peer_stats)},
+  [TUTU_ATTR_LATENCY]     = {.type = NLA_BINARY, .len = sizeof(struct tutu_latency)},
+  [TUTU_ATTR_BATCH]       = {.type = NLA_NESTED},
+  [TUTU_ATTR_DUMP_FILTER] = {.type = NLA_BINARY, .len = sizeof(struct tutu_dump_filter)},
+  [TUTU_ATTR_TXN]         = {.type = NLA_FLAG},
 };
 
 static struct genl_family tutu_genl_family;
@@ -99,7 +108,8 @@ static int tutu_genl_clr_stats(struct sk_buff *skb, struct genl_info *info);
  * session_value 没有 xor_key_len，会直接编译失败。
  *
  * 所以这里用 validator macro：
- *   - TUTU_GENL_VALIDATE_XOR: 用于 egress / ingress / user_info
+ *   - TUTU_GENL_VALIDATE_XOR: 用于 egress / ingress
+ *   - TUTU_GENL_VALIDATE_USER: 用于 user_info，额外清零 key 的填充字节
  *   - TUTU_GENL_VALIDATE_NONE: 用于 session
  */
 #define TUTU_GENL_VALIDATE_NONE(_entry, _info)                                                                                 \
@@ -119,22 +129,104 @@ static int tutu_genl_clr_stats(struct sk_buff *skb, struct genl_info *info);
     }                                                                                                                          \
   } while (0)
 
+#define TUTU_GENL_VALIDATE_USER(_entry, _info)                                                                                 \
+  do {                                                                                                                         \
+    TUTU_GENL_VALIDATE_XOR(_entry, _info);                                                                                     \
+    memset((_entry).key.reserved, 0, sizeof((_entry).key.reserved));                                                           \
+  } while (0)
+
+/*
+ * dump 请求的过滤条件：直接在请求消息中查找属性，不依赖各内核版本对 dumpit 属性解析的差异。
+ * supported 为该 map 支持的 TUTU_DUMP_FILTER_* 组合。
+ */
+static int tutu_dump_filter_parse(struct netlink_callback *cb, struct tutu_dump_filter *f, u32 supported) {
+  const struct nlattr *attr = nlmsg_find_attr(cb->nlh, GENL_HDRLEN, TUTU_ATTR_DUMP_FILTER);
+
+  if (!attr)
+    return 0;
+  if (nla_len(attr) != sizeof(*f))
+    return -EINVAL;
+
+  memcpy(f, nla_data(attr), sizeof(*f));
+  if (f->flags & ~supported)
+    return -EOPNOTSUPP;
+  if (f->prefix_len > 128 || f->projection > TUTU_DUMP_COUNT)
+    return -EINVAL;
+  if ((f->flags & TUTU_DUMP_FILTER_AGE) && f->min_age > f->max_age)
+    return -EINVAL;
+
+  return 0;
+}
+
+static bool tutu_dump_match(const struct tutu_dump_filter *f, const struct in6_addr *addr, u8 uid, __be16 port) {
+  if ((f->flags & TUTU_DUMP_FILTER_UID) && uid != f->uid)
+    return false;
+  if ((f->flags & TUTU_DUMP_FILTER_ADDR) && !ipv6_prefix_equal(addr, &f->address, f->prefix_len))
+    return false;
+  if ((f->flags & TUTU_DUMP_FILTER_PORT) && port != f->port)
+    return false;
+  return true;
+}
+
+/* TUTU_DUMP_COUNT：遍历结束后单独发送一条带计数的消息 */
+static int tutu_dump_put_count(struct sk_buff *skb, struct netlink_callback *cb, u8 cmd, u32 count) {
+  void *hdr;
+
+  hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq, &tutu_genl_family, NLM_F_MULTI, cmd);
+  if (!hdr)
+    return -EMSGSIZE;
+
+  if (nla_put_u32(skb, TUTU_ATTR_DUMP_COUNT, count)) {
+    genlmsg_cancel(skb, hdr);
+    return -EMSGSIZE;
+  }
+  genlmsg_end(skb, hdr);
+  return 0;
+}
+
+#define TUTU_DUMP_FILTER_COMMON (TUTU_DUMP_FILTER_UID | TUTU_DUMP_FILTER_ADDR | TUTU_DUMP_FILTER_PORT)
+
+/* 事务暂存区中与各表对应的副本；会话不参与事务，返回 NULL */
+static struct tutu_htab *tutu_txn_map_egress(struct tutu_txn *txn) {
+  return txn->egress_peer_map;
+}
+
+static struct tutu_htab *tutu_txn_map_ingress(struct tutu_txn *txn) {
+  return txn->ingress_peer_map;
+}
+
+static struct tutu_htab *tutu_txn_map_session(struct tutu_txn *txn) {
+  return NULL;
+}
+
+static struct tutu_htab *tutu_txn_map_user_info(struct tutu_txn *txn) {
+  return txn->user_map;
+}
+
 /*
  * 通用宏：生成 get (doit/dumpit) / delete / update 函数。
  *
  * _validate 用于 update 前检查 entry.value。
  * 这样 session 也可以继续用这个宏，不需要手写一整套函数。
+ * delete/update 成功后调用 tutu_genl_event_<_dir>() 发出事件。
+ * 带 TUTU_ATTR_BATCH 的 delete/update 交给 tutu_genl_batch_<_dir>() 处理。
+ * 带 TUTU_ATTR_TXN 的 delete/update 由 tutu_genl_target_<_dir>() 改为作用于事务暂存区。
+ * dump 用 tutu_genl_match_<_dir>() 求值过滤条件，_filters 为支持的 TUTU_DUMP_FILTER_* 组合。
  */
-#define DEFINE_TUTU_GENL_FUNCS(_dir, _map, _value_type, _attr, _CMD_GET, _validate)                                            \
+#define DEFINE_TUTU_GENL_FUNCS(_dir, _map, _value_type, _attr, _CMD_GET, _validate, _filters)                                  \
                                                                                                                                \
   /* --- 1. Single Lookup (GET DOIT) --- */                                                                                    \
   static int tutu_genl_get_##_dir(struct sk_buff *skb, struct genl_info *info) {                                               \
     struct tutu_##_dir entry;                                                                                                  \
+    struct tutu_net   *tn;                                                                                                     \
     _value_type       *value;                                                                                                  \
     struct sk_buff    *msg;                                                                                                    \
     void              *hdr;                                                                                                    \
     int                err = 0;                                                                                                \
                                                                                                                                \
+    tn = tutu_net_peek(genl_info_net(info));                                                                                   \
+    if (!tn)                                                                                                                   \
+      return -ENOENT;                                                                                                          \
     if (!info->attrs[_attr])                                                                                                   \
       return -EINVAL;                                                                                                          \
     if (nla_len(info->attrs[_attr]) != sizeof(entry))                                                                          \
@@ -144,7 +236,7 @@ static int tutu_genl_clr_stats(struct sk_buff *skb, struct genl_info *info);
     memcpy(&entry, nla_data(info->attrs[_attr]), sizeof(entry));                                                               \
                                                                                                                                \
     rcu_read_lock();                                                                                                           \
-    value = tutu_map_lookup_elem(_map, &entry.key);                                                                            \
+    value = tutu_map_lookup_elem(tn->_map, &entry.key);                                                                        \
     if (value)                                                                                                                 \
       memcpy(&entry.value, value, sizeof(entry.value));                                                                        \
     else                                                                                                                       \
@@ -175,83 +267,98 @@ static int tutu_genl_clr_stats(struct sk_buff *skb, struct genl_info *info);
   }                                                                                                                            \
                                                                                                                                \
   /* --- 2. Dump Operations (GET DUMPIT) --- */                                                                                \
-  /* 上下文结构，用于在多次 recv 之间保存遍历状态 (Key) */                                                                     \
+  /* 上下文结构，用于在多次 recv 之间保存遍历状态（桶下标 + 桶内偏移）和过滤条件 */                                            \
   struct tutu_dump_ctx_##_dir {                                                                                                \
-    bool               started;                                                                                                \
-    bool               done;                                                                                                   \
-    struct tutu_##_dir cursor_entry; /* 保存当前的 Key */                                                                      \
+    bool                     done;                                                                                             \
+    u32                      bucket;                                                                                           \
+    u32                      skip;                                                                                             \
+    u32                      count;                                                                                            \
+    u64                      now;                                                                                              \
+    struct tutu_dump_filter  filter;                                                                                           \
+    struct sk_buff          *skb;                                                                                              \
+    struct netlink_callback *cb;                                                                                               \
   };                                                                                                                           \
                                                                                                                                \
-  static int tutu_genl_dump_##_dir(struct sk_buff *skb, struct netlink_callback *cb) {                                         \
-    struct tutu_dump_ctx_##_dir *ctx = (void *) cb->args[0];                                                                   \
+  static int tutu_genl_dump_one_##_dir(void *key, void *val, void __percpu *pcpu, void *arg) {                                 \
+    struct tutu_dump_ctx_##_dir *ctx = arg;                                                                                    \
     struct tutu_##_dir           temp_entry;                                                                                   \
-    _value_type                 *val;                                                                                          \
     void                        *hdr;                                                                                          \
     int                          err;                                                                                          \
                                                                                                                                \
-    /* 第一次调用分配上下文 */                                                                                                 \
+    /* 组装数据 */                                                                                                             \
+    memcpy(&temp_entry.key, key, sizeof(temp_entry.key));                                                                      \
+    memcpy(&temp_entry.value, val, sizeof(temp_entry.value));                                                                  \
+    temp_entry.map_flags = 0;                                                                                                  \
+                                                                                                                               \
+    if (!tutu_genl_match_##_dir(&ctx->filter, &temp_entry, ctx->now))                                                          \
+      return 0;                                                                                                                \
+                                                                                                                               \
+    if (ctx->filter.projection == TUTU_DUMP_COUNT) {                                                                           \
+      ctx->count++;                                                                                                            \
+      return 0;                                                                                                                \
+    }                                                                                                                          \
+                                                                                                                               \
+    hdr = genlmsg_put(ctx->skb, NETLINK_CB(ctx->cb->skb).portid, ctx->cb->nlh->nlmsg_seq, &tutu_genl_family, NLM_F_MULTI,      \
+                      _CMD_GET);                                                                                               \
+    if (!hdr)                                                                                                                  \
+      return -EMSGSIZE; /* Buffer full */                                                                                      \
+                                                                                                                               \
+    if (ctx->filter.projection == TUTU_DUMP_KEYS)                                                                              \
+      err = nla_put(ctx->skb, TUTU_ATTR_DUMP_KEY, sizeof(temp_entry.key), &temp_entry.key);                                    \
+    else                                                                                                                       \
+      err = nla_put(ctx->skb, _attr, sizeof(temp_entry), &temp_entry);                                                         \
+    if (err) {                                                                                                                 \
+      genlmsg_cancel(ctx->skb, hdr);                                                                                           \
+      return -EMSGSIZE; /* Buffer full */                                                                                      \
+    }                                                                                                                          \
+    genlmsg_end(ctx->skb, hdr);                                                                                                \
+    return 0;                                                                                                                  \
+  }                                                                                                                            \
+                                                                                                                               \
+  static int tutu_genl_dump_##_dir(struct sk_buff *skb, struct netlink_callback *cb) {                                         \
+    struct tutu_dump_ctx_##_dir *ctx = (void *) cb->args[0];                                                                   \
+    struct tutu_net             *tn;                                                                                           \
+    int                          err;                                                                                          \
+                                                                                                                               \
+    tn = tutu_net_peek(sock_net(cb->skb->sk));                                                                                 \
+    if (!tn)                                                                                                                   \
+      return 0;                                                                                                                \
+                                                                                                                               \
+    /* 第一次调用分配上下文并解析过滤条件 */                                                                                   \
     if (!ctx) {                                                                                                                \
       ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);                                                                                 \
       if (!ctx)                                                                                                                \
         return -ENOMEM;                                                                                                        \
       cb->args[0] = (unsigned long) ctx;                                                                                       \
+                                                                                                                               \
+      err = tutu_dump_filter_parse(cb, &ctx->filter, _filters);                                                                \
+      if (err)                                                                                                                 \
+        return err;                                                                                                            \
+      ctx->now = ktime_get_seconds();                                                                                          \
     }                                                                                                                          \
     /* 如果上次已经标记完成了，直接返回 0，告诉 Netlink 结束了 */                                                              \
     if (ctx->done)                                                                                                             \
       return 0;                                                                                                                \
                                                                                                                                \
-    rcu_read_lock();                                                                                                           \
+    ctx->skb = skb;                                                                                                            \
+    ctx->cb  = cb;                                                                                                             \
                                                                                                                                \
-    if (!ctx->started) {                                                                                                       \
-      /* 只有没开始的时候，才需要去拿第一个 */                                                                                 \
-      err = tutu_map_get_next_key(_map, NULL, &ctx->cursor_entry.key);                                                         \
-      if (err) {                                                                                                               \
-        /* Map 为空，直接结束 */                                                                                               \
-        rcu_read_unlock();                                                                                                     \
-        ctx->done = true; /* 标记完成 */                                                                                       \
-        return 0;                                                                                                              \
-      }                                                                                                                        \
-      ctx->started = true;                                                                                                     \
-    }                                                                                                                          \
-                                                                                                                               \
-    /* 开始遍历循环 */                                                                                                         \
-    while (true) {                                                                                                             \
-      /* 查找 Value */                                                                                                         \
-      val = tutu_map_lookup_elem(_map, &ctx->cursor_entry.key);                                                                \
-      if (val) {                                                                                                               \
-        /* 组装数据 */                                                                                                         \
-        memcpy(&temp_entry.key, &ctx->cursor_entry.key, sizeof(temp_entry.key));                                               \
-        memcpy(&temp_entry.value, val, sizeof(temp_entry.value));                                                              \
-        temp_entry.map_flags = 0;                                                                                              \
-                                                                                                                               \
-        hdr = genlmsg_put(skb, NETLINK_CB(cb->skb).portid, cb->nlh->nlmsg_seq, &tutu_genl_family, NLM_F_MULTI, _CMD_GET);      \
-        if (!hdr)                                                                                                              \
-          break; /* Buffer full */                                                                                             \
-                                                                                                                               \
-        if (nla_put(skb, _attr, sizeof(temp_entry), &temp_entry)) {                                                            \
-          genlmsg_cancel(skb, hdr);                                                                                            \
-          break; /* Buffer full */                                                                                             \
-        }                                                                                                                      \
-        genlmsg_end(skb, hdr);                                                                                                 \
-      }                                                                                                                        \
+    /* 从上次停下的桶继续，缓冲区满时返回非 0 */                                                                               \
+    rcu_read_lock();                                                                                                           \
+    err = tutu_map_walk(tn->_map, &ctx->bucket, &ctx->skip, tutu_genl_dump_one_##_dir, ctx);                                   \
+    rcu_read_unlock();                                                                                                         \
                                                                                                                                \
-      /* 准备下一次迭代 */                                                                                                     \
-      /* 使用 temp 暂存 next key，成功后更新 cursor */                                                                         \
-      {                                                                                                                        \
-        struct tutu_##_dir next_node;                                                                                          \
-        err = tutu_map_get_next_key(_map, &ctx->cursor_entry.key, &next_node.key);                                             \
-        if (err) {                                                                                                             \
-          ctx->done = true;                                                                                                    \
-          break; /* 遍历完成 */                                                                                                \
-        }                                                                                                                      \
-        ctx->cursor_entry = next_node; /* 更新 cursor 指向下一个待处理 Key */                                                  \
+    if (!err) {                                                                                                                \
+      if (ctx->filter.projection == TUTU_DUMP_COUNT) {                                                                         \
+        err = tutu_dump_put_count(skb, cb, _CMD_GET, ctx->count);                                                              \
+        if (err)                                                                                                               \
+          return err;                                                                                                          \
       }                                                                                                                        \
+      ctx->done = true; /* 遍历完成 */                                                                                         \
     }                                                                                                                          \
-    rcu_read_unlock();                                                                                                         \
                                                                                                                                \
     return skb->len;                                                                                                           \
   }                                                                                                                            \
-                                                                                                                               \
   static int tutu_genl_done_##_dir(struct netlink_callback *cb) {                                                              \
     struct tutu_dump_ctx_##_dir *ctx = (void *) cb->args[0];                                                                   \
     kfree(ctx);                                                                                                                \
@@ -259,15 +366,118 @@ static int tutu_genl_clr_stats(struct sk_buff *skb, struct genl_info *info);
     return 0;                                                                                                                  \
   }                                                                                                                            \
                                                                                                                                \
-  /* --- 3. Delete --- */                                                                                                      \
+  /* --- 3. Batch Delete/Update --- */                                                                                         \
+  /* 带 TUTU_ATTR_TXN 时修改本 socket 事务的暂存区（不发出事件），否则修改当前生效的表 */                                      \
+  static struct tutu_htab *tutu_genl_target_##_dir(struct genl_info *info, struct tutu_net *tn) {                              \
+    struct tutu_txn  *txn;                                                                                                     \
+    struct tutu_htab *map;                                                                                                     \
+                                                                                                                               \
+    if (!info->attrs[TUTU_ATTR_TXN])                                                                                           \
+      return tn->_map;                                                                                                         \
+    txn = tutu_txn_get(tn, info->snd_portid);                                                                                  \
+    if (IS_ERR(txn)) {                                                                                                         \
+      NL_SET_ERR_MSG(info->extack, "no transaction owned by this socket");                                                     \
+      return ERR_CAST(txn);                                                                                                    \
+    }                                                                                                                          \
+    map = tutu_txn_map_##_dir(txn);                                                                                            \
+    if (!map) {                                                                                                                \
+      NL_SET_ERR_MSG(info->extack, "map does not support transactions");                                                       \
+      return ERR_PTR(-EOPNOTSUPP);                                                                                             \
+    }                                                                                                                          \
+    return map;                                                                                                                \
+  }                                                                                                                            \
+                                                                                                                               \
+  static int tutu_genl_validate_##_dir(struct tutu_##_dir *entry, struct genl_info *info) {                                    \
+    _validate((*entry), info);                                                                                                 \
+    return 0;                                                                                                                  \
+  }                                                                                                                            \
+                                                                                                                               \
+  static int tutu_genl_batch_##_dir(struct genl_info *info, struct tutu_net *tn, struct tutu_htab *map, bool del) {            \
+    const struct nlattr *batch = info->attrs[TUTU_ATTR_BATCH];                                                                 \
+    const struct nlattr *pos;                                                                                                  \
+    struct tutu_##_dir   entry;                                                                                                \
+    struct sk_buff      *msg;                                                                                                  \
+    void                *hdr;                                                                                                  \
+    s32                 *results;                                                                                              \
+    int                  rem, n = 0, err;                                                                                      \
+                                                                                                                               \
+    /* 先整体检查，格式错误时不执行任何条目 */                                                                                 \
+    nla_for_each_nested(pos, batch, rem) {                                                                                     \
+      if (nla_type(pos) != _attr || nla_len(pos) != sizeof(entry)) {                                                           \
+        NL_SET_ERR_MSG(info->extack, "malformed batch entry");                                                                 \
+        return -EINVAL;                                                                                                        \
+      }                                                                                                                        \
+      n++;                                                                                                                     \
+    }                                                                                                                          \
+    if (!n || n > TUTU_BATCH_MAX) {                                                                                            \
+      NL_SET_ERR_MSG(info->extack, "batch must contain 1 to TUTU_BATCH_MAX entries");                                          \
+      return -EINVAL;                                                                                                          \
+    }                                                                                                                          \
+                                                                                                                               \
+    results = kcalloc(n, sizeof(*results), GFP_KERNEL);                                                                        \
+    if (!results)                                                                                                              \
+      return -ENOMEM;                                                                                                          \
+                                                                                                                               \
+    n = 0;                                                                                                                     \
+    /* 修改命令串行执行，map 不会被替换；更新在 RCU 外进行，可用 GFP_KERNEL 分配 */                                            \
+    nla_for_each_nested(pos, batch, rem) {                                                                                     \
+      memcpy(&entry, nla_data(pos), sizeof(entry));                                                                            \
+      if (del) {                                                                                                               \
+        rcu_read_lock();                                                                                                       \
+        err = tutu_map_delete_elem(map, &entry.key);                                                                           \
+        rcu_read_unlock();                                                                                                     \
+      } else {                                                                                                                 \
+        err = tutu_genl_validate_##_dir(&entry, info);                                                                         \
+        if (!err)                                                                                                              \
+          err = tutu_map_update_elem_gfp(map, &entry.key, &entry.value, entry.map_flags, GFP_KERNEL);                          \
+      }                                                                                                                        \
+      if (!err && map == tn->_map)                                                                                             \
+        tutu_genl_event_##_dir(tn, &entry, del);                                                                               \
+      results[n++] = err;                                                                                                      \
+      cond_resched();                                                                                                          \
+    }                                                                                                                          \
+                                                                                                                               \
+    err = -ENOMEM;                                                                                                             \
+    msg = genlmsg_new(nla_total_size(n * sizeof(*results)), GFP_KERNEL);                                                       \
+    if (!msg)                                                                                                                  \
+      goto out;                                                                                                                \
+    hdr = genlmsg_put_reply(msg, info, &tutu_genl_family, 0, info->genlhdr->cmd);                                              \
+    if (!hdr) {                                                                                                                \
+      nlmsg_free(msg);                                                                                                         \
+      goto out;                                                                                                                \
+    }                                                                                                                          \
+    err = nla_put(msg, TUTU_ATTR_BATCH_RESULT, n * sizeof(*results), results);                                                 \
+    if (err) {                                                                                                                 \
+      genlmsg_cancel(msg, hdr);                                                                                                \
+      nlmsg_free(msg);                                                                                                         \
+      goto out;                                                                                                                \
+    }                                                                                                                          \
+    genlmsg_end(msg, hdr);                                                                                                     \
+    err = genlmsg_reply(msg, info);                                                                                            \
+  out:                                                                                                                         \
+    kfree(results);                                                                                                            \
+    return err;                                                                                                                \
+  }                                                                                                                            \
+                                                                                                                               \
+  /* --- 4. Delete --- */                                                                                                      \
   static int tutu_genl_delete_##_dir(struct sk_buff *skb, struct genl_info *info) {                                            \
     struct tutu_##_dir entry;                                                                                                  \
+    struct tutu_net   *tn;                                                                                                     \
+    struct tutu_htab  *map;                                                                                                    \
     int                err;                                                                                                    \
                                                                                                                                \
     if (!tutu_user_allowed(skb, info)) {                                                                                       \
       NL_SET_ERR_MSG(info->extack, "permission denied for this command");                                                      \
       return -EPERM;                                                                                                           \
     }                                                                                                                          \
+    tn = tutu_net_get(genl_info_net(info));                                                                                    \
+    if (IS_ERR(tn))                                                                                                            \
+      return PTR_ERR(tn);                                                                                                      \
+    map = tutu_genl_target_##_dir(info, tn);                                                                                   \
+    if (IS_ERR(map))                                                                                                           \
+      return PTR_ERR(map);                                                                                                     \
+    if (info->attrs[TUTU_ATTR_BATCH])                                                                                          \
+      return tutu_genl_batch_##_dir(info, tn, map, true);                                                                      \
     if (!info->attrs[_attr])                                                                                                   \
       return -EINVAL;                                                                                                          \
     if (nla_len(info->attrs[_attr]) != sizeof(entry))                                                                          \
@@ -275,20 +485,32 @@ static int tutu_genl_clr_stats(struct sk_buff *skb, struct genl_info *info);
     memcpy(&entry, nla_data(info->attrs[_attr]), sizeof(entry));                                                               \
                                                                                                                                \
     rcu_read_lock();                                                                                                           \
-    err = tutu_map_delete_elem(_map, &entry.key);                                                                              \
+    err = tutu_map_delete_elem(map, &entry.key);                                                                               \
     rcu_read_unlock();                                                                                                         \
+    if (!err && map == tn->_map)                                                                                               \
+      tutu_genl_event_##_dir(tn, &entry, true);                                                                                \
     return err;                                                                                                                \
   }                                                                                                                            \
                                                                                                                                \
-  /* --- 4. Update/Set --- */                                                                                                  \
+  /* --- 5. Update/Set --- */                                                                                                  \
   static int tutu_genl_update_##_dir(struct sk_buff *skb, struct genl_info *info) {                                            \
     struct tutu_##_dir entry;                                                                                                  \
+    struct tutu_net   *tn;                                                                                                     \
+    struct tutu_htab  *map;                                                                                                    \
     int                err;                                                                                                    \
                                                                                                                                \
     if (!tutu_user_allowed(skb, info)) {                                                                                       \
       NL_SET_ERR_MSG(info->extack, "permission denied for this command");                                                      \
       return -EPERM;                                                                                                           \
     }                                                                                                                          \
+    tn = tutu_net_get(genl_info_net(info));                                                                                    \
+    if (IS_ERR(tn))                                                                                                            \
+      return PTR_ERR(tn);                                                                                                      \
+    map = tutu_genl_target_##_dir(info, tn);                                                                                   \
+    if (IS_ERR(map))                                                                                                           \
+      return PTR_ERR(map);                                                                                                     \
+    if (info->attrs[TUTU_ATTR_BATCH])                                                                                          \
+      return tutu_genl_batch_##_dir(info, tn, map, false);                                                                     \
     if (!info->attrs[_attr])                                                                                                   \
       return -EINVAL;                                                                                                          \
     if (nla_len(info->attrs[_attr]) != sizeof(entry))                                                                          \
@@ -297,38 +519,268 @@ static int tutu_genl_clr_stats(struct sk_buff *skb, struct genl_info *info);
                                                                                                                                \
     _validate(entry, info);                                                                                                    \
                                                                                                                                \
-    rcu_read_lock();                                                                                                           \
-    err = tutu_map_update_elem(_map, &entry.key, &entry.value, entry.map_flags);                                               \
-    rcu_read_unlock();                                                                                                         \
+    err = tutu_map_update_elem_gfp(map, &entry.key, &entry.value, entry.map_flags, GFP_KERNEL);                                \
+    if (!err && map == tn->_map)                                                                                               \
+      tutu_genl_event_##_dir(tn, &entry, false);                                                                               \
                                                                                                                                \
     return err;                                                                                                                \
   }
 
+/* dump 过滤：取出各 map 条目中的对端地址、uid 与端口 */
+static bool tutu_genl_match_egress(const struct tutu_dump_filter *f, const struct tutu_egress *entry, u64 now) {
+  return tutu_dump_match(f, &entry->key.address, entry->value.uid, entry->key.port);
+}
+
+static bool tutu_genl_match_ingress(const struct tutu_dump_filter *f, const struct tutu_ingress *entry, u64 now) {
+  return tutu_dump_match(f, &entry->key.address, entry->key.uid, entry->value.port);
+}
+
+static bool tutu_genl_match_session(const struct tutu_dump_filter *f, const struct tutu_session *entry, u64 now) {
+  u64 idle;
+
+  if (!tutu_dump_match(f, &entry->key.address, entry->value.uid, entry->key.dport))
+    return false;
+
+  if (f->flags & TUTU_DUMP_FILTER_AGE) {
+    idle = now > entry->value.age ? now - entry->value.age : 0;
+    if (idle < f->min_age || idle > f->max_age)
+      return false;
+  }
+  return true;
+}
+
+static bool tutu_genl_match_user_info(const struct tutu_dump_filter *f, const struct tutu_user_info *entry, u64 now) {
+  return tutu_dump_match(f, &entry->value.address, entry->key.uid, entry->value.dport);
+}
+
+/* genl 修改 map 成功后的事件；删除请求通常只填 key，value 字段可能为 0 */
+static void tutu_genl_event_egress(struct tutu_net *tn, const struct tutu_egress *entry, bool deleted) {
+  struct tutu_event ev = {
+    .type    = deleted ? TUTU_EVENT_PEER_DELETE : TUTU_EVENT_PEER_UPDATE,
+    .uid     = entry->value.uid,
+    .port    = entry->key.port,
+    .address = entry->key.address,
+  };
+
+  tutu_event_queue(tn, &ev);
+}
+
+static void tutu_genl_event_ingress(struct tutu_net *tn, const struct tutu_ingress *entry, bool deleted) {
+  struct tutu_event ev = {
+    .type    = deleted ? TUTU_EVENT_PEER_DELETE : TUTU_EVENT_PEER_UPDATE,
+    .uid     = entry->key.uid,
+    .port    = entry->value.port,
+    .address = entry->key.address,
+  };
+
+  tutu_event_queue(tn, &ev);
+}
+
+static void tutu_genl_event_session(struct tutu_net *tn, const struct tutu_session *entry, bool deleted) {
+  struct tutu_event ev = {
+    .type    = TUTU_EVENT_SESSION_DELETE,
+    .uid     = entry->value.uid,
+    .port    = entry->key.dport,
+    .icmp_id = entry->key.sport,
+    .address = entry->key.address,
+  };
+
+  /* 手工写入的会话不产生事件 */
+  if (deleted)
+    tutu_event_queue(tn, &ev);
+}
+
+static void tutu_genl_event_user_info(struct tutu_net *tn, const struct tutu_user_info *entry, bool deleted) {
+  struct tutu_event ev = {
+    .type    = deleted ? TUTU_EVENT_USER_DELETE : TUTU_EVENT_USER_UPDATE,
+    .uid     = entry->key.uid,
+    .port    = entry->value.dport,
+    .icmp_id = entry->value.icmp_id,
+    .address = entry->value.address,
+  };
+
+  tutu_event_queue(tn, &ev);
+}
+
 /* 生成 Egress 函数 */
 DEFINE_TUTU_GENL_FUNCS(egress, egress_peer_map, struct egress_peer_value, TUTU_ATTR_EGRESS, TUTU_CMD_GET_EGRESS,
-                       TUTU_GENL_VALIDATE_XOR);
+                       TUTU_GENL_VALIDATE_XOR, TUTU_DUMP_FILTER_COMMON);
 
 /* 生成 Ingress 函数 */
 DEFINE_TUTU_GENL_FUNCS(ingress, ingress_peer_map, struct ingress_peer_value, TUTU_ATTR_INGRESS, TUTU_CMD_GET_INGRESS,
-                       TUTU_GENL_VALIDATE_XOR);
+                       TUTU_GENL_VALIDATE_XOR, TUTU_DUMP_FILTER_COMMON);
 
 /* 生成 Session 函数 */
 DEFINE_TUTU_GENL_FUNCS(session, session_map, struct session_value, TUTU_ATTR_SESSION, TUTU_CMD_GET_SESSION,
-                       TUTU_GENL_VALIDATE_NONE);
+                       TUTU_GENL_VALIDATE_NONE, TUTU_DUMP_FILTER_COMMON | TUTU_DUMP_FILTER_AGE);
 
 /* 生成 User Info 函数 */
 DEFINE_TUTU_GENL_FUNCS(user_info, user_map, struct user_info, TUTU_ATTR_USER_INFO, TUTU_CMD_GET_USER_INFO,
-                       TUTU_GENL_VALIDATE_XOR);
+                       TUTU_GENL_VALIDATE_USER, TUTU_DUMP_FILTER_COMMON);
 
 /* ========== 配置与统计 ========== */
 
+/*
+ * 每个 uid / peer 的流量计数 dump。
+ * 计数保存在 map 元素的 per-CPU 区域，只有在这里才汇总，数据路径无需任何共享写。
+ * peer 计数先遍历 egress_peer_map（发送），再遍历 ingress_peer_map（接收）。
+ */
+struct tutu_traffic_dump_ctx {
+  bool                     done;
+  bool                     peer;
+  bool                     ingress;
+  u32                      bucket;
+  u32                      skip;
+  struct tutu_dump_filter  filter;
+  struct sk_buff          *skb;
+  struct netlink_callback *cb;
+};
+
+/* 按 dump 过滤条件匹配则填写 out 并返回 true */
+static bool tutu_fill_user_stats(const struct tutu_dump_filter *f, const void *key, const void *val,
+                                 const void __percpu *pcpu, struct tutu_user_stats *out) {
+  const struct user_key  *ukey = key;
+  const struct user_info *user = val;
+
+  if (!tutu_dump_match(f, &user->address, ukey->uid, user->dport))
+    return false;
+
+  out->key = *ukey;
+  tutu_fold_traffic_stats(pcpu, &out->stats);
+  return true;
+}
+
+static bool tutu_fill_peer_stats(const struct tutu_dump_filter *f, bool ingress, const void *key, const void *val,
+                                 const void __percpu *pcpu, struct tutu_peer_stats *out) {
+  if (ingress) {
+    const struct ingress_peer_key   *ikey = key;
+    const struct ingress_peer_value *ival = val;
+
+    if (!tutu_dump_match(f, &ikey->address, ikey->uid, ival->port))
+      return false;
+    out->key.address = ikey->address;
+    out->key.port    = ival->port;
+    out->uid         = ikey->uid;
+    out->ingress     = 1;
+  } else {
+    const struct egress_peer_key   *ekey = key;
+    const struct egress_peer_value *eval = val;
+
+    if (!tutu_dump_match(f, &ekey->address, eval->uid, ekey->port))
+      return false;
+    out->key = *ekey;
+    out->uid = eval->uid;
+  }
+
+  tutu_fold_traffic_stats(pcpu, &out->stats);
+  return true;
+}
+
+static int tutu_genl_dump_traffic_one(void *key, void *val, void __percpu *pcpu, void *arg) {
+  struct tutu_traffic_dump_ctx *ctx  = arg;
+  u8                            cmd  = ctx->peer ? TUTU_CMD_GET_PEER_STATS : TUTU_CMD_GET_USER_STATS;
+  int                           attr = ctx->peer ? TUTU_ATTR_PEER_STATS : TUTU_ATTR_USER_STATS;
+  union {
+    struct tutu_user_stats user;
+    struct tutu_peer_stats peer;
+  } entry = {};
+  size_t len;
+  void  *hdr;
+
+  if (ctx->peer) {
+    if (!tutu_fill_peer_stats(&ctx->filter, ctx->ingress, key, val, pcpu, &entry.peer))
+      return 0;
+    len = sizeof(entry.peer);
+  } else {
+    if (!tutu_fill_user_stats(&ctx->filter, key, val, pcpu, &entry.user))
+      return 0;
+    len = sizeof(entry.user);
+  }
+
+  hdr = genlmsg_put(ctx->skb, NETLINK_CB(ctx->cb->skb).portid, ctx->cb->nlh->nlmsg_seq, &tutu_genl_family, NLM_F_MULTI, cmd);
+  if (!hdr)
+    return -EMSGSIZE; /* Buffer full */
+
+  if (nla_put(ctx->skb, attr, len, &entry)) {
+    genlmsg_cancel(ctx->skb, hdr);
+    return -EMSGSIZE; /* Buffer full */
+  }
+  genlmsg_end(ctx->skb, hdr);
+  return 0;
+}
+
+static int tutu_genl_dump_traffic(struct sk_buff *skb, struct netlink_callback *cb, bool peer) {
+  struct tutu_traffic_dump_ctx *ctx = (void *) cb->args[0];
+  struct tutu_htab             *map;
+  struct tutu_net              *tn;
+  int                           err;
+
+  tn = tutu_net_peek(sock_net(cb->skb->sk));
+  if (!tn)
+    return 0;
+
+  if (!ctx) {
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (!ctx)
+      return -ENOMEM;
+    cb->args[0] = (unsigned long) ctx;
+
+    err = tutu_dump_filter_parse(cb, &ctx->filter, TUTU_DUMP_FILTER_COMMON);
+    if (err)
+      return err;
+    if (ctx->filter.projection != TUTU_DUMP_FULL)
+      return -EOPNOTSUPP;
+  }
+  if (ctx->done)
+    return 0;
+
+  map       = !peer ? tn->user_map : ctx->ingress ? tn->ingress_peer_map : tn->egress_peer_map;
+  ctx->peer = peer;
+  ctx->skb  = skb;
+  ctx->cb   = cb;
+
+  rcu_read_lock();
+  err = tutu_map_walk(map, &ctx->bucket, &ctx->skip, tutu_genl_dump_traffic_one, ctx);
+  if (!err && peer && !ctx->ingress) {
+    /* egress peer 输出完毕，接着输出 ingress peer 的接收计数 */
+    ctx->ingress = true;
+    ctx->bucket  = 0;
+    ctx->skip    = 0;
+    err          = tutu_map_walk(tn->ingress_peer_map, &ctx->bucket, &ctx->skip, tutu_genl_dump_traffic_one, ctx);
+  }
+  rcu_read_unlock();
+
+  if (!err)
+    ctx->done = true;
+
+  return skb->len;
+}
+
+static int tutu_genl_dump_user_stats(struct sk_buff *skb, struct netlink_callback *cb) {
+  return tutu_genl_dump_traffic(skb, cb, false);
+}
+
+static int tutu_genl_dump_peer_stats(struct sk_buff *skb, struct netlink_callback *cb) {
+  return tutu_genl_dump_traffic(skb, cb, true);
+}
+
+static int tutu_genl_done_traffic(struct netlink_callback *cb) {
+  kfree((void *) cb->args[0]);
+  cb->args[0] = 0;
+  return 0;
+}
+
 static int tutu_genl_get_config(struct sk_buff *skb, struct genl_info *info) {
   struct sk_buff    *msg;
   void              *hdr;
   struct tutu_config cfg = {};
+  struct tutu_net   *tn;
   int                err;
 
-  err = tutu_export_config(&cfg);
+  /* 尚未初始化的 netns 返回默认状态，查询不触发初始化 */
+  tn = tutu_net_peek(genl_info_net(info));
+
+  err = tutu_export_config(tn, &cfg);
   if (err)
     return err;
 
@@ -355,6 +807,7 @@ static int tutu_genl_get_config(struct sk_buff *skb, struct genl_info *info) {
 
 static int tutu_genl_set_config(struct sk_buff *skb, struct genl_info *info) {
   struct tutu_config cfg;
+  struct tutu_net   *tn;
 
   if (!tutu_user_allowed(skb, info)) {
     NL_SET_ERR_MSG(info->extack, "permission denied for this command");
@@ -369,16 +822,61 @@ static int tutu_genl_set_config(struct sk_buff *skb, struct genl_info *info) {
 
   memcpy(&cfg, nla_data(info->attrs[TUTU_ATTR_CONFIG]), sizeof(cfg));
 
-  return tutu_set_config(&cfg);
+  tn = tutu_net_get(genl_info_net(info));
+  if (IS_ERR(tn))
+    return PTR_ERR(tn);
+
+  if (info->attrs[TUTU_ATTR_TXN])
+    return tutu_txn_set_config(tn, info->snd_portid, &cfg);
+
+  return tutu_set_config(tn, &cfg);
+}
+
+/* 事务命令：BEGIN/COMMIT/ABORT 只对发起事务的 socket 有效 */
+static int tutu_genl_txn(struct sk_buff *skb, struct genl_info *info) {
+  struct tutu_net *tn;
+  int              err;
+
+  if (!tutu_user_allowed(skb, info)) {
+    NL_SET_ERR_MSG(info->extack, "permission denied for this command");
+    return -EPERM;
+  }
+
+  tn = tutu_net_get(genl_info_net(info));
+  if (IS_ERR(tn))
+    return PTR_ERR(tn);
+
+  switch (info->genlhdr->cmd) {
+  case TUTU_CMD_TXN_BEGIN:
+    err = tutu_txn_begin(tn, info->snd_portid);
+    if (err == -EBUSY)
+      NL_SET_ERR_MSG(info->extack, "another transaction is in progress");
+    break;
+  case TUTU_CMD_TXN_COMMIT:
+    err = tutu_txn_commit(tn, info->snd_portid);
+    break;
+  case TUTU_CMD_TXN_ABORT:
+    err = tutu_txn_abort(tn, info->snd_portid);
+    break;
+  default:
+    err = -EOPNOTSUPP;
+    break;
+  }
+
+  return err;
 }
 
 static int tutu_genl_get_stats(struct sk_buff *skb, struct genl_info *info) {
   struct sk_buff   *msg;
   void             *hdr;
   struct tutu_stats st = {};
+  struct tutu_net  *tn;
   int               err;
 
-  err = tutu_export_stats(&st);
+  /* 尚未初始化的 netns 返回默认状态，查询不触发初始化 */
+  tn = tutu_net_peek(genl_info_net(info));
+
+  err = tutu_export_stats(tn, &st);
   if (err)
     return err;
 
@@ -404,18 +902,226 @@ static int tutu_genl_get_stats(struct sk_buff *skb, struct genl_info *info) {
 }
 
 static int tutu_genl_clr_stats(struct sk_buff *skb, struct genl_info *info) {
+  struct tutu_net *tn;
+
+  if (!tutu_user_allowed(skb, info)) {
+    NL_SET_ERR_MSG(info->extack, "permission denied for this command");
+    return -EPERM;
+  }
+
+  tn = tutu_net_get(genl_info_net(info));
+  if (IS_ERR(tn))
+    return PTR_ERR(tn);
+
+  return tutu_clear_stats(tn);
+}
+
+static int tutu_genl_get_latency(struct sk_buff *skb, struct genl_info *info) {
+  struct sk_buff      *msg;
+  void                *hdr;
+  struct tutu_latency *lat;
+  struct tutu_net     *tn;
+  int                  err;
+
+  /* 尚未初始化的 netns 返回默认状态，查询不触发初始化 */
+  tn = tutu_net_peek(genl_info_net(info));
+
+  /* 约 2KB，不放在栈上 */
+  lat = kmalloc(sizeof(*lat), GFP_KERNEL);
+  if (!lat)
+    return -ENOMEM;
+
+  err = tutu_export_latency(tn, lat);
+  if (err)
+    goto out;
+
+  msg = genlmsg_new(nla_total_size(sizeof(*lat)), GFP_KERNEL);
+  if (!msg) {
+    err = -ENOMEM;
+    goto out;
+  }
+
+  hdr = genlmsg_put_reply(msg, info, &tutu_genl_family, 0, TUTU_CMD_GET_LATENCY);
+  if (!hdr) {
+    nlmsg_free(msg);
+    err = -ENOMEM;
+    goto out;
+  }
+
+  err = nla_put(msg, TUTU_ATTR_LATENCY, sizeof(*lat), lat);
+  if (err) {
+    genlmsg_cancel(msg, hdr);
+    nlmsg_free(msg);
+    goto out;
+  }
+
+  genlmsg_end(msg, hdr);
+  err = genlmsg_reply(msg, info);
+out:
+  kfree(lat);
+  return err;
+}
+
+static int tutu_genl_clr_latency(struct sk_buff *skb, struct genl_info *info) {
+  struct tutu_net *tn;
+
   if (!tutu_user_allowed(skb, info)) {
     NL_SET_ERR_MSG(info->extack, "permission denied for this command");
     return -EPERM;
   }
 
-  return tutu_clear_stats();
+  tn = tutu_net_get(genl_info_net(info));
+  if (IS_ERR(tn))
+    return PTR_ERR(tn);
+
+  return tutu_clear_latency(tn);
+}
+
+/* ========== 事件组播 ========== */
+
+enum {
+  TUTU_MCGRP_EVENTS,
+};
+
+/*
+ * 事件含客户端地址、uid 和 ICMP id，订阅需要 CAP_NET_ADMIN。
+ * 6.6 之前的内核没有 GENL_MCAST_CAP_NET_ADMIN，订阅时无法鉴权，因此不注册组播组，事件功能不可用。
+ */
+#ifdef GENL_MCAST_CAP_NET_ADMIN
+static const struct genl_multicast_group tutu_genl_mcgrps[] = {
+  [TUTU_MCGRP_EVENTS] =
+    {
+      .name  = TUTU_GENL_MCGRP_EVENTS,
+      .flags = GENL_MCAST_CAP_NET_ADMIN,
+    },
+};
+
+#define TUTU_HAVE_EVENTS 1
+#define TUTU_FAM_MCGRPS  .mcgrps = tutu_genl_mcgrps, .n_mcgrps = ARRAY_SIZE(tutu_genl_mcgrps),
+#else
+#define TUTU_HAVE_EVENTS 0
+#define TUTU_FAM_MCGRPS
+#endif
+
+/*
+ * family 注册之后才允许发送；模块卸载时先注销 family 再销毁各命名空间，
+ * 中间仍可能有 event_work 在运行，由 tutu_event_mutex 保证不会向已注销的 family 发送。
+ */
+static DEFINE_MUTEX(tutu_event_mutex);
+static bool tutu_event_ready;
+
+void tutu_event_queue(struct tutu_net *tn, const struct tutu_event *ev) {
+  unsigned long flags;
+
+  if (!READ_ONCE(tutu_event_ready) || !tn->events)
+    return;
+  if (!genl_has_listeners(&tutu_genl_family, tn->net, TUTU_MCGRP_EVENTS))
+    return;
+
+  spin_lock_irqsave(&tn->event_lock, flags);
+  if (tn->event_count < TUTU_EVENT_RING) {
+    tn->events[tn->event_count]           = *ev;
+    tn->events[tn->event_count].timestamp = ktime_get_real_ns();
+    /* 队列由空变为非空时才调度，之后的事件在同一批次中发送 */
+    if (tn->event_count++ == 0)
+      queue_delayed_work(system_wq, &tn->event_work, msecs_to_jiffies(TUTU_EVENT_DELAY_MS));
+  } else {
+    tn->event_lost++;
+  }
+  spin_unlock_irqrestore(&tn->event_lock, flags);
+}
+
+static void tutu_event_work(struct work_struct *work) {
+  struct tutu_net   *tn = container_of(to_delayed_work(work), struct tutu_net, event_work);
+  struct tutu_event *batch;
+  u32                count, lost, i = 0;
+
+  /* 交换缓冲区后立即放锁，数据路径可继续向新缓冲区入队 */
+  spin_lock_irq(&tn->event_lock);
+  batch            = tn->events;
+  tn->events       = tn->events_spare;
+  tn->events_spare = batch;
+  count            = tn->event_count;
+  lost             = tn->event_lost;
+  tn->event_count  = 0;
+  tn->event_lost   = 0;
+  spin_unlock_irq(&tn->event_lock);
+
+  mutex_lock(&tutu_event_mutex);
+  if (!tutu_event_ready)
+    goto out;
+
+  while (i < count || lost) {
+    struct sk_buff *msg;
+    void           *hdr;
+
+    msg = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+    if (!msg)
+      break;
+
+    hdr = genlmsg_put(msg, 0, 0, &tutu_genl_family, 0, TUTU_CMD_EVENT);
+    if (!hdr) {
+      nlmsg_free(msg);
+      break;
+    }
+
+    if (lost) {
+      if (nla_put_u32(msg, TUTU_ATTR_EVENT_LOST, lost)) {
+        genlmsg_cancel(msg, hdr);
+        nlmsg_free(msg);
+        break;
+      }
+      lost = 0;
+    }
+
+    /* 一条消息装不下时，剩余事件放到下一条 */
+    for (; i < count; i++) {
+      if (nla_put(msg, TUTU_ATTR_EVENT, sizeof(batch[i]), &batch[i]))
+        break;
+    }
+
+    genlmsg_end(msg, hdr);
+    genlmsg_multicast_netns(&tutu_genl_family, tn->net, msg, 0, TUTU_MCGRP_EVENTS, GFP_KERNEL);
+  }
+
+out:
+  mutex_unlock(&tutu_event_mutex);
+}
+
+int tutu_event_init(struct tutu_net *tn) {
+  spin_lock_init(&tn->event_lock);
+  INIT_DELAYED_WORK(&tn->event_work, tutu_event_work);
+  tn->event_count = 0;
+  tn->event_lost  = 0;
+
+  /* 没有组播组时不分配队列，tutu_event_queue() 直接返回 */
+  if (!TUTU_HAVE_EVENTS)
+    return 0;
+
+  tn->events       = kcalloc(TUTU_EVENT_RING, sizeof(struct tutu_event), GFP_KERNEL);
+  tn->events_spare = kcalloc(TUTU_EVENT_RING, sizeof(struct tutu_event), GFP_KERNEL);
+  if (!tn->events || !tn->events_spare) {
+    kfree(tn->events);
+    kfree(tn->events_spare);
+    tn->events = tn->events_spare = NULL;
+    return -ENOMEM;
+  }
+
+  return 0;
+}
+
+/* 调用前 hook 已注销，不会再有新事件入队 */
+void tutu_event_exit(struct tutu_net *tn) {
+  cancel_delayed_work_sync(&tn->event_work);
+  kfree(tn->events);
+  kfree(tn->events_spare);
+  tn->events = tn->events_spare = NULL;
 }
 
 /* 辅助函数：查找是否存在 */
-static bool __ifname_exists(const char *name) {
+static bool __ifname_exists(struct tutu_net *tn, const char *name) {
   struct tutu_ifname_node *node;
-  list_for_each_entry(node, &tutu_ifname_list, list) {
+  list_for_each_entry(node, &tn->ifname_list, list) {
     if (!strcmp(node->name, name))
       return true;
   }
@@ -424,6 +1130,7 @@ static bool __ifname_exists(const char *name) {
 
 static int tutu_genl_ifname_add(struct sk_buff *skb, struct genl_info *info) {
   struct tutu_ifname_node *node;
+  struct tutu_net         *tn;
   char                    *name;
   int                      err;
 
@@ -437,13 +1144,17 @@ static int tutu_genl_ifname_add(struct sk_buff *skb, struct genl_info *info) {
 
   name = nla_data(info->attrs[TUTU_ATTR_IFNAME_NAME]);
 
-  if (!net_has_device(name))
+  tn = tutu_net_get(genl_info_net(info));
+  if (IS_ERR(tn))
+    return PTR_ERR(tn);
+
+  if (!net_has_device(tn->net, name))
     return -ENODEV;
 
-  mutex_lock(&tutu_ifname_lock);
+  mutex_lock(&tn->ifname_lock);
 
   /* 查重 */
-  if (__ifname_exists(name)) {
+  if (__ifname_exists(tn, name)) {
     err = -EEXIST;
     goto out_unlock;
   }
@@ -456,19 +1167,20 @@ static int tutu_genl_ifname_add(struct sk_buff *skb, struct genl_info *info) {
   }
 
   strscpy(node->name, name, IFNAMSIZ);
-  list_add_tail(&node->list, &tutu_ifname_list);
-  mutex_unlock(&tutu_ifname_lock);
+  list_add_tail(&node->list, &tn->ifname_list);
+  mutex_unlock(&tn->ifname_lock);
 
   /* 触发配置重载（此处不能锁） */
-  return ifset_reload_config();
+  return ifset_reload_config(tn);
 
 out_unlock:
-  mutex_unlock(&tutu_ifname_lock);
+  mutex_unlock(&tn->ifname_lock);
   return err;
 }
 
 static int tutu_genl_ifname_del(struct sk_buff *skb, struct genl_info *info) {
   struct tutu_ifname_node *node, *tmp;
+  struct tutu_net         *tn;
   char                    *name;
   bool                     found = false;
 
@@ -482,8 +1194,12 @@ static int tutu_genl_ifname_del(struct sk_buff *skb, struct genl_info *info) {
 
   name = nla_data(info->attrs[TUTU_ATTR_IFNAME_NAME]);
 
-  mutex_lock(&tutu_ifname_lock);
-  list_for_each_entry_safe(node, tmp, &tutu_ifname_list, list) {
+  tn = tutu_net_get(genl_info_net(info));
+  if (IS_ERR(tn))
+    return PTR_ERR(tn);
+
+  mutex_lock(&tn->ifname_lock);
+  list_for_each_entry_safe(node, tmp, &tn->ifname_list, list) {
     if (!strcmp(node->name, name)) {
       list_del(&node->list);
       kfree(node);
@@ -491,18 +1207,23 @@ static int tutu_genl_ifname_del(struct sk_buff *skb, struct genl_info *info) {
       break; /* 找到了就退出 */
     }
   }
-  mutex_unlock(&tutu_ifname_lock);
+  mutex_unlock(&tn->ifname_lock);
 
-  return found ? ifset_reload_config() : -ENOENT;
+  return found ? ifset_reload_config(tn) : -ENOENT;
 }
 
 static int tutu_genl_ifname_dump(struct sk_buff *skb, struct netlink_callback *cb) {
   struct tutu_ifname_node *node;
+  struct tutu_net         *tn;
   int                      idx = 0, start_idx = (int) cb->args[0];
   void                    *hdr;
 
-  mutex_lock(&tutu_ifname_lock);
-  list_for_each_entry(node, &tutu_ifname_list, list) {
+  tn = tutu_net_peek(sock_net(cb->skb->sk));
+  if (!tn)
+    return 0;
+
+  mutex_lock(&tn->ifname_lock);
+  list_for_each_entry(node, &tn->ifname_list, list) {
     /* 跳过已经发送过的 */
     if (idx < start_idx) {
       idx++;
@@ -523,7 +1244,7 @@ static int tutu_genl_ifname_dump(struct sk_buff *skb, struct netlink_callback *c
     idx++;
   }
 
-  mutex_unlock(&tutu_ifname_lock);
+  mutex_unlock(&tn->ifname_lock);
 
   cb->args[0] = idx; // 记录进度
   return (int) skb->len;
@@ -578,16 +1299,29 @@ static const struct genl_ops tutu_genl_ops[] = {
   {.cmd = TUTU_CMD_IFNAME_GET, .dumpit = tutu_genl_ifname_dump, TUTU_OPS_POLICY},
   {.cmd = TUTU_CMD_IFNAME_ADD, .doit = tutu_genl_ifname_add, TUTU_OPS_POLICY},
   {.cmd = TUTU_CMD_IFNAME_DEL, .doit = tutu_genl_ifname_del, TUTU_OPS_POLICY},
+
+  /* Per-uid / per-peer traffic */
+  {.cmd = TUTU_CMD_GET_USER_STATS, .dumpit = tutu_genl_dump_user_stats, .done = tutu_genl_done_traffic, TUTU_OPS_POLICY},
+  {.cmd = TUTU_CMD_GET_PEER_STATS, .dumpit = tutu_genl_dump_peer_stats, .done = tutu_genl_done_traffic, TUTU_OPS_POLICY},
+
+  /* Latency */
+  {.cmd = TUTU_CMD_GET_LATENCY, .doit = tutu_genl_get_latency, TUTU_OPS_POLICY},
+  {.cmd = TUTU_CMD_CLR_LATENCY, .doit = tutu_genl_clr_latency, TUTU_OPS_POLICY},
+
+  /* Transactions */
+  {.cmd = TUTU_CMD_TXN_BEGIN, .doit = tutu_genl_txn, TUTU_OPS_POLICY},
+  {.cmd = TUTU_CMD_TXN_COMMIT, .doit = tutu_genl_txn, TUTU_OPS_POLICY},
+  {.cmd = TUTU_CMD_TXN_ABORT, .doit = tutu_genl_txn, TUTU_OPS_POLICY},
 };
 
-static struct genl_family tutu_genl_family = {.name    = TUTU_GENL_FAMILY_NAME,
-                                              .version = TUTU_GENL_VERSION,
-                                              .maxattr = TUTU_ATTR_MAX,
-                                              .module  = THIS_MODULE,
-                                              .netnsok = true,
-                                              .ops     = tutu_genl_ops,
-                                              .n_ops   = ARRAY_SIZE(tutu_genl_ops),
-                                              TUTU_FAM_POLICY};
+static struct genl_family tutu_genl_family = {.name     = TUTU_GENL_FAMILY_NAME,
+                                              .version  = TUTU_GENL_VERSION,
+                                              .maxattr  = TUTU_ATTR_MAX,
+                                              .module   = THIS_MODULE,
+                                              .netnsok  = true,
+                                              .ops      = tutu_genl_ops,
+                                              .n_ops    = ARRAY_SIZE(tutu_genl_ops),
+                                              TUTU_FAM_MCGRPS TUTU_FAM_POLICY};
 
 int tutu_genl_init(void) {
   int err;
@@ -598,6 +1332,10 @@ int tutu_genl_init(void) {
     return err;
   }
 
+  mutex_lock(&tutu_event_mutex);
+  WRITE_ONCE(tutu_event_ready, true);
+  mutex_unlock(&tutu_event_mutex);
+
   pr_info("genetlink family '%s' registered, id=%u\n", tutu_genl_family.name, tutu_genl_family.id);
   return 0;
 }
@@ -605,6 +1343,10 @@ int tutu_genl_init(void) {
 void tutu_genl_exit(void) {
   int err;
 
+  mutex_lock(&tutu_event_mutex);
+  WRITE_ONCE(tutu_event_ready, false);
+  mutex_unlock(&tutu_event_mutex);
+
   err = genl_unregister_family(&tutu_genl_family);
   if (err)
     pr_err("genl_unregister_family failed: %d\n", err);
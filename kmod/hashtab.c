@@ -1,12 +1,14 @@
 #include <linux/filter.h>
 #include <linux/jhash.h>
+#include <linux/log2.h>
 #include <linux/vmalloc.h>
 
 #include "hashtab.h"
 #include "tutuicmptunnel.h"
 
 /* Called from syscall */
-struct tutu_htab *tutu_map_alloc(u32 key_size, u32 value_size, u32 max_entries) {
+struct tutu_htab *tutu_map_alloc_pcpu(u32 key_size, u32 value_size, u32 max_entries, u32 pcpu_size,
+                                      void (*pcpu_init)(void __percpu *pcpu)) {
   struct tutu_htab *htab;
   int               err, i;
 
@@ -18,6 +20,8 @@ struct tutu_htab *tutu_map_alloc(u32 key_size, u32 value_size, u32 max_entries)
   htab->key_size    = key_size;
   htab->value_size  = value_size;
   htab->max_entries = max_entries;
+  htab->pcpu_size   = pcpu_size;
+  htab->pcpu_init   = pcpu_init;
 
   /* check sanity of attributes.
    * value_size == 0 may be allowed in the future to use map as a set
@@ -60,6 +64,20 @@ free_htab:
   return ERR_PTR(err);
 }
 
+struct tutu_htab *tutu_map_alloc(u32 key_size, u32 value_size, u32 max_entries) {
+  return tutu_map_alloc_pcpu(key_size, value_size, max_entries, 0, NULL);
+}
+
+static void htab_elem_free(struct htab_elem *l) {
+  if (l->pcpu_owner)
+    free_percpu(l->pcpu);
+  kfree(l);
+}
+
+static void htab_elem_free_rcu(struct rcu_head *head) {
+  htab_elem_free(container_of(head, struct htab_elem, rcu));
+}
+
 static inline u32 htab_map_hash(const void *key, u32 key_len) {
   return jhash(key, key_len, 0);
 }
@@ -76,7 +94,7 @@ static struct htab_elem *lookup_elem_raw(struct hlist_head *head, u32 hash, void
   return NULL;
 }
 
-static void *htab_map_lookup_elem(struct tutu_htab *htab, void *key) {
+static void *htab_map_lookup_elem(struct tutu_htab *htab, void *key, void __percpu **pcpu) {
   struct hlist_head *head;
   struct htab_elem  *l;
   u32                hash, key_size;
@@ -92,8 +110,11 @@ static void *htab_map_lookup_elem(struct tutu_htab *htab, void *key) {
 
   l = lookup_elem_raw(head, hash, key, key_size);
 
-  if (l)
+  if (l) {
+    if (pcpu)
+      *pcpu = l->pcpu;
     return l->key + round_up(htab->key_size, 8);
+  }
 
   return NULL;
 }
@@ -152,9 +173,17 @@ find_first_elem:
   return -ENOENT;
 }
 
-static int htab_map_update_elem(struct tutu_htab *htab, void *key, void *value, u64 map_flags) {
+/*
+ * gfp 不允许睡眠时（数据路径、持有 rcu_read_lock() 的调用者）要求调用者持有 rcu_read_lock()；
+ * 允许睡眠时（进程上下文的批量更新、表复制）调用者不能持有，这里只在查找和插入期间加锁，
+ * 分配都在锁外进行，per-CPU 区域因此可以用 GFP_KERNEL 分配，不会因原子分配池耗尽而失败。
+ */
+static int htab_map_update_elem(struct tutu_htab *htab, void *key, void *value, u64 map_flags, gfp_t gfp) {
   struct htab_elem  *l_new, *l_old;
   struct hlist_head *head;
+  void __percpu     *pcpu_new  = NULL;
+  bool               can_sleep = gfpflags_allow_blocking(gfp);
+  bool               need_pcpu;
   unsigned long      flags;
   u32                key_size;
   int                ret;
@@ -163,10 +192,13 @@ static int htab_map_update_elem(struct tutu_htab *htab, void *key, void *value,
     /* unknown flags */
     return -EINVAL;
 
-  WARN_ON_ONCE(!rcu_read_lock_held());
+  if (can_sleep)
+    might_sleep();
+  else
+    WARN_ON_ONCE(!rcu_read_lock_held());
 
   /* allocate new element outside of lock */
-  l_new = kmalloc(htab->elem_size, GFP_ATOMIC | __GFP_NOWARN);
+  l_new = kmalloc(htab->elem_size, gfp | __GFP_NOWARN);
   if (!l_new)
     return -ENOMEM;
 
@@ -174,16 +206,49 @@ static int htab_map_update_elem(struct tutu_htab *htab, void *key, void *value,
 
   memcpy(l_new->key, key, key_size);
   memcpy(l_new->key + round_up(key_size, 8), value, htab->value_size);
+  l_new->pcpu       = NULL;
+  l_new->pcpu_owner = false;
 
   l_new->hash = htab_map_hash(l_new->key, key_size);
+  head        = select_bucket(htab, l_new->hash);
+
+  /*
+   * per-CPU 区域也必须在锁外分配。已有元素的更新（最常见的情况）会继承旧区域，
+   * 所以先无锁查一次，只有看起来是插入时才分配。
+   */
+  if (can_sleep)
+    rcu_read_lock();
+  need_pcpu = htab->pcpu_size && !lookup_elem_raw(head, l_new->hash, key, key_size);
+  if (can_sleep)
+    rcu_read_unlock();
+
+again:
+  if (need_pcpu && !pcpu_new) {
+    pcpu_new = __alloc_percpu_gfp(htab->pcpu_size, sizeof(u64), gfp | __GFP_NOWARN);
+    if (!pcpu_new) {
+      kfree(l_new);
+      return -ENOMEM;
+    }
+    if (htab->pcpu_init)
+      htab->pcpu_init(pcpu_new);
+  }
 
+  if (can_sleep)
+    rcu_read_lock();
   /* htab_map_update_elem() can be called in_irq() */
   raw_spin_lock_irqsave(&htab->lock, flags);
 
-  head = select_bucket(htab, l_new->hash);
-
   l_old = lookup_elem_raw(head, l_new->hash, key, key_size);
 
+  if (!l_old && htab->pcpu_size && !pcpu_new) {
+    /* 无锁检查之后元素被并发删除，改为插入，需要先分配 */
+    raw_spin_unlock_irqrestore(&htab->lock, flags);
+    if (can_sleep)
+      rcu_read_unlock();
+    need_pcpu = true;
+    goto again;
+  }
+
   if (!l_old && unlikely(htab->count >= htab->max_entries)) {
     /* if elem with this 'key' doesn't exist and we've reached
      * max_entries limit, fail insertion of new elem
@@ -204,21 +269,39 @@ static int htab_map_update_elem(struct tutu_htab *htab, void *key, void *value,
     goto err;
   }
 
+  if (l_old) {
+    /* 继承旧元素的 per-CPU 区域，旧元素释放时不再释放它 */
+    l_new->pcpu       = l_old->pcpu;
+    l_new->pcpu_owner = l_old->pcpu_owner;
+    l_old->pcpu_owner = false;
+  } else if (pcpu_new) {
+    l_new->pcpu       = pcpu_new;
+    l_new->pcpu_owner = true;
+    pcpu_new          = NULL;
+  }
+
   /* add new element to the head of the list, so that concurrent
    * search will find it before old elem
    */
   hlist_add_head_rcu(&l_new->hash_node, head);
   if (l_old) {
     hlist_del_rcu(&l_old->hash_node);
-    kfree_rcu(l_old, rcu);
+    call_rcu(&l_old->rcu, htab_elem_free_rcu);
   } else {
     htab->count++;
   }
   raw_spin_unlock_irqrestore(&htab->lock, flags);
+  if (can_sleep)
+    rcu_read_unlock();
 
+  /* 无锁检查时不存在、加锁后又出现的元素：预分配的区域用不上 */
+  free_percpu(pcpu_new);
   return 0;
 err:
   raw_spin_unlock_irqrestore(&htab->lock, flags);
+  if (can_sleep)
+    rcu_read_unlock();
+  free_percpu(pcpu_new);
   kfree(l_new);
   return ret;
 }
@@ -246,7 +329,7 @@ static int htab_map_delete_elem(struct tutu_htab *htab, void *key) {
   if (l) {
     hlist_del_rcu(&l->hash_node);
     htab->count--;
-    kfree_rcu(l, rcu);
+    call_rcu(&l->rcu, htab_elem_free_rcu);
     ret = 0;
   }
 
@@ -265,13 +348,17 @@ static void delete_all_elements(struct tutu_htab *htab) {
     hlist_for_each_entry_safe(l, n, head, hash_node) {
       hlist_del_rcu(&l->hash_node);
       htab->count--;
-      kfree(l);
+      htab_elem_free(l);
     }
   }
 }
 
 /* Called when map->refcnt goes to zero, either from workqueue or from syscall */
 void tutu_map_free(struct tutu_htab *htab) {
+  /* 与 kfree() 一样接受 NULL，出错路径上可能还有未分配的表 */
+  if (!htab)
+    return;
+
   /* at this point bpf_prog->aux->refcnt == 0 and this map->refcnt == 0,
    * so the programs (can be more than one that used this map) were
    * disconnected from events. Wait for outstanding critical sections in
@@ -283,6 +370,9 @@ void tutu_map_free(struct tutu_htab *htab) {
    * executed. It's ok. Proceed to free residual elements and map itself
    */
   delete_all_elements(htab);
+
+  /* 删除/替换的元素使用 call_rcu() 释放，回调执行的是本模块代码，卸载前必须等待完成 */
+  rcu_barrier();
   kvfree(htab->buckets);
   kfree(htab);
 }
@@ -290,7 +380,14 @@ void tutu_map_free(struct tutu_htab *htab) {
 void *tutu_map_lookup_elem(struct tutu_htab *htab, void *key) {
   void *val;
 
-  val = htab_map_lookup_elem(htab, key);
+  val = htab_map_lookup_elem(htab, key, NULL);
+  return val;
+}
+
+void *tutu_map_lookup_elem_pcpu(struct tutu_htab *htab, void *key, void __percpu **pcpu) {
+  void *val;
+
+  val = htab_map_lookup_elem(htab, key, pcpu);
   return val;
 }
 
@@ -308,11 +405,137 @@ int tutu_map_get_next_key(struct tutu_htab *htab, void *key, void *next_key) {
   return err;
 }
 
+int tutu_map_walk(struct tutu_htab *htab, u32 *bucket, u32 *skip, tutu_map_walk_cb_t cb, void *arg) {
+  struct htab_elem *l;
+  u32               i, n;
+  int               ret;
+
+  WARN_ON_ONCE(!rcu_read_lock_held());
+
+  for (i = *bucket; i < htab->n_buckets; i++) {
+    n = 0;
+    hlist_for_each_entry_rcu(l, &htab->buckets[i], hash_node) {
+      if (n++ < *skip)
+        continue;
+
+      ret = cb(l->key, l->key + round_up(htab->key_size, 8), l->pcpu, arg);
+      if (ret) {
+        *bucket = i;
+        *skip   = n - 1;
+        return ret;
+      }
+    }
+    *skip = 0;
+  }
+
+  *bucket = i;
+  return 0;
+}
+
+/*
+ * 逐桶复制：在 rcu_read_lock() 内把一个桶的 key/value 拷到临时缓冲区，解锁后再插入 dst，
+ * 插入时可以用 GFP_KERNEL 分配，大表复制不会因原子分配失败。
+ */
+struct tutu_htab *tutu_map_clone(struct tutu_htab *src) {
+  u32               kv_size = round_up(src->key_size, 8) + src->value_size;
+  u32               cap     = 16, n, i, j;
+  struct tutu_htab *dst;
+  struct htab_elem *l;
+  char             *buf;
+  int               err = 0;
+
+  dst = tutu_map_alloc_pcpu(src->key_size, src->value_size, src->max_entries, src->pcpu_size, src->pcpu_init);
+  if (IS_ERR(dst))
+    return dst;
+
+  buf = kmalloc_array(cap, kv_size, GFP_KERNEL);
+  if (!buf) {
+    err = -ENOMEM;
+    goto out;
+  }
+
+  for (i = 0; i < src->n_buckets && !err; i++) {
+  again:
+    n = 0;
+    rcu_read_lock();
+    hlist_for_each_entry_rcu(l, &src->buckets[i], hash_node) {
+      if (n < cap)
+        memcpy(buf + (size_t) n * kv_size, l->key, kv_size);
+      n++;
+    }
+    rcu_read_unlock();
+
+    if (n > cap) {
+      /* 桶比缓冲区长：扩大后重新复制这个桶 */
+      kfree(buf);
+      cap = roundup_pow_of_two(n);
+      buf = kmalloc_array(cap, kv_size, GFP_KERNEL);
+      if (!buf) {
+        err = -ENOMEM;
+        goto out;
+      }
+      goto again;
+    }
+
+    for (j = 0; j < n && !err; j++) {
+      char *kv = buf + (size_t) j * kv_size;
+
+      err = htab_map_update_elem(dst, kv, kv + round_up(src->key_size, 8), TUTU_ANY, GFP_KERNEL);
+    }
+    cond_resched();
+  }
+
+out:
+  kfree(buf);
+  if (err) {
+    tutu_map_free(dst);
+    return ERR_PTR(err);
+  }
+
+  return dst;
+}
+
+void tutu_map_adopt_pcpu(struct tutu_htab *dst, struct tutu_htab *src) {
+  struct htab_elem *l, *old;
+  void __percpu    *stale;
+  unsigned long     flags;
+  u32               i;
+
+  if (!dst->pcpu_size || dst->pcpu_size != src->pcpu_size || dst->key_size != src->key_size)
+    return;
+
+  rcu_read_lock();
+  for (i = 0; i < dst->n_buckets; i++) {
+    hlist_for_each_entry_rcu(l, &dst->buckets[i], hash_node) {
+      stale = NULL;
+
+      /* 与数据路径的原位更新互斥：更新同样会转移 pcpu_owner */
+      raw_spin_lock_irqsave(&src->lock, flags);
+      old = lookup_elem_raw(select_bucket(src, l->hash), l->hash, l->key, src->key_size);
+      if (old && old->pcpu_owner) {
+        if (l->pcpu_owner)
+          stale = l->pcpu;
+        l->pcpu         = old->pcpu;
+        l->pcpu_owner   = true;
+        old->pcpu_owner = false;
+      }
+      raw_spin_unlock_irqrestore(&src->lock, flags);
+
+      free_percpu(stale);
+    }
+  }
+  rcu_read_unlock();
+}
+
 int tutu_map_update_elem(struct tutu_htab *htab, void *key, void *value, u64 map_flags) {
   int err;
 
-  err = htab_map_update_elem(htab, key, value, map_flags);
+  err = htab_map_update_elem(htab, key, value, map_flags, GFP_ATOMIC);
   return err;
 }
 
+int tutu_map_update_elem_gfp(struct tutu_htab *htab, void *key, void *value, u64 map_flags, gfp_t gfp) {
+  return htab_map_update_elem(htab, key, value, map_flags, gfp);
+}
+
 // vim: set sw=2 ts=2 expandtab:
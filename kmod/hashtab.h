@@ -14,17 +14,29 @@ struct tutu_htab {
   u32                key_size;
   u32                value_size;
   u32                max_entries;
+  u32                pcpu_size; /* 每个元素附带的 per-CPU 区域大小，0 表示没有 */
+  void (*pcpu_init)(void __percpu *pcpu);
 };
 
-/* each htab element is struct htab_elem + key + value */
+/*
+ * each htab element is struct htab_elem + key + value
+ *
+ * pcpu: 可选的 per-CPU 区域（如流量计数）。更新已有 key 时新元素继承旧元素的 pcpu，
+ *       因此计数不会因为 value 被替换而清零；只有元素被删除时才随 RCU 回调释放。
+ */
 struct htab_elem {
   struct hlist_node hash_node;
   struct rcu_head   rcu;
+  void __percpu    *pcpu;
   u32               hash;
+  bool              pcpu_owner;
   DECLARE_FLEX_ARRAY(char, key);
 };
 
 struct tutu_htab *tutu_map_alloc(u32 key_size, u32 value_size, u32 max_entries);
+/* pcpu_init 可为 NULL；per-CPU 区域已清零 */
+struct tutu_htab *tutu_map_alloc_pcpu(u32 key_size, u32 value_size, u32 max_entries, u32 pcpu_size,
+                                      void (*pcpu_init)(void __percpu *pcpu));
 
 /* 以下接口要求调用者持有 rcu_read_lock()：
  *   - tutu_map_lookup_elem
@@ -33,9 +45,36 @@ struct tutu_htab *tutu_map_alloc(u32 key_size, u32 value_size, u32 max_entries);
  *   - tutu_map_delete_elem
  */
 void *tutu_map_lookup_elem(struct tutu_htab *htab, void *key);
+/* 同 tutu_map_lookup_elem，额外返回元素的 per-CPU 区域（没有时为 NULL） */
+void *tutu_map_lookup_elem_pcpu(struct tutu_htab *htab, void *key, void __percpu **pcpu);
 int   tutu_map_get_next_key(struct tutu_htab *htab, void *key, void *next_key);
 int   tutu_map_update_elem(struct tutu_htab *htab, void *key, void *value, u64 map_flags);
 int   tutu_map_delete_elem(struct tutu_htab *htab, void *key);
+
+/*
+ * 进程上下文的更新（genl 修改命令、批量更新）：gfp 允许睡眠时调用者不能持有 rcu_read_lock()，
+ * 元素和 per-CPU 区域用 gfp 分配；gfp 不允许睡眠时与 tutu_map_update_elem 相同。
+ */
+int tutu_map_update_elem_gfp(struct tutu_htab *htab, void *key, void *value, u64 map_flags, gfp_t gfp);
+
+/*
+ * 按桶遍历（要求持有 rcu_read_lock()），供 genl dump 使用。
+ * 从第 *bucket 个桶、桶内第 *skip 个元素开始对每个元素调用 cb；cb 返回非 0 时停止并返回该值，
+ * 此时 *bucket/*skip 指向该元素，下次调用从它重新开始，无需像 get_next_key 那样重新哈希上一个 key。
+ * 遍历完所有桶返回 0。遍历期间的并发修改可能导致元素被重复或遗漏，与 get_next_key 相同。
+ */
+typedef int (*tutu_map_walk_cb_t)(void *key, void *value, void __percpu *pcpu, void *arg);
+int tutu_map_walk(struct tutu_htab *htab, u32 *bucket, u32 *skip, tutu_map_walk_cb_t cb, void *arg);
+
+/* 复制一张表（参数与内容相同，per-CPU 区域为新分配的空区域），用于配置事务；可能睡眠，失败返回 ERR_PTR */
+struct tutu_htab *tutu_map_clone(struct tutu_htab *src);
+
+/*
+ * dst 中与 src 同 key 的元素接管 src 元素的 per-CPU 区域，用整张 dst 替换 src 后计数保持连续。
+ * dst 必须尚未发布；src 可以正被数据路径使用。
+ */
+void tutu_map_adopt_pcpu(struct tutu_htab *dst, struct tutu_htab *src);
+/* htab 为 NULL 时什么也不做 */
 void  tutu_map_free(struct tutu_htab *htab);
 
 // vim: set sw=2 ts=2 expandtab:
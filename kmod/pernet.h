@@ -0,0 +1,137 @@
+#pragma once
+
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/netfilter.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+#include <net/net_namespace.h>
+#include <net/netns/generic.h>
+
+#include "tutuicmptunnel.h"
+
+struct ifset;
+struct tutu_config_rcu;
+struct tutu_event;
+struct tutu_htab;
+struct tutu_stats_k;
+
+/*
+ * tutu_txn: 配置事务的暂存区
+ *
+ * BEGIN 时克隆 egress/ingress/user 三张表和当前配置，之后带 TUTU_ATTR_TXN 的修改只作用于副本，
+ * COMMIT 时与配置一起通过一次 cfg_ptr 替换发布。每个命名空间同时只有一个事务，
+ * 只在 genl 回调中访问（genl_mutex 串行化）。
+ *
+ * - portid:      发起事务的 netlink socket，只有它能修改/提交
+ * - expires:     空闲超时（jiffies），超时后其它 socket 可以开始新事务
+ *
+ * 会话不参与事务，没有 session_map 副本。
+ */
+struct tutu_txn {
+  u32                portid;
+  unsigned long      expires;
+  struct tutu_config cfg;
+  struct tutu_htab  *egress_peer_map;
+  struct tutu_htab  *ingress_peer_map;
+  struct tutu_htab  *user_map;
+};
+
+/*
+ * tutu_net: 每个网络命名空间独立的隧道实例
+ *
+ * init_net 在模块加载时即初始化（与原来的全局实例行为一致）；其它命名空间
+ * 在第一次收到本命名空间的 genl 命令时才分配 map 并注册 hook，避免宿主机上
+ * 大量不使用隧道的容器白白占用内存。
+ *
+ * - active:        实例是否已初始化（map/hook 均可用），只在 lock 下由 false 变为 true
+ * - dead:          命名空间正在销毁，netdev 通知不再调度 reload_work（rtnl 下读写）
+ * - cfg_mutex:     保护 cfg_ptr 的更新
+ * - ifset_mutex:   保护 ifset 的更新
+ * - ifname_lock:   保护 ifname_list
+ * - event_lock:    保护 events/event_count/event_lost，数据路径中也会获取
+ *
+ * egress_peer_map/ingress_peer_map/user_map 是控制面视图，数据路径通过 cfg_ptr 中的同名指针访问，
+ * 两者只在事务提交时（genl 回调中）一起替换。
+ */
+struct tutu_net {
+  struct net  *net;
+  struct mutex lock;
+  bool         active;
+  bool         dead;
+
+  struct tutu_htab *egress_peer_map;
+  struct tutu_htab *ingress_peer_map;
+  struct tutu_htab *session_map;
+  struct tutu_htab *user_map;
+
+  struct tutu_config_rcu __rcu *cfg_ptr;
+  struct mutex                  cfg_mutex;
+
+  struct ifset __rcu *ifset;
+  struct mutex        ifset_mutex;
+  struct list_head    ifname_list;
+  struct mutex        ifname_lock;
+
+  struct tutu_stats_k __percpu *stats;
+
+  struct tutu_txn *txn;
+
+  struct delayed_work gc_work;
+  struct delayed_work reload_work;
+
+  struct tutu_event  *events;       /* 待发送的事件 */
+  struct tutu_event  *events_spare; /* 与 events 交换，供 event_work 发送 */
+  u32                 event_count;
+  u32                 event_lost;
+  spinlock_t          event_lock;
+  struct delayed_work event_work;
+
+  const struct nf_hook_ops *egress_hook;
+  bool                      forward_hook;
+  bool                      defrag_ipv4;
+  bool                      defrag_ipv6;
+};
+
+extern unsigned int tutu_net_id;
+
+static inline struct tutu_net *tutu_pernet(const struct net *net) {
+  return net_generic(net, tutu_net_id);
+}
+
+/* 返回已初始化的实例，必要时先初始化；失败返回 ERR_PTR */
+struct tutu_net *tutu_net_get(struct net *net);
+
+/*
+ * 只读路径使用：返回已初始化的实例，尚未初始化时返回 NULL，不会触发初始化。
+ * 初始化会注册 hook、启用 netns 范围的 nf_defrag 并分配所有 map，只能由有权限的修改命令触发。
+ */
+static inline struct tutu_net *tutu_net_peek(const struct net *net) {
+  struct tutu_net *tn = tutu_pernet(net);
+
+  /* 与 tutu_net_activate() 的 smp_store_release() 配对 */
+  return smp_load_acquire(&tn->active) ? tn : NULL;
+}
+
+/* 配置事务（tutu.c），均在 genl 回调中调用 */
+int              tutu_txn_begin(struct tutu_net *tn, u32 portid);
+int              tutu_txn_commit(struct tutu_net *tn, u32 portid);
+int              tutu_txn_abort(struct tutu_net *tn, u32 portid);
+int              tutu_txn_set_config(struct tutu_net *tn, u32 portid, const struct tutu_config *in);
+/* 返回 portid 持有的未超时事务并刷新超时；没有事务返回 -ENOENT，被其它 socket 持有返回 -EBUSY */
+struct tutu_txn *tutu_txn_get(struct tutu_net *tn, u32 portid);
+
+/* 事件队列（genl.c），在 activate/deactivate 中调用 */
+int  tutu_event_init(struct tutu_net *tn);
+void tutu_event_exit(struct tutu_net *tn);
+/* 可在任意上下文调用；没有订阅者时直接返回 */
+void tutu_event_queue(struct tutu_net *tn, const struct tutu_event *ev);
+
+struct tutu_traffic_stats;
+
+/* 汇总 map 元素的 per-CPU 流量计数（pcpu 可为 NULL，此时结果为 0） */
+void tutu_fold_traffic_stats(const void __percpu *pcpu, struct tutu_traffic_stats *out);
+
+// vim: set sw=2 ts=2 expandtab:
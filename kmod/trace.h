@@ -0,0 +1,112 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tutu
+
+#if !defined(_TUTU_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TUTU_TRACE_H
+
+#include <linux/in6.h>
+#include <linux/netfilter.h>
+#include <linux/tracepoint.h>
+
+#include "tutuicmptunnel.h"
+
+/*
+ * 数据路径 tracepoint，未启用时只有一个 static key 分支。
+ *
+ * 用法示例：
+ *   perf trace -e 'tutu:*'
+ *   bpftrace -e 'tracepoint:tutu:drop { @[args->reason] = count(); }'
+ *
+ * 端口、icmp id/seq 均以主机字节序记录；IPv4 地址以 v4-mapped IPv6 形式记录。
+ */
+
+TRACE_DEFINE_ENUM(TUTU_REASON_NONE);
+TRACE_DEFINE_ENUM(TUTU_REASON_BAD_LENGTH);
+TRACE_DEFINE_ENUM(TUTU_REASON_NO_SESSION);
+TRACE_DEFINE_ENUM(TUTU_REASON_SESSION_EXPIRED);
+TRACE_DEFINE_ENUM(TUTU_REASON_UID_NOT_FOUND);
+TRACE_DEFINE_ENUM(TUTU_REASON_ADDR_MISMATCH);
+TRACE_DEFINE_ENUM(TUTU_REASON_SESSION_UPDATE);
+TRACE_DEFINE_ENUM(TUTU_REASON_PEER_NOT_FOUND);
+TRACE_DEFINE_ENUM(TUTU_REASON_GSO);
+TRACE_DEFINE_ENUM(TUTU_REASON_FRAGMENTED);
+TRACE_DEFINE_ENUM(TUTU_REASON_NO_UDP_CSUM);
+TRACE_DEFINE_ENUM(TUTU_REASON_NOT_WRITABLE);
+TRACE_DEFINE_ENUM(TUTU_REASON_CSUM);
+
+#define show_tutu_reason(r)                                                                                                    \
+  __print_symbolic(r, {TUTU_REASON_NONE, "none"}, {TUTU_REASON_BAD_LENGTH, "bad-length"},                                      \
+                   {TUTU_REASON_NO_SESSION, "no-session"}, {TUTU_REASON_SESSION_EXPIRED, "session-expired"},                   \
+                   {TUTU_REASON_UID_NOT_FOUND, "uid-not-found"}, {TUTU_REASON_ADDR_MISMATCH, "addr-mismatch"},                 \
+                   {TUTU_REASON_SESSION_UPDATE, "session-update"}, {TUTU_REASON_PEER_NOT_FOUND, "peer-not-found"},             \
+                   {TUTU_REASON_GSO, "gso"}, {TUTU_REASON_FRAGMENTED, "fragmented"}, {TUTU_REASON_NO_UDP_CSUM, "udp-csum"},    \
+                   {TUTU_REASON_NOT_WRITABLE, "not-writable"}, {TUTU_REASON_CSUM, "csum-offload"})
+
+/* saddr/daddr 为转换后数据包的地址 */
+DECLARE_EVENT_CLASS(tutu_convert,
+                    TP_PROTO(bool is_server, u8 uid, const struct in6_addr *saddr, const struct in6_addr *daddr, __be16 sport,
+                             __be16 dport, __be16 icmp_id, __be16 icmp_seq, unsigned int len),
+                    TP_ARGS(is_server, uid, saddr, daddr, sport, dport, icmp_id, icmp_seq, len),
+                    TP_STRUCT__entry(__field(bool, is_server) __field(u8, uid) __array(u8, saddr, sizeof(struct in6_addr))
+                                       __array(u8, daddr, sizeof(struct in6_addr)) __field(u16, sport) __field(u16, dport)
+                                         __field(u16, icmp_id) __field(u16, icmp_seq) __field(unsigned int, len)),
+                    TP_fast_assign(__entry->is_server = is_server; __entry->uid = uid;
+                                   memcpy(__entry->saddr, saddr, sizeof(__entry->saddr));
+                                   memcpy(__entry->daddr, daddr, sizeof(__entry->daddr)); __entry->sport = ntohs(sport);
+                                   __entry->dport = ntohs(dport); __entry->icmp_id = ntohs(icmp_id);
+                                   __entry->icmp_seq = ntohs(icmp_seq); __entry->len = len;),
+                    TP_printk("%s uid=%u %pI6c:%u -> %pI6c:%u id=%u seq=%u len=%u", __entry->is_server ? "server" : "client",
+                              __entry->uid, __entry->saddr, __entry->sport, __entry->daddr, __entry->dport, __entry->icmp_id,
+                              __entry->icmp_seq, __entry->len));
+
+/* UDP → ICMP；sport/dport 为原 UDP 端口 */
+DEFINE_EVENT(tutu_convert, egress_convert,
+             TP_PROTO(bool is_server, u8 uid, const struct in6_addr *saddr, const struct in6_addr *daddr, __be16 sport,
+                      __be16 dport, __be16 icmp_id, __be16 icmp_seq, unsigned int len),
+             TP_ARGS(is_server, uid, saddr, daddr, sport, dport, icmp_id, icmp_seq, len));
+
+/* ICMP → UDP；sport/dport 为重建后的 UDP 端口 */
+DEFINE_EVENT(tutu_convert, ingress_convert,
+             TP_PROTO(bool is_server, u8 uid, const struct in6_addr *saddr, const struct in6_addr *daddr, __be16 sport,
+                      __be16 dport, __be16 icmp_id, __be16 icmp_seq, unsigned int len),
+             TP_ARGS(is_server, uid, saddr, daddr, sport, dport, icmp_id, icmp_seq, len));
+
+DECLARE_EVENT_CLASS(tutu_session,
+                    TP_PROTO(const struct session_key *key, u8 uid, __be16 client_sport, u64 age),
+                    TP_ARGS(key, uid, client_sport, age),
+                    TP_STRUCT__entry(__array(u8, address, sizeof(struct in6_addr)) __field(u16, sport) __field(u16, dport)
+                                       __field(u8, uid) __field(u16, client_sport) __field(u64, age)),
+                    TP_fast_assign(memcpy(__entry->address, &key->address, sizeof(__entry->address));
+                                   __entry->sport = ntohs(key->sport); __entry->dport = ntohs(key->dport); __entry->uid = uid;
+                                   __entry->client_sport = ntohs(client_sport); __entry->age = age;),
+                    TP_printk("client=%pI6c id=%u dport=%u uid=%u client_sport=%u age=%llu", __entry->address, __entry->sport,
+                              __entry->dport, __entry->uid, __entry->client_sport, __entry->age));
+
+/* server ingress 新建会话（key 之前不存在） */
+DEFINE_EVENT(tutu_session, session_create, TP_PROTO(const struct session_key *key, u8 uid, __be16 client_sport, u64 age),
+             TP_ARGS(key, uid, client_sport, age));
+
+/* 会话过期被删除：egress 查找时发现或由 gc 清理 */
+DEFINE_EVENT(tutu_session, session_expire, TP_PROTO(const struct session_key *key, u8 uid, __be16 client_sport, u64 age),
+             TP_ARGS(key, uid, client_sport, age));
+
+/* hook 放弃转换：verdict 为 NF_DROP 时丢包，否则原样放行 */
+TRACE_EVENT(drop, TP_PROTO(const struct sk_buff *skb, bool egress, unsigned int verdict, enum tutu_reason reason),
+            TP_ARGS(skb, egress, verdict, reason),
+            TP_STRUCT__entry(__field(const void *, skbaddr) __field(unsigned int, len) __field(bool, egress)
+                               __field(bool, dropped) __field(int, reason)),
+            TP_fast_assign(__entry->skbaddr = skb; __entry->len = skb->len; __entry->egress = egress;
+                           __entry->dropped = verdict == NF_DROP; __entry->reason = reason;),
+            TP_printk("skbaddr=%p len=%u %s %s reason=%s", __entry->skbaddr, __entry->len,
+                      __entry->egress ? "egress" : "ingress", __entry->dropped ? "drop" : "bypass",
+                      show_tutu_reason(__entry->reason)));
+
+#endif /* _TUTU_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
+
+// vim: set sw=2 ts=2 expandtab:
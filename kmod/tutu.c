@@ -8,8 +8,10 @@
 #include <linux/icmp.h>
 #include <linux/ip.h>
 #include <linux/ipv6.h>
+#include <linux/jump_label.h>
 #include <linux/kernel.h>
 #include <linux/lockdep.h>
+#include <linux/log2.h>
 #include <linux/module.h>
 #include <linux/netfilter.h>
 #include <linux/netfilter_ipv4.h>
@@ -17,10 +19,28 @@
 #include <linux/rcupdate.h>
 #include <linux/tcp.h>
 #include <linux/types.h>
+#include <linux/u64_stats_sync.h>
 #include <linux/uaccess.h>
 #include <linux/udp.h>
+#include <linux/version.h>
 #include <net/checksum.h>
+#include <net/inet_frag.h>
+#include <net/ip.h>
 #include <net/ip6_checksum.h>
+#include <net/ipv6.h>
+
+#if IS_ENABLED(CONFIG_NF_CONNTRACK)
+#include <net/netfilter/nf_conntrack.h>
+#include <net/netfilter/nf_conntrack_helper.h>
+#endif
+
+#if IS_ENABLED(CONFIG_NF_DEFRAG_IPV4)
+#include <net/netfilter/ipv4/nf_defrag_ipv4.h>
+#endif
+
+#if IS_ENABLED(CONFIG_NF_DEFRAG_IPV6)
+#include <net/netfilter/ipv6/nf_defrag_ipv6.h>
+#endif
 
 #if __has_include(<asm/unaligned.h>)
 #include <asm/unaligned.h>
@@ -31,12 +51,15 @@
 #include "compat.h"
 #include "defs.h"
 #include "hashtab.h"
+#include "pernet.h"
 #include "tutuicmptunnel.h"
 
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
 #include "net_proto.h"
 
-LIST_HEAD(tutu_ifname_list);
-DEFINE_MUTEX(tutu_ifname_lock);
+unsigned int tutu_net_id __read_mostly;
 
 /* Config structure protected by RCU: dynamic bitmap of allowed ifindex */
 struct ifset {
@@ -46,15 +69,12 @@ struct ifset {
   DECLARE_FLEX_ARRAY(unsigned long, bitmap); /* flexible array */
 };
 
-static struct ifset __rcu *g_ifset;
-static DEFINE_MUTEX(g_ifset_mutex); // 保护ifnames和g_ifset
-
-static unsigned int get_max_ifindex_locked(void) {
+static unsigned int get_max_ifindex_locked(struct net *net) {
   struct net_device *dev;
   unsigned int       max_idx = 0;
 
   /* Device enumeration must be done under rtnl_lock */
-  for_each_netdev(&init_net, dev) {
+  for_each_netdev(net, dev) {
     if (dev->ifindex > max_idx)
       max_idx = dev->ifindex;
   }
@@ -75,7 +95,7 @@ static struct ifset *ifset_alloc(unsigned int max_ifindex) {
   return w;
 }
 
-static int build_ifset_from_list(struct ifset **out_new) {
+static int build_ifset_from_list(struct tutu_net *tn, struct ifset **out_new) {
   struct ifset            *w;
   unsigned int             max_idx;
   struct tutu_ifname_node *node;
@@ -87,7 +107,7 @@ static int build_ifset_from_list(struct ifset **out_new) {
    * 且允许我们使用 __dev_get_by_name (无引用计数版本)
    */
   rtnl_lock();
-  max_idx = get_max_ifindex_locked();
+  max_idx = get_max_ifindex_locked(tn->net);
 
   /* 2. 分配 ifset 结构体 */
   w = ifset_alloc(max_idx);
@@ -96,18 +116,18 @@ static int build_ifset_from_list(struct ifset **out_new) {
     goto out_rtnl;
   }
 
-  mutex_lock(&tutu_ifname_lock);
+  mutex_lock(&tn->ifname_lock);
   // 如果列表为空，表示“允许所有接口”
-  if (list_empty(&tutu_ifname_list)) {
+  if (list_empty(&tn->ifname_list)) {
     w->allow_all = true;
   } else {
     w->allow_all = false;
 
     /* 遍历链表 */
-    list_for_each_entry(node, &tutu_ifname_list, list) {
+    list_for_each_entry(node, &tn->ifname_list, list) {
       struct net_device *dev;
 
-      dev = __dev_get_by_name(&init_net, node->name);
+      dev = __dev_get_by_name(tn->net, node->name);
 
       if (!dev) {
         /* 接口名在配置里，但系统里没这个网卡 */
@@ -121,7 +141,7 @@ static int build_ifset_from_list(struct ifset **out_new) {
     }
   }
 
-  mutex_unlock(&tutu_ifname_lock);
+  mutex_unlock(&tn->ifname_lock);
 
   *out_new = w;
   err      = 0;
@@ -131,48 +151,48 @@ out_rtnl:
   return err;
 }
 
-int ifset_reload_config(void) {
+int ifset_reload_config(struct tutu_net *tn) {
   struct ifset *newcfg;
   struct ifset *oldcfg;
   int           err;
 
-  err = build_ifset_from_list(&newcfg);
+  err = build_ifset_from_list(tn, &newcfg);
   if (err)
     return err;
 
-  mutex_lock(&g_ifset_mutex);
-  oldcfg = rcu_replace_pointer(g_ifset, newcfg, lockdep_is_held(&g_ifset_mutex));
+  mutex_lock(&tn->ifset_mutex);
+  oldcfg = rcu_replace_pointer(tn->ifset, newcfg, lockdep_is_held(&tn->ifset_mutex));
   if (oldcfg)
     kfree_rcu(oldcfg, rcu);
-  mutex_unlock(&g_ifset_mutex);
+  mutex_unlock(&tn->ifset_mutex);
   return 0;
 }
 
-static void free_ifset(void) {
+static void free_ifset(struct tutu_net *tn) {
   struct ifset            *oldcfg;
   struct tutu_ifname_node *node, *tmp;
 
-  mutex_lock(&g_ifset_mutex);
-  oldcfg = rcu_replace_pointer(g_ifset, NULL, lockdep_is_held(&g_ifset_mutex));
-  mutex_unlock(&g_ifset_mutex);
+  mutex_lock(&tn->ifset_mutex);
+  oldcfg = rcu_replace_pointer(tn->ifset, NULL, lockdep_is_held(&tn->ifset_mutex));
+  mutex_unlock(&tn->ifset_mutex);
 
   if (oldcfg)
     kfree_rcu(oldcfg, rcu);
 
-  mutex_lock(&tutu_ifname_lock);
-  list_for_each_entry_safe(node, tmp, &tutu_ifname_list, list) {
+  mutex_lock(&tn->ifname_lock);
+  list_for_each_entry_safe(node, tmp, &tn->ifname_list, list) {
     list_del(&node->list);
     kfree(node);
   }
-  mutex_unlock(&tutu_ifname_lock);
+  mutex_unlock(&tn->ifname_lock);
 }
 
-bool net_has_device(const char *dev_name) {
+bool net_has_device(struct net *net, const char *dev_name) {
   struct net_device *dev;
   bool               found = false;
 
   rtnl_lock();
-  dev = dev_get_by_name(&init_net, dev_name);
+  dev = dev_get_by_name(net, dev_name);
   if (dev) {
     found = true;
     dev_put(dev);
@@ -187,12 +207,12 @@ bool net_has_device(const char *dev_name) {
  * - else: allow only if bit set
  * No explicit rcu_read_lock: single deref + read-only access, safe with kfree_rcu lifecycle.
  */
-static bool iface_allowed(int ifindex) {
+static bool iface_allowed(struct tutu_net *tn, int ifindex) {
   WARN_ON_ONCE(!rcu_read_lock_held());
 
   bool allowed = true;
 
-  const struct ifset *cfg = rcu_dereference(g_ifset);
+  const struct ifset *cfg = rcu_dereference(tn->ifset);
 
   if (cfg) {
     if (cfg->allow_all) {
@@ -205,9 +225,16 @@ static bool iface_allowed(int ifindex) {
   return allowed;
 }
 
+/*
+ * 数据路径每个包只解引用一次 cfg_ptr，配置和 peer/user 表都从同一个对象取得，
+ * 因此事务提交（整体替换）时不会看到一半新一半旧的状态。
+ */
 struct tutu_config_rcu {
   struct rcu_head    rcu;
   struct tutu_config inner;
+  struct tutu_htab  *egress_peer_map;
+  struct tutu_htab  *ingress_peer_map;
+  struct tutu_htab  *user_map;
 };
 
 static struct tutu_config_rcu g_cfg_init = {
@@ -218,22 +245,196 @@ static struct tutu_config_rcu g_cfg_init = {
     },
 };
 
+enum tutu_stat_idx {
+  TUTU_STAT_PACKETS_PROCESSED,
+  TUTU_STAT_BYTES_PROCESSED,
+  TUTU_STAT_PACKETS_DROPPED,
+  TUTU_STAT_BYTES_DROPPED,
+  TUTU_STAT_CHECKSUM_ERRORS,
+  TUTU_STAT_FRAGMENTED,
+  TUTU_STAT_GSO,
+  TUTU_STAT_REASSEMBLED,
+  TUTU_STAT_REASSEMBLED_BYTES,
+  __TUTU_STAT_MAX,
+};
+
+/*
+ * 每 CPU 统计：数据路径只做本 CPU 的普通加法，不需要原子指令。
+ * 64 位内核上 u64_stats_sync 为空操作；32 位内核上由 syncp 保证读者看到完整的 64 位值。
+ * hook 可能在进程上下文（LOCAL_OUT）和软中断中运行，因此写者使用 irqsave 版本。
+ */
 struct tutu_stats_k {
-  atomic64_t packets_processed;
-  atomic64_t packets_dropped;
-  atomic64_t checksum_errors;
-  atomic64_t fragmented;
-  atomic64_t gso;
+  u64_stats_t           cnt[__TUTU_STAT_MAX];
+  u64_stats_t           reason[__TUTU_REASON_MAX];
+  u64_stats_t           lat_sum[TUTU_LAT_HISTS];
+  u64_stats_t           lat[TUTU_LAT_HISTS][TUTU_LAT_BUCKETS];
+  struct u64_stats_sync syncp;
+};
+
+/* 耗时采样开关，默认关闭：关闭时 hook 中只剩一个 static key 分支 */
+static DEFINE_STATIC_KEY_FALSE(tutu_latency_key);
+
+/* 返回 hook 开始时间；0 表示未采样 */
+static __always_inline u64 tutu_latency_begin(void) {
+  if (static_branch_unlikely(&tutu_latency_key))
+    return ktime_get_ns();
+  return 0;
+}
+
+enum tutu_traffic_idx {
+  TUTU_TRAFFIC_RX_PACKETS,
+  TUTU_TRAFFIC_RX_BYTES,
+  TUTU_TRAFFIC_RX_DROPPED,
+  TUTU_TRAFFIC_TX_PACKETS,
+  TUTU_TRAFFIC_TX_BYTES,
+  TUTU_TRAFFIC_TX_DROPPED,
+  __TUTU_TRAFFIC_MAX,
+};
+
+/*
+ * 每个 user_map / peer map 元素附带的 per-CPU 流量计数，存放在 htab_elem->pcpu。
+ * 与全局统计相同，数据路径只写本 CPU 的副本，由 genl dump 时汇总。
+ */
+struct tutu_traffic_k {
+  u64_stats_t           cnt[__TUTU_TRAFFIC_MAX];
+  struct u64_stats_sync syncp;
 };
 
-struct tutu_htab *egress_peer_map;
-struct tutu_htab *ingress_peer_map;
-struct tutu_htab *session_map;
-struct tutu_htab *user_map;
+static void tutu_traffic_init(void __percpu *pcpu) {
+  struct tutu_traffic_k __percpu *traffic = pcpu;
+  int                             cpu;
 
-static struct tutu_config_rcu __rcu *g_cfg_ptr;
+  for_each_possible_cpu(cpu)
+    u64_stats_init(&per_cpu_ptr(traffic, cpu)->syncp);
+}
+
+/* 本包的统计结果，由 tutu_hook_verdict() 在 hook 出口一次记入 */
+struct tutu_hook_acct {
+  void __percpu *traffic;     /* 匹配到的 user_map / peer map 元素的流量计数，未匹配时为 NULL */
+  u64            t0;          /* tutu_latency_begin() 的返回值，0 表示未采样 */
+  int            lat_hist;    /* 转换成功时的耗时直方图下标 */
+  bool           converted;   /* 转换成功 */
+  bool           reassembled; /* 转换成功且由 nf_defrag 重组而来 */
+  bool           failed;      /* 匹配到元素之后转换失败，计为丢包 */
+};
+
+/*
+ * 在一个更新区间内记录本包的全部统计：processed/dropped、重组、GSO/分片、放弃原因、耗时采样，
+ * 以及所属 uid/peer 的流量计数。流量计数有自己的 syncp，但嵌套在全局统计的 irqsave 区间内，
+ * 32 位内核上每个包只关/开一次中断；64 位内核上两者都是空操作。
+ */
+static __always_inline void tutu_hook_account(struct tutu_stats_k __percpu *stats, const struct tutu_hook_acct *acct,
+                                              bool tx, unsigned int len, enum tutu_reason reason) {
+  struct tutu_stats_k *st;
+  unsigned long        flags;
+  u64                  delta  = 0;
+  int                  bucket = 0;
+
+  if (acct->converted && acct->t0) {
+    delta  = ktime_get_ns() - acct->t0;
+    bucket = delta ? min_t(int, ilog2(delta), TUTU_LAT_BUCKETS - 1) : 0;
+  }
+
+  st    = get_cpu_ptr(stats);
+  flags = u64_stats_update_begin_irqsave(&st->syncp);
+  if (acct->converted) {
+    u64_stats_inc(&st->cnt[TUTU_STAT_PACKETS_PROCESSED]);
+    u64_stats_add(&st->cnt[TUTU_STAT_BYTES_PROCESSED], len);
+    if (acct->reassembled) {
+      u64_stats_inc(&st->cnt[TUTU_STAT_REASSEMBLED]);
+      u64_stats_add(&st->cnt[TUTU_STAT_REASSEMBLED_BYTES], len);
+    }
+    if (acct->t0) {
+      u64_stats_inc(&st->lat[acct->lat_hist][bucket]);
+      u64_stats_add(&st->lat_sum[acct->lat_hist], delta);
+    }
+  } else if (acct->failed) {
+    u64_stats_inc(&st->cnt[TUTU_STAT_PACKETS_DROPPED]);
+    u64_stats_add(&st->cnt[TUTU_STAT_BYTES_DROPPED], len);
+  }
+  if (reason == TUTU_REASON_GSO)
+    u64_stats_inc(&st->cnt[TUTU_STAT_GSO]);
+  else if (reason == TUTU_REASON_FRAGMENTED)
+    u64_stats_inc(&st->cnt[TUTU_STAT_FRAGMENTED]);
+  if (reason != TUTU_REASON_NONE)
+    u64_stats_inc(&st->reason[reason]);
+
+  if (acct->traffic && (acct->converted || acct->failed)) {
+    struct tutu_traffic_k *tt   = this_cpu_ptr((struct tutu_traffic_k __percpu *) acct->traffic);
+    int                    base = tx ? TUTU_TRAFFIC_TX_PACKETS : TUTU_TRAFFIC_RX_PACKETS;
+
+    u64_stats_update_begin(&tt->syncp);
+    /* rx/tx 两组均按 packets, bytes, dropped 顺序排列 */
+    if (acct->failed) {
+      u64_stats_inc(&tt->cnt[base + 2]);
+    } else {
+      u64_stats_inc(&tt->cnt[base]);
+      u64_stats_add(&tt->cnt[base + 1], len);
+    }
+    u64_stats_update_end(&tt->syncp);
+  }
+  u64_stats_update_end_irqrestore(&st->syncp, flags);
+  put_cpu_ptr(stats);
+}
+
+/*
+ * hook 的统一出口：记录统计和放弃转换的原因。
+ *
+ * 5.18 起丢包改为由本模块调用 kfree_skb_reason() 并返回 NF_STOLEN，dropwatch / skb:kfree_skb 一律显示为
+ * NETFILTER_DROP：这些都是本模块的策略性丢弃，不是协议栈意义上的错误（UDP 检验和为 0 并非检验和错误），
+ * 具体原因见 tutu:drop tracepoint。
+ */
+static __always_inline unsigned int tutu_hook_verdict(struct tutu_stats_k __percpu *stats, const struct tutu_hook_acct *acct,
+                                                      struct sk_buff *skb, bool egress, unsigned int verdict,
+                                                      enum tutu_reason reason) {
+  if (reason != TUTU_REASON_NONE || verdict == NF_DROP)
+    trace_drop(skb, egress, verdict, reason);
+
+  if (acct->converted || acct->failed || reason != TUTU_REASON_NONE)
+    tutu_hook_account(stats, acct, egress, skb->len, reason);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+  if (verdict == NF_DROP) {
+    kfree_skb_reason(skb, SKB_DROP_REASON_NETFILTER_DROP);
+    return NF_STOLEN;
+  }
+#endif
 
-DEFINE_PER_CPU(struct tutu_stats_k, g_stats_percpu);
+  return verdict;
+}
+
+void tutu_fold_traffic_stats(const void __percpu *pcpu, struct tutu_traffic_stats *out) {
+  const struct tutu_traffic_k __percpu *traffic = pcpu;
+  u64                                   sum[__TUTU_TRAFFIC_MAX] = {};
+  int                                   cpu;
+
+  for_each_possible_cpu(cpu) {
+    const struct tutu_traffic_k *st;
+    u64                          tmp[__TUTU_TRAFFIC_MAX];
+    unsigned int                 start;
+    int                          i;
+
+    if (!traffic)
+      break;
+
+    st = per_cpu_ptr(traffic, cpu);
+    do {
+      start = u64_stats_fetch_begin(&st->syncp);
+      for (i = 0; i < __TUTU_TRAFFIC_MAX; i++)
+        tmp[i] = u64_stats_read(&st->cnt[i]);
+    } while (u64_stats_fetch_retry(&st->syncp, start));
+
+    for (i = 0; i < __TUTU_TRAFFIC_MAX; i++)
+      sum[i] += tmp[i];
+  }
+
+  out->rx_packets = sum[TUTU_TRAFFIC_RX_PACKETS];
+  out->rx_bytes   = sum[TUTU_TRAFFIC_RX_BYTES];
+  out->rx_dropped = sum[TUTU_TRAFFIC_RX_DROPPED];
+  out->tx_packets = sum[TUTU_TRAFFIC_TX_PACKETS];
+  out->tx_bytes   = sum[TUTU_TRAFFIC_TX_BYTES];
+  out->tx_dropped = sum[TUTU_TRAFFIC_TX_DROPPED];
+}
 
 static __always_inline __wsum udp_pseudoheader_sum(struct iphdr *iph, struct udphdr *udp) {
   return csum_tcpudp_nofold(iph->saddr, iph->daddr, ntohs(udp->len), IPPROTO_UDP, 0);
@@ -253,6 +454,15 @@ static void ipv6_copy(struct in6_addr *dst, const struct in6_addr *src) {
   *dst = *src;
 }
 
+// nf_defrag 重组出的数据报会在 IPCB/IP6CB 中记录最大分片长度，供输出时重新分片
+static __always_inline bool skb_is_reassembled(struct sk_buff *skb, u32 ip_type) {
+  if (ip_type == 4)
+    return IPCB(skb)->frag_max_size != 0;
+  if (ip_type == 6)
+    return IP6CB(skb)->frag_max_size != 0;
+  return false;
+}
+
 /*
  * 解析 L2/L3/L4 头部
  *
@@ -323,7 +533,8 @@ static int parse_headers(struct sk_buff *skb, u32 *ip_type, u32 *l2_len, u32 *ip
         break;
 
       /* 以下扩展头无法按 ipv6_opt_hdr 通用规则安全解析，直接拒绝：
-       * - FRAGMENT: 长度规则不同，且分片包无法在不重组前提下做协议转换
+       * - FRAGMENT: 长度规则不同，且分片包无法在不重组前提下做协议转换；
+       *             nf_defrag_ipv6 重组后的包已去掉分片头，不受影响
        * - AUTH:     长度规则为 (hdrlen+2)*4，与通用规则 (hdrlen+1)*8 不同
        * - ESP:      不具有标准扩展头格式
        * - NONE:     无后续负载，不应作为扩展头继续解析
@@ -393,8 +604,21 @@ static __wsum recover_payload_csum_from_icmp(struct icmphdr *icmp, struct ipv6hd
   return payload_sum;
 }
 
+static void tutu_session_event(struct tutu_net *tn, u8 type, const struct session_key *key, u8 uid) {
+  struct tutu_event ev = {
+    .type    = type,
+    .uid     = uid,
+    .port    = key->dport,
+    .icmp_id = key->sport,
+    .address = key->address,
+  };
+
+  tutu_event_queue(tn, &ev);
+}
+
 // 检查并删除过期会话
-static int check_age(struct tutu_config *cfg, struct session_key *lookup_key, struct session_value *value_ptr) {
+static int check_age(struct tutu_net *tn, struct tutu_config *cfg, struct session_key *lookup_key,
+                     struct session_value *value_ptr) {
   // 检查下age
   __u64 age = READ_ONCE(value_ptr->age);
   __u64 now = ktime_get_seconds();
@@ -402,7 +626,9 @@ static int check_age(struct tutu_config *cfg, struct session_key *lookup_key, st
   if (!age || now < age || now - age >= cfg->session_max_age) {
     // 太老，需要跳过并删除这个key
     pr_debug("session_map entry: age %llu too old: now is %llu\n", age, now);
-    tutu_map_delete_elem(session_map, lookup_key);
+    trace_session_expire(lookup_key, value_ptr->uid, value_ptr->client_sport, age);
+    tutu_session_event(tn, TUTU_EVENT_SESSION_EXPIRE, lookup_key, value_ptr->uid);
+    tutu_map_delete_elem(tn->session_map, lookup_key);
     return -1;
   }
 
@@ -559,7 +785,8 @@ static int skb_change_type(struct sk_buff *skb, u32 ip_type, u32 l2_len, u32 ip_
     if (icmp_len < sizeof(*icmph))
       return -EINVAL;
 
-    writable_len = l4_offset + (use_partial ? sizeof(*icmph) : icmp_len);
+    // 软件校验和用 skb_checksum() 计算，只需头部可写，不必线性化整个（可能是重组后的）大包
+    writable_len = l4_offset + sizeof(*icmph);
     err          = skb_ensure_writable(skb, writable_len);
     if (unlikely(err))
       return err;
@@ -577,7 +804,7 @@ static int skb_change_type(struct sk_buff *skb, u32 ip_type, u32 l2_len, u32 ip_
        */
       skb->csum_offset = offsetof(struct icmphdr, checksum);
     } else {
-      icmph->checksum = csum_fold(csum_partial((char *) icmph, (int) icmp_len, 0));
+      icmph->checksum = csum_fold(skb_checksum(skb, l4_offset, (int) icmp_len, 0));
       skb->ip_summed  = CHECKSUM_UNNECESSARY;
     }
   } else if (ip_type == 6 && ip_proto == IPPROTO_ICMPV6) {
@@ -594,7 +821,7 @@ static int skb_change_type(struct sk_buff *skb, u32 ip_type, u32 l2_len, u32 ip_
     if (icmp_len < sizeof(*icmp6h))
       return -EINVAL;
 
-    writable_len = l4_offset + (use_partial ? sizeof(*icmp6h) : icmp_len);
+    writable_len = l4_offset + sizeof(*icmp6h);
     err          = skb_ensure_writable(skb, writable_len);
     if (unlikely(err))
       return err;
@@ -616,7 +843,7 @@ static int skb_change_type(struct sk_buff *skb, u32 ip_type, u32 l2_len, u32 ip_
       __wsum csum;
 
       icmp6h->icmp6_cksum = 0;
-      csum                = csum_partial((char *) icmp6h, (int) icmp_len, 0);
+      csum                = skb_checksum(skb, l4_offset, (int) icmp_len, 0);
       icmp6h->icmp6_cksum = csum_ipv6_magic(&ip6h->saddr, &ip6h->daddr, icmp_len, IPPROTO_ICMPV6, csum);
       skb->ip_summed      = CHECKSUM_UNNECESSARY;
     }
@@ -625,12 +852,30 @@ static int skb_change_type(struct sk_buff *skb, u32 ip_type, u32 l2_len, u32 ip_
   return 0;
 }
 
-static int update_session_map(struct user_info *user, u8 uid, __be16 icmp_seq) {
+/*
+ * 按（本地地址, uid）查找用户，未命中时回退到通配地址 (::)。
+ * key 返回实际命中的键，供后续原位更新使用；traffic 返回该用户的流量计数。
+ */
+static struct user_info *lookup_user(const struct tutu_config_rcu *p, const struct in6_addr *laddr, u8 uid,
+                                     struct user_key *key, void __percpu **traffic) {
+  struct user_info *user;
+
+  *key = (struct user_key) {.uid = uid};
+  ipv6_copy(&key->address, laddr);
+  user = tutu_map_lookup_elem_pcpu(p->user_map, key, traffic);
+  if (user)
+    return user;
+
+  memset(&key->address, 0, sizeof(key->address));
+  return tutu_map_lookup_elem_pcpu(p->user_map, key, traffic);
+}
+
+static int update_session_map(struct tutu_net *tn, struct user_info *user, u8 uid, __be16 icmp_seq) {
   int                err;
   struct session_key key = {.dport = user->dport, .sport = user->icmp_id, .address = user->address};
   __u64              now = ktime_get_seconds();
 
-  struct session_value *exist = tutu_map_lookup_elem(session_map, &key);
+  struct session_value *exist = tutu_map_lookup_elem(tn->session_map, &key);
 
   if (exist) {
     bool  client_sport_changed = exist->client_sport != icmp_seq;
@@ -649,9 +894,13 @@ static int update_session_map(struct user_info *user, u8 uid, __be16 icmp_seq) {
     .age          = now,
     .client_sport = icmp_seq,
   };
-  err = tutu_map_update_elem(session_map, &key, &value, TUTU_ANY);
+  err = tutu_map_update_elem(tn->session_map, &key, &value, TUTU_ANY);
   pr_debug("update session_map: sport %5u, dport: %5u, age: %llu: ret: %d\n", ntohs(key.sport), ntohs(key.dport), value.age,
            err);
+  if (!exist && !err) {
+    trace_session_create(&key, uid, icmp_seq, now);
+    tutu_session_event(tn, TUTU_EVENT_SESSION_CREATE, &key, uid);
+  }
 
   return err;
 }
@@ -693,16 +942,19 @@ static int update_session_map(struct user_info *user, u8 uid, __be16 icmp_seq) {
  * - Client 模式：用 egress_peer_map 查隧道服务器配置
  */
 static unsigned int egress_hook_func(void *priv, struct sk_buff *skb, const struct nf_hook_state *state) {
-  int                  err;
-  struct tutu_config   config, *cfg = &config;
-  struct tutu_stats_k *stat = this_cpu_ptr(&g_stats_percpu);
+  int                           err;
+  enum tutu_reason              reason = TUTU_REASON_NONE;
+  struct tutu_config            config, *cfg = &config;
+  struct tutu_net              *tn    = tutu_pernet(state->net);
+  struct tutu_stats_k __percpu *stats = tn->stats;
+  struct tutu_hook_acct         acct  = {.t0 = tutu_latency_begin()};
 
   if (!skb || !ip_hdr(skb)) {
     return NF_ACCEPT;
   }
 
   rcu_read_lock();
-  struct tutu_config_rcu *p = rcu_dereference(g_cfg_ptr);
+  struct tutu_config_rcu *p = rcu_dereference(tn->cfg_ptr);
   if (likely(p)) {
     config = p->inner;
   } else {
@@ -718,7 +970,7 @@ static unsigned int egress_hook_func(void *priv, struct sk_buff *skb, const stru
     const struct net_device *out     = state->out;
     int                      ifindex = out ? out->ifindex : (skb ? skb->skb_iif : 0);
 
-    if (!iface_allowed(ifindex)) {
+    if (!iface_allowed(tn, ifindex)) {
       err = NF_ACCEPT;
       goto err_cleanup;
     }
@@ -745,11 +997,14 @@ static unsigned int egress_hook_func(void *priv, struct sk_buff *skb, const stru
 
   // 非法的udp长度
   if (ntohs(udp->len) < sizeof(*udp)) {
-    err = NF_ACCEPT;
+    reason = TUTU_REASON_BAD_LENGTH;
+    err    = NF_ACCEPT;
     goto err_cleanup;
   }
 
   struct user_info *user = NULL;
+  struct user_key   user_key;
+  struct in6_addr   laddr;
   __be16            icmp_id, icmp_seq;
   u8                icmp_type = 0, uid;
 
@@ -779,12 +1034,14 @@ static unsigned int egress_hook_func(void *priv, struct sk_buff *skb, const stru
 
       ipv6_addr_set_v4mapped(get_unaligned(&ipv4->daddr), &in6);
       lookup_key.address = in6;
+      ipv6_addr_set_v4mapped(get_unaligned(&ipv4->saddr), &laddr);
     } else if (ipv6) {
       ipv6_copy(&lookup_key.address, &ipv6->daddr);
+      ipv6_copy(&laddr, &ipv6->saddr);
     }
 
     pr_debug("search port: %5u, sport: %5u\n", ntohs(lookup_key.dport), ntohs(lookup_key.sport));
-    struct session_value *value_ptr = tutu_map_lookup_elem(session_map, &lookup_key);
+    struct session_value *value_ptr = tutu_map_lookup_elem(tn->session_map, &lookup_key);
 
     if (!value_ptr) {
       if (ipv4) {
@@ -793,19 +1050,22 @@ static unsigned int egress_hook_func(void *priv, struct sk_buff *skb, const stru
         pr_debug("cannot get uid: %pI6:%5u -> %pI6:%5u\n", &ipv6->saddr, ntohs(udp->source), &ipv6->daddr, ntohs(udp->dest));
       }
 
-      err = NF_ACCEPT;
+      reason = TUTU_REASON_NO_SESSION;
+      err    = NF_ACCEPT;
       goto err_cleanup;
     }
 
     uid      = value_ptr->uid;
     icmp_seq = value_ptr->client_sport;
-    try2_ok(check_age(cfg, &lookup_key, value_ptr), "check age: %ld\n", _ret);
-    user = try2_p_ok(tutu_map_lookup_elem(user_map, &uid), "invalid uid: %u\n", uid);
+    try2_ok_reason(check_age(tn, cfg, &lookup_key, value_ptr), TUTU_REASON_SESSION_EXPIRED, "check age: %ld\n", _ret);
+    // 回包的源地址即客户端访问的服务器地址
+    user = try2_p_ok_reason(lookup_user(p, &laddr, uid, &user_key, &acct.traffic), TUTU_REASON_UID_NOT_FOUND,
+                            "invalid uid: %u\n", uid);
 
     if (skb_is_gso(skb)) {
       pr_debug("cannot handle GSO packets: length %u\n", skb->len);
-      atomic64_inc(&stat->gso);
-      err = NF_DROP;
+      reason = TUTU_REASON_GSO;
+      err    = NF_DROP;
       goto err_cleanup;
     }
 
@@ -831,24 +1091,13 @@ static unsigned int egress_hook_func(void *priv, struct sk_buff *skb, const stru
       ipv6_copy(&peer_key.address, &ipv6->daddr);
     }
 
-    struct egress_peer_value *peer_value = try2_p_ok(tutu_map_lookup_elem(egress_peer_map, &peer_key),
+    struct egress_peer_value *peer_value = try2_p_ok(tutu_map_lookup_elem_pcpu(p->egress_peer_map, &peer_key, &acct.traffic),
                                                      "egress client: unrelated packet\n");
     {
       if (skb_is_gso(skb)) {
         pr_debug("cannot handle GSO packets: length %u\n", skb->len);
-        atomic64_inc(&stat->gso);
-        err = NF_DROP;
-        goto err_cleanup;
-      }
-    }
-
-    if (ipv4) {
-      // 如果UDP包为分片（包括第一个包或后续包），无法重写后续包没有的UDP头部，直接丢包
-      if ((ntohs(ipv4->frag_off) & 0x1FFF) != 0 || (ntohs(ipv4->frag_off) & 0x2000) != 0) {
-        // 检查分片偏移和MF标志，只要有分片相关标志就丢弃
-        pr_debug("drop fragmented UDP packet\n");
-        atomic64_inc(&stat->fragmented);
-        err = NF_DROP;
+        reason = TUTU_REASON_GSO;
+        err    = NF_DROP;
         goto err_cleanup;
       }
     }
@@ -867,7 +1116,17 @@ static unsigned int egress_hook_func(void *priv, struct sk_buff *skb, const stru
     xor_key_len        = peer_value->xor_key_len;
   }
 
-  atomic64_inc(&stat->packets_processed);
+  /*
+   * 如果UDP包为分片（包括第一个包或后续包），无法重写后续包没有的UDP头部，直接丢包。
+   * 启用 nf_defrag 时转发流量已在 PRE_ROUTING 重组，本机流量要到 POST_ROUTING 之后才分片，
+   * 转换后的 ICMP 包由 ip_finish_output() 按 frag_max_size 重新分片，所以这里只会遇到无法重组的分片。
+   */
+  if (ipv4 && ip_is_fragment(ipv4)) {
+    pr_debug("drop fragmented UDP packet\n");
+    reason = TUTU_REASON_FRAGMENTED;
+    err    = NF_DROP;
+    goto err_cleanup;
+  }
 
   struct udphdr old_udp = *udp;
 
@@ -878,7 +1137,8 @@ static unsigned int egress_hook_func(void *priv, struct sk_buff *skb, const stru
 
     if (ipv4) {
       if (ntohs(ipv4->tot_len) < ip_hdr_len + sizeof(struct udphdr)) {
-        err = NF_ACCEPT;
+        reason = TUTU_REASON_BAD_LENGTH;
+        err    = NF_ACCEPT;
         goto err_cleanup;
       }
 
@@ -888,20 +1148,23 @@ static unsigned int egress_hook_func(void *priv, struct sk_buff *skb, const stru
       u32 ext_len;
 
       if (ip_hdr_len < sizeof(struct ipv6hdr)) {
-        err = NF_ACCEPT;
+        reason = TUTU_REASON_BAD_LENGTH;
+        err    = NF_ACCEPT;
         goto err_cleanup;
       }
 
       ext_len = ip_hdr_len - sizeof(struct ipv6hdr);
 
       if (ip_payload_len < ext_len + sizeof(struct udphdr)) {
-        err = NF_ACCEPT;
+        reason = TUTU_REASON_BAD_LENGTH;
+        err    = NF_ACCEPT;
         goto err_cleanup;
       }
 
       l4_len = ip_payload_len - ext_len;
     } else {
-      err = NF_ACCEPT;
+      reason = TUTU_REASON_BAD_LENGTH;
+      err    = NF_ACCEPT;
       goto err_cleanup;
     }
 
@@ -912,9 +1175,10 @@ static unsigned int egress_hook_func(void *priv, struct sk_buff *skb, const stru
 
     err = skb_xor_payload_linear(skb, payload_off, payload_len, xor_key, xor_key_len, key_start);
     if (err) {
-      atomic64_inc(&stat->packets_dropped);
+      acct.failed = true;
       pr_debug("skb_xor_payload_linear failed: %d\n", err);
-      err = NF_DROP;
+      reason = TUTU_REASON_NOT_WRITABLE;
+      err    = NF_DROP;
       goto err_cleanup;
     }
 
@@ -931,8 +1195,9 @@ static unsigned int egress_hook_func(void *priv, struct sk_buff *skb, const stru
 
   if (!old_udp.check) {
     pr_debug("udp must has checksum\n");
-    atomic64_inc(&stat->packets_dropped);
-    err = NF_DROP;
+    acct.failed = true;
+    reason = TUTU_REASON_NO_UDP_CSUM;
+    err    = NF_DROP;
     goto err_cleanup;
   }
 
@@ -941,9 +1206,10 @@ static unsigned int egress_hook_func(void *priv, struct sk_buff *skb, const stru
   // 将UDP头部替换为ICMP头部
   err = skb_store_bytes_linear(skb, ip_end, &icmp_hdr, sizeof(icmp_hdr));
   if (err) {
-    atomic64_inc(&stat->packets_dropped);
+    acct.failed = true;
     pr_debug("skb_store_bytes_linear failed: %d\n", err);
-    err = NF_DROP;
+    reason = TUTU_REASON_NOT_WRITABLE;
+    err    = NF_DROP;
     goto err_cleanup;
   }
 
@@ -957,9 +1223,10 @@ static unsigned int egress_hook_func(void *priv, struct sk_buff *skb, const stru
 
     err = skb_update_ipv4_checksum(skb, ipv4, l2_len, IPPROTO_UDP, new_proto);
     if (err) {
-      atomic64_inc(&stat->packets_dropped);
+      acct.failed = true;
       pr_debug("skb_update_ipv4_checksum failed: %d\n", err);
-      err = NF_DROP;
+      reason = TUTU_REASON_NOT_WRITABLE;
+      err    = NF_DROP;
       goto err_cleanup;
     }
 
@@ -968,9 +1235,10 @@ static unsigned int egress_hook_func(void *priv, struct sk_buff *skb, const stru
 
   err = skb_store_bytes_linear(skb, ip_proto_offset, &new_proto, sizeof(new_proto));
   if (err) {
-    atomic64_inc(&stat->packets_dropped);
+    acct.failed = true;
     pr_debug("skb_store_bytes_linear failed: %d\n", err);
-    err = NF_DROP;
+    reason = TUTU_REASON_NOT_WRITABLE;
+    err    = NF_DROP;
     goto err_cleanup;
   }
 
@@ -981,9 +1249,10 @@ static unsigned int egress_hook_func(void *priv, struct sk_buff *skb, const stru
   // ipv6: 重新算整个icmpv6的检验和，停止硬件计算
   err = skb_change_type(skb, ip_type, l2_len, ip_hdr_len, ip_proto_offset, ip_end);
   if (err) {
-    atomic64_inc(&stat->packets_dropped);
+    acct.failed = true;
     pr_debug("skb_change_type failed: %d\n", err);
-    err = NF_DROP;
+    reason = TUTU_REASON_CSUM;
+    err    = NF_DROP;
     goto err_cleanup;
   }
 
@@ -995,10 +1264,28 @@ static unsigned int egress_hook_func(void *priv, struct sk_buff *skb, const stru
     // dump_skb(skb);
   }
 
+  if (trace_egress_convert_enabled()) {
+    struct in6_addr saddr, daddr;
+
+    if (ipv4) {
+      ipv6_addr_set_v4mapped(get_unaligned(&ipv4->saddr), &saddr);
+      ipv6_addr_set_v4mapped(get_unaligned(&ipv4->daddr), &daddr);
+    } else {
+      ipv6_copy(&saddr, &ipv6->saddr);
+      ipv6_copy(&daddr, &ipv6->daddr);
+    }
+    trace_egress_convert(cfg->is_server, uid, &saddr, &daddr, old_udp.source, old_udp.dest, icmp_id, icmp_seq, skb->len);
+  }
+
+  /* 只有转换成功的包才计入 processed/tx，失败的包已标记 acct.failed，由 tutu_hook_verdict() 计为丢包 */
+  acct.converted   = true;
+  acct.reassembled = skb_is_reassembled(skb, ip_type);
+  acct.lat_hist    = TUTU_LAT_INDEX(false, cfg->is_server, tutu_xor_enabled(xor_key, xor_key_len));
+
   err = NF_ACCEPT;
 err_cleanup:
   rcu_read_unlock();
-  return err;
+  return tutu_hook_verdict(stats, &acct, skb, true, err, reason);
 }
 
 // 更新udp检验和
@@ -1041,16 +1328,19 @@ static void update_udp_cksum(struct iphdr *ipv4, struct ipv6hdr *ipv6, struct ud
  *   即使 NAT 通过别的会话的 icmp_id 将包还原回来，seq 通道仍保证数据不串
  */
 static unsigned int ingress_hook_func(void *priv, struct sk_buff *skb, const struct nf_hook_state *state) {
-  int                  err;
-  struct tutu_config   config, *cfg = &config;
-  struct tutu_stats_k *stat = this_cpu_ptr(&g_stats_percpu);
+  int                           err;
+  enum tutu_reason              reason = TUTU_REASON_NONE;
+  struct tutu_config            config, *cfg = &config;
+  struct tutu_net              *tn    = tutu_pernet(state->net);
+  struct tutu_stats_k __percpu *stats = tn->stats;
+  struct tutu_hook_acct         acct  = {.t0 = tutu_latency_begin()};
 
   if (!skb || !ip_hdr(skb)) {
     return NF_ACCEPT;
   }
 
   rcu_read_lock();
-  struct tutu_config_rcu *p = rcu_dereference(g_cfg_ptr);
+  struct tutu_config_rcu *p = rcu_dereference(tn->cfg_ptr);
   if (likely(p)) {
     config = p->inner;
   } else {
@@ -1066,7 +1356,7 @@ static unsigned int ingress_hook_func(void *priv, struct sk_buff *skb, const str
     const struct net_device *in      = state->in;
     int                      ifindex = in ? in->ifindex : (skb ? skb->skb_iif : 0);
 
-    if (!iface_allowed(ifindex)) {
+    if (!iface_allowed(tn, ifindex)) {
       err = NF_ACCEPT;
       goto err_cleanup;
     }
@@ -1099,19 +1389,22 @@ static unsigned int ingress_hook_func(void *priv, struct sk_buff *skb, const str
     if (ipv4) {
       // IPv4: icmp报文全长必须足够
       if (ntohs(ipv4->tot_len) < least_size) {
-        err = NF_ACCEPT;
+        reason = TUTU_REASON_BAD_LENGTH;
+        err    = NF_ACCEPT;
         goto err_cleanup;
       }
     } else if (ipv6) {
       // 守护
       if (ip_hdr_len < sizeof(struct ipv6hdr)) {
-        err = NF_ACCEPT;
+        reason = TUTU_REASON_BAD_LENGTH;
+        err    = NF_ACCEPT;
         goto err_cleanup;
       }
       // IPV6的payload_len: 不包括基本头部的剩余数据包长度
       // 加上ipv6头部后必须足够
       if (sizeof(struct ipv6hdr) + ntohs(ipv6->payload_len) < least_size) {
-        err = NF_ACCEPT;
+        reason = TUTU_REASON_BAD_LENGTH;
+        err    = NF_ACCEPT;
         goto err_cleanup;
       }
     }
@@ -1129,27 +1422,38 @@ static unsigned int ingress_hook_func(void *priv, struct sk_buff *skb, const str
   try2_ok(icmp_seq != 0 ? 0 : -1);
 
   struct user_info *user = NULL;
+  struct user_key   user_key;
 
   const __u8 *xor_key     = NULL;
   __u8        xor_key_len = 0;
 
   if (cfg->is_server) {
+    struct in6_addr laddr;
+
     // Server: Check for ECHO_REQUEST and valid UID
     if (ipv4) {
       try2_ok(icmp->type == ICMP_ECHO_REQUEST ? 0 : -1);
     } else if (ipv6) {
       try2_ok(icmp->type == ICMP6_ECHO_REQUEST ? 0 : -1);
     }
-    // Find user by UID
-    user = try2_p_ok(tutu_map_lookup_elem(user_map, &uid), "cannot get user: %u\n", uid);
+    // Find user by (local address, UID)
+    if (ipv4) {
+      ipv6_addr_set_v4mapped(get_unaligned(&ipv4->daddr), &laddr);
+    } else {
+      ipv6_copy(&laddr, &ipv6->daddr);
+    }
+    user = try2_p_ok_reason(lookup_user(p, &laddr, uid, &user_key, &acct.traffic), TUTU_REASON_UID_NOT_FOUND,
+                            "cannot get user: %u\n", uid);
 
     // 验证客户端地址与用户配置地址相等
     if (ipv4) {
       struct in6_addr in6;
       ipv6_addr_set_v4mapped(get_unaligned(&ipv4->saddr), &in6);
-      try2_ok(!ipv6_addr_cmp(&user->address, &in6) ? 0 : -1, "unrelated client ipv4 address\n");
+      try2_ok_reason(!ipv6_addr_cmp(&user->address, &in6) ? 0 : -1, TUTU_REASON_ADDR_MISMATCH,
+                     "unrelated client ipv4 address\n");
     } else if (ipv6) {
-      try2_ok(!ipv6_addr_cmp(&user->address, &ipv6->saddr) ? 0 : -1, "unrelated client ipv6 address\n");
+      try2_ok_reason(!ipv6_addr_cmp(&user->address, &ipv6->saddr) ? 0 : -1, TUTU_REASON_ADDR_MISMATCH,
+                     "unrelated client ipv6 address\n");
     }
 
     // 优化：只有发生变化才需要更新user_map
@@ -1158,15 +1462,28 @@ static unsigned int ingress_hook_func(void *priv, struct sk_buff *skb, const str
       struct user_info new_user = *user;
 
       new_user.icmp_id = icmp_id;
-      err              = tutu_map_update_elem(user_map, &uid, &new_user, TUTU_EXIST);
+      err              = tutu_map_update_elem(p->user_map, &user_key, &new_user, TUTU_EXIST);
       pr_debug("user_map updated: uid: %u, icmp_id: %u, %d\n", uid, icmp_id, err);
+      if (!err) {
+        struct tutu_event ev = {
+          .type        = TUTU_EVENT_USER_ICMP_ID,
+          .uid         = uid,
+          .port        = user->dport,
+          .icmp_id     = icmp_id,
+          .old_icmp_id = user->icmp_id,
+          .address     = user->address,
+        };
+
+        tutu_event_queue(tn, &ev);
+      }
 
       /* 重新 lookup 获取最新 user 信息，确保后续使用的字段都是更新后的 */
-      user = try2_p_ok(tutu_map_lookup_elem(user_map, &uid), "cannot get user: %u\n", uid);
+      user = try2_p_ok_reason(tutu_map_lookup_elem_pcpu(p->user_map, &user_key, &acct.traffic), TUTU_REASON_UID_NOT_FOUND,
+                              "cannot get user: %u\n", uid);
     }
 
     // 需要更新session_map
-    try2_ok(update_session_map(user, uid, icmp_seq), "update session map: %ld\n", _ret);
+    try2_ok_reason(update_session_map(tn, user, uid, icmp_seq), TUTU_REASON_SESSION_UPDATE, "update session map: %ld\n", _ret);
     xor_key     = user->xor_key;
     xor_key_len = user->xor_key_len;
   } else {
@@ -1198,20 +1515,27 @@ static unsigned int ingress_hook_func(void *priv, struct sk_buff *skb, const str
       ipv6_copy(&peer_key.address, &ipv6->saddr);
     }
 
-    struct ingress_peer_value *peer_value = try2_p_ok(tutu_map_lookup_elem(ingress_peer_map, &peer_key),
-                                                      "ingress client: unrelated packet\n");
+    struct ingress_peer_value *peer_value =
+      try2_p_ok_reason(tutu_map_lookup_elem_pcpu(p->ingress_peer_map, &peer_key, &acct.traffic), TUTU_REASON_PEER_NOT_FOUND,
+                       "ingress client: unrelated packet\n");
     udp_src                               = peer_value->port;
     udp_dst                               = icmp_seq; // Use ICMP sequence as destination port
     xor_key                               = peer_value->xor_key;
     xor_key_len                           = peer_value->xor_key_len;
   }
 
-  atomic64_inc(&stat->packets_processed);
+  // 未能重组的 ICMP 分片：后续分片仍是 ICMP 协议，只转换第一个分片会得到损坏的 UDP 数据报
+  if (ipv4 && ip_is_fragment(ipv4)) {
+    pr_debug("drop fragmented ICMP packet\n");
+    reason = TUTU_REASON_FRAGMENTED;
+    err    = NF_DROP;
+    goto err_cleanup;
+  }
 
   if (skb_is_gso(skb)) {
     pr_debug("cannot handle GSO packets: length %u\n", skb->len);
-    atomic64_inc(&stat->gso);
-    err = NF_DROP;
+    reason = TUTU_REASON_GSO;
+    err    = NF_DROP;
     goto err_cleanup;
   }
 
@@ -1242,7 +1566,8 @@ static unsigned int ingress_hook_func(void *priv, struct sk_buff *skb, const str
       need_len += payload_len;
 
     if (!pskb_may_pull(skb, need_len)) {
-      err = NF_ACCEPT;
+      reason = TUTU_REASON_BAD_LENGTH;
+      err    = NF_ACCEPT;
       goto err_cleanup;
     }
 
@@ -1268,9 +1593,10 @@ static unsigned int ingress_hook_func(void *priv, struct sk_buff *skb, const str
 
   err = skb_store_bytes_linear(skb, ip_proto_offset, &new_proto, sizeof(new_proto));
   if (err) {
-    atomic64_inc(&stat->packets_dropped);
+    acct.failed = true;
     pr_debug("skb_store_bytes_linear failed: %d\n", err);
-    err = NF_DROP;
+    reason = TUTU_REASON_NOT_WRITABLE;
+    err    = NF_DROP;
     goto err_cleanup;
   }
 
@@ -1279,9 +1605,10 @@ static unsigned int ingress_hook_func(void *priv, struct sk_buff *skb, const str
   if (ipv4) {
     err = skb_update_ipv4_checksum(skb, ipv4, l2_len, IPPROTO_ICMP, new_proto);
     if (err) {
-      atomic64_inc(&stat->packets_dropped);
+      acct.failed = true;
       pr_debug("skb_update_ipv4_checksum failed: %d\n", err);
-      err = NF_DROP;
+      reason = TUTU_REASON_NOT_WRITABLE;
+      err    = NF_DROP;
       goto err_cleanup;
     }
 
@@ -1300,9 +1627,10 @@ static unsigned int ingress_hook_func(void *priv, struct sk_buff *skb, const str
 
       err = skb_xor_payload_linear(skb, payload_off, payload_len, xor_key, xor_key_len, key_start);
       if (err) {
-        atomic64_inc(&stat->packets_dropped);
+        acct.failed = true;
         pr_debug("skb_xor_payload_linear failed: %d\n", err);
-        err = NF_DROP;
+        reason = TUTU_REASON_NOT_WRITABLE;
+        err    = NF_DROP;
         goto err_cleanup;
       }
 
@@ -1320,9 +1648,10 @@ static unsigned int ingress_hook_func(void *priv, struct sk_buff *skb, const str
   // Replace ICMP header with UDP header
   err = skb_store_bytes_linear(skb, ip_end, &udp_hdr, sizeof(udp_hdr));
   if (err) {
-    atomic64_inc(&stat->packets_dropped);
+    acct.failed = true;
     pr_debug("skb_store_bytes_linear failed: %d\n", err);
-    err = NF_DROP;
+    reason = TUTU_REASON_NOT_WRITABLE;
+    err    = NF_DROP;
     goto err_cleanup;
   }
 
@@ -1333,22 +1662,115 @@ static unsigned int ingress_hook_func(void *priv, struct sk_buff *skb, const str
     // dump_skb(skb);
   }
 
+  trace_ingress_convert(cfg->is_server, uid, &saddr, &daddr, udp_src, udp_dst, icmp_id, icmp_seq, skb->len);
+  acct.converted   = true;
+  acct.reassembled = skb_is_reassembled(skb, ip_type);
+  acct.lat_hist    = TUTU_LAT_INDEX(true, cfg->is_server, tutu_xor_enabled(xor_key, xor_key_len));
+
   err = NF_ACCEPT;
 err_cleanup:
   rcu_read_unlock();
-  return err;
+  return tutu_hook_verdict(stats, &acct, skb, false, err, reason);
+}
+
+static int latency_stats_set(const char *val, const struct kernel_param *kp) {
+  bool enable;
+  int  err;
+
+  err = kstrtobool(val, &enable);
+  if (err)
+    return err;
+
+  if (enable)
+    static_branch_enable(&tutu_latency_key);
+  else
+    static_branch_disable(&tutu_latency_key);
+  return 0;
+}
+
+static int latency_stats_get(char *buffer, const struct kernel_param *kp) {
+  return sprintf(buffer, "%c\n", static_key_enabled(&tutu_latency_key) ? 'Y' : 'N');
 }
 
+static const struct kernel_param_ops latency_stats_ops = {
+  .set = latency_stats_set,
+  .get = latency_stats_get,
+};
+
+module_param_cb(latency_stats, &latency_stats_ops, NULL, 0644);
+MODULE_PARM_DESC(latency_stats, "Record per-CPU histograms of hook processing time (see ktuctl latency). Default: N");
+
 static bool local_only = false;
 module_param(local_only, bool, 0444);
 MODULE_PARM_DESC(local_only, "If true, only intercept locally generated UDP traffic (mode: client only). Cannot be changed "
                              "after module load. Default: false.");
 
+#if IS_ENABLED(CONFIG_NF_CONNTRACK)
+static bool flowtable_bypass = true;
+module_param(flowtable_bypass, bool, 0444);
+MODULE_PARM_DESC(flowtable_bypass, "Keep forwarded tunnel flows out of nf_flowtable (software/hardware flow offload). Cannot be "
+                                   "changed after module load. Default: true.");
+
+/*
+ * forward_hook_func: 阻止隧道流量被 nf_flowtable 卸载
+ *
+ * OpenWrt 的软件/硬件流量卸载 (nft "flow add @ft") 会让已确认的连接绕过
+ * POST_ROUTING，egress_hook_func 因此看不到 LAN 客户端的隧道流量。
+ * nft_flow_offload 会跳过带 helper 扩展的 conntrack，而扩展只能在连接确认前添加，
+ * 所以这里在连接首包上为命中 egress_peer_map 的 UDP 流挂一个空 helper 扩展。
+ * 其它流量只多一次 nf_ct_is_confirmed() 判断，照常卸载。
+ *
+ * 用回复方向的源地址/端口作为查找键：它等于 DNAT 之后的真实目的地址，
+ * 与 egress_hook_func 在 POST_ROUTING 看到的一致。
+ */
+static unsigned int forward_hook_func(void *priv, struct sk_buff *skb, const struct nf_hook_state *state) {
+  enum ip_conntrack_info          ctinfo;
+  const struct nf_conntrack_tuple *tuple;
+  const struct tutu_config_rcu   *p;
+  struct egress_peer_key          peer_key = {};
+  struct tutu_net                *tn       = tutu_pernet(state->net);
+  struct nf_conn                 *ct;
+
+  ct = nf_ct_get(skb, &ctinfo);
+  if (!ct || nf_ct_is_confirmed(ct) || nf_ct_protonum(ct) != IPPROTO_UDP || nfct_help(ct))
+    return NF_ACCEPT;
+
+  tuple         = &ct->tuplehash[IP_CT_DIR_REPLY].tuple;
+  peer_key.port = tuple->src.u.udp.port;
+
+  if (nf_ct_l3num(ct) == NFPROTO_IPV4)
+    ipv6_addr_set_v4mapped(tuple->src.u3.ip, &peer_key.address);
+  else if (nf_ct_l3num(ct) == NFPROTO_IPV6)
+    ipv6_copy(&peer_key.address, &tuple->src.u3.in6);
+  else
+    return NF_ACCEPT;
+
+  rcu_read_lock();
+  p = rcu_dereference(tn->cfg_ptr);
+  if (p && !p->inner.is_server && tutu_map_lookup_elem(p->egress_peer_map, &peer_key)) {
+    if (!nf_ct_helper_ext_add(ct, GFP_ATOMIC))
+      pr_debug("forward: cannot exclude flow from offload\n");
+  }
+  rcu_read_unlock();
+
+  return NF_ACCEPT;
+}
+
+/* 必须晚于 conntrack，早于 fw4 在 filter 优先级上的 flow offload 规则 */
+static struct nf_hook_ops forward_hook_ops = {
+  .hook     = forward_hook_func,
+  .pf       = NFPROTO_INET,
+  .hooknum  = NF_INET_FORWARD,
+  .priority = NF_IP_PRI_FILTER - 1,
+};
+#endif
+
+/* 紧跟在 nf_defrag 之后，保证看到的是重组后的完整 ICMP 数据报；仍然早于 raw/conntrack */
 static struct nf_hook_ops ingress_hook_ops = {
   .hook     = ingress_hook_func,
   .pf       = NFPROTO_INET,
   .hooknum  = NF_INET_PRE_ROUTING,
-  .priority = NF_IP_PRI_FIRST,
+  .priority = NF_IP_PRI_CONNTRACK_DEFRAG + 1,
 };
 
 static struct nf_hook_ops egress_hook_ops_post = {
@@ -1365,12 +1787,18 @@ static struct nf_hook_ops egress_hook_ops_local = {
   .priority = NF_IP_PRI_LAST,
 };
 
-int tutu_export_config(struct tutu_config *out) {
+/* tn 为 NULL 表示 netns 尚未初始化，以下导出函数返回初始化后的默认状态 */
+int tutu_export_config(struct tutu_net *tn, struct tutu_config *out) {
   int                           err = -ENOENT;
   const struct tutu_config_rcu *cfg;
 
+  if (!tn) {
+    *out = g_cfg_init.inner;
+    return 0;
+  }
+
   rcu_read_lock();
-  cfg = rcu_dereference(g_cfg_ptr);
+  cfg = rcu_dereference(tn->cfg_ptr);
   if (cfg) {
     *out = cfg->inner;
     err  = 0;
@@ -1380,20 +1808,16 @@ int tutu_export_config(struct tutu_config *out) {
   return err;
 }
 
-static DEFINE_MUTEX(cfg_mutex);
-
-static struct tutu_config_rcu *set_new_config(struct tutu_config_rcu *newcfg) {
+static struct tutu_config_rcu *set_new_config(struct tutu_net *tn, struct tutu_config_rcu *newcfg) {
   struct tutu_config_rcu *oldcfg;
 
-  mutex_lock(&cfg_mutex);
-  oldcfg = rcu_replace_pointer(g_cfg_ptr, newcfg, lockdep_is_held(&cfg_mutex));
-  mutex_unlock(&cfg_mutex);
+  mutex_lock(&tn->cfg_mutex);
+  oldcfg = rcu_replace_pointer(tn->cfg_ptr, newcfg, lockdep_is_held(&tn->cfg_mutex));
+  mutex_unlock(&tn->cfg_mutex);
   return oldcfg;
 }
 
-int tutu_set_config(const struct tutu_config *in) {
-  struct tutu_config_rcu *new_cfg, *old_cfg;
-
+static int tutu_config_check(const struct tutu_config *in) {
   if (!in)
     return -EINVAL;
 
@@ -1403,53 +1827,314 @@ int tutu_set_config(const struct tutu_config *in) {
   if (in->is_server != 0 && in->is_server != 1)
     return -EINVAL;
 
+  return 0;
+}
+
+int tutu_set_config(struct tutu_net *tn, const struct tutu_config *in) {
+  struct tutu_config_rcu *new_cfg, *old_cfg;
+  int                     err;
+
+  err = tutu_config_check(in);
+  if (err)
+    return err;
+
+  new_cfg = kzalloc(sizeof(*new_cfg), GFP_KERNEL);
+  if (!new_cfg)
+    return -ENOMEM;
+
+  new_cfg->inner            = *in;
+  new_cfg->egress_peer_map  = tn->egress_peer_map;
+  new_cfg->ingress_peer_map = tn->ingress_peer_map;
+  new_cfg->user_map         = tn->user_map;
+
+  old_cfg = set_new_config(tn, new_cfg);
+  if (old_cfg)
+    kfree_rcu(old_cfg, rcu);
+
+  return 0;
+}
+
+static void tutu_txn_free(struct tutu_txn *txn) {
+  if (!txn)
+    return;
+
+  tutu_map_free(txn->user_map);
+  tutu_map_free(txn->ingress_peer_map);
+  tutu_map_free(txn->egress_peer_map);
+  kfree(txn);
+}
+
+static bool tutu_txn_expired(const struct tutu_txn *txn) {
+  return time_after(jiffies, txn->expires);
+}
+
+int tutu_txn_begin(struct tutu_net *tn, u32 portid) {
+  struct tutu_config_rcu *p;
+  struct tutu_txn        *txn;
+  int                     err;
+
+  /* 同一 socket 重新 BEGIN 或旧事务已超时：丢弃旧的暂存区 */
+  if (tn->txn) {
+    if (tn->txn->portid != portid && !tutu_txn_expired(tn->txn))
+      return -EBUSY;
+    tutu_txn_free(tn->txn);
+    tn->txn = NULL;
+  }
+
+  txn = kzalloc(sizeof(*txn), GFP_KERNEL);
+  if (!txn)
+    return -ENOMEM;
+
+  txn->portid  = portid;
+  txn->expires = jiffies + TUTU_TXN_TIMEOUT * HZ;
+
+  rcu_read_lock();
+  p = rcu_dereference(tn->cfg_ptr);
+  if (p)
+    txn->cfg = p->inner;
+  rcu_read_unlock();
+
+  txn->egress_peer_map = tutu_map_clone(tn->egress_peer_map);
+  if (IS_ERR(txn->egress_peer_map)) {
+    err                  = PTR_ERR(txn->egress_peer_map);
+    txn->egress_peer_map = NULL;
+    goto err_free;
+  }
+
+  txn->ingress_peer_map = tutu_map_clone(tn->ingress_peer_map);
+  if (IS_ERR(txn->ingress_peer_map)) {
+    err                   = PTR_ERR(txn->ingress_peer_map);
+    txn->ingress_peer_map = NULL;
+    goto err_free;
+  }
+
+  txn->user_map = tutu_map_clone(tn->user_map);
+  if (IS_ERR(txn->user_map)) {
+    err           = PTR_ERR(txn->user_map);
+    txn->user_map = NULL;
+    goto err_free;
+  }
+
+  tn->txn = txn;
+  return 0;
+
+err_free:
+  tutu_txn_free(txn);
+  return err;
+}
+
+struct tutu_txn *tutu_txn_get(struct tutu_net *tn, u32 portid) {
+  struct tutu_txn *txn = tn->txn;
+
+  if (!txn || tutu_txn_expired(txn))
+    return ERR_PTR(-ENOENT);
+
+  if (txn->portid != portid)
+    return ERR_PTR(-EBUSY);
+
+  txn->expires = jiffies + TUTU_TXN_TIMEOUT * HZ;
+  return txn;
+}
+
+int tutu_txn_set_config(struct tutu_net *tn, u32 portid, const struct tutu_config *in) {
+  struct tutu_txn *txn;
+  int              err;
+
+  txn = tutu_txn_get(tn, portid);
+  if (IS_ERR(txn))
+    return PTR_ERR(txn);
+
+  err = tutu_config_check(in);
+  if (err)
+    return err;
+
+  txn->cfg = *in;
+  return 0;
+}
+
+/* 暂存期间数据路径可能更新了客户端的 icmp_id，地址和端口没变的用户沿用当前值 */
+static int tutu_txn_carry_icmp_id(void *key, void *value, void __percpu *pcpu, void *arg) {
+  struct user_info *staged = value;
+  struct user_info *live   = tutu_map_lookup_elem(arg, key);
+
+  if (live && !ipv6_addr_cmp(&live->address, &staged->address) && live->dport == staged->dport)
+    staged->icmp_id = READ_ONCE(live->icmp_id);
+  return 0;
+}
+
+int tutu_txn_commit(struct tutu_net *tn, u32 portid) {
+  struct tutu_config_rcu *new_cfg, *old_cfg;
+  struct tutu_txn        *txn;
+  struct tutu_htab       *old_egress, *old_ingress, *old_user;
+  u32                     bucket = 0, skip = 0;
+
+  txn = tutu_txn_get(tn, portid);
+  if (IS_ERR(txn))
+    return PTR_ERR(txn);
+
   new_cfg = kzalloc(sizeof(*new_cfg), GFP_KERNEL);
   if (!new_cfg)
     return -ENOMEM;
 
-  new_cfg->inner = *in;
+  /* 流量计数随元素迁移到新表，之后旧表只剩下被删除元素的计数 */
+  tutu_map_adopt_pcpu(txn->egress_peer_map, tn->egress_peer_map);
+  tutu_map_adopt_pcpu(txn->ingress_peer_map, tn->ingress_peer_map);
+  tutu_map_adopt_pcpu(txn->user_map, tn->user_map);
+
+  rcu_read_lock();
+  tutu_map_walk(txn->user_map, &bucket, &skip, tutu_txn_carry_icmp_id, tn->user_map);
+  rcu_read_unlock();
+
+  new_cfg->inner            = txn->cfg;
+  new_cfg->egress_peer_map  = txn->egress_peer_map;
+  new_cfg->ingress_peer_map = txn->ingress_peer_map;
+  new_cfg->user_map         = txn->user_map;
 
-  old_cfg = set_new_config(new_cfg);
+  old_egress  = tn->egress_peer_map;
+  old_ingress = tn->ingress_peer_map;
+  old_user    = tn->user_map;
+
+  /* 配置和三张表通过一次指针替换同时生效 */
+  old_cfg              = set_new_config(tn, new_cfg);
+  tn->egress_peer_map  = txn->egress_peer_map;
+  tn->ingress_peer_map = txn->ingress_peer_map;
+  tn->user_map         = txn->user_map;
   if (old_cfg)
     kfree_rcu(old_cfg, rcu);
 
+  /* tutu_map_free 会等待 RCU 宽限期，仍在使用旧表的 hook 退出后才释放 */
+  tutu_map_free(old_user);
+  tutu_map_free(old_ingress);
+  tutu_map_free(old_egress);
+
+  tn->txn = NULL;
+  kfree(txn);
+  return 0;
+}
+
+int tutu_txn_abort(struct tutu_net *tn, u32 portid) {
+  struct tutu_txn *txn;
+
+  txn = tutu_txn_get(tn, portid);
+  if (IS_ERR(txn))
+    return PTR_ERR(txn);
+
+  tutu_txn_free(txn);
+  tn->txn = NULL;
   return 0;
 }
 
-int tutu_export_stats(struct tutu_stats *out) {
-  u64 packets_processed, packets_dropped, checksum_errors, fragmented, gso;
+int tutu_export_stats(struct tutu_net *tn, struct tutu_stats *out) {
+  u64 sum[__TUTU_STAT_MAX]       = {};
+  u64 reason[__TUTU_REASON_MAX] = {};
   int cpu;
 
-  packets_processed = packets_dropped = checksum_errors = fragmented = gso = 0;
+  BUILD_BUG_ON(__TUTU_REASON_MAX > TUTU_REASON_SLOTS);
+
+  if (!tn) {
+    memset(out, 0, sizeof(*out));
+    return 0;
+  }
+
   for_each_possible_cpu(cpu) {
-    struct tutu_stats_k *st = per_cpu_ptr(&g_stats_percpu, cpu);
-    packets_processed += (u64) atomic64_read(&st->packets_processed);
-    packets_dropped += (u64) atomic64_read(&st->packets_dropped);
-    checksum_errors += (u64) atomic64_read(&st->checksum_errors);
-    fragmented += (u64) atomic64_read(&st->fragmented);
-    gso += (u64) atomic64_read(&st->gso);
+    const struct tutu_stats_k *st = per_cpu_ptr(tn->stats, cpu);
+    u64                        tmp[__TUTU_STAT_MAX];
+    u64                        tmp_reason[__TUTU_REASON_MAX];
+    unsigned int               start;
+    int                        i;
+
+    do {
+      start = u64_stats_fetch_begin(&st->syncp);
+      for (i = 0; i < __TUTU_STAT_MAX; i++)
+        tmp[i] = u64_stats_read(&st->cnt[i]);
+      for (i = 0; i < __TUTU_REASON_MAX; i++)
+        tmp_reason[i] = u64_stats_read(&st->reason[i]);
+    } while (u64_stats_fetch_retry(&st->syncp, start));
+
+    for (i = 0; i < __TUTU_STAT_MAX; i++)
+      sum[i] += tmp[i];
+    for (i = 0; i < __TUTU_REASON_MAX; i++)
+      reason[i] += tmp_reason[i];
   }
 
-  out->packets_processed = packets_processed;
-  out->packets_dropped   = packets_dropped;
-  out->checksum_errors   = checksum_errors;
-  out->fragmented        = fragmented;
-  out->gso               = gso;
+  out->packets_processed = sum[TUTU_STAT_PACKETS_PROCESSED];
+  out->packets_dropped   = sum[TUTU_STAT_PACKETS_DROPPED];
+  out->checksum_errors   = sum[TUTU_STAT_CHECKSUM_ERRORS];
+  out->fragmented        = sum[TUTU_STAT_FRAGMENTED];
+  out->gso               = sum[TUTU_STAT_GSO];
+  out->reassembled       = sum[TUTU_STAT_REASSEMBLED];
+  out->reassembled_bytes = sum[TUTU_STAT_REASSEMBLED_BYTES];
+  out->bytes_processed   = sum[TUTU_STAT_BYTES_PROCESSED];
+  out->bytes_dropped     = sum[TUTU_STAT_BYTES_DROPPED];
+  out->frag_mem          = tn->net->ipv4.fqdir ? (u64) frag_mem_limit(tn->net->ipv4.fqdir) : 0;
+  memset(out->reasons, 0, sizeof(out->reasons));
+  memcpy(out->reasons, reason, sizeof(reason));
+
+  return 0;
+}
+
+int tutu_clear_stats(struct tutu_net *tn) {
+  int cpu;
+
+  /* 与数据路径并发时可能丢失少量计数，清零本身就是近似操作 */
+  for_each_possible_cpu(cpu) {
+    struct tutu_stats_k *st = per_cpu_ptr(tn->stats, cpu);
+    int                  i;
 
+    for (i = 0; i < __TUTU_STAT_MAX; i++)
+      u64_stats_set(&st->cnt[i], 0);
+    for (i = 0; i < __TUTU_REASON_MAX; i++)
+      u64_stats_set(&st->reason[i], 0);
+  }
   return 0;
 }
 
-int tutu_clear_stats(void) {
+int tutu_export_latency(struct tutu_net *tn, struct tutu_latency *out) {
   int cpu;
 
+  memset(out, 0, sizeof(*out));
+  out->enabled = static_key_enabled(&tutu_latency_key);
+  if (!tn)
+    return 0;
+
   for_each_possible_cpu(cpu) {
-    struct tutu_stats_k *st = per_cpu_ptr(&g_stats_percpu, cpu);
+    const struct tutu_stats_k *st = per_cpu_ptr(tn->stats, cpu);
+    u64                        sum[TUTU_LAT_HISTS];
+    u64                        tmp[TUTU_LAT_HISTS][TUTU_LAT_BUCKETS];
+    unsigned int               start;
+    int                        h, b;
+
+    do {
+      start = u64_stats_fetch_begin(&st->syncp);
+      for (h = 0; h < TUTU_LAT_HISTS; h++) {
+        sum[h] = u64_stats_read(&st->lat_sum[h]);
+        for (b = 0; b < TUTU_LAT_BUCKETS; b++)
+          tmp[h][b] = u64_stats_read(&st->lat[h][b]);
+      }
+    } while (u64_stats_fetch_retry(&st->syncp, start));
 
-    atomic64_set(&st->packets_processed, 0);
-    atomic64_set(&st->packets_dropped, 0);
-    atomic64_set(&st->checksum_errors, 0);
-    atomic64_set(&st->fragmented, 0);
-    atomic64_set(&st->gso, 0);
+    for (h = 0; h < TUTU_LAT_HISTS; h++) {
+      out->sum_ns[h] += sum[h];
+      for (b = 0; b < TUTU_LAT_BUCKETS; b++)
+        out->buckets[h][b] += tmp[h][b];
+    }
+  }
+
+  return 0;
+}
+
+int tutu_clear_latency(struct tutu_net *tn) {
+  int cpu;
+
+  for_each_possible_cpu(cpu) {
+    struct tutu_stats_k *st = per_cpu_ptr(tn->stats, cpu);
+    int                  h, b;
+
+    for (h = 0; h < TUTU_LAT_HISTS; h++) {
+      u64_stats_set(&st->lat_sum[h], 0);
+      for (b = 0; b < TUTU_LAT_BUCKETS; b++)
+        u64_stats_set(&st->lat[h][b], 0);
+    }
   }
   return 0;
 }
@@ -1457,10 +2142,11 @@ int tutu_clear_stats(void) {
 typedef bool (*tutu_gc_predicate)(const struct session_key *key, const struct session_value *value, void *ctx);
 
 static bool gc_session_check_age(const struct session_key *key, const struct session_value *value, void *ctx) {
-  u32 session_max_age = 0;
+  struct tutu_net *tn              = ctx;
+  u32              session_max_age = 0;
 
   rcu_read_lock();
-  struct tutu_config_rcu *p = rcu_dereference(g_cfg_ptr);
+  struct tutu_config_rcu *p = rcu_dereference(tn->cfg_ptr);
   if (p)
     session_max_age = READ_ONCE(p->inner.session_max_age);
   rcu_read_unlock();
@@ -1476,20 +2162,20 @@ static bool gc_session_check_age(const struct session_key *key, const struct ses
   return false;
 }
 
-static int gc_session(tutu_gc_predicate need_delete, void *ctx) {
+static int gc_session(struct tutu_net *tn, tutu_gc_predicate need_delete, void *ctx) {
   struct session_key cur_key;
   struct session_key next_key;
   int                err;
 
   rcu_read_lock();
-  err = tutu_map_get_next_key(session_map, NULL, &cur_key);
+  err = tutu_map_get_next_key(tn->session_map, NULL, &cur_key);
   if (err)
     goto out;
 
   while (1) {
-    struct session_value *val = tutu_map_lookup_elem(session_map, &cur_key);
+    struct session_value *val = tutu_map_lookup_elem(tn->session_map, &cur_key);
 
-    err = tutu_map_get_next_key(session_map, &cur_key, &next_key);
+    err = tutu_map_get_next_key(tn->session_map, &cur_key, &next_key);
     if (err && err != -ENOENT) {
       goto out;
     }
@@ -1497,7 +2183,11 @@ static int gc_session(tutu_gc_predicate need_delete, void *ctx) {
     bool del = need_delete(&cur_key, val, ctx);
 
     if (del) {
-      tutu_map_delete_elem(session_map, &cur_key);
+      if (val) {
+        trace_session_expire(&cur_key, val->uid, val->client_sport, READ_ONCE(val->age));
+        tutu_session_event(tn, TUTU_EVENT_SESSION_EXPIRE, &cur_key, val->uid);
+      }
+      tutu_map_delete_elem(tn->session_map, &cur_key);
     }
 
     // 没有下一个了
@@ -1517,41 +2207,13 @@ out:
   return err;
 }
 
-struct tutu_gc_ctx {
-  struct delayed_work dwork;
-  unsigned long       period_jiffies;
-};
-
-static struct tutu_gc_ctx *gcctx;
+#define TUTU_GC_PERIOD_MS 1000
 
 static void tutu_gc_work(struct work_struct *work) {
-  struct tutu_gc_ctx *ctx = container_of(to_delayed_work(work), struct tutu_gc_ctx, dwork);
-
-  (void) gc_session(gc_session_check_age, NULL);
-  queue_delayed_work(system_unbound_wq, &ctx->dwork, ctx->period_jiffies);
-}
-
-static int tutu_gc_start(unsigned int period_sec) {
-  if (gcctx)
-    return 0;
-
-  gcctx = kzalloc(sizeof(*gcctx), GFP_KERNEL);
-  if (!gcctx)
-    return -ENOMEM;
+  struct tutu_net *tn = container_of(to_delayed_work(work), struct tutu_net, gc_work);
 
-  INIT_DELAYED_WORK(&gcctx->dwork, tutu_gc_work);
-  gcctx->period_jiffies = msecs_to_jiffies(period_sec * 1000);
-
-  queue_delayed_work(system_unbound_wq, &gcctx->dwork, gcctx->period_jiffies);
-  return 0;
-}
-
-static void tutu_gc_stop(void) {
-  if (!gcctx)
-    return;
-  cancel_delayed_work_sync(&gcctx->dwork);
-  kfree(gcctx);
-  gcctx = NULL;
+  (void) gc_session(tn, gc_session_check_age, tn);
+  queue_delayed_work(system_unbound_wq, &tn->gc_work, msecs_to_jiffies(TUTU_GC_PERIOD_MS));
 }
 
 static unsigned int egress_peer_map_size = 1024;
@@ -1566,20 +2228,80 @@ static unsigned int session_map_size = 16384;
 module_param(session_map_size, uint, 0400);
 MODULE_PARM_DESC(session_map_size, "Size for the session map, must be power of 2");
 
+static unsigned int user_map_size = 4096;
+module_param(user_map_size, uint, 0400);
+MODULE_PARM_DESC(user_map_size, "Size for the server user map (256 uids per server address), must be power of 2");
+
+static bool defrag = true;
+module_param(defrag, bool, 0444);
+MODULE_PARM_DESC(defrag, "Reassemble fragmented IPv4/IPv6 packets with nf_defrag before conversion. Cannot be changed after "
+                         "module load. Default: true.");
+
+static void tutu_defrag_disable(struct tutu_net *tn) {
+  /* 5.13 之前 nf_defrag 没有引用计数，启用后一直保留到 nf_defrag 模块卸载 */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 13, 0)
+#if IS_ENABLED(CONFIG_NF_DEFRAG_IPV4)
+  if (tn->defrag_ipv4)
+    nf_defrag_ipv4_disable(tn->net);
+#endif
+#if IS_ENABLED(CONFIG_NF_DEFRAG_IPV6)
+  if (tn->defrag_ipv6)
+    nf_defrag_ipv6_disable(tn->net);
+#endif
+#endif
+  tn->defrag_ipv4 = tn->defrag_ipv6 = false;
+}
+
+/*
+ * 启用 nf_defrag：分片在 PRE_ROUTING (NF_IP_PRI_CONNTRACK_DEFRAG) 重组，
+ * 之后 ingress/egress hook 看到的都是完整数据报；转换后的包在输出时由
+ * ip_finish_output()/ip6_finish_output() 按记录的 frag_max_size 重新分片。
+ */
+static int tutu_defrag_enable(struct tutu_net *tn) {
+  int err = 0;
+
+  if (!defrag)
+    return 0;
+
+#if IS_ENABLED(CONFIG_NF_DEFRAG_IPV4)
+  err = nf_defrag_ipv4_enable(tn->net);
+  if (err) {
+    pr_err("failed to enable IPv4 defrag: %d\n", err);
+    return err;
+  }
+  tn->defrag_ipv4 = true;
+#endif
+
+#if IS_ENABLED(CONFIG_NF_DEFRAG_IPV6)
+  err = nf_defrag_ipv6_enable(tn->net);
+  if (err) {
+    pr_err("failed to enable IPv6 defrag: %d\n", err);
+    tutu_defrag_disable(tn);
+    return err;
+  }
+  tn->defrag_ipv6 = true;
+#endif
+
+  return err;
+}
+
 static void reload_work_func(struct work_struct *work) {
-  int err;
+  struct tutu_net *tn  = container_of(to_delayed_work(work), struct tutu_net, reload_work);
+  int              err = 0;
 
-  err = ifset_reload_config();
+  mutex_lock(&tn->lock);
+  if (tn->active)
+    err = ifset_reload_config(tn);
+  mutex_unlock(&tn->lock);
 
   if (err)
     pr_err("reload_config_locked() failed: %d\n", err);
 }
 
-static DECLARE_DELAYED_WORK(g_reload_work, reload_work_func);
-
 static int netdev_event_handler(struct notifier_block *nb, unsigned long event, void *ptr) {
   struct net_device *dev = netdev_notifier_info_to_dev(ptr);
-  const char        *ev  = NULL;
+  struct tutu_net   *tn;
+  const char        *ev = NULL;
 
   switch (event) {
   case NETDEV_REGISTER:
@@ -1592,8 +2314,13 @@ static int netdev_event_handler(struct notifier_block *nb, unsigned long event,
     return NOTIFY_DONE;
   }
 
+  /* 通知在 rtnl 下调用，tn->dead 也在 rtnl 下设置 */
+  tn = tutu_pernet(dev_net(dev));
+  if (tn->dead)
+    return NOTIFY_DONE;
+
   pr_debug("reloading interface: event=%s dev=%s\n", ev, dev ? dev->name : "unknown");
-  schedule_delayed_work(&g_reload_work, msecs_to_jiffies(100));
+  schedule_delayed_work(&tn->reload_work, msecs_to_jiffies(100));
   return NOTIFY_DONE;
 }
 
@@ -1601,49 +2328,104 @@ static struct notifier_block g_netdev_notifier = {
   .notifier_call = netdev_event_handler,
 };
 
-static struct nf_hook_ops *egress_hook_registered = NULL;
+static void tutu_net_deactivate(struct tutu_net *tn) {
+  struct tutu_config_rcu *old_cfg;
 
-static int __init tutuicmptunnel_module_init(void) {
-  int                     err;
-  struct tutu_config_rcu *cfg_init;
-  struct nf_hook_ops     *egress_hook_to_register = NULL;
+  lockdep_assert_held(&tn->lock);
 
-  if (!is_power_of_2(egress_peer_map_size) || !is_power_of_2(ingress_peer_map_size) || !is_power_of_2(session_map_size) ||
-      egress_peer_map_size < 256 || ingress_peer_map_size < 256 || session_map_size < 256) {
-    pr_err("Invalid map size: all map sizes must be a power of 2 and >= 256.\n");
-    return -EINVAL;
-  }
+#if IS_ENABLED(CONFIG_NF_CONNTRACK)
+  if (tn->forward_hook)
+    nf_unregister_net_hook(tn->net, &forward_hook_ops);
+  tn->forward_hook = false;
+#endif
+  if (tn->egress_hook)
+    nf_unregister_net_hook(tn->net, tn->egress_hook);
+  tn->egress_hook = NULL;
+  nf_unregister_net_hook(tn->net, &ingress_hook_ops);
+  tutu_defrag_disable(tn);
+
+  /* 等待仍在执行的 hook 退出，之后才能释放 stats */
+  synchronize_net();
+
+  cancel_delayed_work_sync(&tn->gc_work);
+  tutu_event_exit(tn);
+
+  old_cfg = set_new_config(tn, NULL);
+  if (old_cfg)
+    kfree_rcu(old_cfg, rcu);
+
+  tutu_txn_free(tn->txn);
+  tn->txn = NULL;
+
+  tutu_map_free(tn->user_map);
+  tutu_map_free(tn->session_map);
+  tutu_map_free(tn->ingress_peer_map);
+  tutu_map_free(tn->egress_peer_map);
+  tn->user_map = tn->session_map = tn->ingress_peer_map = tn->egress_peer_map = NULL;
+
+  free_percpu(tn->stats);
+  tn->stats = NULL;
 
-  err = ifset_reload_config();
+  free_ifset(tn);
+  tn->active = false;
+}
+
+static int tutu_net_activate(struct tutu_net *tn) {
+  int                       err;
+  struct tutu_config_rcu   *cfg_init;
+  const struct nf_hook_ops *egress_hook_to_register = NULL;
+
+  lockdep_assert_held(&tn->lock);
+
+  err = ifset_reload_config(tn);
   if (err) {
     pr_err("ifset config failed: %d\n", err);
     return err;
   }
 
-  egress_peer_map = tutu_map_alloc(sizeof(struct egress_peer_key), sizeof(struct egress_peer_value), egress_peer_map_size);
-  if (IS_ERR(egress_peer_map)) {
-    err = PTR_ERR(egress_peer_map);
-    pr_err("failed to create egress peer map: %d\n", err);
+  tn->stats = alloc_percpu(struct tutu_stats_k);
+  if (!tn->stats) {
+    err = -ENOMEM;
     goto err_free_ifset;
   }
+  {
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+      u64_stats_init(&per_cpu_ptr(tn->stats, cpu)->syncp);
+  }
+
+  err = tutu_event_init(tn);
+  if (err)
+    goto err_free_stats;
+
+  tn->egress_peer_map = tutu_map_alloc_pcpu(sizeof(struct egress_peer_key), sizeof(struct egress_peer_value),
+                                            egress_peer_map_size, sizeof(struct tutu_traffic_k), tutu_traffic_init);
+  if (IS_ERR(tn->egress_peer_map)) {
+    err = PTR_ERR(tn->egress_peer_map);
+    pr_err("failed to create egress peer map: %d\n", err);
+    goto err_event_exit;
+  }
 
-  ingress_peer_map = tutu_map_alloc(sizeof(struct ingress_peer_key), sizeof(struct ingress_peer_value), ingress_peer_map_size);
-  if (IS_ERR(ingress_peer_map)) {
-    err = PTR_ERR(ingress_peer_map);
+  tn->ingress_peer_map = tutu_map_alloc_pcpu(sizeof(struct ingress_peer_key), sizeof(struct ingress_peer_value),
+                                             ingress_peer_map_size, sizeof(struct tutu_traffic_k), tutu_traffic_init);
+  if (IS_ERR(tn->ingress_peer_map)) {
+    err = PTR_ERR(tn->ingress_peer_map);
     pr_err("failed to create ingress peer map: %d\n", err);
     goto err_free_egress_peer_map;
   }
 
-  session_map = tutu_map_alloc(sizeof(struct session_key), sizeof(struct session_value), session_map_size);
-  if (IS_ERR(session_map)) {
-    err = PTR_ERR(session_map);
+  tn->session_map = tutu_map_alloc(sizeof(struct session_key), sizeof(struct session_value), session_map_size);
+  if (IS_ERR(tn->session_map)) {
+    err = PTR_ERR(tn->session_map);
     pr_err("failed to create session map: %d\n", err);
     goto err_free_ingress_peer_map;
   }
 
-  user_map = tutu_map_alloc(sizeof(u8), sizeof(struct user_info), 256);
-  if (IS_ERR(user_map)) {
-    err = PTR_ERR(user_map);
+  tn->user_map = tutu_map_alloc_pcpu(sizeof(struct user_key), sizeof(struct user_info), user_map_size,
+                                     sizeof(struct tutu_traffic_k), tutu_traffic_init);
+  if (IS_ERR(tn->user_map)) {
+    err = PTR_ERR(tn->user_map);
     pr_err("failed to create user map: %d\n", err);
     goto err_free_session_map;
   }
@@ -1654,12 +2436,19 @@ static int __init tutuicmptunnel_module_init(void) {
     err = -ENOMEM;
     goto err_free_user_map;
   }
-  rcu_assign_pointer(g_cfg_ptr, cfg_init);
+  cfg_init->egress_peer_map  = tn->egress_peer_map;
+  cfg_init->ingress_peer_map = tn->ingress_peer_map;
+  cfg_init->user_map         = tn->user_map;
+  rcu_assign_pointer(tn->cfg_ptr, cfg_init);
+
+  err = tutu_defrag_enable(tn);
+  if (err)
+    goto err_free_cfg;
 
-  err = nf_register_net_hook(&init_net, &ingress_hook_ops);
+  err = nf_register_net_hook(tn->net, &ingress_hook_ops);
   if (err < 0) {
     pr_err("failed to register ingress hook\n");
-    goto err_free_cfg;
+    goto err_defrag_disable;
   }
 
   pr_debug("ingress hook registered.\n");
@@ -1670,75 +2459,164 @@ static int __init tutuicmptunnel_module_init(void) {
     egress_hook_to_register = &egress_hook_ops_post;
   }
 
-  err = nf_register_net_hook(&init_net, egress_hook_to_register);
+  err = nf_register_net_hook(tn->net, egress_hook_to_register);
   if (err < 0) {
     pr_err("failed to register egress hook\n");
     goto err_unreg_ingress;
   }
-  egress_hook_registered = egress_hook_to_register;
+  tn->egress_hook = egress_hook_to_register;
 
   pr_debug("egress hook registered.\n");
-  err = tutu_genl_init();
-  if (err)
-    goto err_unreg_egress;
 
-  err = register_netdevice_notifier(&g_netdev_notifier);
-  if (err)
-    goto err_genl_exit;
+#if IS_ENABLED(CONFIG_NF_CONNTRACK)
+  if (flowtable_bypass && !local_only) {
+    err = nf_register_net_hook(tn->net, &forward_hook_ops);
+    if (err < 0) {
+      pr_err("failed to register forward hook\n");
+      goto err_unreg_egress;
+    }
+    tn->forward_hook = true;
+    pr_debug("forward hook registered.\n");
+  }
+#endif
 
-  err = tutu_gc_start(1);
-  if (err)
-    goto err_unregister_netdevice_notifier;
+  queue_delayed_work(system_unbound_wq, &tn->gc_work, msecs_to_jiffies(TUTU_GC_PERIOD_MS));
+
+  /* 与 tutu_net_get() 的 smp_load_acquire() 配对：看到 active 即可看到上面初始化的所有字段 */
+  smp_store_release(&tn->active, true);
   return 0;
 
-err_unregister_netdevice_notifier:
-  unregister_netdevice_notifier(&g_netdev_notifier);
-err_genl_exit:
-  tutu_genl_exit();
+#if IS_ENABLED(CONFIG_NF_CONNTRACK)
 err_unreg_egress:
-  if (egress_hook_registered)
-    nf_unregister_net_hook(&init_net, egress_hook_registered);
-  egress_hook_registered = NULL;
+  nf_unregister_net_hook(tn->net, tn->egress_hook);
+  tn->egress_hook = NULL;
+#endif
 err_unreg_ingress:
-  nf_unregister_net_hook(&init_net, &ingress_hook_ops);
+  nf_unregister_net_hook(tn->net, &ingress_hook_ops);
+  synchronize_net();
+err_defrag_disable:
+  tutu_defrag_disable(tn);
 err_free_cfg:
-  cfg_init = set_new_config(NULL);
+  cfg_init = set_new_config(tn, NULL);
   if (cfg_init)
     kfree_rcu(cfg_init, rcu);
 err_free_user_map:
-  tutu_map_free(user_map);
+  tutu_map_free(tn->user_map);
 err_free_session_map:
-  tutu_map_free(session_map);
+  tutu_map_free(tn->session_map);
 err_free_ingress_peer_map:
-  tutu_map_free(ingress_peer_map);
+  tutu_map_free(tn->ingress_peer_map);
 err_free_egress_peer_map:
-  tutu_map_free(egress_peer_map);
+  tutu_map_free(tn->egress_peer_map);
+  tn->user_map = tn->session_map = tn->ingress_peer_map = tn->egress_peer_map = NULL;
+err_event_exit:
+  tutu_event_exit(tn);
+err_free_stats:
+  free_percpu(tn->stats);
+  tn->stats = NULL;
 err_free_ifset:
-  free_ifset();
+  free_ifset(tn);
 
   return err;
 }
 
-static void __exit tutuicmptunnel_module_exit(void) {
-  struct tutu_config_rcu *old_cfg;
+struct tutu_net *tutu_net_get(struct net *net) {
+  struct tutu_net *tn  = tutu_pernet(net);
+  int              err = 0;
 
-  tutu_gc_stop();
-  unregister_netdevice_notifier(&g_netdev_notifier);
-  cancel_delayed_work_sync(&g_reload_work);
-  tutu_genl_exit();
-  nf_unregister_net_hook(&init_net, egress_hook_registered);
-  nf_unregister_net_hook(&init_net, &ingress_hook_ops);
+  if (likely(smp_load_acquire(&tn->active)))
+    return tn;
 
-  old_cfg = set_new_config(NULL);
-  if (old_cfg)
-    kfree_rcu(old_cfg, rcu);
+  mutex_lock(&tn->lock);
+  if (!tn->active)
+    err = tutu_net_activate(tn);
+  mutex_unlock(&tn->lock);
+
+  return err ? ERR_PTR(err) : tn;
+}
+
+static int __net_init tutu_net_init(struct net *net) {
+  struct tutu_net *tn = tutu_pernet(net);
+
+  tn->net = net;
+  mutex_init(&tn->lock);
+  mutex_init(&tn->cfg_mutex);
+  mutex_init(&tn->ifset_mutex);
+  mutex_init(&tn->ifname_lock);
+  INIT_LIST_HEAD(&tn->ifname_list);
+  INIT_DELAYED_WORK(&tn->gc_work, tutu_gc_work);
+  INIT_DELAYED_WORK(&tn->reload_work, reload_work_func);
+
+  return 0;
+}
+
+static void __net_exit tutu_net_exit(struct net *net) {
+  struct tutu_net *tn = tutu_pernet(net);
+
+  rtnl_lock();
+  tn->dead = true;
+  rtnl_unlock();
+  cancel_delayed_work_sync(&tn->reload_work);
+
+  mutex_lock(&tn->lock);
+  if (tn->active)
+    tutu_net_deactivate(tn);
+  mutex_unlock(&tn->lock);
+}
+
+static struct pernet_operations tutu_net_ops = {
+  .init = tutu_net_init,
+  .exit = tutu_net_exit,
+  .id   = &tutu_net_id,
+  .size = sizeof(struct tutu_net),
+};
+
+static int __init tutuicmptunnel_module_init(void) {
+  int              err;
+  struct tutu_net *tn;
 
-  tutu_map_free(user_map);
-  tutu_map_free(session_map);
-  tutu_map_free(ingress_peer_map);
-  tutu_map_free(egress_peer_map);
+  if (!is_power_of_2(egress_peer_map_size) || !is_power_of_2(ingress_peer_map_size) || !is_power_of_2(session_map_size) ||
+      !is_power_of_2(user_map_size) || egress_peer_map_size < 256 || ingress_peer_map_size < 256 || session_map_size < 256 ||
+      user_map_size < 256) {
+    pr_err("Invalid map size: all map sizes must be a power of 2 and >= 256.\n");
+    return -EINVAL;
+  }
 
-  free_ifset();
+  err = register_pernet_subsys(&tutu_net_ops);
+  if (err) {
+    pr_err("register_pernet_subsys failed: %d\n", err);
+    return err;
+  }
+
+  /* init_net 立即初始化，保持与单实例版本相同的行为 */
+  tn = tutu_net_get(&init_net);
+  if (IS_ERR(tn)) {
+    err = PTR_ERR(tn);
+    goto err_unregister_pernet;
+  }
+
+  err = register_netdevice_notifier(&g_netdev_notifier);
+  if (err)
+    goto err_unregister_pernet;
+
+  err = tutu_genl_init();
+  if (err)
+    goto err_unregister_netdevice_notifier;
+
+  return 0;
+
+err_unregister_netdevice_notifier:
+  unregister_netdevice_notifier(&g_netdev_notifier);
+err_unregister_pernet:
+  unregister_pernet_subsys(&tutu_net_ops);
+
+  return err;
+}
+
+static void __exit tutuicmptunnel_module_exit(void) {
+  tutu_genl_exit();
+  unregister_netdevice_notifier(&g_netdev_notifier);
+  unregister_pernet_subsys(&tutu_net_ops);
   pr_info("tutuicmptunnel: device removed\n");
 }
 
@@ -36,12 +36,43 @@ enum {
   TUTU_CMD_IFNAME_ADD,
   TUTU_CMD_IFNAME_DEL,
 
+  /* Per-uid / per-peer traffic counters, DUMPIT only */
+  TUTU_CMD_GET_USER_STATS,
+  TUTU_CMD_GET_PEER_STATS,
+
+  /* Hook latency histograms */
+  TUTU_CMD_GET_LATENCY,
+  TUTU_CMD_CLR_LATENCY,
+
+  /* 事件通知，仅由内核通过 TUTU_GENL_MCGRP_EVENTS 组播发出 */
+  TUTU_CMD_EVENT,
+
+  /* 配置事务，见 TUTU_TXN_TIMEOUT */
+  TUTU_CMD_TXN_BEGIN,
+  TUTU_CMD_TXN_COMMIT,
+  TUTU_CMD_TXN_ABORT,
+
   __TUTU_CMD_MAX,
 };
 
 #define TUTU_CMD_MAX     (__TUTU_CMD_MAX - 1)
 #define TUTU_XOR_KEY_MAX 64
 
+/*
+ * UPDATE_* / DELETE_* 命令带 TUTU_ATTR_BATCH 时为批量模式：一条消息最多 TUTU_BATCH_MAX 个条目，
+ * 按顺序逐个执行，与单条命令一样各自原子地生效（数据路径可能看到只执行了一部分的批次，需要整体生效时使用事务），
+ * 单个条目失败不影响其它条目；回复中的 TUTU_ATTR_BATCH_RESULT 给出每个条目的结果。
+ */
+#define TUTU_BATCH_MAX 1024
+
+/*
+ * 配置事务：TXN_BEGIN 复制 egress/ingress/user 表和当前配置，之后同一 socket 发出的 UPDATE_* / DELETE_* /
+ * SET_CONFIG 带 TUTU_ATTR_TXN 时只修改副本，TXN_COMMIT 一次性替换全部，TXN_ABORT 丢弃副本。
+ * 每个命名空间同时只有一个事务，其它 socket 在事务空闲 TUTU_TXN_TIMEOUT 秒后才能开始新事务（-EBUSY）。
+ * 会话表不参与事务；暂存期间不能读取副本，GET_* 总是返回当前生效的内容。
+ */
+#define TUTU_TXN_TIMEOUT 60
+
 enum {
   TUTU_ATTR_UNSPEC,
 
@@ -55,13 +86,32 @@ enum {
 
   TUTU_ATTR_IFNAME_NAME, /* String */
 
+  TUTU_ATTR_USER_STATS, /* binary: struct tutu_user_stats */
+  TUTU_ATTR_PEER_STATS, /* binary: struct tutu_peer_stats */
+
+  TUTU_ATTR_LATENCY, /* binary: struct tutu_latency */
+
+  TUTU_ATTR_EVENT,      /* binary: struct tutu_event，一条消息可含多个 */
+  TUTU_ATTR_EVENT_LOST, /* u32: 上次发送以来因队列满丢弃的事件数 */
+
+  TUTU_ATTR_BATCH,        /* nested: 多个与命令对应的条目属性（如 TUTU_ATTR_EGRESS），见 TUTU_BATCH_MAX */
+  TUTU_ATTR_BATCH_RESULT, /* binary: __s32 数组，按顺序给出每个条目的结果（0 或 -errno） */
+
+  TUTU_ATTR_DUMP_FILTER, /* binary: struct tutu_dump_filter，GET_* dump 请求的过滤/投影条件 */
+  TUTU_ATTR_DUMP_KEY,    /* binary: TUTU_DUMP_KEYS 时只返回条目的 key */
+  TUTU_ATTR_DUMP_COUNT,  /* u32: TUTU_DUMP_COUNT 时返回的匹配条目数 */
+
+  TUTU_ATTR_TXN, /* flag: 修改作用于当前事务的暂存区 */
+
   __TUTU_ATTR_MAX,
 };
 
 #define TUTU_ATTR_MAX (__TUTU_ATTR_MAX - 1)
 
 #define TUTU_GENL_FAMILY_NAME "tutuicmptunnel"
-#define TUTU_GENL_VERSION     0x1
+#define TUTU_GENL_VERSION     0x2
+
+#define TUTU_GENL_MCGRP_EVENTS "events"
 
 enum {
   TUTU_ANY     = 0, /* create new element or update existing */
@@ -92,8 +142,47 @@ struct tutu_config {
   __u16 reserved1; /* padding to 8-byte boundary */
 };
 
+/*
+ * tutu_reason: hook 放弃转换的原因
+ *
+ * BYPASS 类：包看起来属于隧道但无法匹配（会话/用户/peer 查找失败等），原样放行（NF_ACCEPT）；
+ * DROP 类：已确定要转换但中途失败，包被丢弃。
+ * 与隧道无关的流量（接口不匹配、协议不匹配等）不计数。
+ * 新增原因只能追加在末尾，且总数不超过 TUTU_REASON_SLOTS。
+ */
+enum tutu_reason {
+  TUTU_REASON_NONE = 0,
+
+  /* bypass */
+  TUTU_REASON_BAD_LENGTH,      /* 头部/长度字段不合法 */
+  TUTU_REASON_NO_SESSION,      /* server egress: 找不到会话 */
+  TUTU_REASON_SESSION_EXPIRED, /* server egress: 会话已过期 */
+  TUTU_REASON_UID_NOT_FOUND,   /* server: uid 未配置 */
+  TUTU_REASON_ADDR_MISMATCH,   /* server ingress: 客户端地址与 uid 配置不符 */
+  TUTU_REASON_SESSION_UPDATE,  /* server ingress: 更新会话表失败 */
+  TUTU_REASON_PEER_NOT_FOUND,  /* client ingress: 找不到对端 */
+
+  /* drop */
+  TUTU_REASON_GSO,          /* 无法分段的 GSO 包 */
+  TUTU_REASON_FRAGMENTED,   /* 未能重组的分片 */
+  TUTU_REASON_NO_UDP_CSUM,  /* UDP 检验和字段为 0（未计算），无法转换 */
+  TUTU_REASON_NOT_WRITABLE, /* 改写包内容失败 */
+  TUTU_REASON_CSUM,         /* 检验和 offload 状态无法转换 */
+
+  __TUTU_REASON_MAX,
+};
+
+#define TUTU_REASON_SLOTS 32
+
 /*
  * tutu_stats: 全局统计计数器
+ * - bytes_processed:   完成转换的数据报总字节数（转换前长度）
+ * - bytes_dropped:     转换过程中被丢弃的数据报总字节数
+ * - fragmented:        未能重组、只能丢弃的分片包
+ * - reassembled:       经 nf_defrag 重组后完成转换的数据报
+ * - reassembled_bytes: 上述数据报的总字节数
+ * - frag_mem:          当前 IPv4 重组队列占用的内存（字节，快照值）
+ * - reasons:           按 enum tutu_reason 下标的放行/丢弃次数
  */
 struct tutu_stats {
   __u64 packets_processed;
@@ -101,6 +190,12 @@ struct tutu_stats {
   __u64 checksum_errors;
   __u64 fragmented;
   __u64 gso;
+  __u64 reassembled;
+  __u64 reassembled_bytes;
+  __u64 frag_mem;
+  __u64 bytes_processed;
+  __u64 bytes_dropped;
+  __u64 reasons[TUTU_REASON_SLOTS];
 };
 
 /*
@@ -129,12 +224,29 @@ struct user_info {
   __u8            reserved2[7];
 };
 
+/*
+ * user_key: server 模式下 user_map 的查找键
+ * - address: 客户端访问的服务器本地地址，统一 IPv6（v4-mapped IPv4）。
+ *            全零（::）表示通配，对所有本地地址生效，即旧版单一 UID 空间的行为。
+ *            每个本地地址各有一个独立的 256 UID 空间，因此多 IP 的服务器可以
+ *            服务 256 × 地址数 个客户端；线上报文格式不变，旧客户端无需改动。
+ * - uid: ICMP code 字段携带的 UID
+ * - reserved: 填充，必须为 0（参与哈希与比较）
+ *
+ * 查找顺序：先按（本地地址, uid）精确匹配，未命中再查（::, uid）。
+ */
+struct user_key {
+  struct in6_addr address;
+  __u8            uid;
+  __u8            reserved[3];
+};
+
 /*
  * tutu_user_info: user_info 的 netlink 传输包装
  * 用于内核模块与用户态工具（ktuctl）之间的 netlink 消息传递。
  */
 struct tutu_user_info {
-  __u8             key;
+  struct user_key  key;
   struct user_info value;
   __u64            map_flags;
 };
@@ -254,19 +366,157 @@ struct tutu_session {
   __u64                map_flags;
 };
 
-struct tutu_htab;
-extern struct tutu_htab *egress_peer_map;
-extern struct tutu_htab *ingress_peer_map;
-extern struct tutu_htab *session_map;
-extern struct tutu_htab *user_map;
+/* tutu_dump_filter.flags */
+#define TUTU_DUMP_FILTER_UID  (1U << 0)
+#define TUTU_DUMP_FILTER_ADDR (1U << 1)
+#define TUTU_DUMP_FILTER_PORT (1U << 2)
+#define TUTU_DUMP_FILTER_AGE  (1U << 3) /* 仅 session */
+
+/* tutu_dump_filter.projection */
+enum {
+  TUTU_DUMP_FULL  = 0, /* 完整条目（默认） */
+  TUTU_DUMP_KEYS  = 1, /* 只返回 key，属性为 TUTU_ATTR_DUMP_KEY */
+  TUTU_DUMP_COUNT = 2, /* 不返回条目，最后一条消息给出 TUTU_ATTR_DUMP_COUNT */
+};
+
+/*
+ * tutu_dump_filter: GET_EGRESS/INGRESS/SESSION/USER_INFO 的 dump 请求可携带的条件，在内核中求值
+ * - flags: TUTU_DUMP_FILTER_* 的组合，未置位的条件不参与匹配；map 不支持的条件返回 -EOPNOTSUPP
+ * - uid: 条目所属 UID
+ * - prefix_len/address: 对端地址前缀（server 上为客户端地址，client 上为服务器地址），IPv6 语义；
+ *                       IPv4 使用 v4-mapped 地址，前缀长度加 96
+ * - port: 网络字节序；egress 为服务器端口，ingress 为客户端本地端口，session/user_info 为服务器端口
+ * - min_age/max_age: 会话距上次活跃的秒数，闭区间
+ * - projection: TUTU_DUMP_*
+ */
+struct tutu_dump_filter {
+  __u32           flags;
+  __u8            uid;
+  __u8            prefix_len;
+  __be16          port;
+  struct in6_addr address;
+  __u64           min_age;
+  __u64           max_age;
+  __u8            projection;
+  __u8            reserved[7];
+};
+
+/*
+ * tutu_traffic_stats: 单个 uid（server）或 peer（client）的流量计数
+ * - rx_*: ICMP → UDP 方向（ingress）
+ * - tx_*: UDP → ICMP 方向（egress）
+ * - *_dropped: 已匹配到该 uid/peer，但转换失败被丢弃的包
+ *
+ * 计数随 user_map / peer map 条目存在，更新条目不会清零，删除条目即丢弃。
+ */
+struct tutu_traffic_stats {
+  __u64 rx_packets;
+  __u64 rx_bytes;
+  __u64 rx_dropped;
+  __u64 tx_packets;
+  __u64 tx_bytes;
+  __u64 tx_dropped;
+};
+
+/*
+ * tutu_user_stats: server 模式下每个 user_map 条目的流量（TUTU_CMD_GET_USER_STATS）
+ *
+ * GET_USER_STATS / GET_PEER_STATS 的 dump 同样接受 tutu_dump_filter 的 uid/address/port 条件（不支持 projection），
+ * 按对应的 user_info / egress / ingress 条目求值。
+ */
+struct tutu_user_stats {
+  struct user_key           key;
+  struct tutu_traffic_stats stats;
+};
+
+/*
+ * tutu_peer_stats: client 模式下每个 peer 的流量（TUTU_CMD_GET_PEER_STATS）
+ *
+ * 发送和接收计数分属不同的 map，dump 先输出每个 egress peer，再输出每个 ingress peer：
+ * 端口范围内的多个 egress peer 共用一个 ingress peer，接收计数只报告一次，各条记录相加即为实际流量。
+ * - ingress: 0 为 egress peer，只有 tx_*；1 为 ingress peer，只有 rx_*
+ * - key: egress peer 为 egress_peer_map 的键；ingress peer 为其地址和 value 中的端口
+ * - uid: 该 peer 的 UID
+ */
+struct tutu_peer_stats {
+  struct egress_peer_key    key;
+  __u8                      uid;
+  __u8                      ingress;
+  __u8                      reserved[4];
+  struct tutu_traffic_stats stats;
+};
+
+/*
+ * tutu_latency: hook 处理耗时直方图（TUTU_CMD_GET_LATENCY）
+ *
+ * 仅在模块参数 latency_stats 打开时采样，只统计完成转换的包。
+ * 按 方向 × 模式 × 是否 XOR 分成 TUTU_LAT_HISTS 组，每组 TUTU_LAT_BUCKETS 个 log2 桶：
+ * 桶 i 记录耗时落在 [2^i, 2^(i+1)) 纳秒的包（桶 0 含 0ns，最后一个桶含更大值）。
+ * - enabled: 当前是否在采样
+ * - sum_ns:  每组耗时总和，用于计算平均值
+ */
+#define TUTU_LAT_BUCKETS 32
+#define TUTU_LAT_HISTS   8
+
+#define TUTU_LAT_INDEX(ingress, server, xor) ((!!(ingress) << 2) | (!!(server) << 1) | !!(xor))
+
+struct tutu_latency {
+  __u8  enabled;
+  __u8  reserved[7];
+  __u64 sum_ns[TUTU_LAT_HISTS];
+  __u64 buckets[TUTU_LAT_HISTS][TUTU_LAT_BUCKETS];
+};
+
+/*
+ * tutu_event: 会话/peer 变化事件（TUTU_CMD_EVENT）
+ *
+ * 数据路径只把事件放入每命名空间的队列，由 workqueue 每 TUTU_EVENT_DELAY_MS 毫秒
+ * 批量组播一次；队列满时丢弃并在下一条消息的 TUTU_ATTR_EVENT_LOST 中报告数量。
+ * 没有订阅者时不入队。
+ *
+ * - address:     会话/用户为客户端地址，peer 为服务器地址
+ * - port:        会话/用户为服务器 UDP 端口，peer 为 peer 的端口
+ * - icmp_id:     会话为 key.sport；USER_ICMP_ID 为新值
+ * - old_icmp_id: 仅 USER_ICMP_ID：旧值
+ * - timestamp:   入队时间（CLOCK_REALTIME，纳秒）
+ */
+enum tutu_event_type {
+  TUTU_EVENT_NONE,
+  TUTU_EVENT_SESSION_CREATE, /* server ingress 新建会话 */
+  TUTU_EVENT_SESSION_EXPIRE, /* 会话过期被删除 */
+  TUTU_EVENT_SESSION_DELETE, /* 会话通过 genl 被删除（如 ktuctl reaper） */
+  TUTU_EVENT_USER_ICMP_ID,   /* 客户端 icmp_id 变化（NAT 重新映射） */
+  TUTU_EVENT_USER_UPDATE,    /* user_map 条目通过 genl 新增/更新 */
+  TUTU_EVENT_USER_DELETE,
+  TUTU_EVENT_PEER_UPDATE, /* egress/ingress peer 通过 genl 新增/更新 */
+  TUTU_EVENT_PEER_DELETE,
+};
+
+#define TUTU_EVENT_RING     256
+#define TUTU_EVENT_DELAY_MS 100
+
+struct tutu_event {
+  __u8            type;
+  __u8            uid;
+  __be16          port;
+  __be16          icmp_id;
+  __be16          old_icmp_id;
+  struct in6_addr address;
+  __u64           timestamp;
+};
+
+struct net;
+struct tutu_net;
 
 int  tutu_genl_init(void);
 void tutu_genl_exit(void);
-int  tutu_export_config(struct tutu_config *out);
-int  tutu_set_config(const struct tutu_config *in);
-int  tutu_clear_stats(void);
-int  tutu_export_stats(struct tutu_stats *out);
-int  ifset_reload_config(void);
-bool net_has_device(const char *dev_name);
+int  tutu_export_config(struct tutu_net *tn, struct tutu_config *out);
+int  tutu_set_config(struct tutu_net *tn, const struct tutu_config *in);
+int  tutu_clear_stats(struct tutu_net *tn);
+int  tutu_export_stats(struct tutu_net *tn, struct tutu_stats *out);
+int  tutu_clear_latency(struct tutu_net *tn);
+int  tutu_export_latency(struct tutu_net *tn, struct tutu_latency *out);
+int  ifset_reload_config(struct tutu_net *tn);
+bool net_has_device(struct net *net, const char *dev_name);
 
 // vim: set sw=2 ts=2 expandtab:
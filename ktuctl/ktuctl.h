@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * ktuctl 命令层的进程内接口，供 tuctl_server 直接链接（libktuctl_core.a）。
+ *
+ * 命令经由常驻的 genl socket 下发，内核按调用进程的凭据鉴权：需要 CAP_NET_ADMIN，
+ * 或 euid/egid 与模块参数 allowed_uid/allowed_gid 匹配。
+ * 命令层使用全局状态，所有函数必须在同一线程中串行调用。
+ */
+
+/* 命令行入口，main.c 直接调用 */
+int ktuctl_main(int argc, char **argv);
+
+/*
+ * 执行一段脚本，等同于 `ktuctl script -`。
+ * 命令的输出和调用线程的日志写入 out（超出 out_size 的部分丢弃），长度存入 *out_len；
+ * 不重定向进程的 stdout/stderr，其它线程的输出不受影响。
+ * 脚本中不能使用 monitor，也不能用 "-" 让 script/snapshot 读写 stdin/stdout，这些命令直接报错。
+ * 返回脚本的退出码：0 表示全部命令成功。
+ */
+int ktuctl_exec_script(const char *script, size_t script_len, char *out, size_t out_size, size_t *out_len);
+
+/* 关闭常驻的 genl socket，释放 uid 映射 */
+void ktuctl_exit(void);
+
+// vim: set sw=2 ts=2 expandtab:
@@ -0,0 +1,7 @@
+#include "ktuctl.h"
+
+int main(int argc, char *argv[]) {
+  return ktuctl_main(argc, argv);
+}
+
+// vim: set sw=2 ts=2 expandtab:
@@ -16,6 +16,7 @@
 #include <linux/genetlink.h>
 
 #include "list.h"
+#include "ktuctl.h"
 #include "log.h"
 #include "resolve.h"
 #include "try.h"
@@ -43,14 +44,41 @@ int cmd_server_add(int argc, char **argv);
 int cmd_server_del(int argc, char **argv);
 int cmd_reaper(int argc, char **argv);
 int cmd_status(int argc, char **argv);
+int cmd_latency(int argc, char **argv);
+int cmd_monitor(int argc, char **argv);
 int cmd_dump(int argc, char **argv);
 int cmd_script(int argc, char **argv);
+int cmd_snapshot(int argc, char **argv);
 int cmd_help(int argc, char **argv);
 int cmd_version(int argc, char **argv);
 
 /* 全局状态 */
-static struct mnl_socket *g_nl        = NULL;
-static int                g_family_id = 0;
+static struct mnl_socket *g_nl           = NULL;
+static int                g_family_id    = 0;
+static uint32_t           g_mcgrp_events = 0;
+/* script atomic：修改命令带 TUTU_ATTR_TXN 写入内核事务的暂存区 */
+static bool g_txn = false;
+/* script 模式：整个脚本共用一个 socket，修改命令流水线发送，配置只查询一次 */
+static bool               g_persist    = false;
+static bool               g_cfg_cached = false;
+static struct tutu_config g_cfg_cache;
+/* script 模式：第一次 server-add 时 dump 一次 user_map，之后的比较只查这份副本 */
+static struct tutu_user_info *g_user_cache;
+static size_t                 g_user_cache_count;
+static size_t                 g_user_cache_cap;
+static bool                   g_user_cached = false;
+static bool                   g_user_cache_oom;
+/* 命令输出的去向：命令行下为 stdout/stderr，ktuctl_exec_script() 执行期间指向同一个内存流 */
+static FILE *g_out;
+static FILE *g_err;
+/* ktuctl_exec_script() 执行期间为 true：命令不能长时间阻塞执行线程，也不能读写进程的 stdin/stdout */
+static bool g_exec = false;
+
+extern int   script_parse(void);
+extern FILE *script_in;
+extern void  script_lex_destroy(void);
+extern int   script_exit_code;
+extern int   script_lineno;
 
 static int ctrl_attr_cb(const struct nlattr *attr, void *data) {
   const struct nlattr **tb   = data;
@@ -61,6 +89,27 @@ static int ctrl_attr_cb(const struct nlattr *attr, void *data) {
   return MNL_CB_OK;
 }
 
+/* 在 CTRL_ATTR_MCAST_GROUPS 中查找事件组的 ID */
+static void parse_mcast_groups(const struct nlattr *groups) {
+  const struct nlattr *grp;
+
+  mnl_attr_for_each_nested(grp, groups) {
+    const struct nlattr *attr;
+    const char          *name = NULL;
+    uint32_t             id   = 0;
+
+    mnl_attr_for_each_nested(attr, grp) {
+      if (mnl_attr_get_type(attr) == CTRL_ATTR_MCAST_GRP_NAME)
+        name = mnl_attr_get_str(attr);
+      else if (mnl_attr_get_type(attr) == CTRL_ATTR_MCAST_GRP_ID)
+        id = mnl_attr_get_u32(attr);
+    }
+
+    if (name && !strcmp(name, TUTU_GENL_MCGRP_EVENTS))
+      g_mcgrp_events = id;
+  }
+}
+
 static int ctrl_cb(const struct nlmsghdr *nlh, void *data) {
   struct nlattr     *tb[CTRL_ATTR_MAX + 1] = {};
   struct genlmsghdr *genl                  = mnl_nlmsg_get_payload(nlh);
@@ -74,6 +123,10 @@ static int ctrl_cb(const struct nlmsghdr *nlh, void *data) {
     *(uint16_t *) data = mnl_attr_get_u16(tb[CTRL_ATTR_FAMILY_ID]);
   }
 
+  if (tb[CTRL_ATTR_MCAST_GROUPS]) {
+    parse_mcast_groups(tb[CTRL_ATTR_MCAST_GROUPS]);
+  }
+
   return MNL_CB_OK;
 }
 
@@ -112,12 +165,20 @@ static void deinit_tutuicmptunnel(void) {
     mnl_socket_close(g_nl);
     g_nl = NULL;
   }
-  g_family_id = 0;
+  g_family_id    = 0;
+  g_mcgrp_events = 0;
 }
 
 static int init_tutuicmptunnel(void) {
   int err;
 
+  /*
+   * 事务属于打开它的 socket（portid），事务期间各命令必须沿用同一个 socket；
+   * script 模式下同样复用，省去每条命令的 socket 创建和 family 查询。
+   */
+  if ((g_txn || g_persist) && g_nl)
+    return 0;
+
   deinit_tutuicmptunnel();
   g_nl = try2_p(mnl_socket_open(NETLINK_GENERIC));
   try2_e(mnl_socket_bind(g_nl, 0, MNL_SOCKET_AUTOPID));
@@ -127,6 +188,13 @@ static int init_tutuicmptunnel(void) {
     goto err_cleanup;
   }
 
+  if (g_persist) {
+    int one = 1;
+
+    /* 流水线中积压的 ack 不回带原请求，避免撑满接收缓冲区 */
+    try2_e(mnl_socket_setsockopt(g_nl, NETLINK_CAP_ACK, &one, sizeof(one)));
+  }
+
   err = 0;
 err_cleanup:
   if (err) {
@@ -136,6 +204,163 @@ err_cleanup:
   return err;
 }
 
+/*
+ * script 模式下的请求流水线：调用者不依赖结果的修改命令只追加到 g_pipe，攒满 PIPELINE_MAX 条
+ * 或下一个需要同步结果的请求到来时一次 sendto 发出，再按序号收齐 ack。
+ * 失败的命令按入队时的脚本行号报告并记入 script_exit_code，不影响后续命令；
+ * 调用者的结果消息通过 log_deferred() 挂在本行的请求上，本行的请求都成功后才打印。
+ */
+#define PIPELINE_MAX      128
+#define PIPELINE_BUF_SIZE (32 * 1024)
+
+struct pipeline {
+  char    *buf;
+  size_t   len;
+  unsigned count;
+  __u32    seq;
+  int      lines[PIPELINE_MAX];
+  int      errors[PIPELINE_MAX];
+  char    *msgs[PIPELINE_MAX];
+};
+
+static struct pipeline g_pipe;
+
+static bool pipelined_cmd(int cmd) {
+  if (!g_persist)
+    return false;
+
+  /*
+   * 只有调用者不需要根据结果做后续处理的命令：
+   * SET_CONFIG 成功后才能更新 g_cfg_cache，UPDATE_INGRESS 要根据 -EEXIST 检查端口冲突，
+   * UPDATE_EGRESS 失败时 client-add 要回滚刚加入的 ingress 条目，它们都同步执行
+   */
+  switch (cmd) {
+  case TUTU_CMD_DELETE_EGRESS:
+  case TUTU_CMD_DELETE_INGRESS:
+  case TUTU_CMD_UPDATE_USER_INFO:
+  case TUTU_CMD_DELETE_USER_INFO:
+    return true;
+  default:
+    return false;
+  }
+}
+
+/* 发出所有排队的请求并等待它们的 ack；只有 socket 本身出错才返回错误 */
+static int pipeline_flush(void) {
+  char     buf[MNL_SOCKET_BUFFER_SIZE];
+  unsigned count = g_pipe.count, pending = count;
+  int      err;
+
+  if (!pending)
+    return 0;
+
+  try2_e(mnl_socket_sendto(g_nl, g_pipe.buf, g_pipe.len));
+
+  while (pending) {
+    const struct nlmsghdr *nlh;
+    int                    len = try2_e(mnl_socket_recvfrom(g_nl, buf, sizeof(buf)));
+
+    for (nlh = (const struct nlmsghdr *) buf; mnl_nlmsg_ok(nlh, len); nlh = mnl_nlmsg_next(nlh, &len)) {
+      const struct nlmsgerr *e   = mnl_nlmsg_get_payload(nlh);
+      __u32                  idx = nlh->nlmsg_seq - g_pipe.seq;
+
+      if (nlh->nlmsg_type != NLMSG_ERROR || idx >= count)
+        continue;
+
+      g_pipe.errors[idx] = e->error;
+      pending--;
+    }
+  }
+
+  /* 按入队顺序报告：失败的请求打印错误，本行请求全部成功时才打印调用者的结果消息 */
+  for (unsigned i = 0, failed = 0; i < count; i++) {
+    if (i && g_pipe.lines[i] != g_pipe.lines[i - 1])
+      failed = 0;
+    if (g_pipe.errors[i]) {
+      log_error("Command failed (%s) at line %d", strerror(-g_pipe.errors[i]), g_pipe.lines[i]);
+      script_exit_code = g_pipe.errors[i];
+      failed           = 1;
+    } else if (g_pipe.msgs[i] && !failed) {
+      log_info("%s", g_pipe.msgs[i]);
+    }
+  }
+
+  err = 0;
+err_cleanup:
+  for (unsigned i = 0; i < count; i++) {
+    free(g_pipe.msgs[i]);
+    g_pipe.msgs[i] = NULL;
+  }
+  g_pipe.count = 0;
+  g_pipe.len   = 0;
+  return err;
+}
+
+static int pipeline_add(struct nlmsghdr *nlh) {
+  int err;
+
+  if (!g_pipe.buf)
+    g_pipe.buf = try2_p(malloc(PIPELINE_BUF_SIZE));
+
+  if (g_pipe.count == PIPELINE_MAX || g_pipe.len + nlh->nlmsg_len > PIPELINE_BUF_SIZE)
+    try2(pipeline_flush());
+
+  if (!g_pipe.count)
+    g_pipe.seq = time(NULL);
+
+  nlh->nlmsg_seq               = g_pipe.seq + g_pipe.count;
+  g_pipe.errors[g_pipe.count]  = 0;
+  g_pipe.lines[g_pipe.count++] = script_lineno;
+  memcpy(g_pipe.buf + g_pipe.len, nlh, nlh->nlmsg_len);
+  g_pipe.len += MNL_ALIGN(nlh->nlmsg_len);
+
+  err = 0;
+err_cleanup:
+  return err;
+}
+
+/*
+ * 打印修改命令的结果消息。本行还有请求在流水线中时，消息要等 ack 回来再打印，
+ * 避免命令实际失败时仍然输出成功；否则立即打印。
+ */
+static void log_deferred(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void log_deferred(const char *fmt, ...) {
+  char   *msg = NULL;
+  va_list ap;
+  int     ret;
+
+  va_start(ap, fmt);
+  ret = vasprintf(&msg, fmt, ap);
+  va_end(ap);
+  if (ret < 0)
+    return;
+
+  if (g_pipe.count && g_pipe.lines[g_pipe.count - 1] == script_lineno) {
+    free(g_pipe.msgs[g_pipe.count - 1]);
+    g_pipe.msgs[g_pipe.count - 1] = msg;
+    return;
+  }
+
+  log_info("%s", msg);
+  free(msg);
+}
+
+/* 事务期间这些命令修改暂存区，其余命令（查询、会话、统计等）照常作用于当前生效的状态 */
+static bool txn_staged_cmd(int cmd) {
+  switch (cmd) {
+  case TUTU_CMD_SET_CONFIG:
+  case TUTU_CMD_UPDATE_EGRESS:
+  case TUTU_CMD_DELETE_EGRESS:
+  case TUTU_CMD_UPDATE_INGRESS:
+  case TUTU_CMD_DELETE_INGRESS:
+  case TUTU_CMD_UPDATE_USER_INFO:
+  case TUTU_CMD_DELETE_USER_INFO:
+    return g_txn;
+  default:
+    return false;
+  }
+}
+
 /* --- 内部辅助：发送简单的 Request (用于 Update/Delete/Set) --- */
 static int send_simple_cmd(int cmd, int attr_type, const void *data, size_t len, int flags) {
   char               buf[MNL_SOCKET_BUFFER_SIZE];
@@ -161,6 +386,13 @@ static int send_simple_cmd(int cmd, int attr_type, const void *data, size_t len,
   if (data && len > 0) {
     mnl_attr_put(nlh, attr_type, len, data);
   }
+  if (txn_staged_cmd(cmd)) {
+    mnl_attr_put(nlh, TUTU_ATTR_TXN, 0, NULL);
+  }
+
+  if (pipelined_cmd(cmd))
+    return pipeline_add(nlh);
+  try2(pipeline_flush());
 
   try2_e(mnl_socket_sendto(g_nl, nlh, nlh->nlmsg_len));
   err = try2_e(mnl_socket_recvfrom(g_nl, buf, sizeof(buf)));
@@ -204,10 +436,38 @@ static int single_data_cb(const struct nlmsghdr *nlh, void *data) {
 }
 
 static int set_config_map(const struct tutu_config *cfg) {
-  return send_simple_cmd(TUTU_CMD_SET_CONFIG, TUTU_ATTR_CONFIG, cfg, sizeof(*cfg), 0);
+  int err = send_simple_cmd(TUTU_CMD_SET_CONFIG, TUTU_ATTR_CONFIG, cfg, sizeof(*cfg), 0);
+
+  if (!err && g_persist) {
+    g_cfg_cache  = *cfg;
+    g_cfg_cached = true;
+  }
+  return err;
+}
+
+static void user_cache_free(void) {
+  free(g_user_cache);
+  g_user_cache       = NULL;
+  g_user_cache_count = 0;
+  g_user_cache_cap   = 0;
+  g_user_cached      = false;
+}
+
+/*
+ * 本进程修改过的条目从副本中移除，之后同一 key 的 server-add 总是照常写入。
+ * UPDATE/DELETE 在流水线中异步确认，不能假定已经成功，所以不把新值写进副本。
+ */
+static void user_cache_evict(const struct user_key *key) {
+  for (size_t i = 0; i < g_user_cache_count; i++) {
+    if (!memcmp(&g_user_cache[i].key, key, sizeof(*key))) {
+      g_user_cache[i] = g_user_cache[--g_user_cache_count];
+      return;
+    }
+  }
 }
 
 static int set_user_info_map(const struct tutu_user_info *info) {
+  user_cache_evict(&info->key);
   /*
    * 发送 UPDATE 命令
    * map_flags 已经在 info 结构体里了，直接传整个结构体即可
@@ -215,11 +475,12 @@ static int set_user_info_map(const struct tutu_user_info *info) {
   return send_simple_cmd(TUTU_CMD_UPDATE_USER_INFO, TUTU_ATTR_USER_INFO, info, sizeof(*info), 0);
 }
 
-static int delete_user_info_map(__u8 uid) {
+static int delete_user_info_map(const struct user_key *key) {
   struct tutu_user_info info = {
-    .key = uid,
+    .key = *key,
   };
 
+  user_cache_evict(key);
   /* 发送 DELETE 命令，带上完整的结构体 */
   return send_simple_cmd(TUTU_CMD_DELETE_USER_INFO, TUTU_ATTR_USER_INFO, &info, sizeof(info), 0);
 }
@@ -259,6 +520,7 @@ static int send_and_recv_data(int cmd, int attr_type, const void *in_data, size_
     mnl_attr_put(nlh, attr_type, in_len, in_data);
   }
 
+  try2(pipeline_flush());
   try2_e(mnl_socket_sendto(g_nl, nlh, nlh->nlmsg_len));
   err = try2_e(mnl_socket_recvfrom(g_nl, buf, sizeof(buf)));
   /* 使用 single_data_cb 解析回包，将结果填入 out_data */
@@ -275,14 +537,139 @@ err_cleanup:
   return err;
 }
 
+/* 批量请求的发送缓冲区；条目数同时受 TUTU_BATCH_MAX 限制 */
+#define BATCH_BUF_SIZE (64 * 1024)
+
+struct batch_result_ctx {
+  int   *results; /* 可为 NULL */
+  size_t count;   /* 本条消息中的条目数 */
+  int    failed;
+};
+
+static int batch_result_cb(const struct nlmsghdr *nlh, void *data) {
+  struct batch_result_ctx *ctx = data;
+  struct nlattr           *attr;
+
+  mnl_attr_for_each(attr, nlh, sizeof(struct genlmsghdr)) {
+    const __s32 *res;
+
+    if (mnl_attr_get_type(attr) != TUTU_ATTR_BATCH_RESULT)
+      continue;
+
+    if (mnl_attr_get_payload_len(attr) != ctx->count * sizeof(__s32)) {
+      log_error("netlink batch result length mismatch: expected %zu, got %u", ctx->count * sizeof(__s32),
+                mnl_attr_get_payload_len(attr));
+      return MNL_CB_ERROR;
+    }
+
+    res = mnl_attr_get_payload(attr);
+    for (size_t i = 0; i < ctx->count; i++) {
+      if (ctx->results)
+        ctx->results[i] = res[i];
+      if (res[i])
+        ctx->failed++;
+    }
+    return MNL_CB_STOP;
+  }
+
+  return MNL_CB_ERROR;
+}
+
+/*
+ * 批量 Update/Delete：entries 为 count 个 size 字节的条目（如 struct tutu_session），
+ * 按 TUTU_ATTR_BATCH 打包，每条消息最多 TUTU_BATCH_MAX 个条目。
+ * results 可为 NULL，否则写入每个条目的结果（0 或 -errno）。
+ * 返回失败的条目数；整条消息被内核拒绝时返回负数。
+ */
+static int send_batch_cmd(int cmd, int attr_type, const void *entries, size_t size, size_t count, int *results) {
+  char               rbuf[MNL_SOCKET_BUFFER_SIZE + TUTU_BATCH_MAX * sizeof(__s32)];
+  char              *buf = NULL;
+  struct nlmsghdr   *nlh;
+  struct genlmsghdr *genl;
+  struct nlattr     *nest;
+  size_t             per_msg, done = 0;
+  int                failed = 0, err;
+
+  if (!g_nl) {
+    return -EBADF;
+  }
+
+  buf = try2_p(calloc(1, BATCH_BUF_SIZE));
+  try2(pipeline_flush());
+
+  per_msg = (BATCH_BUF_SIZE - MNL_NLMSG_HDRLEN - MNL_ALIGN(sizeof(struct genlmsghdr)) - MNL_ATTR_HDRLEN) /
+            MNL_ALIGN(MNL_ATTR_HDRLEN + size);
+  if (per_msg > TUTU_BATCH_MAX)
+    per_msg = TUTU_BATCH_MAX;
+
+  while (done < count) {
+    size_t                  n   = count - done < per_msg ? count - done : per_msg;
+    struct batch_result_ctx ctx = {
+      .results = results ? results + done : NULL,
+      .count   = n,
+    };
+
+    nlh              = mnl_nlmsg_put_header(buf);
+    nlh->nlmsg_type  = g_family_id;
+    nlh->nlmsg_flags = NLM_F_REQUEST;
+    nlh->nlmsg_seq   = time(NULL);
+
+    genl          = mnl_nlmsg_put_extra_header(nlh, sizeof(struct genlmsghdr));
+    genl->cmd     = cmd;
+    genl->version = TUTU_GENL_VERSION;
+
+    nest = mnl_attr_nest_start(nlh, TUTU_ATTR_BATCH);
+    for (size_t i = 0; i < n; i++) {
+      mnl_attr_put(nlh, attr_type, size, (const char *) entries + (done + i) * size);
+    }
+    mnl_attr_nest_end(nlh, nest);
+    if (txn_staged_cmd(cmd)) {
+      mnl_attr_put(nlh, TUTU_ATTR_TXN, 0, NULL);
+    }
+
+    try2_e(mnl_socket_sendto(g_nl, nlh, nlh->nlmsg_len));
+    err = try2_e(mnl_socket_recvfrom(g_nl, rbuf, sizeof(rbuf)));
+    try2(mnl_cb_run(rbuf, err, nlh->nlmsg_seq, mnl_socket_get_portid(g_nl), batch_result_cb, &ctx));
+
+    failed += ctx.failed;
+    done += n;
+  }
+  err = failed;
+
+err_cleanup:
+  free(buf);
+  return err;
+}
+
+/* script 模式下配置只会被本进程的 set_config_map 修改，查询一次后使用缓存 */
 static int get_config_map(struct tutu_config *cfg) {
-  return send_and_recv_data(TUTU_CMD_GET_CONFIG, TUTU_ATTR_CONFIG, NULL, 0, cfg, sizeof(*cfg));
+  int err;
+
+  if (g_persist && g_cfg_cached) {
+    *cfg = g_cfg_cache;
+    return 0;
+  }
+
+  err = send_and_recv_data(TUTU_CMD_GET_CONFIG, TUTU_ATTR_CONFIG, NULL, 0, cfg, sizeof(*cfg));
+  if (!err && g_persist) {
+    g_cfg_cache  = *cfg;
+    g_cfg_cached = true;
+  }
+  return err;
 }
 
 static int get_stats_map(struct tutu_stats *stats) {
   return send_and_recv_data(TUTU_CMD_GET_STATS, TUTU_ATTR_STATS, NULL, 0, stats, sizeof(*stats));
 }
 
+static int get_latency(struct tutu_latency *lat) {
+  return send_and_recv_data(TUTU_CMD_GET_LATENCY, TUTU_ATTR_LATENCY, NULL, 0, lat, sizeof(*lat));
+}
+
+static int clear_latency(void) {
+  return send_simple_cmd(TUTU_CMD_CLR_LATENCY, 0, NULL, 0, 0);
+}
+
 /* Lookup: 既发送数据 (Key)，也接收数据 (Value 回填到 data) */
 static int lookup_map(int cmd, int attr_type, void *data, size_t len) {
   /* 输入和输出使用同一个 data 指针，传入相同的长度 */
@@ -353,7 +740,12 @@ static int dump_cb_internal(const struct nlmsghdr *nlh, void *data) {
   return MNL_CB_OK;
 }
 
-static int tutu_foreach(int cmd, int attr_type, int size, tutu_iter_cb_t cb, void *user_data) {
+/*
+ * filter 可为 NULL；不为 NULL 时随 dump 请求发送，由内核过滤。
+ * 投影为 TUTU_DUMP_KEYS/TUTU_DUMP_COUNT 时，调用者需相应地传入 TUTU_ATTR_DUMP_KEY/TUTU_ATTR_DUMP_COUNT 及其长度。
+ */
+static int tutu_foreach_filter(int cmd, int attr_type, int size, const struct tutu_dump_filter *filter, tutu_iter_cb_t cb,
+                               void *user_data) {
   char               buf[MNL_SOCKET_BUFFER_SIZE];
   struct nlmsghdr   *nlh;
   struct genlmsghdr *genl;
@@ -370,6 +762,11 @@ static int tutu_foreach(int cmd, int attr_type, int size, tutu_iter_cb_t cb, voi
   genl->cmd        = cmd;
   genl->version    = TUTU_GENL_VERSION;
 
+  if (filter) {
+    mnl_attr_put(nlh, TUTU_ATTR_DUMP_FILTER, sizeof(*filter), filter);
+  }
+
+  try2(pipeline_flush());
   try2_e(mnl_socket_sendto(g_nl, nlh, nlh->nlmsg_len));
 
   while ((err = try2_e(mnl_socket_recvfrom(g_nl, buf, sizeof(buf)))) > 0) {
@@ -382,21 +779,104 @@ err_cleanup:
   return err;
 }
 
-/* 具体的遍历封装 */
-static int foreach_egress(tutu_iter_cb_t cb, void *data) {
-  return tutu_foreach(TUTU_CMD_GET_EGRESS, TUTU_ATTR_EGRESS, sizeof(struct tutu_egress), cb, data);
+static int tutu_foreach(int cmd, int attr_type, int size, tutu_iter_cb_t cb, void *user_data) {
+  return tutu_foreach_filter(cmd, attr_type, size, NULL, cb, user_data);
+}
+
+/* 具体的遍历封装，filter 可为 NULL */
+static int foreach_egress(const struct tutu_dump_filter *filter, tutu_iter_cb_t cb, void *data) {
+  return tutu_foreach_filter(TUTU_CMD_GET_EGRESS, TUTU_ATTR_EGRESS, sizeof(struct tutu_egress), filter, cb, data);
+}
+
+static int foreach_ingress(const struct tutu_dump_filter *filter, tutu_iter_cb_t cb, void *data) {
+  return tutu_foreach_filter(TUTU_CMD_GET_INGRESS, TUTU_ATTR_INGRESS, sizeof(struct tutu_ingress), filter, cb, data);
+}
+
+static int foreach_user_info(const struct tutu_dump_filter *filter, tutu_iter_cb_t cb, void *data) {
+  return tutu_foreach_filter(TUTU_CMD_GET_USER_INFO, TUTU_ATTR_USER_INFO, sizeof(struct tutu_user_info), filter, cb, data);
+}
+
+static int foreach_session(const struct tutu_dump_filter *filter, tutu_iter_cb_t cb, void *data) {
+  return tutu_foreach_filter(TUTU_CMD_GET_SESSION, TUTU_ATTR_SESSION, sizeof(struct tutu_session), filter, cb, data);
+}
+
+static int user_cache_collect_cb(void *entry, void *user_data) {
+  (void) user_data;
+
+  /* 内存不足时只做标记，继续收完 dump 的应答，不在 socket 中留下残余消息 */
+  if (g_user_cache_oom)
+    return 0;
+  if (g_user_cache_count == g_user_cache_cap) {
+    size_t cap = g_user_cache_cap ? g_user_cache_cap * 2 : 64;
+    void  *p   = realloc(g_user_cache, cap * sizeof(*g_user_cache));
+
+    if (!p) {
+      g_user_cache_oom = true;
+      return 0;
+    }
+    g_user_cache     = p;
+    g_user_cache_cap = cap;
+  }
+  memcpy(&g_user_cache[g_user_cache_count++], entry, sizeof(*g_user_cache));
+  return 0;
+}
+
+/*
+ * 内核中已有完全相同的用户条目时返回 true。
+ * 同步脚本每分钟都会推送同样的 server-add，状态未变时跳过 UPDATE：不替换 user_map 元素，
+ * 也不产生 RCU 释放和事件通知。事务中暂存区可能与生效状态不同，总是照常写入。
+ * 请求未指定 icmp_id（为 0）时由内核从客户端报文中学习，已学到的值不算变化。
+ * 每个脚本只 dump 一次 user_map（会先冲刷流水线），之后的比较不再与内核往返；
+ * dump 失败时不跳过任何写入。
+ */
+static bool user_info_unchanged(const struct tutu_user_info *info) {
+  struct user_info want = info->value;
+
+  if (g_txn)
+    return false;
+
+  if (!g_user_cached) {
+    user_cache_free();
+    g_user_cache_oom = false;
+    if (foreach_user_info(NULL, user_cache_collect_cb, NULL) < 0 || g_user_cache_oom) {
+      user_cache_free();
+      return false;
+    }
+    g_user_cached = true;
+  }
+
+  for (size_t i = 0; i < g_user_cache_count; i++) {
+    const struct tutu_user_info *cur = &g_user_cache[i];
+
+    if (memcmp(&cur->key, &info->key, sizeof(info->key)))
+      continue;
+    if (!want.icmp_id)
+      want.icmp_id = cur->value.icmp_id;
+    return !memcmp(&cur->value, &want, sizeof(cur->value));
+  }
+  return false;
+}
+
+static int count_cb(void *entry, void *user_data) {
+  memcpy(user_data, entry, sizeof(__u32));
+  return 0;
 }
 
-static int foreach_ingress(tutu_iter_cb_t cb, void *data) {
-  return tutu_foreach(TUTU_CMD_GET_INGRESS, TUTU_ATTR_INGRESS, sizeof(struct tutu_ingress), cb, data);
+/* 只让内核返回匹配的条目数（TUTU_DUMP_COUNT），cmd 为 TUTU_CMD_GET_* */
+static int count_entries(int cmd, const struct tutu_dump_filter *filter, __u32 *count) {
+  struct tutu_dump_filter f = filter ? *filter : (struct tutu_dump_filter) {};
+
+  f.projection = TUTU_DUMP_COUNT;
+  *count       = 0;
+  return tutu_foreach_filter(cmd, TUTU_ATTR_DUMP_COUNT, sizeof(__u32), &f, count_cb, count);
 }
 
-static int foreach_user_info(tutu_iter_cb_t cb, void *data) {
-  return tutu_foreach(TUTU_CMD_GET_USER_INFO, TUTU_ATTR_USER_INFO, sizeof(struct tutu_user_info), cb, data);
+static int foreach_user_stats(const struct tutu_dump_filter *filter, tutu_iter_cb_t cb, void *data) {
+  return tutu_foreach_filter(TUTU_CMD_GET_USER_STATS, TUTU_ATTR_USER_STATS, sizeof(struct tutu_user_stats), filter, cb, data);
 }
 
-static int foreach_session(tutu_iter_cb_t cb, void *data) {
-  return tutu_foreach(TUTU_CMD_GET_SESSION, TUTU_ATTR_SESSION, sizeof(struct tutu_session), cb, data);
+static int foreach_peer_stats(const struct tutu_dump_filter *filter, tutu_iter_cb_t cb, void *data) {
+  return tutu_foreach_filter(TUTU_CMD_GET_PEER_STATS, TUTU_ATTR_PEER_STATS, sizeof(struct tutu_peer_stats), filter, cb, data);
 }
 
 /* 专门针对 ifname 的 foreach 包装，传入 size=0 */
@@ -496,7 +976,7 @@ static int parse_xor_key(const char *s, __u8 *key, __u8 *key_len, size_t max_len
 }
 
 static void print_iface_usage(const char *prog, bool add) {
-  fprintf(stderr,
+  fprintf(g_err,
           "Usage: %s %s [OPTIONS] iface IFACE [IFACE...]\n\n"
           "  %s a network interface %s " STR(PROJECT_NAME) ".\n\n"
                                                            "Arguments:\n"
@@ -510,7 +990,7 @@ static int ifname_print_cb(void *entry, void *user_data) {
   bool       *found = (bool *) user_data;
 
   /* 打印接口名 */
-  printf("  %s\n", name);
+  fprintf(g_out, "  %s\n", name);
 
   /* 标记至少找到了一个 */
   if (found)
@@ -523,16 +1003,16 @@ static int print_ifnames(void) {
   bool found = false;
   int  err;
 
-  printf("Managed interfaces:\n");
+  fprintf(g_out, "Managed interfaces:\n");
 
   /* 调用 Generic Netlink Dump */
   try2(foreach_ifname(ifname_print_cb, &found), "Error dumping interfaces: %s", strerrno);
 
   if (!found) {
-    printf("  [all interfaces]\n");
+    fprintf(g_out, "  [all interfaces]\n");
   }
 
-  printf("\n");
+  fprintf(g_out, "\n");
   err = 0;
 
 err_cleanup:
@@ -610,7 +1090,7 @@ int cmd_unload(int argc, char **argv) {
 static int print_server_usage(int argc, char *argv[]) {
   (void) argc;
 
-  fprintf(stderr,
+  fprintf(g_err,
           "Usage: %s %s [OPTIONS]\n\n"
 
           "  " CMD_SERVER_SUMMARY ".\n\n"
@@ -646,7 +1126,7 @@ int cmd_server(int argc, char **argv) {
     }
   }
 
-  printf("server mode, session max age=%u\n", session_max_age);
+  fprintf(g_out, "server mode, session max age=%u\n", session_max_age);
 
   struct tutu_config cfg = {
     .is_server       = 1,
@@ -665,7 +1145,7 @@ err_cleanup:
 
 static int print_client_usage(int argc, char **argv) {
   (void) argc;
-  fprintf(stderr,
+  fprintf(g_err,
           "Usage: %s %s [OPTIONS]\n\n"
 
           "  " CMD_CLIENT_SUMMARY ".\n\n",
@@ -695,7 +1175,7 @@ int cmd_client(int argc, char **argv) {
     }
   }
 
-  printf("client mode\n");
+  fprintf(g_out, "client mode\n");
 
   cfg = (typeof(cfg)) {
     .is_server = 0,
@@ -726,7 +1206,7 @@ err_cleanup:
 
 static int print_client_add_usage(int argc, char **argv) {
   (void) argc;
-  fprintf(stderr,
+  fprintf(g_err,
           "Usage: %s %s [OPTIONS] address ADDR port PORT {uid UID | user USERNAME} [comment COMMENT]\n\n"
 
           "  " CMD_CLIENT_ADD_SUMMARY ".\n\n"
@@ -760,6 +1240,7 @@ int cmd_client_add(int argc, char **argv) {
   bool        is_server     = false;
   const char *xor_arg       = NULL;
   bool        xor_specified = false;
+  bool        ingress_added = false;
 
   struct tutu_egress  egress;
   struct tutu_ingress ingress;
@@ -859,7 +1340,8 @@ int cmd_client_add(int argc, char **argv) {
   }
 
   /* 1. 尝试设置 (TUTU_NOEXIST) */
-  err = set_ingress_peer_map(&ingress.key, &ingress.value);
+  err           = set_ingress_peer_map(&ingress.key, &ingress.value);
+  ingress_added = !err;
 
   if (err < 0) { /* Netlink 封装函数出错返回 -1 */
     if (err == -EEXIST) {
@@ -888,7 +1370,14 @@ int cmd_client_add(int argc, char **argv) {
     }
   }
 
-  try2(set_egress_peer_map(&egress.key, &egress.value), _("set_egress_peer_map: %s"), strerrno);
+  err = set_egress_peer_map(&egress.key, &egress.value);
+  if (err < 0) {
+    log_error(_("set_egress_peer_map: %s"), strerror(-err));
+    /* 回滚本命令刚加入的 ingress 条目，不留下只有一个方向的配置 */
+    if (ingress_added)
+      delete_ingress_peer_map(&ingress.key);
+    goto err_cleanup;
+  }
 
   {
     char ipstr[INET6_ADDRSTRLEN], *uidstr = NULL;
@@ -908,7 +1397,7 @@ err_cleanup:
 
 static int print_client_del_usage(int argc, char **argv) {
   (void) argc;
-  fprintf(stderr,
+  fprintf(g_err,
           "Usage: %s %s [OPTIONS] {uid UID | user USERNAME} address ADDRESS\n\n"
 
           "  " CMD_CLIENT_DEL_SUMMARY ".\n\n"
@@ -1025,13 +1514,20 @@ int cmd_client_del(int argc, char **argv) {
 
   /* 初始化搜索上下文，传入局部变量 uid 和 in6 */
   struct delete_search_ctx ctx = {.target_uid = uid, .target_ip = in6};
+  /* 由内核按 uid 和地址过滤，只返回候选条目 */
+  struct tutu_dump_filter filter = {
+    .flags      = TUTU_DUMP_FILTER_UID | TUTU_DUMP_FILTER_ADDR,
+    .uid        = uid,
+    .prefix_len = 128,
+    .address    = in6,
+  };
 
   /* 1. 遍历并处理 Egress */
-  foreach_egress(check_and_del_egress_cb, &ctx);
+  foreach_egress(&filter, check_and_del_egress_cb, &ctx);
 
   /* 2. 遍历并处理 Ingress */
   /* 继续使用同一个 ctx */
-  foreach_ingress(check_and_del_ingress_cb, &ctx);
+  foreach_ingress(&filter, check_and_del_ingress_cb, &ctx);
 
   if (ctx.found_egress) {
     try2(delete_egress_peer_map(&ctx.pending_egress_key), "delete egress failed: %s", strerrno);
@@ -1048,9 +1544,9 @@ int cmd_client_del(int argc, char **argv) {
   char *uidstr = NULL;
   try2(uid2string(uid, &uidstr, 0), "uid2string: %s", strret);
   if (deleted)
-    log_info("client deleted: %s", uidstr);
+    log_deferred("client deleted: %s", uidstr);
   else
-    log_info("client peer: %s address %s not found", uidstr, address);
+    log_deferred("client peer: %s address %s not found", uidstr, address);
   free(uidstr);
 
   err = 0;
@@ -1063,8 +1559,9 @@ err_cleanup:
 static int print_server_add_usage(int argc, char **argv) {
   (void) argc;
   fprintf(
-    stderr,
-    "Usage: %s %s [OPTIONS] {uid UID | user USERNAME} address ADDR port PORT [icmp-id ID] [sport PORT] [comment COMMENT]\n\n"
+    g_err,
+    "Usage: %s %s [OPTIONS] {uid UID | user USERNAME} address ADDR port PORT [server-addr ADDR] [icmp-id ID] [sport PORT] "
+    "[comment COMMENT]\n\n"
 
     "  " CMD_SERVER_ADD_SUMMARY ".\n\n"
 
@@ -1075,6 +1572,8 @@ static int print_server_add_usage(int argc, char **argv) {
     "  %-22s The username to authorize.\n"
     "  %-22s The client's source address.\n"
     "  %-22s The destination port on the server for the tunnel.\n"
+    "  %-22s Optional: Local server address the client connects to. Each server address\n"
+    "  %-22s has its own 256 UIDs; without it the UID applies to all addresses.\n"
     "  %-22s Optional: The specific ICMP ID for the client.\n"
     "  %-22s Optional: The specific source port for the client.\n"
     "  %-22s Optional: A descriptive comment for this client entry.\n"
@@ -1086,7 +1585,8 @@ static int print_server_add_usage(int argc, char **argv) {
     "  %-22s Display UID as a number instead of resolving it to a username"
     " in command output. \n",
 
-    STR(PROG_NAME), argv[0], "uid UID", "user USERNAME", "address ADDR", "port PORT", "icmp-id ICMP_ID", "sport PORT",
+    STR(PROG_NAME), argv[0], "uid UID", "user USERNAME", "address ADDR", "port PORT", "server-addr ADDR", "", "icmp-id ICMP_ID",
+    "sport PORT",
     "comment COMMENT", "xor XOR_KEY", "-4", "-6", "-n");
   return 0;
 }
@@ -1094,6 +1594,7 @@ static int print_server_add_usage(int argc, char **argv) {
 int cmd_server_add(int argc, char **argv) {
   uint8_t     uid           = 0;
   const char *address       = NULL;
+  const char *server_addr   = NULL;
   uint16_t    port          = 0;
   uint16_t    icmp_id       = 0;
   bool        uid_set       = false;
@@ -1102,6 +1603,7 @@ int cmd_server_add(int argc, char **argv) {
   bool        is_server     = false;
   const char *xor_arg       = NULL;
   bool        xor_specified = false;
+  bool        unchanged     = false;
 
   struct user_info user;
 
@@ -1122,6 +1624,11 @@ int cmd_server_add(int argc, char **argv) {
         goto usage;
 
       address = argv[i];
+    } else if (matches(tok, "server-addr")) {
+      if (++i >= argc)
+        goto usage;
+
+      server_addr = argv[i];
     } else if (matches(tok, "sport")) {
       if (++i >= argc)
         goto usage;
@@ -1196,20 +1703,29 @@ int cmd_server_add(int argc, char **argv) {
   }
 
   struct tutu_user_info user_info = {
-    .key       = uid,
+    .key       = {.uid = uid},
     .value     = user,
     .map_flags = TUTU_ANY,
   };
 
-  try2(set_user_info_map(&user_info), _("netlink update user info: %s"), strerrno);
+  if (server_addr)
+    try2(resolve_ip_addr(family, server_addr, &user_info.key.address));
+
+  unchanged = user_info_unchanged(&user_info);
+  if (!unchanged)
+    try2(set_user_info_map(&user_info), _("netlink update user info: %s"), strerrno);
 
   {
     char  ipstr[INET6_ADDRSTRLEN];
-    char *uidstr = NULL;
+    char  srvstr[INET6_ADDRSTRLEN] = "any";
+    char *uidstr                   = NULL;
     try2(ipv6_ntop(ipstr, &user.address), "ipv6_ntop: %s %s", ipstr, strret);
+    if (server_addr)
+      try2(ipv6_ntop(srvstr, &user_info.key.address), "ipv6_ntop: %s %s", srvstr, strret);
     try2(uid2string(uid, &uidstr, 0), "uid2string: %s", strret);
-    log_info("server updated: %s, address: %s, dport: %u, comment: %.*s%s", uidstr, ipstr, ntohs(user.dport),
-             (int) sizeof(user.comment), user.comment, xor_specified ? ", with xor key" : "");
+    log_deferred("server %s: %s, address: %s, dport: %u, server address: %s, comment: %.*s%s",
+                 unchanged ? "unchanged" : "updated", uidstr, ipstr, ntohs(user.dport), srvstr, (int) sizeof(user.comment),
+                 user.comment, xor_specified ? ", with xor key" : "");
     free(uidstr);
   }
 
@@ -1223,29 +1739,31 @@ err_cleanup:
 static int print_server_del_usage(int argc, char **argv) {
   (void) argc;
 
-  fprintf(stderr,
-          "Usage: %s %s [OPTIONS] {uid <id> | user <name>}\n\n"
+  fprintf(g_err,
+          "Usage: %s %s [OPTIONS] {uid <id> | user <name>} [server-addr <addr>]\n\n"
 
           "  " CMD_SERVER_DEL_SUMMARY ".\n\n"
 
           "Arguments:\n"
           "  You must specify a user to delete using exactly one of the following identifiers:\n\n"
           "  %-22s Specifies the target user by their numerical User ID (UID).\n"
-          "  %-22s Specifies the target user by their username.\n\n"
+          "  %-22s Specifies the target user by their username.\n"
+          "  %-22s Optional: The server address the UID was added for.\n\n"
 
           "Options:\n"
           "  %-22s Display UID as a number instead of resolving it to a username"
           " in command output. \n",
 
-          STR(PROG_NAME), argv[0], "uid <id>", "user <name>", "-n");
+          STR(PROG_NAME), argv[0], "uid <id>", "user <name>", "server-addr <addr>", "-n");
   return 0;
 }
 
 int cmd_server_del(int argc, char **argv) {
-  uint8_t uid       = 0;
-  bool    uid_set   = false;
-  int     err       = -EINVAL;
-  bool    is_server = false;
+  uint8_t     uid         = 0;
+  bool        uid_set     = false;
+  int         err         = -EINVAL;
+  bool        is_server   = false;
+  const char *server_addr = NULL;
 
   if (help)
     goto usage;
@@ -1259,6 +1777,11 @@ int cmd_server_del(int argc, char **argv) {
 
       try(string2uid(argv[i], &uid));
       uid_set = true;
+    } else if (matches(tok, "server-addr")) {
+      if (++i >= argc)
+        goto usage;
+
+      server_addr = argv[i];
     } else if (is_help_kw(tok)) {
       goto usage;
     } else {
@@ -1283,11 +1806,15 @@ int cmd_server_del(int argc, char **argv) {
     goto err_cleanup;
   }
 
-  try2(delete_user_info_map(uid), _("netlink delete user info failed: %s"), strerrno);
+  struct user_key key = {.uid = uid};
+  if (server_addr)
+    try2(resolve_ip_addr(family, server_addr, &key.address));
+
+  try2(delete_user_info_map(&key), _("netlink delete user info failed: %s"), strerrno);
 
   char *uidstr = NULL;
   try2(uid2string(uid, &uidstr, 0), "uid2string: %s", strret);
-  log_info("server deleted: %s", uidstr);
+  log_deferred("server deleted: %s", uidstr);
   free(uidstr);
 
   err = 0;
@@ -1297,22 +1824,44 @@ err_cleanup:
 
 #define CMD_STATUS_SUMMARY "Display the current status and active sessions"
 
+static const char *const reason_names[__TUTU_REASON_MAX] = {
+  [TUTU_REASON_NONE]            = "none",
+  [TUTU_REASON_BAD_LENGTH]      = "bad-length",
+  [TUTU_REASON_NO_SESSION]      = "no-session",
+  [TUTU_REASON_SESSION_EXPIRED] = "session-expired",
+  [TUTU_REASON_UID_NOT_FOUND]   = "uid-not-found",
+  [TUTU_REASON_ADDR_MISMATCH]   = "addr-mismatch",
+  [TUTU_REASON_SESSION_UPDATE]  = "session-update",
+  [TUTU_REASON_PEER_NOT_FOUND]  = "peer-not-found",
+  [TUTU_REASON_GSO]             = "gso",
+  [TUTU_REASON_FRAGMENTED]      = "fragmented",
+  [TUTU_REASON_NO_UDP_CSUM]     = "udp-csum",
+  [TUTU_REASON_NOT_WRITABLE]    = "not-writable",
+  [TUTU_REASON_CSUM]            = "csum-offload",
+};
+
 static int print_status_usage(int argc, char *argv[]) {
   (void) argc;
 
-  fprintf(stderr,
-          "Usage: %s %s [OPTIONS] [debug]\n\n"
+  fprintf(g_err,
+          "Usage: %s %s [OPTIONS] [debug] [user UID] [address ADDR[/PREFIX]] [port PORT] [count]\n\n"
 
           "  " CMD_STATUS_SUMMARY ".\n\n"
 
           "Arguments:\n"
-          "  %-22s Optional: If specified, displays detailed debugging information.\n\n"
+          "  %-22s Optional: If specified, displays detailed debugging information.\n"
+          "  %-22s Optional: Only show peers and sessions of this user.\n"
+          "  %-22s Optional: Only show peers and sessions whose remote address is in this prefix.\n"
+          "  %-22s Optional: Only show peers and sessions using this UDP port.\n"
+          "  %-22s Optional: Only print the number of matching peers and sessions.\n\n"
+
+          "  Filters are evaluated by the kernel module, only matching entries are transferred.\n\n"
 
           "Options:\n"
           "  %-22s Display UID as a number instead of resolving it to a username"
           " in command output. \n",
 
-          STR(PROG_NAME), argv[0], "debug", "-n");
+          STR(PROG_NAME), argv[0], "debug", "user UID", "address ADDR[/PREFIX]", "port PORT", "count", "-n");
   return 0;
 }
 
@@ -1320,8 +1869,8 @@ static void print_comment(const char *comment, size_t comment_len, int dsl) {
   if (!comment[0])
     return;
 
-  printf(dsl ? " comment " : ", Comment: ");
-  printf("%.*s", (int) comment_len, comment);
+  fprintf(g_out, dsl ? " comment " : ", Comment: ");
+  fprintf(g_out, "%.*s", (int) comment_len, comment);
 }
 
 static int get_boot_seconds(__u64 *seconds) {
@@ -1379,23 +1928,31 @@ static int print_user_info_cb(void *entry_ptr, void *user_data) {
   char           *uidstr = NULL;
 
   if (ipv6_ntop(ipstr, &in6) < 0) {
-    fprintf(stderr, "ipv6_ntop failed: %s\n", strerror(errno));
+    fprintf(g_err, "ipv6_ntop failed: %s\n", strerror(errno));
     return 0;
   }
 
-  if (uid2string(u_info->key, &uidstr, 0) < 0) {
-    fprintf(stderr, "uid2string failed: %s\n", strerror(errno));
+  if (uid2string(u_info->key.uid, &uidstr, 0) < 0) {
+    fprintf(g_err, "uid2string failed: %s\n", strerror(errno));
     return 0;
   }
 
-  printf("  %s, Address: %s, Dport: %u, ICMP: %u", uidstr, ipstr, ntohs(u_info->value.dport), ntohs(u_info->value.icmp_id));
+  fprintf(g_out, "  %s, Address: %s, Dport: %u, ICMP: %u", uidstr, ipstr, ntohs(u_info->value.dport),
+          ntohs(u_info->value.icmp_id));
   free(uidstr);
 
+  if (!IN6_IS_ADDR_UNSPECIFIED(&u_info->key.address)) {
+    char srvstr[INET6_ADDRSTRLEN];
+
+    if (ipv6_ntop(srvstr, &u_info->key.address) == 0)
+      fprintf(g_out, ", Server: %s", srvstr);
+  }
+
   if (u_info->value.xor_key_len)
-    printf(", with xor key");
+    fprintf(g_out, ", with xor key");
 
   print_comment((const char *) u_info->value.comment, sizeof(u_info->value.comment), 0);
-  printf("\n");
+  fprintf(g_out, "\n");
 
   return 0;
 }
@@ -1421,9 +1978,9 @@ static int print_session_cb(void *entry_ptr, void *user_data) {
   }
 
   /* 打印逻辑 */
-  printf("  Address: %s, SPort: %u, DPort: %u => %s, Age: %llu, Client Sport: %u\n", ipstr, ntohs(sess->key.sport),
-         ntohs(sess->key.dport), uidstr, (unsigned long long) sess->value.age, /* 强转以匹配 %llu */
-         ntohs(sess->value.client_sport));
+  fprintf(g_out, "  Address: %s, SPort: %u, DPort: %u => %s, Age: %llu, Client Sport: %u\n", ipstr, ntohs(sess->key.sport),
+                 ntohs(sess->key.dport), uidstr, (unsigned long long) sess->value.age, /* 强转以匹配 %llu */
+                 ntohs(sess->value.client_sport));
 
   free(uidstr);
 
@@ -1440,23 +1997,23 @@ static int print_egress_peer_cb(void *entry_ptr, void *user_data) {
     char           *uidstr = NULL;
 
     if (ipv6_ntop(ipstr, &in6) < 0) {
-      fprintf(stderr, "ipv6_ntop failed: %s\n", strerror(errno));
+      fprintf(g_err, "ipv6_ntop failed: %s\n", strerror(errno));
       return 0;
     }
 
     if (uid2string(egress->value.uid, &uidstr, 0) < 0) {
-      fprintf(stderr, "uid2string failed: %s\n", strerror(errno));
+      fprintf(g_err, "uid2string failed: %s\n", strerror(errno));
       return 0;
     }
 
-    printf("  %s, Address: %s, Port: %u", uidstr, ipstr, ntohs(egress->key.port));
+    fprintf(g_out, "  %s, Address: %s, Port: %u", uidstr, ipstr, ntohs(egress->key.port));
     free(uidstr);
 
     if (egress->value.xor_key_len)
-      printf(", with xor key");
+      fprintf(g_out, ", with xor key");
 
     print_comment((const char *) egress->value.comment, sizeof(egress->value.comment), 0);
-    printf("\n");
+    fprintf(g_out, "\n");
 
     (*cnt)++;
   }
@@ -1464,6 +2021,65 @@ static int print_egress_peer_cb(void *entry_ptr, void *user_data) {
   return 0;
 }
 
+static void print_traffic(const struct tutu_traffic_stats *st) {
+  fprintf(g_out, "    RX: %llu packets (%llu bytes), %llu dropped\n", st->rx_packets, st->rx_bytes, st->rx_dropped);
+  fprintf(g_out, "    TX: %llu packets (%llu bytes), %llu dropped\n", st->tx_packets, st->tx_bytes, st->tx_dropped);
+}
+
+static int print_user_stats_cb(void *entry_ptr, void *user_data) {
+  (void) user_data;
+  struct tutu_user_stats *us     = entry_ptr;
+  char                   *uidstr = NULL;
+
+  if (uid2string(us->key.uid, &uidstr, 0) < 0) {
+    fprintf(g_err, "uid2string failed: %s\n", strerror(errno));
+    return 0;
+  }
+
+  fprintf(g_out, "  %s", uidstr);
+  free(uidstr);
+
+  if (!IN6_IS_ADDR_UNSPECIFIED(&us->key.address)) {
+    char srvstr[INET6_ADDRSTRLEN];
+
+    if (ipv6_ntop(srvstr, &us->key.address) == 0)
+      fprintf(g_out, ", Server: %s", srvstr);
+  }
+  fprintf(g_out, ":\n");
+  print_traffic(&us->stats);
+
+  return 0;
+}
+
+/* egress peer 只有发送计数；同一地址和 UID 的接收计数汇总在一条 ingress peer 记录上 */
+static int print_peer_stats_cb(void *entry_ptr, void *user_data) {
+  (void) user_data;
+  struct tutu_peer_stats *ps = entry_ptr;
+  char                    ipstr[INET6_ADDRSTRLEN];
+  char                   *uidstr = NULL;
+
+  if (ipv6_ntop(ipstr, &ps->key.address) < 0) {
+    fprintf(g_err, "ipv6_ntop failed: %s\n", strerror(errno));
+    return 0;
+  }
+
+  if (uid2string(ps->uid, &uidstr, 0) < 0) {
+    fprintf(g_err, "uid2string failed: %s\n", strerror(errno));
+    return 0;
+  }
+
+  fprintf(g_out, "  %s, Address: %s, Port: %u%s:\n", uidstr, ipstr, ntohs(ps->key.port), ps->ingress ? " (ingress)" : "");
+  free(uidstr);
+  if (ps->ingress)
+    fprintf(g_out, "    RX: %llu packets (%llu bytes), %llu dropped\n", ps->stats.rx_packets, ps->stats.rx_bytes,
+            ps->stats.rx_dropped);
+  else
+    fprintf(g_out, "    TX: %llu packets (%llu bytes), %llu dropped\n", ps->stats.tx_packets, ps->stats.tx_bytes,
+            ps->stats.tx_dropped);
+
+  return 0;
+}
+
 static int print_ingress_peer_cb(void *entry_ptr, void *user_data) {
   (void) user_data;
   struct tutu_ingress *ingress = entry_ptr;
@@ -1472,24 +2088,65 @@ static int print_ingress_peer_cb(void *entry_ptr, void *user_data) {
   char *uidstr = NULL;
 
   if (ipv6_ntop(ipstr, &ingress->key.address) < 0) {
-    fprintf(stderr, "ipv6_ntop failed: %s\n", strerror(errno));
+    fprintf(g_err, "ipv6_ntop failed: %s\n", strerror(errno));
     return 0;
   }
 
   if (uid2string(ingress->key.uid, &uidstr, 0) < 0) {
-    fprintf(stderr, "uid2string failed: %s\n", strerror(errno));
+    fprintf(g_err, "uid2string failed: %s\n", strerror(errno));
     return 0;
   }
 
-  printf("  %s, Address: %s => Sport: %u%s\n", uidstr, ipstr, ntohs(ingress->value.port),
-         ingress->value.xor_key_len ? ", with xor key" : "");
+  fprintf(g_out, "  %s, Address: %s => Sport: %u%s\n", uidstr, ipstr, ntohs(ingress->value.port),
+                 ingress->value.xor_key_len ? ", with xor key" : "");
 
   free(uidstr);
   return 0;
 }
 
+/* ADDR[/PREFIX]；IPv4 的前缀长度换算为 v4-mapped 地址上的长度 */
+static int parse_addr_prefix(const char *arg, struct in6_addr *addr, __u8 *prefix_len) {
+  char          buf[256];
+  char         *slash, *end;
+  unsigned long len = 128;
+  int           err;
+
+  snprintf(buf, sizeof(buf), "%s", arg);
+  slash = strrchr(buf, '/');
+  if (slash) {
+    *slash = '\0';
+    errno  = 0;
+    len    = strtoul(slash + 1, &end, 10);
+    if (errno || end == slash + 1 || *end) {
+      log_error("invalid prefix length: %s", slash + 1);
+      return -EINVAL;
+    }
+  }
+
+  err = resolve_ip_addr(family, buf, addr);
+  if (err)
+    return err;
+
+  if (IN6_IS_ADDR_V4MAPPED(addr)) {
+    if (slash && len > 32) {
+      log_error("invalid IPv4 prefix length: %lu", len);
+      return -EINVAL;
+    }
+    len = slash ? len + 96 : 128;
+  } else if (len > 128) {
+    log_error("invalid IPv6 prefix length: %lu", len);
+    return -EINVAL;
+  }
+
+  *prefix_len = len;
+  return 0;
+}
+
 int cmd_status(int argc, char **argv) {
-  int err = 0;
+  struct tutu_dump_filter  filter = {};
+  struct tutu_dump_filter *fp     = NULL;
+  bool                     count  = false;
+  int                      err    = 0;
 
   if (help)
     goto usage;
@@ -1499,6 +2156,26 @@ int cmd_status(int argc, char **argv) {
 
     if (matches(tok, "debug")) {
       debug = 1;
+    } else if (is_user_kw(tok)) {
+      if (++i >= argc)
+        goto usage;
+      try(string2uid(argv[i], &filter.uid));
+      filter.flags |= TUTU_DUMP_FILTER_UID;
+    } else if (is_address_kw(tok)) {
+      if (++i >= argc)
+        goto usage;
+      try(parse_addr_prefix(argv[i], &filter.address, &filter.prefix_len));
+      filter.flags |= TUTU_DUMP_FILTER_ADDR;
+    } else if (matches(tok, "port")) {
+      uint16_t port;
+
+      if (++i >= argc)
+        goto usage;
+      try(parse_port(argv[i], &port));
+      filter.port = htons(port);
+      filter.flags |= TUTU_DUMP_FILTER_PORT;
+    } else if (matches(tok, "count")) {
+      count = true;
     } else if (is_help_kw(tok)) {
       goto usage;
     } else {
@@ -1512,46 +2189,72 @@ int cmd_status(int argc, char **argv) {
   try2(init_tutuicmptunnel(), _("open tutuicmptunnel device: %s"), strerrno);
   try2(get_config_map(&cfg), _("get_config_map: %s"), strerrno);
 
-  printf("%s: Role: %s\n\n", STR(PROJECT_NAME), cfg.is_server ? "Server" : "Client");
+  fprintf(g_out, "%s: Role: %s\n\n", STR(PROJECT_NAME), cfg.is_server ? "Server" : "Client");
+
+  if (filter.flags)
+    fp = &filter;
+
+  if (count) {
+    __u32 n = 0;
+
+    try2(count_entries(cfg.is_server ? TUTU_CMD_GET_USER_INFO : TUTU_CMD_GET_EGRESS, fp, &n), _("count peers: %s"), strerrno);
+    fprintf(g_out, "Peers: %u\n", n);
+    if (cfg.is_server) {
+      try2(count_entries(TUTU_CMD_GET_SESSION, fp, &n), _("count sessions: %s"), strerrno);
+      fprintf(g_out, "Sessions: %u\n", n);
+    }
+    err = 0;
+    goto err_cleanup;
+  }
 
   print_ifnames();
 
   if (cfg.is_server) {
-    printf("Peers:\n");
+    fprintf(g_out, "Peers:\n");
     // 打印所有peer
 
-    if (foreach_user_info(print_user_info_cb, NULL) < 0) {
+    if (foreach_user_info(fp, print_user_info_cb, NULL) < 0) {
       log_error("netlink user_info first key failed: %s", strerrno);
     }
 
+    fprintf(g_out, "\nTraffic:\n");
+    if (foreach_user_stats(fp, print_user_stats_cb, NULL) < 0) {
+      log_error(_("dump user stats failed: %s"), strerrno);
+    }
+
     if (debug) {
       __u64 boot = 0;
 
       try2(get_boot_seconds(&boot), _("failed to get boot seconds: %s"), strret);
-      printf("\nSessions (max age: %u, current: %llu):\n", cfg.session_max_age, boot);
-      if (foreach_session(print_session_cb, NULL) < 0) {
+      fprintf(g_out, "\nSessions (max age: %u, current: %llu):\n", cfg.session_max_age, boot);
+      if (foreach_session(fp, print_session_cb, NULL) < 0) {
         log_error("netlink session first key failed: %s", strerrno);
       }
     }
   } else { /* client 角色 */
     int cnt = 0;
 
-    printf("Client Peers: \n");
+    fprintf(g_out, "Client Peers: \n");
 
-    if (foreach_egress(print_egress_peer_cb, &cnt) < 0) {
+    if (foreach_egress(fp, print_egress_peer_cb, &cnt) < 0) {
       /* 对应原来的 log_error */
       log_error(_("dump egress peers failed: %s"), strerror(errno));
     }
 
     /* 如果回调一次没跑，或者跑了但没符合条件的，cnt 依然是 0 */
     if (!cnt) {
-      printf("No peer configure\n");
+      fprintf(g_out, "No peer configure\n");
+    } else {
+      fprintf(g_out, "\nTraffic:\n");
+      if (foreach_peer_stats(fp, print_peer_stats_cb, NULL) < 0) {
+        log_error(_("dump peer stats failed: %s"), strerrno);
+      }
     }
 
     if (debug) {
-      printf("\nIngress peers:\n");
+      fprintf(g_out, "\nIngress peers:\n");
 
-      if (foreach_ingress(print_ingress_peer_cb, NULL) < 0) {
+      if (foreach_ingress(fp, print_ingress_peer_cb, NULL) < 0) {
         log_error(_("dump ingress peers failed: %s"), strerror(errno));
       }
     }
@@ -1560,14 +2263,22 @@ int cmd_status(int argc, char **argv) {
   if (debug) {
     struct tutu_stats stats;
 
-    printf("\nPackets:\n");
+    fprintf(g_out, "\nPackets:\n");
 
     try2(get_stats_map(&stats), _("get_stats_map: %s"), strerrno);
-    printf("  processed:   %8llu\n", stats.packets_processed);
-    printf("  dropped:     %8llu\n", stats.packets_dropped);
-    printf("  cksum error: %8llu\n", stats.checksum_errors);
-    printf("  fragmented:  %8llu\n", stats.fragmented);
-    printf("  GSO:         %8llu\n", stats.gso);
+    fprintf(g_out, "  processed:   %8llu (%llu bytes)\n", stats.packets_processed, stats.bytes_processed);
+    fprintf(g_out, "  dropped:     %8llu (%llu bytes)\n", stats.packets_dropped, stats.bytes_dropped);
+    fprintf(g_out, "  cksum error: %8llu\n", stats.checksum_errors);
+    fprintf(g_out, "  fragmented:  %8llu\n", stats.fragmented);
+    fprintf(g_out, "  GSO:         %8llu\n", stats.gso);
+    fprintf(g_out, "  reassembled: %8llu (%llu bytes)\n", stats.reassembled, stats.reassembled_bytes);
+    fprintf(g_out, "  frag memory: %8llu bytes\n", stats.frag_mem);
+
+    fprintf(g_out, "\nReasons:\n");
+    for (int i = TUTU_REASON_NONE + 1; i < __TUTU_REASON_MAX; i++) {
+      if (stats.reasons[i])
+        fprintf(g_out, "  %-16s %8llu (%s)\n", reason_names[i], stats.reasons[i], i >= TUTU_REASON_GSO ? "drop" : "bypass");
+    }
   }
 
   err = 0;
@@ -1575,12 +2286,273 @@ err_cleanup:
   return err;
 }
 
+#define CMD_LATENCY_SUMMARY "Display hook processing time histograms"
+
+static int print_latency_usage(int argc, char *argv[]) {
+  (void) argc;
+
+  fprintf(g_err,
+          "Usage: %s %s [clear]\n\n"
+
+          "  " CMD_LATENCY_SUMMARY ".\n\n"
+
+          "  Sampling is off by default, enable it with:\n"
+          "    echo 1 > /sys/module/tutuicmptunnel/parameters/latency_stats\n\n"
+
+          "Arguments:\n"
+          "  %-22s Optional: Reset the histograms instead of displaying them.\n",
+
+          STR(PROG_NAME), argv[0], "clear");
+  return 0;
+}
+
+#define LATENCY_BAR_WIDTH 40
+
+static void print_latency_hist(const struct tutu_latency *lat, int hist) {
+  static const char bar[] = "########################################";
+  const __u64 *buckets = lat->buckets[hist];
+  __u64        count = 0, max = 0;
+  int          first = -1, last = -1;
+
+  for (int b = 0; b < TUTU_LAT_BUCKETS; b++) {
+    if (!buckets[b])
+      continue;
+    if (first < 0)
+      first = b;
+    last = b;
+    count += buckets[b];
+    if (buckets[b] > max)
+      max = buckets[b];
+  }
+
+  if (!count)
+    return;
+
+  fprintf(g_out, "\n%s %s%s: %llu packets, avg %llu ns\n", hist & TUTU_LAT_INDEX(1, 0, 0) ? "ingress" : "egress",
+                 hist & TUTU_LAT_INDEX(0, 1, 0) ? "server" : "client", hist & TUTU_LAT_INDEX(0, 0, 1) ? " xor" : "", count,
+                 lat->sum_ns[hist] / count);
+
+  for (int b = first; b <= last; b++) {
+    int width = (int) (buckets[b] * LATENCY_BAR_WIDTH / max);
+
+    if (b == TUTU_LAT_BUCKETS - 1)
+      fprintf(g_out, "  [%10llu,        inf) ns %10llu |%.*s\n", 1ULL << b, buckets[b], width, bar);
+    else
+      fprintf(g_out, "  [%10llu, %10llu) ns %10llu |%.*s\n", b ? 1ULL << b : 0ULL, 1ULL << (b + 1), buckets[b], width, bar);
+  }
+}
+
+int cmd_latency(int argc, char **argv) {
+  int                  err   = 0;
+  int                  clear = 0;
+  struct tutu_latency *lat   = NULL;
+
+  if (help)
+    goto usage;
+
+  for (int i = 1; i < argc; ++i) {
+    const char *tok = argv[i];
+
+    if (matches(tok, "clear")) {
+      clear = 1;
+    } else if (is_help_kw(tok)) {
+      goto usage;
+    } else {
+      log_error("unknown keyword \"%s\"", tok);
+    usage:
+      return print_latency_usage(argc, argv), -EINVAL;
+    }
+  }
+
+  try2(init_tutuicmptunnel(), _("open tutuicmptunnel device: %s"), strerrno);
+
+  if (clear) {
+    try2(clear_latency(), _("clear latency: %s"), strerrno);
+    goto err_cleanup;
+  }
+
+  lat = calloc(1, sizeof(*lat));
+  if (!lat) {
+    err = -ENOMEM;
+    goto err_cleanup;
+  }
+
+  try2(get_latency(lat), _("get latency: %s"), strerrno);
+  fprintf(g_out, "Latency sampling: %s\n", lat->enabled ? "enabled" : "disabled");
+
+  for (int h = 0; h < TUTU_LAT_HISTS; h++)
+    print_latency_hist(lat, h);
+
+  err = 0;
+err_cleanup:
+  free(lat);
+  return err;
+}
+
+#define CMD_MONITOR_SUMMARY "Print session and peer change events as they happen"
+
+static int print_monitor_usage(int argc, char *argv[]) {
+  (void) argc;
+
+  fprintf(g_err,
+          "Usage: %s %s [OPTIONS]\n\n"
+
+          "  " CMD_MONITOR_SUMMARY ".\n\n"
+
+          "  Events are batched by the kernel and delivered about every %d ms.\n\n"
+
+          "Options:\n"
+          "  %-22s Display UID as a number instead of resolving it to a username"
+          " in command output. \n",
+
+          STR(PROG_NAME), argv[0], TUTU_EVENT_DELAY_MS, "-n");
+  return 0;
+}
+
+static const char *event_type_name(__u8 type) {
+  switch (type) {
+  case TUTU_EVENT_SESSION_CREATE:
+    return "session-create";
+  case TUTU_EVENT_SESSION_EXPIRE:
+    return "session-expire";
+  case TUTU_EVENT_SESSION_DELETE:
+    return "session-delete";
+  case TUTU_EVENT_USER_ICMP_ID:
+    return "user-icmp-id";
+  case TUTU_EVENT_USER_UPDATE:
+    return "user-update";
+  case TUTU_EVENT_USER_DELETE:
+    return "user-delete";
+  case TUTU_EVENT_PEER_UPDATE:
+    return "peer-update";
+  case TUTU_EVENT_PEER_DELETE:
+    return "peer-delete";
+  default:
+    return "unknown";
+  }
+}
+
+static void print_event(const struct tutu_event *ev) {
+  char      ipstr[INET6_ADDRSTRLEN];
+  char      timestr[32];
+  char     *uidstr = NULL;
+  time_t    sec    = (time_t) (ev->timestamp / 1000000000ULL);
+  struct tm tm;
+
+  if (ipv6_ntop(ipstr, &ev->address) < 0)
+    snprintf(ipstr, sizeof(ipstr), "?");
+  if (!localtime_r(&sec, &tm) || !strftime(timestr, sizeof(timestr), "%H:%M:%S", &tm))
+    snprintf(timestr, sizeof(timestr), "?");
+  uid2string(ev->uid, &uidstr, 0);
+
+  fprintf(g_out, "%s.%03llu %-15s %s, Address: %s, Port: %u", timestr, (unsigned long long) (ev->timestamp / 1000000ULL % 1000),
+                 event_type_name(ev->type), uidstr ? uidstr : "?", ipstr, ntohs(ev->port));
+
+  switch (ev->type) {
+  case TUTU_EVENT_USER_ICMP_ID:
+    fprintf(g_out, ", ICMP ID: %u -> %u", ntohs(ev->old_icmp_id), ntohs(ev->icmp_id));
+    break;
+  case TUTU_EVENT_SESSION_CREATE:
+  case TUTU_EVENT_SESSION_EXPIRE:
+  case TUTU_EVENT_SESSION_DELETE:
+  case TUTU_EVENT_USER_UPDATE:
+    fprintf(g_out, ", ICMP ID: %u", ntohs(ev->icmp_id));
+    break;
+  default:
+    break;
+  }
+
+  fprintf(g_out, "\n");
+  free(uidstr);
+}
+
+static int monitor_cb(const struct nlmsghdr *nlh, void *data) {
+  struct nlattr *attr;
+
+  (void) data;
+
+  mnl_attr_for_each(attr, nlh, sizeof(struct genlmsghdr)) {
+    switch (mnl_attr_get_type(attr)) {
+    case TUTU_ATTR_EVENT:
+      if (mnl_attr_get_payload_len(attr) == sizeof(struct tutu_event))
+        print_event(mnl_attr_get_payload(attr));
+      break;
+    case TUTU_ATTR_EVENT_LOST:
+      fprintf(g_out, "%u events lost\n", mnl_attr_get_u32(attr));
+      break;
+    default:
+      break;
+    }
+  }
+
+  fflush(g_out);
+  return MNL_CB_OK;
+}
+
+int cmd_monitor(int argc, char **argv) {
+  int  err = 0;
+  char buf[MNL_SOCKET_BUFFER_SIZE];
+
+  if (help)
+    goto usage;
+
+  for (int i = 1; i < argc; ++i) {
+    const char *tok = argv[i];
+
+    if (is_help_kw(tok)) {
+      goto usage;
+    } else {
+      log_error("unknown keyword \"%s\"", tok);
+    usage:
+      return print_monitor_usage(argc, argv), -EINVAL;
+    }
+  }
+
+  /* monitor 不会返回，会让 tuctl_server 之后的所有请求都等下去 */
+  if (g_exec) {
+    log_error("monitor is not available in tuctl_server scripts");
+    return -EOPNOTSUPP;
+  }
+
+  try2(init_tutuicmptunnel(), _("open tutuicmptunnel device: %s"), strerrno);
+  if (!g_mcgrp_events) {
+    log_error(_("kernel module does not provide the \"%s\" multicast group"), TUTU_GENL_MCGRP_EVENTS);
+    err = -EOPNOTSUPP;
+    goto err_cleanup;
+  }
+
+  try2_e(mnl_socket_setsockopt(g_nl, NETLINK_ADD_MEMBERSHIP, &g_mcgrp_events, sizeof(g_mcgrp_events)),
+         _("subscribe to events: %s"), strerrno);
+
+  while (1) {
+    int len = mnl_socket_recvfrom(g_nl, buf, sizeof(buf));
+
+    if (len < 0) {
+      /* 接收缓冲区溢出：内核已丢弃部分消息，继续接收 */
+      if (errno == ENOBUFS) {
+        fprintf(g_out, "receive buffer overrun, some events lost\n");
+        continue;
+      }
+      if (errno == EINTR)
+        continue;
+      err = -errno;
+      log_error(_("receive events: %s"), strerror(errno));
+      goto err_cleanup;
+    }
+
+    try2(mnl_cb_run(buf, len, 0, 0, monitor_cb, NULL), _("parse events: %s"), strerrno);
+  }
+
+err_cleanup:
+  return err;
+}
+
 #define CMD_DUMP_SUMMARY "Dump the current running configuration in a raw format"
 
 static int print_dump_usage(int argc, char *argv[]) {
   (void) argc;
 
-  fprintf(stderr,
+  fprintf(g_err,
           "Usage: %s %s [OPTIONS]\n\n"
 
           "  " CMD_DUMP_SUMMARY ".\n\n"
@@ -1603,31 +2575,38 @@ static int dump_user_info_cb(void *entry_ptr, void *user_data) {
   char           *uidstr = NULL;
 
   if (ipv6_ntop(ipstr, &in6) < 0) {
-    fprintf(stderr, "ipv6_ntop failed: %s\n", strerror(errno));
+    fprintf(g_err, "ipv6_ntop failed: %s\n", strerror(errno));
     return 0;
   }
 
-  if (uid2string(u_info->key, &uidstr, 1) < 0) {
-    fprintf(stderr, "uid2string failed: %s\n", strerror(errno));
+  if (uid2string(u_info->key.uid, &uidstr, 1) < 0) {
+    fprintf(g_err, "uid2string failed: %s\n", strerror(errno));
     return 0;
   }
 
-  printf("server-add "
-         "%s "
-         "addr %s "
-         "icmp-id %u "
-         "port %u",
-         uidstr, ipstr, ntohs(u_info->value.icmp_id), ntohs(u_info->value.dport));
+  fprintf(g_out, "server-add "
+                 "%s "
+                 "addr %s "
+                 "icmp-id %u "
+                 "port %u",
+                 uidstr, ipstr, ntohs(u_info->value.icmp_id), ntohs(u_info->value.dport));
   free(uidstr);
 
+  if (!IN6_IS_ADDR_UNSPECIFIED(&u_info->key.address)) {
+    char srvstr[INET6_ADDRSTRLEN];
+
+    if (ipv6_ntop(srvstr, &u_info->key.address) == 0)
+      fprintf(g_out, " server-addr %s", srvstr);
+  }
+
   if (u_info->value.xor_key_len) {
-    printf(" xor ");
+    fprintf(g_out, " xor ");
     for (int i = 0; i < u_info->value.xor_key_len; i++)
-      printf("%02x", u_info->value.xor_key[i]);
+      fprintf(g_out, "%02x", u_info->value.xor_key[i]);
   }
 
   print_comment((const char *) u_info->value.comment, sizeof(u_info->value.comment), 1);
-  printf("\n");
+  fprintf(g_out, "\n");
 
   return 0;
 }
@@ -1643,30 +2622,30 @@ static int dump_egress_cb(void *entry_ptr, void *user_data) {
     char           *uidstr = NULL;
 
     if (ipv6_ntop(ipstr, &in6) < 0) {
-      fprintf(stderr, "ipv6_ntop failed: %s\n", strerror(errno));
+      fprintf(g_err, "ipv6_ntop failed: %s\n", strerror(errno));
       return 0;
     }
 
     if (uid2string(egress->value.uid, &uidstr, 1) < 0) {
-      fprintf(stderr, "uid2string failed: %s\n", strerror(errno));
+      fprintf(g_err, "uid2string failed: %s\n", strerror(errno));
       return 0;
     }
 
-    printf("client-add "
-           "%s "
-           "addr %s "
-           "port %u",
-           uidstr, ipstr, ntohs(egress->key.port));
+    fprintf(g_out, "client-add "
+                   "%s "
+                   "addr %s "
+                   "port %u",
+                   uidstr, ipstr, ntohs(egress->key.port));
     free(uidstr);
 
     if (egress->value.xor_key_len) {
-      printf(" xor ");
+      fprintf(g_out, " xor ");
       for (int i = 0; i < egress->value.xor_key_len; i++)
-        printf("%02x", egress->value.xor_key[i]);
+        fprintf(g_out, "%02x", egress->value.xor_key[i]);
     }
 
     print_comment((const char *) egress->value.comment, sizeof(egress->value.comment), 1);
-    printf("\n");
+    fprintf(g_out, "\n");
   }
   return 0;
 }
@@ -1700,21 +2679,21 @@ int cmd_dump(int argc, char **argv) {
     strftime(buf, sizeof(buf), "%F %T %Z", &tm);
     buf[sizeof(buf) - 1] = '\0';
 
-    printf("#!%s/sbin/ktuctl script -\n", STR(INSTALL_PREFIX_DIR));
-    printf("# Auto-generated by \"ktuctl dump\" on %s\n\n", buf);
+    fprintf(g_out, "#!%s/sbin/ktuctl script -\n", STR(INSTALL_PREFIX_DIR));
+    fprintf(g_out, "# Auto-generated by \"ktuctl dump\" on %s\n\n", buf);
   }
 
   if (cfg.is_server) {
-    printf("server max-age %u\n\n", cfg.session_max_age);
+    fprintf(g_out, "server max-age %u\n\n", cfg.session_max_age);
 
-    if (foreach_user_info(dump_user_info_cb, NULL) < 0) {
+    if (foreach_user_info(NULL, dump_user_info_cb, NULL) < 0) {
       log_error("dump user info failed: %s", strerrno);
     }
 
   } else {
-    printf("client\n");
+    fprintf(g_out, "client\n");
 
-    if (foreach_egress(dump_egress_cb, NULL) < 0) {
+    if (foreach_egress(NULL, dump_egress_cb, NULL) < 0) {
       log_error("dump egress failed: %s", strerrno);
     }
   }
@@ -1726,6 +2705,7 @@ err_cleanup:
 
 #define CMD_REAPER_SUMMARY "Cleanup stale NAT sessions"
 #define CMD_SCRIPT_SUMMARY "Execute a batch of commands from a file or standard input"
+#define CMD_SNAPSHOT_SUMMARY "Save or restore the complete module state in a binary snapshot"
 
 // clang-format off
 static subcommand_t subcommands[] = {
@@ -1739,19 +2719,22 @@ static subcommand_t subcommands[] = {
   { "server-del", cmd_server_del, CMD_SERVER_DEL_SUMMARY, },
   { "reaper", cmd_reaper, CMD_REAPER_SUMMARY, },
   { "status", cmd_status, CMD_STATUS_SUMMARY, },
+  { "latency", cmd_latency, CMD_LATENCY_SUMMARY, },
+  { "monitor", cmd_monitor, CMD_MONITOR_SUMMARY, },
   { "version", cmd_version, "Show program version", },
   { "dump", cmd_dump, CMD_DUMP_SUMMARY, },
   { "script", cmd_script, CMD_SCRIPT_SUMMARY, },
+  { "snapshot", cmd_snapshot, CMD_SNAPSHOT_SUMMARY, },
   { "help", cmd_help, "Show this help message"},
   {NULL, NULL, NULL},
 };
 // clang-format on
 
 static void print_help_usage(void) {
-  printf("Usage: %s <subcommand> [options]\n", STR(PROG_NAME));
-  printf("Subcommands:\n");
+  fprintf(g_out, "Usage: %s <subcommand> [options]\n", STR(PROG_NAME));
+  fprintf(g_out, "Subcommands:\n");
   for (int i = 0; subcommands[i].name; ++i) {
-    printf("  %-10s  %s\n", subcommands[i].name, subcommands[i].desc);
+    fprintf(g_out, "  %-10s  %s\n", subcommands[i].name, subcommands[i].desc);
   }
 }
 
@@ -1770,35 +2753,93 @@ int dispatch(int argc, char **argv) {
 
 static int print_script_usage(int argc, char **argv) {
   (void) argc;
-  fprintf(stderr,
-          "Usage: %s %s [<file>|-]\n\n"
+  fprintf(g_err,
+          "Usage: %s %s [atomic] [<file>|-]\n\n"
 
           "  " CMD_SCRIPT_SUMMARY ".\n\n"
 
           "Arguments:\n"
+          "  %-22s Stage all config/peer/user changes and apply them together only if every command succeeds.\n"
           "  %-22s The path to a script file containing commands to be executed.\n"
           "  %-22s If specified, commands will be read from standard input (stdin).\n\n",
 
-          STR(PROG_NAME), argv[0], "<file>", "-");
+          STR(PROG_NAME), argv[0], "atomic", "<file>", "-");
   return 0;
 }
 
-extern int   script_parse(void);
-extern FILE *script_in;
-extern void  script_lex_destroy(void);
-extern int   script_exit_code;
+/* 执行 fp 中的脚本，不关闭 fp；atomic 时所有修改在一个内核事务中提交 */
+static int run_script(FILE *fp, bool atomic) {
+  bool persist = g_persist;
+  int  err     = 0;
+
+  g_persist = true;
+  if (atomic) {
+    try2(init_tutuicmptunnel(), _("open tutuicmptunnel device: %s"), strerrno);
+    try2(send_simple_cmd(TUTU_CMD_TXN_BEGIN, 0, NULL, 0, 0), _("begin transaction: %s"), strerrno);
+    g_txn = true;
+  }
+
+  script_in        = fp;
+  script_lineno    = 1;
+  script_exit_code = 0;
+  err              = script_parse();
+
+  if (err) {
+    log_error("Script execution aborted due to %s.", err == 1 ? "syntax error" : "memory exhaustion");
+    err = -1;
+    goto err_cleanup;
+  }
+
+  /* 先收齐流水线中的 ack，失败的命令会更新 script_exit_code */
+  try2(pipeline_flush(), _("netlink: %s"), strerrno);
+  err = script_exit_code;
+  if (g_txn && !err) {
+    g_txn = false;
+    try2(send_simple_cmd(TUTU_CMD_TXN_COMMIT, 0, NULL, 0, 0), _("commit transaction: %s"), strerrno);
+  }
+err_cleanup:
+  pipeline_flush();
+  if (g_txn) {
+    /* 任一命令失败：丢弃暂存的修改，内核状态保持不变 */
+    g_txn = false;
+    log_error("Discarding staged changes.");
+    send_simple_cmd(TUTU_CMD_TXN_ABORT, 0, NULL, 0, 0);
+  }
+  g_persist = persist;
+  if (!g_persist) {
+    g_cfg_cached = false;
+    user_cache_free();
+    free(g_pipe.buf);
+    g_pipe.buf = NULL;
+  }
+  script_lex_destroy();
+
+  return err;
+}
 
 int cmd_script(int argc, char **argv) {
-  FILE       *fp   = NULL;
-  const char *path = "-";
-  int         err  = 0;
+  FILE       *fp     = NULL;
+  const char *path   = "-";
+  bool        atomic = false;
+  int         first  = 1, err = 0;
+
+  if (argc >= 2 && !strcmp(argv[1], "atomic")) {
+    atomic = true;
+    first  = 2;
+  }
 
-  if (help || argc > 2) {
+  /* 事务不能嵌套：atomic 脚本中不能再执行 script atomic */
+  if (help || argc > first + 1 || (atomic && g_txn)) {
     return print_script_usage(argc, argv), -EINVAL;
   }
 
-  if (argc == 2) {
-    path = argv[1];
+  if (argc == first + 1) {
+    path = argv[first];
+  }
+
+  if (g_exec && !strcmp(path, "-")) {
+    log_error("script: reading from stdin is not available in tuctl_server scripts");
+    return -EINVAL;
   }
 
   // 打开文件
@@ -1808,21 +2849,9 @@ int cmd_script(int argc, char **argv) {
     fp = try2_p(fopen(path, "r"), "fopen: %s", strret);
   }
 
-  script_in = fp;
-
-  script_exit_code = 0;
-  err              = script_parse();
-
-  if (err) {
-    log_error("Script execution aborted due to %s.", err == 1 ? "syntax error" : "memory exhaustion");
-    err = -1;
-    goto err_cleanup;
-  }
+  err = run_script(fp, atomic);
 
-  err = script_exit_code;
 err_cleanup:
-  script_lex_destroy();
-
   if (fp && fp != stdin) {
     fclose(fp);
   }
@@ -1839,7 +2868,7 @@ static __u64 get_monotonic_seconds(void) {
 static int print_reaper_usage(int argc, char *argv[]) {
   (void) argc;
 
-  fprintf(stderr,
+  fprintf(g_err,
           "Usage: %s %s [OPTIONS]\n\n"
 
           "  " CMD_REAPER_SUMMARY ".\n\n"
@@ -1854,15 +2883,6 @@ static int print_reaper_usage(int argc, char *argv[]) {
   return 0;
 }
 
-static int delete_session_map(const struct session_key *key) {
-  /* 构造一个包含 Key 的完整结构体 */
-  struct tutu_session sess = {
-    .key = *key,
-  };
-  /* 发送 DELETE_SESSION 命令 */
-  return send_simple_cmd(TUTU_CMD_DELETE_SESSION, TUTU_ATTR_SESSION, &sess, sizeof(sess), 0);
-}
-
 /* 用于暂存待删除 Session Key 的节点 */
 struct reap_node {
   struct session_key key;
@@ -1895,8 +2915,8 @@ static int reap_session_cb(void *entry_ptr, void *user_data) {
       return 0;
     uid2string(sess->value.uid, &uidstr, 0);
 
-    printf("Reaping old entry: Address: %s, DPort: %u, SPort: %u, %s, Age: %llu\n", ipstr, ntohs(sess->key.dport),
-           ntohs(sess->key.sport), uidstr ? uidstr : "?", (unsigned long long) age);
+    fprintf(g_out, "Reaping old entry: Address: %s, DPort: %u, SPort: %u, %s, Age: %llu\n", ipstr, ntohs(sess->key.dport),
+                   ntohs(sess->key.sport), uidstr ? uidstr : "?", (unsigned long long) age);
 
     free(uidstr);
 
@@ -1933,6 +2953,8 @@ int cmd_reaper(int argc, char **argv) {
   struct reap_ctx ctx = {
     .now = now,
   };
+  struct tutu_session *sessions = NULL;
+  int                 *results  = NULL;
 
   /* 立即初始化链表头 */
   INIT_LIST_HEAD(&ctx.reap_list);
@@ -1944,32 +2966,51 @@ int cmd_reaper(int argc, char **argv) {
   /* 获取配置成功后，更新 max_age */
   ctx.max_age = cfg.session_max_age;
 
-  /* 1. 第一阶段：Dump 并收集 (Mark) */
-  if (foreach_session(reap_session_cb, &ctx) < 0) {
+  /* 1. 第一阶段：Dump 并收集 (Mark)，由内核只返回空闲超过 max_age 的会话 */
+  struct tutu_dump_filter filter = {
+    .flags   = TUTU_DUMP_FILTER_AGE,
+    .min_age = (__u64) cfg.session_max_age + 1,
+    .max_age = UINT64_MAX,
+  };
+
+  if (foreach_session(&filter, reap_session_cb, &ctx) < 0) {
     log_error("dump sessions failed: %s", strerrno);
   }
 
-  /* 2. 第二阶段：遍历链表并删除 (Sweep) */
+  /* 2. 第二阶段：批量删除 (Sweep)，每 TUTU_BATCH_MAX 个条目一次系统调用 */
   if (ctx.count > 0) {
     log_info("Found %d expired sessions, deleting...", ctx.count);
 
     struct reap_node *node, *tmp;
+    int               i = 0;
+
+    sessions = try2_p(calloc(ctx.count, sizeof(*sessions)), "calloc: %s", strret);
+    results  = try2_p(calloc(ctx.count, sizeof(*results)), "calloc: %s", strret);
 
     /* 使用 safe 版本，因为我们在循环里 free(node) */
     list_for_each_entry_safe(node, tmp, &ctx.reap_list, list) {
-      /* 发起删除请求 */
-      if (delete_session_map(&node->key) < 0) {
-        log_warn("failed to delete session: %s", strerrno);
-      }
+      sessions[i++].key = node->key;
 
       /* 从链表中摘除并释放内存 */
       list_del(&node->list);
       free(node);
     }
+
+    err = send_batch_cmd(TUTU_CMD_DELETE_SESSION, TUTU_ATTR_SESSION, sessions, sizeof(*sessions), ctx.count, results);
+    if (err < 0) {
+      log_warn("failed to delete sessions: %s", strerrno);
+    } else if (err > 0) {
+      for (i = 0; i < ctx.count; i++) {
+        if (results[i])
+          log_warn("failed to delete session %d: %s", i, strerror(-results[i]));
+      }
+    }
   }
 
   err = 0;
 err_cleanup:
+  free(sessions);
+  free(results);
   /* 如果中间出错 goto 这里的处理：防止内存泄漏 */
   if (!list_empty(&ctx.reap_list)) {
     struct reap_node *node, *tmp;
@@ -1981,6 +3022,375 @@ err_cleanup:
   return err;
 }
 
+static int print_snapshot_usage(int argc, char *argv[]) {
+  (void) argc;
+
+  fprintf(g_err,
+          "Usage: %s %s save|restore [<file>|-]\n\n"
+
+          "  " CMD_SNAPSHOT_SUMMARY ".\n\n"
+
+          "Arguments:\n"
+          "  %-22s Write config, interfaces, users, peers and sessions to <file>.\n"
+          "  %-22s Load a snapshot into the (freshly loaded) module; existing entries are kept.\n"
+          "  %-22s Snapshot file, or standard input/output when omitted or \"-\".\n\n",
+
+          STR(PROG_NAME), argv[0], "save", "restore", "<file>");
+  return 0;
+}
+
+/*
+ * 快照格式（主机字节序）：snapshot_header 之后是若干 snapshot_section，
+ * 每段后面紧跟 count 个 entry_size 字节的条目（即 genl 传输用的结构体，ifname 为 IFNAMSIZ 字节）。
+ * 读取时 entry_size 与本程序不一致的段视为格式不兼容；未知类型的段被跳过。
+ */
+#define SNAPSHOT_MAGIC   "TUTUSNAP"
+#define SNAPSHOT_VERSION 1
+
+enum {
+  SNAPSHOT_CONFIG = 1,
+  SNAPSHOT_IFNAME,
+  SNAPSHOT_USER_INFO,
+  SNAPSHOT_EGRESS,
+  SNAPSHOT_INGRESS,
+  SNAPSHOT_SESSION,
+  __SNAPSHOT_MAX,
+};
+
+struct snapshot_header {
+  char  magic[8];
+  __u32 version;
+  __u32 reserved;
+  __u64 monotonic; /* 保存时的 CLOCK_MONOTONIC 秒数，与会话 age 同一时钟 */
+  __u64 realtime;  /* 保存时的墙上时间，用于计算停机时长 */
+};
+
+struct snapshot_section {
+  __u32 type;
+  __u32 entry_size;
+  __u32 count;
+  __u32 reserved;
+};
+
+struct snapshot_vec {
+  void  *data;
+  size_t size;
+  size_t count;
+  size_t cap;
+};
+
+static const size_t snapshot_entry_size[__SNAPSHOT_MAX] = {
+  [SNAPSHOT_CONFIG]    = sizeof(struct tutu_config),
+  [SNAPSHOT_IFNAME]    = IFNAMSIZ,
+  [SNAPSHOT_USER_INFO] = sizeof(struct tutu_user_info),
+  [SNAPSHOT_EGRESS]    = sizeof(struct tutu_egress),
+  [SNAPSHOT_INGRESS]   = sizeof(struct tutu_ingress),
+  [SNAPSHOT_SESSION]   = sizeof(struct tutu_session),
+};
+
+static int snapshot_vec_grow(struct snapshot_vec *vec, size_t count) {
+  size_t cap = vec->cap ? vec->cap : 64;
+  void  *data;
+
+  if (vec->count + count <= vec->cap)
+    return 0;
+  while (cap < vec->count + count)
+    cap *= 2;
+  data = realloc(vec->data, cap * vec->size);
+  if (!data)
+    return -ENOMEM;
+  vec->data = data;
+  vec->cap  = cap;
+  return 0;
+}
+
+static int snapshot_collect_cb(void *entry, void *user_data) {
+  struct snapshot_vec *vec = user_data;
+  char                *dst;
+
+  if (snapshot_vec_grow(vec, 1) < 0) {
+    errno = ENOMEM;
+    return -1;
+  }
+  dst = (char *) vec->data + vec->count++ * vec->size;
+  memset(dst, 0, vec->size);
+  /* ifname 为变长字符串，其它条目为定长结构体 */
+  if (vec->size == IFNAMSIZ)
+    strncpy(dst, entry, IFNAMSIZ - 1);
+  else
+    memcpy(dst, entry, vec->size);
+  return 0;
+}
+
+static int snapshot_write_section(FILE *fp, __u32 type, const struct snapshot_vec *vec) {
+  struct snapshot_section sec = {
+    .type       = type,
+    .entry_size = vec->size,
+    .count      = vec->count,
+  };
+
+  if (fwrite(&sec, sizeof(sec), 1, fp) != 1)
+    return -EIO;
+  if (vec->count && fwrite(vec->data, vec->size, vec->count, fp) != vec->count)
+    return -EIO;
+  return 0;
+}
+
+static int snapshot_save(const char *path) {
+  struct snapshot_vec    vecs[__SNAPSHOT_MAX] = {};
+  struct snapshot_header hdr                  = {.version = SNAPSHOT_VERSION};
+  struct tutu_config     cfg                  = {};
+  char                   tmp[PATH_MAX];
+  FILE                  *fp = stdout;
+  int                    err;
+
+  for (int i = 1; i < __SNAPSHOT_MAX; i++)
+    vecs[i].size = snapshot_entry_size[i];
+
+  try2(init_tutuicmptunnel(), _("open tutuicmptunnel device: %s"), strerrno);
+  try2(get_config_map(&cfg), _("get_config_map: %s"), strerrno);
+  try2(snapshot_collect_cb(&cfg, &vecs[SNAPSHOT_CONFIG]), "collect config: %s", strerrno);
+  try2(foreach_ifname(snapshot_collect_cb, &vecs[SNAPSHOT_IFNAME]), "dump interfaces: %s", strerrno);
+  try2(foreach_user_info(NULL, snapshot_collect_cb, &vecs[SNAPSHOT_USER_INFO]), "dump user info: %s", strerrno);
+  try2(foreach_egress(NULL, snapshot_collect_cb, &vecs[SNAPSHOT_EGRESS]), "dump egress: %s", strerrno);
+  try2(foreach_ingress(NULL, snapshot_collect_cb, &vecs[SNAPSHOT_INGRESS]), "dump ingress: %s", strerrno);
+  try2(foreach_session(NULL, snapshot_collect_cb, &vecs[SNAPSHOT_SESSION]), "dump sessions: %s", strerrno);
+
+  memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+  hdr.monotonic = get_monotonic_seconds();
+  hdr.realtime  = (__u64) time(NULL);
+
+  /* 先写临时文件再 rename，保存失败不会破坏旧快照 */
+  if (strcmp(path, "-")) {
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+      err = -ENAMETOOLONG;
+      goto err_cleanup;
+    }
+    fp = try2_p(fopen(tmp, "wb"), "fopen %s: %s", tmp, strret);
+  }
+
+  err = fwrite(&hdr, sizeof(hdr), 1, fp) == 1 ? 0 : -EIO;
+  for (int i = 1; i < __SNAPSHOT_MAX && !err; i++)
+    err = snapshot_write_section(fp, i, &vecs[i]);
+  if (fflush(fp) || (fp != stdout && fsync(fileno(fp))))
+    err = -errno;
+
+  if (fp != stdout) {
+    if (fclose(fp) && !err)
+      err = -errno;
+    fp = NULL;
+    if (!err && rename(tmp, path) < 0)
+      err = -errno;
+    if (err)
+      unlink(tmp);
+  }
+  if (err) {
+    log_error("write snapshot: %s", strerror(-err));
+    goto err_cleanup;
+  }
+
+  log_info("saved %zu users, %zu egress peers, %zu ingress peers, %zu sessions", vecs[SNAPSHOT_USER_INFO].count,
+           vecs[SNAPSHOT_EGRESS].count, vecs[SNAPSHOT_INGRESS].count, vecs[SNAPSHOT_SESSION].count);
+  err = 0;
+err_cleanup:
+  for (int i = 1; i < __SNAPSHOT_MAX; i++)
+    free(vecs[i].data);
+  return err;
+}
+
+static int snapshot_read(FILE *fp, struct snapshot_header *hdr, struct snapshot_vec *vecs) {
+  struct snapshot_section sec;
+  char                    skip[256];
+
+  if (fread(hdr, sizeof(*hdr), 1, fp) != 1 || memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic))) {
+    log_error("not a %s snapshot", STR(PROJECT_NAME));
+    return -EINVAL;
+  }
+  if (hdr->version != SNAPSHOT_VERSION) {
+    log_error("unsupported snapshot version %u", hdr->version);
+    return -EINVAL;
+  }
+
+  while (fread(&sec, sizeof(sec), 1, fp) == 1) {
+    size_t left = (size_t) sec.entry_size * sec.count;
+
+    if (sec.type && sec.type < __SNAPSHOT_MAX) {
+      struct snapshot_vec *vec = &vecs[sec.type];
+
+      if (sec.entry_size != vec->size) {
+        log_error("snapshot section %u: entry size %u, expected %zu", sec.type, sec.entry_size, vec->size);
+        return -EINVAL;
+      }
+      if (snapshot_vec_grow(vec, sec.count) < 0)
+        return -ENOMEM;
+      if (sec.count && fread((char *) vec->data + vec->count * vec->size, vec->size, sec.count, fp) != sec.count)
+        return -EIO;
+      vec->count += sec.count;
+      continue;
+    }
+
+    /* 未知段：逐块读掉，输入可能是管道 */
+    while (left) {
+      size_t n = left < sizeof(skip) ? left : sizeof(skip);
+
+      if (fread(skip, 1, n, fp) != n)
+        return -EIO;
+      left -= n;
+    }
+  }
+
+  return ferror(fp) ? -EIO : 0;
+}
+
+static int snapshot_load(int cmd, int attr_type, const struct snapshot_vec *vec, const char *what) {
+  int *results = NULL;
+  int  err;
+
+  if (!vec->count)
+    return 0;
+
+  results = calloc(vec->count, sizeof(*results));
+  if (!results)
+    return -ENOMEM;
+
+  err = send_batch_cmd(cmd, attr_type, vec->data, vec->size, vec->count, results);
+  if (err < 0) {
+    err = -errno;
+    log_error("restore %s: %s", what, strerrno);
+  } else if (err > 0) {
+    for (size_t i = 0; i < vec->count; i++) {
+      if (results[i])
+        log_warn("restore %s entry %zu: %s", what, i, strerror(-results[i]));
+    }
+    err = 0;
+  }
+
+  free(results);
+  return err;
+}
+
+/*
+ * 会话 age 以保存时的空闲时长加上停机时长重新换算到当前时钟，这样重启主机后恢复也不会让会话变"年轻"；
+ * 已经超过 session_max_age 的会话不再恢复。
+ */
+static void snapshot_rebase_sessions(struct snapshot_vec *vec, const struct snapshot_header *hdr, __u32 max_age) {
+  struct tutu_session *sess = vec->data;
+  __u64                now  = get_monotonic_seconds();
+  __u64                real = (__u64) time(NULL);
+  __u64                down = real > hdr->realtime ? real - hdr->realtime : 0;
+  size_t               n    = 0;
+
+  for (size_t i = 0; i < vec->count; i++) {
+    __u64 idle = hdr->monotonic > sess[i].value.age ? hdr->monotonic - sess[i].value.age : 0;
+
+    idle += down;
+    if (!sess[i].value.age || idle >= max_age || idle >= now)
+      continue;
+
+    sess[n]           = sess[i];
+    sess[n].value.age = now - idle;
+    sess[n].map_flags = TUTU_ANY;
+    n++;
+  }
+
+  if (n != vec->count)
+    log_info("skipped %zu expired sessions", vec->count - n);
+  vec->count = n;
+}
+
+static int snapshot_restore(const char *path) {
+  struct snapshot_vec    vecs[__SNAPSHOT_MAX] = {};
+  struct snapshot_header hdr                  = {};
+  struct tutu_config     cfg                  = {};
+  FILE                  *fp                   = stdin;
+  int                    err;
+
+  for (int i = 1; i < __SNAPSHOT_MAX; i++)
+    vecs[i].size = snapshot_entry_size[i];
+
+  if (strcmp(path, "-"))
+    fp = try2_p(fopen(path, "rb"), "fopen %s: %s", path, strret);
+
+  try2(snapshot_read(fp, &hdr, vecs), "read snapshot: %s", strret);
+  if (vecs[SNAPSHOT_CONFIG].count != 1) {
+    log_error("snapshot has no configuration");
+    err = -EINVAL;
+    goto err_cleanup;
+  }
+  memcpy(&cfg, vecs[SNAPSHOT_CONFIG].data, sizeof(cfg));
+
+  for (int i = SNAPSHOT_USER_INFO; i <= SNAPSHOT_INGRESS; i++) {
+    for (size_t j = 0; j < vecs[i].count; j++) {
+      /* map_flags 位于各结构体末尾 */
+      __u64 *flags = (__u64 *) ((char *) vecs[i].data + (j + 1) * vecs[i].size - sizeof(__u64));
+
+      *flags = TUTU_ANY;
+    }
+  }
+
+  try2(init_tutuicmptunnel(), _("open tutuicmptunnel device: %s"), strerrno);
+
+  for (size_t i = 0; i < vecs[SNAPSHOT_IFNAME].count; i++) {
+    const char *name = (const char *) vecs[SNAPSHOT_IFNAME].data + i * IFNAMSIZ;
+
+    if (nl_add_iface(name) < 0 && errno != EEXIST)
+      log_warn("restore interface %s: %s", name, strerrno);
+  }
+
+  /* 配置、用户和 peer 在一个事务中整体生效，之后再恢复引用它们的会话 */
+  try2(send_simple_cmd(TUTU_CMD_TXN_BEGIN, 0, NULL, 0, 0), _("begin transaction: %s"), strerrno);
+  g_txn = true;
+  try2(set_config_map(&cfg), _("set_config_map: %s"), strerrno);
+  try2(snapshot_load(TUTU_CMD_UPDATE_USER_INFO, TUTU_ATTR_USER_INFO, &vecs[SNAPSHOT_USER_INFO], "user info"));
+  try2(snapshot_load(TUTU_CMD_UPDATE_EGRESS, TUTU_ATTR_EGRESS, &vecs[SNAPSHOT_EGRESS], "egress"));
+  try2(snapshot_load(TUTU_CMD_UPDATE_INGRESS, TUTU_ATTR_INGRESS, &vecs[SNAPSHOT_INGRESS], "ingress"));
+  g_txn = false;
+  try2(send_simple_cmd(TUTU_CMD_TXN_COMMIT, 0, NULL, 0, 0), _("commit transaction: %s"), strerrno);
+
+  snapshot_rebase_sessions(&vecs[SNAPSHOT_SESSION], &hdr, cfg.session_max_age);
+  try2(snapshot_load(TUTU_CMD_UPDATE_SESSION, TUTU_ATTR_SESSION, &vecs[SNAPSHOT_SESSION], "session"));
+
+  log_info("restored %zu users, %zu egress peers, %zu ingress peers, %zu sessions", vecs[SNAPSHOT_USER_INFO].count,
+           vecs[SNAPSHOT_EGRESS].count, vecs[SNAPSHOT_INGRESS].count, vecs[SNAPSHOT_SESSION].count);
+  err = 0;
+err_cleanup:
+  if (g_txn) {
+    g_txn = false;
+    send_simple_cmd(TUTU_CMD_TXN_ABORT, 0, NULL, 0, 0);
+  }
+  /* 用户表被整体替换，server-add 比较用的副本作废 */
+  user_cache_free();
+  if (fp && fp != stdin)
+    fclose(fp);
+  for (int i = 1; i < __SNAPSHOT_MAX; i++)
+    free(vecs[i].data);
+  return err;
+}
+
+int cmd_snapshot(int argc, char **argv) {
+  const char *path = "-";
+
+  if (help || argc < 2 || argc > 3 || is_help_kw(argv[1]))
+    return print_snapshot_usage(argc, argv), -EINVAL;
+
+  if (argc == 3)
+    path = argv[2];
+
+  /* 快照是二进制数据，不放进文本应答；"-" 只在命令行下表示 stdin/stdout */
+  if (g_exec && !strcmp(path, "-")) {
+    log_error("snapshot: \"-\" is not available in tuctl_server scripts, give a file path");
+    return -EINVAL;
+  }
+
+  if (!strcmp(argv[1], "save"))
+    return snapshot_save(path);
+  if (!strcmp(argv[1], "restore"))
+    return snapshot_restore(path);
+
+  log_error("unknown keyword \"%s\"", argv[1]);
+  return print_snapshot_usage(argc, argv), -EINVAL;
+}
+
 int cmd_help(int argc, char **argv) {
   (void) argc;
   (void) argv;
@@ -1991,7 +3401,7 @@ int cmd_help(int argc, char **argv) {
 int cmd_version(int argc, char **argv) {
   (void) argc;
   (void) argv;
-  printf("%s: %s (%s)\n", STR(PROJECT_NAME), VERSION_STR, HOMEPAGE_STR);
+  fprintf(g_out, "%s: %s (%s)\n", STR(PROJECT_NAME), VERSION_STR, HOMEPAGE_STR);
   return 0;
 }
 
@@ -2044,9 +3454,11 @@ static int parse_argument(int argc, char **argv, int *subcmd_pos) {
   return err;
 }
 
-int main(int argc, char *argv[]) {
+int ktuctl_main(int argc, char *argv[]) {
   int err, subcmd_pos;
 
+  g_out = stdout;
+  g_err = stderr;
   uid_map_init(&uids);
   try(uid_map_load(&uids, UID_CONFIG_PATH));
   try(parse_argument(argc, argv, &subcmd_pos));
@@ -2065,4 +3477,81 @@ err_cleanup:
   return err;
 }
 
+/*
+ * 常驻进程复用 socket 前确认模块没有被重新加载：family id 变化（或查询失败）时关闭旧 socket，
+ * 由下一次 init_tutuicmptunnel 重新打开。只多一次 CTRL_CMD_GETFAMILY 往返。
+ */
+static void revalidate_tutuicmptunnel(void) {
+  int family_id = 0;
+
+  if (!g_nl)
+    return;
+
+  if (get_family_id_internal(g_nl, TUTU_GENL_FAMILY_NAME, &family_id) < 0 || family_id != g_family_id)
+    deinit_tutuicmptunnel();
+}
+
+int ktuctl_exec_script(const char *script, size_t script_len, char *out, size_t out_size, size_t *out_len) {
+  FILE  *fp      = NULL;
+  FILE  *capture = NULL;
+  char  *buf     = NULL;
+  size_t len     = 0;
+  int    err     = 0;
+
+  *out_len = 0;
+  if (!script_len)
+    return 0;
+
+  fp = try2_p(fmemopen((void *) script, script_len, "r"), "fmemopen: %s", strret);
+
+  /* 命令输出和本线程的日志都写入内存流，不触碰进程的 stdout/stderr */
+  capture    = try2_p(open_memstream(&buf, &len), "open_memstream: %s", strret);
+  g_out      = capture;
+  g_err      = capture;
+  log_stream = capture;
+
+  /* 每个请求都像新进程一样：清空选项和配置缓存，重新读取 uid 映射 */
+  numeric      = 0;
+  debug        = 0;
+  family       = AF_UNSPEC;
+  help         = 0;
+  g_persist    = true;
+  g_cfg_cached = false;
+  g_exec       = true;
+  user_cache_free();
+  uid_map_free(&uids);
+  try2(uid_map_load(&uids, UID_CONFIG_PATH));
+  revalidate_tutuicmptunnel();
+
+  err = run_script(fp, false);
+
+err_cleanup:
+  g_exec     = false;
+  g_out      = stdout;
+  g_err      = stderr;
+  log_stream = NULL;
+  user_cache_free();
+  if (capture && !fclose(capture)) {
+    *out_len = len < out_size ? len : out_size;
+    memcpy(out, buf, *out_len);
+  }
+  free(buf);
+  if (fp)
+    fclose(fp);
+  /* 出错时 socket 中可能残留未读的应答，下次重新打开 */
+  if (err)
+    deinit_tutuicmptunnel();
+
+  return err;
+}
+
+void ktuctl_exit(void) {
+  g_persist = false;
+  user_cache_free();
+  free(g_pipe.buf);
+  g_pipe.buf = NULL;
+  uid_map_free(&uids);
+  deinit_tutuicmptunnel();
+}
+
 // vim: set sw=2 ts=2 expandtab:
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * ChaCha20 的 SIMD 批量块函数，由 xchacha_encrypt_bytes() 在运行时选用。
+ *
+ * blocks 必须是 width 的整数倍；函数只递增 input[12]，调用者保证低 32 位计数器在本次调用中不会进位。
+ */
+typedef void (*chacha20_blocks_fn)(uint32_t input[16], const uint8_t *m, uint8_t *c, size_t blocks);
+
+struct chacha20_simd {
+  const char        *name;
+  unsigned           width;
+  chacha20_blocks_fn blocks;
+};
+
+/* 按 cpuid / hwcap 返回当前 CPU 可用的最快实现，没有时返回 NULL */
+const struct chacha20_simd *chacha20_simd_detect(void);
+
+/* 按名字（"sse2"、"avx2"、"neon"）查找实现，未编译进来或当前 CPU 不支持时返回 NULL */
+const struct chacha20_simd *chacha20_simd_find(const char *name);
+
+// vim: set sw=2 ts=2 expandtab:
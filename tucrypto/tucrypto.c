@@ -1,5 +1,6 @@
 #include "tucrypto.h"
 #include "argon2.h"
+#include "blake2.h"
 #include "poly1305-donna.h"
 #include "xchacha20.h"
 
@@ -219,4 +220,9 @@ int tucrypto_crypto_aead_xchacha20poly1305_ietf_decrypt(uint8_t *m, size_t *mlen
   return 0;
 }
 
+/* keyed BLAKE2b，与 libsodium crypto_generichash 输出一致 */
+int tucrypto_generichash(uint8_t *out, size_t outlen, const uint8_t *in, size_t inlen, const uint8_t *key, size_t keylen) {
+  return blake2b(out, outlen, in, inlen, key, keylen);
+}
+
 // vim: set sw=2 ts=2 expandtab:
@@ -12,6 +12,7 @@ void     tucrypto_randombytes_buf(void *buf, const size_t nbytes);
 void     tucrypto_memzero(void *ptr, size_t nbytes);
 uint32_t tucrypto_randombytes_uniform(uint32_t upper_bound);
 int      tucrypto_memcmp(const void *const b1_, const void *const b2_, size_t len);
+int      tucrypto_generichash(uint8_t *out, size_t outlen, const uint8_t *in, size_t inlen, const uint8_t *key, size_t keylen);
 #elif defined USE_SODIUM
 #include "sodium.h"
 
@@ -19,6 +20,7 @@ int      tucrypto_memcmp(const void *const b1_, const void *const b2_, size_t le
 #define tucrypto_memzero             sodium_memzero
 #define tucrypto_randombytes_uniform randombytes_uniform
 #define tucrypto_memcmp              sodium_memcmp
+#define tucrypto_generichash         crypto_generichash
 #else
 #error Invalid configuration
 #endif
@@ -0,0 +1,203 @@
+/*
+ * XChaCha20 / XChaCha20-Poly1305 的固定向量测试。
+ *
+ * 用环境变量 TUTUICMPTUNNEL_CHACHA20 指定块函数实现（scalar、sse2、avx2、neon），每种实现各跑一遍（见 CMakeLists.txt）。
+ * 当前 CPU 不支持指定的实现时返回 77，ctest 记为跳过；支持却没被选用（启动自检不通过）则算失败。
+ *
+ * AEAD 向量取自 draft-irtf-cfrg-xchacha-03 附录 A.3.1；其余向量由 libsodium 生成，长输入只记录输出的 BLAKE2b-256。
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chacha20-simd.h"
+#include "tucrypto.h"
+#include "xchacha20.h"
+
+#define SKIP_RETURN_CODE 77
+
+/* 流向量的明文长度：48 个整块加 29 字节尾部 */
+#define STREAM_LEN (48 * XCHACHA_BLOCKLENGTH + 29)
+
+static const uint8_t draft_ad[] = {0x50, 0x51, 0x52, 0x53, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7};
+
+static const char draft_pt[] = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, "
+                               "sunscreen would be it.";
+
+static const uint8_t draft_ct[] = {
+  0xbd, 0x6d, 0x17, 0x9d, 0x3e, 0x83, 0xd4, 0x3b, 0x95, 0x76, 0x57, 0x94, 0x93, 0xc0, 0xe9, 0x39, 0x57, 0x2a, 0x17, 0x00,
+  0x25, 0x2b, 0xfa, 0xcc, 0xbe, 0xd2, 0x90, 0x2c, 0x21, 0x39, 0x6c, 0xbb, 0x73, 0x1c, 0x7f, 0x1b, 0x0b, 0x4a, 0xa6, 0x44,
+  0x0b, 0xf3, 0xa8, 0x2f, 0x4e, 0xda, 0x7e, 0x39, 0xae, 0x64, 0xc6, 0x70, 0x8c, 0x54, 0xc2, 0x16, 0xcb, 0x96, 0xb7, 0x2e,
+  0x12, 0x13, 0xb4, 0x52, 0x2f, 0x8c, 0x9b, 0xa4, 0x0d, 0xb5, 0xd9, 0x45, 0xb1, 0x1b, 0x69, 0xb9, 0x82, 0xc1, 0xbb, 0x9e,
+  0x3f, 0x3f, 0xac, 0x2b, 0xc3, 0x69, 0x48, 0x8f, 0x76, 0xb2, 0x38, 0x35, 0x65, 0xd3, 0xff, 0xf9, 0x21, 0xf9, 0x66, 0x4c,
+  0x97, 0x63, 0x7d, 0xa9, 0x76, 0x88, 0x12, 0xf6, 0x15, 0xc6, 0x8b, 0x13, 0xb5, 0x2e,
+  /* tag */
+  0xc0, 0x87, 0x59, 0x24, 0xc1, 0xc7, 0x98, 0x79, 0x47, 0xde, 0xaf, 0xd8, 0x78, 0x0a, 0xcf, 0x49,
+};
+
+/* 1500 字节明文、12 字节 AD 的 AEAD 输出（密文加 tag）的 BLAKE2b-256，输入见 fill_inputs() */
+static const uint8_t aead_1500_hash[32] = {
+  0x37, 0xdf, 0x7a, 0x03, 0x7e, 0x67, 0xbc, 0xa3, 0xa9, 0xf9, 0xa9, 0x6d, 0x29, 0xb5, 0x1c, 0x66,
+  0xe9, 0x6d, 0x63, 0x4f, 0x26, 0x61, 0x3c, 0xb8, 0x53, 0xbf, 0x32, 0x91, 0x2a, 0xe9, 0xbd, 0x9a,
+};
+
+/* crypto_stream_xchacha20_xor_ic() 在不同初始块计数器下的输出，计数器靠近 2^32 时会在中途进位到高 32 位 */
+static const struct {
+  uint64_t counter;
+  uint8_t  hash[32];
+} stream_vectors[] = {
+  {0x0, {0x9d, 0x1f, 0x58, 0x64, 0x97, 0x77, 0xfe, 0x0b, 0x47, 0xd2, 0x42, 0x17, 0x82, 0xd3, 0x63, 0x6a,
+         0x55, 0x39, 0x1f, 0x74, 0x43, 0xb1, 0x8d, 0xd8, 0x9a, 0x7e, 0x7c, 0x2d, 0xa5, 0x1f, 0x0a, 0xb7}},
+  {0x1, {0xbb, 0x52, 0xdf, 0x20, 0xb9, 0x46, 0x08, 0x7a, 0x87, 0x6d, 0x79, 0x0d, 0x1f, 0x79, 0x04, 0x27,
+         0x72, 0x66, 0x58, 0xb9, 0x84, 0x08, 0xbe, 0xa5, 0x32, 0xd3, 0xbc, 0x7f, 0x19, 0x41, 0x00, 0xbc}},
+  {0xffffffef, {0x51, 0x50, 0x5b, 0x52, 0x64, 0x18, 0xfa, 0xb9, 0xf5, 0xa1, 0xe4, 0x05, 0xab, 0x85, 0x5e, 0x4e,
+                0x29, 0xdc, 0x66, 0x55, 0x2f, 0xc9, 0xc1, 0xcc, 0xc7, 0x2f, 0xb7, 0x8e, 0xe5, 0x01, 0x1e, 0x19}},
+  {0xfffffff0, {0x4c, 0x6f, 0x99, 0x16, 0x15, 0x18, 0xd0, 0x0e, 0x57, 0xe9, 0x84, 0xcb, 0x95, 0x3b, 0x94, 0xf2,
+                0x5e, 0x9f, 0x09, 0x66, 0xf4, 0x26, 0xf4, 0x5f, 0x51, 0x7b, 0xc6, 0x5b, 0xbf, 0xa2, 0x45, 0x89}},
+  {0xfffffffb, {0xce, 0x62, 0x27, 0x5e, 0x8e, 0xd1, 0x0b, 0xdc, 0xd9, 0x96, 0x27, 0x35, 0x3b, 0x72, 0xe2, 0xd8,
+                0x96, 0x84, 0x82, 0x13, 0x80, 0xf5, 0xfb, 0x80, 0xd5, 0x2f, 0xbf, 0x3a, 0x5d, 0xaf, 0x9d, 0xa4}},
+  {0x1fffffff8, {0xd4, 0x16, 0xb1, 0xc9, 0x8d, 0x25, 0x48, 0x5d, 0x99, 0xc6, 0xbd, 0x1c, 0xe7, 0x5c, 0x56, 0x9b,
+                 0xeb, 0xd9, 0xb0, 0x05, 0x28, 0x3d, 0x58, 0x32, 0x62, 0x60, 0x3f, 0x3d, 0x68, 0x37, 0x21, 0xcc}},
+};
+
+/*
+ * 分段方式（单位为块，0 表示剩余全部）。SIMD 实现每次调用只处理整组块，
+ * 不同的分段让计数器在 2^32 附近分别落在 SIMD 路径和标量回退路径上。
+ */
+static const unsigned chunkings[][4] = {
+  {0},
+  {8, 8, 8, 0},
+  {1, 16, 5, 0},
+  {3, 0},
+};
+
+static uint8_t key[32], iv[24], ad[12], msg[STREAM_LEN];
+
+static void fill_inputs(void) {
+  for (size_t i = 0; i < sizeof(key); i++)
+    key[i] = (uint8_t) (i * 7 + 3);
+  for (size_t i = 0; i < sizeof(iv); i++)
+    iv[i] = (uint8_t) (i * 13 + 5);
+  for (size_t i = 0; i < sizeof(ad); i++)
+    ad[i] = (uint8_t) i;
+  for (size_t i = 0; i < sizeof(msg); i++)
+    msg[i] = (uint8_t) (i * 31 + 17);
+}
+
+static int check_draft_aead(void) {
+  uint8_t draft_key[32], draft_iv[24], c[sizeof(draft_ct)], m[sizeof(draft_pt)];
+  size_t  clen, mlen;
+
+  for (size_t i = 0; i < sizeof(draft_key); i++)
+    draft_key[i] = (uint8_t) (0x80 + i);
+  for (size_t i = 0; i < sizeof(draft_iv); i++)
+    draft_iv[i] = (uint8_t) (0x40 + i);
+
+  tucrypto_crypto_aead_xchacha20poly1305_ietf_encrypt(c, &clen, (const uint8_t *) draft_pt, sizeof(draft_pt) - 1, draft_ad,
+                                                      sizeof(draft_ad), draft_iv, draft_key);
+  if (clen != sizeof(draft_ct) || memcmp(c, draft_ct, clen)) {
+    fprintf(stderr, "draft AEAD vector: encrypt mismatch\n");
+    return -1;
+  }
+
+  if (tucrypto_crypto_aead_xchacha20poly1305_ietf_decrypt(m, &mlen, c, clen, draft_ad, sizeof(draft_ad), draft_iv,
+                                                          draft_key) < 0 ||
+      mlen != sizeof(draft_pt) - 1 || memcmp(m, draft_pt, mlen)) {
+    fprintf(stderr, "draft AEAD vector: decrypt mismatch\n");
+    return -1;
+  }
+
+  c[0] ^= 1;
+  if (tucrypto_crypto_aead_xchacha20poly1305_ietf_decrypt(m, &mlen, c, clen, draft_ad, sizeof(draft_ad), draft_iv,
+                                                          draft_key) >= 0) {
+    fprintf(stderr, "draft AEAD vector: forged ciphertext accepted\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int check_aead_1500(void) {
+  uint8_t c[1500 + TAG], m[1500], hash[32];
+  size_t  clen, mlen;
+
+  tucrypto_crypto_aead_xchacha20poly1305_ietf_encrypt(c, &clen, msg, 1500, ad, sizeof(ad), iv, key);
+  tucrypto_generichash(hash, sizeof(hash), c, clen, NULL, 0);
+  if (memcmp(hash, aead_1500_hash, sizeof(hash))) {
+    fprintf(stderr, "1500-byte AEAD vector: encrypt mismatch\n");
+    return -1;
+  }
+
+  if (tucrypto_crypto_aead_xchacha20poly1305_ietf_decrypt(m, &mlen, c, clen, ad, sizeof(ad), iv, key) < 0 || mlen != 1500 ||
+      memcmp(m, msg, mlen)) {
+    fprintf(stderr, "1500-byte AEAD vector: decrypt mismatch\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int check_stream(size_t v, size_t k) {
+  uint8_t     c[STREAM_LEN], ctr[8], hash[32];
+  XChaCha_ctx ctx;
+  uint64_t    counter = stream_vectors[v].counter;
+  size_t      off     = 0;
+
+  for (size_t i = 0; i < sizeof(ctr); i++)
+    ctr[i] = (uint8_t) (counter >> (8 * i));
+
+  xchacha_keysetup(&ctx, key, iv);
+  xchacha_set_counter(&ctx, ctr);
+
+  /* 除最后一段外每段都是整块，上下文中的计数器才能接着用 */
+  for (size_t i = 0; i < sizeof(chunkings[k]) / sizeof(chunkings[k][0]) && off < sizeof(msg); i++) {
+    size_t len = chunkings[k][i] ? (size_t) chunkings[k][i] * XCHACHA_BLOCKLENGTH : sizeof(msg) - off;
+
+    if (len > sizeof(msg) - off)
+      len = sizeof(msg) - off;
+    xchacha_encrypt_bytes(&ctx, msg + off, c + off, (uint32_t) len);
+    off += len;
+  }
+
+  tucrypto_generichash(hash, sizeof(hash), c, sizeof(c), NULL, 0);
+  if (off != sizeof(msg) || memcmp(hash, stream_vectors[v].hash, sizeof(hash))) {
+    fprintf(stderr, "stream vector counter=0x%llx, chunking %zu: mismatch\n", (unsigned long long) counter, k);
+    return -1;
+  }
+
+  return 0;
+}
+
+int main(void) {
+  const char *want = getenv("TUTUICMPTUNNEL_CHACHA20");
+  const char *impl = xchacha_impl_name();
+  int         err  = 0;
+
+  if (want && *want && strcmp(want, impl)) {
+    if (strcmp(want, "scalar") && !chacha20_simd_find(want)) {
+      printf("%s: not available on this CPU, skipped\n", want);
+      return SKIP_RETURN_CODE;
+    }
+    fprintf(stderr, "%s: rejected by the startup self-test, %s in use\n", want, impl);
+    return 1;
+  }
+
+  fill_inputs();
+
+  if (check_draft_aead() < 0)
+    err = 1;
+  if (check_aead_1500() < 0)
+    err = 1;
+
+  for (size_t v = 0; v < sizeof(stream_vectors) / sizeof(stream_vectors[0]); v++) {
+    for (size_t k = 0; k < sizeof(chunkings) / sizeof(chunkings[0]); k++) {
+      if (check_stream(v, k) < 0)
+        err = 1;
+    }
+  }
+
+  printf("%s: %s\n", impl, err ? "FAILED" : "ok");
+  return err;
+}
+
+// vim: set sw=2 ts=2 expandtab:
@@ -8,8 +8,10 @@
  * info., look in the NOTICE file.                                       *
  *************************************************************************/
 #include "xchacha20.h"
+#include "chacha20-simd.h"
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 /** hchacha an intermediary step towards XChaCha20 based on the
  * construction and security proof used to create XSalsa20.
@@ -109,7 +111,8 @@ void xchacha_set_counter(XChaCha_ctx *ctx, uint8_t *counter) {
   ctx->input[13] = U8TO32_LITTLE(counter + 4);
 }
 
-/** Encrypt data with the XChaCha20 stream cipher
+/** Portable scalar XChaCha20, also used for the tail left over by the
+ * SIMD implementations.
  * @param x The XChaCha20 context with the cipher's state to use
  * @param m The plaintext to encrypt
  * @param c A buffer to hold the ciphertext created from the plaintext
@@ -118,7 +121,7 @@ void xchacha_set_counter(XChaCha_ctx *ctx, uint8_t *counter) {
  * overflow will occur.
  *
  */
-void xchacha_encrypt_bytes(XChaCha_ctx *ctx, const uint8_t *m, uint8_t *c, uint32_t bytes) {
+static void xchacha_encrypt_bytes_scalar(XChaCha_ctx *ctx, const uint8_t *m, uint8_t *c, uint32_t bytes) {
   uint32_t x0, x1, x2, x3, x4, x5, x6, x7, x8, x9, x10, x11, x12, x13, x14, x15;
   uint32_t j0, j1, j2, j3, j4, j5, j6, j7, j8, j9, j10, j11, j12, j13, j14, j15;
   uint8_t *ctarget = NULL;
@@ -252,6 +255,95 @@ void xchacha_encrypt_bytes(XChaCha_ctx *ctx, const uint8_t *m, uint8_t *c, uint3
   }
 }
 
+/*
+ * 选用 SIMD 实现前先与标量代码对比一段固定输入的输出，不一致时（编译器或 CPU 的问题）退回标量代码。
+ * 环境变量 TUTUICMPTUNNEL_CHACHA20 可指定实现（scalar、sse2、avx2、neon），供测试逐一覆盖各条路径；
+ * 指定的实现不可用时同样退回标量代码。
+ */
+static const struct chacha20_simd *xchacha_simd_select(void) {
+  const char                 *val = getenv("TUTUICMPTUNNEL_CHACHA20");
+  const struct chacha20_simd *simd;
+  uint8_t                     key[32], iv[24], ctr[8] = {1};
+  uint8_t                     m[16 * XCHACHA_BLOCKLENGTH], c1[sizeof(m)], c2[sizeof(m)];
+  XChaCha_ctx                 ctx1, ctx2;
+  size_t                      len;
+
+  if (!val || !*val)
+    simd = chacha20_simd_detect();
+  else
+    simd = strcmp(val, "scalar") ? chacha20_simd_find(val) : NULL;
+  if (!simd)
+    return NULL;
+
+  for (size_t i = 0; i < sizeof(key); i++)
+    key[i] = (uint8_t) (i * 7 + 3);
+  for (size_t i = 0; i < sizeof(iv); i++)
+    iv[i] = (uint8_t) (i * 13 + 5);
+  for (size_t i = 0; i < sizeof(m); i++)
+    m[i] = (uint8_t) (i * 31 + 17);
+
+  len = (size_t) 2 * simd->width * XCHACHA_BLOCKLENGTH;
+  xchacha_keysetup(&ctx1, key, iv);
+  xchacha_set_counter(&ctx1, ctr);
+  ctx2 = ctx1;
+
+  xchacha_encrypt_bytes_scalar(&ctx1, m, c1, (uint32_t) len);
+  simd->blocks(ctx2.input, m, c2, len / XCHACHA_BLOCKLENGTH);
+
+  if (memcmp(c1, c2, len) || memcmp(ctx1.input, ctx2.input, sizeof(ctx1.input)))
+    return NULL;
+  return simd;
+}
+
+static const struct chacha20_simd *xchacha_simd(void) {
+  static const struct chacha20_simd *simd;
+  static int                         selected;
+
+  /* 并发的首次调用可能各自选择一次，结果相同，无需加锁 */
+  if (!__atomic_load_n(&selected, __ATOMIC_ACQUIRE)) {
+    __atomic_store_n(&simd, xchacha_simd_select(), __ATOMIC_RELAXED);
+    __atomic_store_n(&selected, 1, __ATOMIC_RELEASE);
+  }
+  return __atomic_load_n(&simd, __ATOMIC_RELAXED);
+}
+
+/** Name of the ChaCha20 block implementation in use
+ * @return "scalar", or the name of the SIMD implementation
+ *
+ */
+const char *xchacha_impl_name(void) {
+  const struct chacha20_simd *simd = xchacha_simd();
+
+  return simd ? simd->name : "scalar";
+}
+
+/** Encrypt data with the XChaCha20 stream cipher
+ * @param x The XChaCha20 context with the cipher's state to use
+ * @param m The plaintext to encrypt
+ * @param c A buffer to hold the ciphertext created from the plaintext
+ * @param bytes The length of the plaintext to encrypt
+ * @note Whole groups of blocks go through the SIMD implementation when
+ * the CPU has one; the tail and counter carries use the scalar code.
+ *
+ */
+void xchacha_encrypt_bytes(XChaCha_ctx *ctx, const uint8_t *m, uint8_t *c, uint32_t bytes) {
+  const struct chacha20_simd *simd = xchacha_simd();
+
+  if (simd) {
+    size_t blocks = bytes / XCHACHA_BLOCKLENGTH / simd->width * simd->width;
+
+    /* SIMD 实现只递增低 32 位计数器，会进位的情况交给标量代码 */
+    if (blocks && blocks <= UINT32_MAX - ctx->input[12]) {
+      simd->blocks(ctx->input, m, c, blocks);
+      m += blocks * XCHACHA_BLOCKLENGTH;
+      c += blocks * XCHACHA_BLOCKLENGTH;
+      bytes -= (uint32_t) (blocks * XCHACHA_BLOCKLENGTH);
+    }
+  }
+
+  xchacha_encrypt_bytes_scalar(ctx, m, c, bytes);
+}
+
 /** Decrypt data with the XChaCha20 stream cipher
  * @param x The XChaCha20 context with the cipher's state to use
  * @param c The ciphertext to decrypt
@@ -165,6 +165,12 @@ void xchacha_decrypt_bytes(XChaCha_ctx *ctx, const uint8_t *ciphertext, uint8_t
  */
 void xchacha_keystream_bytes(XChaCha_ctx *ctx, uint8_t *keystream, uint32_t length);
 
+/** Name of the ChaCha20 block implementation chosen at runtime.
+ *  @return "scalar", "sse2", "avx2" or "neon"
+ *
+ */
+const char *xchacha_impl_name(void);
+
 /** Encrypt/decrypt of blocks.
  *  @param ctx The XChaCha context to use
  *  @param plaintext A buffer which holds unencrypted data
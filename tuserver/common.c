@@ -1,6 +1,7 @@
 #include "../tucrypto/tucrypto.h"
 
 #include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -60,6 +61,172 @@ void setup_pwhash_memlimit(void) {
   log_info("pwhash memory limit set to %zu", pwhash_memlimit);
 }
 
+void psk_ctx_init(struct psk_ctx *ctx, const char *psk) {
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->psk = psk;
+  pthread_mutex_init(&ctx->lock, NULL);
+  pthread_cond_init(&ctx->cond, NULL);
+}
+
+void psk_ctx_free(struct psk_ctx *ctx) {
+  tucrypto_memzero(ctx->keys, sizeof(ctx->keys));
+  tucrypto_memzero(ctx->inflight, sizeof(ctx->inflight));
+  ctx->clock = 0;
+  pthread_cond_destroy(&ctx->cond);
+  pthread_mutex_destroy(&ctx->lock);
+}
+
+void pkt_hdr_init(struct pkt_hdr *hdr, int version) {
+  hdr->version = version;
+  tucrypto_randombytes_buf(hdr->salt, SALT_LEN);
+}
+
+// 插入长期密钥，替换最久未使用的槽；同一 salt 的多个报文可能先后插入，已有时只更新
+static void psk_ctx_insert(struct psk_ctx *ctx, const uint8_t *salt, const uint8_t *key) {
+  struct psk_key *victim;
+
+  pthread_mutex_lock(&ctx->lock);
+  victim = &ctx->keys[0];
+  for (int i = 0; i < KEY_CACHE_SIZE; i++) {
+    if (ctx->keys[i].used && !memcmp(ctx->keys[i].salt, salt, SALT_LEN)) {
+      victim = &ctx->keys[i];
+      break;
+    }
+    if (ctx->keys[i].used < victim->used)
+      victim = &ctx->keys[i];
+  }
+
+  memcpy(victim->salt, salt, SALT_LEN);
+  memcpy(victim->key, key, KEYB);
+  victim->used = ++ctx->clock;
+  pthread_mutex_unlock(&ctx->lock);
+}
+
+// Argon2id 不持锁运行，多个线程可以同时派生不同 salt 的密钥
+static int psk_ctx_derive(struct psk_ctx *ctx, const uint8_t *salt, uint8_t key[KEYB]) {
+  int err;
+
+  __atomic_add_fetch(&ctx->derivations, 1, __ATOMIC_RELAXED);
+  err = psk2key(ctx->psk, salt, key);
+  if (err)
+    return err < 0 ? err : -EINVAL;
+
+  return 0;
+}
+
+// 用完 inflight 槽，最后一个引用清空它；调用者持有 lock
+static void psk_inflight_put(struct psk_inflight *f) {
+  if (!--f->refs)
+    tucrypto_memzero(f, sizeof(*f));
+}
+
+/*
+ * 取 salt 对应的长期密钥。命中缓存时不运行 Argon2id；未命中时计算，insert 为真则放入缓存。
+ * 同一 salt 已在计算时等待其结果：一条多报文消息的各个分片同时到达，只运行一次 Argon2id。
+ * 返回 1 表示命中，0 表示新计算，负数为错误。
+ */
+static int psk_ctx_key(struct psk_ctx *ctx, const uint8_t *salt, uint8_t key[KEYB], bool insert) {
+  struct psk_inflight *f = NULL;
+  int                  err;
+
+  pthread_mutex_lock(&ctx->lock);
+  for (int i = 0; i < KEY_CACHE_SIZE; i++) {
+    struct psk_key *k = &ctx->keys[i];
+
+    if (k->used && !memcmp(k->salt, salt, SALT_LEN)) {
+      k->used = ++ctx->clock;
+      memcpy(key, k->key, KEYB);
+      pthread_mutex_unlock(&ctx->lock);
+      return 1;
+    }
+  }
+
+  for (int i = 0; i < PSK_INFLIGHT_MAX; i++) {
+    struct psk_inflight *p = &ctx->inflight[i];
+
+    if (p->refs && !memcmp(p->salt, salt, SALT_LEN)) {
+      p->refs++;
+      while (!p->done)
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+      memcpy(key, p->key, KEYB);
+      err = p->err;
+      psk_inflight_put(p);
+      pthread_mutex_unlock(&ctx->lock);
+      return err;
+    }
+    if (!p->refs && !f)
+      f = p;
+  }
+
+  /* 槽位用完时直接计算，不再合并 */
+  if (f) {
+    memcpy(f->salt, salt, SALT_LEN);
+    f->refs = 1;
+  }
+  pthread_mutex_unlock(&ctx->lock);
+
+  err = psk_ctx_derive(ctx, salt, key);
+
+  if (f) {
+    pthread_mutex_lock(&ctx->lock);
+    memcpy(f->key, key, KEYB);
+    f->err  = err;
+    f->done = true;
+    psk_inflight_put(f);
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+  }
+
+  if (err)
+    return err;
+
+  if (insert)
+    psk_ctx_insert(ctx, salt, key);
+
+  return 0;
+}
+
+// v2 报文密钥：BLAKE2b(key=长期密钥, SUBKEY_CONTEXT | ts | nonce)
+static int derive_subkey(const uint8_t ltk[KEYB], const uint8_t *ts_b, const uint8_t *nonce, uint8_t key[KEYB]) {
+  const size_t ctx_len = sizeof(SUBKEY_CONTEXT) - 1;
+  uint8_t      in[sizeof(SUBKEY_CONTEXT) - 1 + TS_LEN + NONCE_LEN];
+
+  memcpy(in, SUBKEY_CONTEXT, ctx_len);
+  memcpy(in + ctx_len, ts_b, TS_LEN);
+  memcpy(in + ctx_len + TS_LEN, nonce, NONCE_LEN);
+
+  return tucrypto_generichash(key, KEYB, in, sizeof(in), ltk, KEYB) ? -EINVAL : 0;
+}
+
+// XChaCha20-Poly1305，输出 ct | tag（mlen + TAG 字节）
+int aead_encrypt(uint8_t *ct, const uint8_t *m, size_t mlen, const uint8_t *ad, size_t adlen, const uint8_t *nonce,
+                 const uint8_t key[KEYB]) {
+#ifdef USE_TUCRYPTO
+  return tucrypto_crypto_aead_xchacha20poly1305_ietf_encrypt(ct, NULL, m, mlen, ad, adlen, nonce, key);
+#elif defined(USE_SODIUM)
+  return crypto_aead_xchacha20poly1305_ietf_encrypt(ct, NULL, m, mlen, ad, adlen, NULL, nonce, key);
+#else
+#error Invalid configuration
+#endif
+}
+
+// 验证失败返回非 0
+int aead_decrypt(uint8_t *m, unsigned long long *mlen, const uint8_t *ct, size_t ct_len, const uint8_t *ad, size_t adlen,
+                 const uint8_t *nonce, const uint8_t key[KEYB]) {
+#ifdef USE_TUCRYPTO
+  size_t mlen_t = 0;
+  int    err;
+
+  err   = tucrypto_crypto_aead_xchacha20poly1305_ietf_decrypt(m, &mlen_t, ct, ct_len, ad, adlen, nonce, key);
+  *mlen = (unsigned long long) mlen_t;
+  return err;
+#elif defined(USE_SODIUM)
+  return crypto_aead_xchacha20poly1305_ietf_decrypt(m, mlen, NULL, ct, ct_len, ad, adlen, nonce, key);
+#else
+#error Invalid configuration
+#endif
+}
+
 int remove_padding(uint8_t *pt, unsigned long long *pt_len) {
   long long i, len = (long long) *pt_len;
 
@@ -80,49 +247,134 @@ int remove_padding(uint8_t *pt, unsigned long long *pt_len) {
   return 0;
 }
 
-void replay_window_init(struct replay_window *rw, uint32_t window, uint32_t max_size) {
-  rw->window   = window;
-  rw->max_size = max_size;
-  rw->count    = 0;
-  INIT_LIST_HEAD(&rw->head);
+/*
+ * 重放缓存：条目在初始化时一次性分配，之后不再 malloc。
+ * - 查重：按 (ts, nonce) 哈希，哈希表大小为不小于 max_size 的 2 的幂，平均链长不超过 1；
+ * - 过期：按时间戳放入环形时间桶（每秒一个），时间前进时整桶回收，均摊 O(1)；
+ * - 满了：从最旧的时间桶中淘汰。
+ * 哈希带随机种子，nonce 由对方选择，不能让其构造冲突。
+ */
+static uint32_t replay_hash(const struct replay_window *rw, time_t ts, const uint8_t nonce[NONCE_LEN]) {
+  _Static_assert(NONCE_LEN % sizeof(uint64_t) == 0, "NONCE_LEN must be a multiple of 8");
+
+  uint64_t h = rw->seed ^ (uint64_t) ts, w;
+
+  for (size_t i = 0; i < NONCE_LEN; i += sizeof(w)) {
+    memcpy(&w, nonce + i, sizeof(w));
+    h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 32;
+  }
+
+  return (uint32_t) h & rw->hash_mask;
+}
+
+static struct list_head *replay_slot(const struct replay_window *rw, time_t ts) {
+  return &rw->slots[(uint64_t) ts & (rw->nslots - 1)];
 }
 
-void replay_window_free(struct replay_window *rw) {
-  struct list_head *p, *n;
+static void replay_release(struct replay_window *rw, struct replay_entry *e) {
+  hlist_del(&e->hnode);
+  list_move(&e->tlist, &rw->free);
+  rw->count--;
+}
 
-  list_for_each_safe(p, n, &rw->head) {
-    struct replay_entry *e = list_entry(p, struct replay_entry, list);
+// 回收时间戳早于 now - window 的条目
+static void replay_expire(struct replay_window *rw, time_t now) {
+  time_t target = now - (time_t) rw->window - 1;
+  time_t t      = rw->expired + 1;
+
+  if (target <= rw->expired)
+    return;
 
-    list_del(&e->list);
-    free(e);
+  // 停机很久后只需把每个桶扫一遍
+  if (target - t >= (time_t) rw->nslots)
+    t = target - (time_t) rw->nslots + 1;
+
+  for (; t <= target; t++) {
+    struct replay_entry *e, *n;
+
+    // 时间桶数量有上限时，一个桶里可能有多个不同秒的条目
+    list_for_each_entry_safe(e, n, replay_slot(rw, t), tlist) {
+      if (e->ts <= target)
+        replay_release(rw, e);
+    }
+  }
+
+  rw->expired = target;
+}
+
+// 淘汰最旧的时间桶中的一个条目
+static void replay_evict(struct replay_window *rw) {
+  for (uint32_t i = 1; i <= rw->nslots; i++) {
+    struct list_head *slot = replay_slot(rw, rw->expired + (time_t) i);
+
+    if (!list_empty(slot)) {
+      replay_release(rw, list_first_entry(slot, struct replay_entry, tlist));
+      return;
+    }
+  }
+}
+
+static uint32_t roundup_pow2(uint32_t n) {
+  uint32_t v = 1;
+
+  while (v < n && v < (1U << 31))
+    v <<= 1;
+  return v;
+}
+
+int replay_window_init(struct replay_window *rw, uint32_t window, uint32_t max_size) {
+  uint64_t nslots = 2 * (uint64_t) window + 2; // 可接受的时间戳范围为 now ± window
+
+  memset(rw, 0, sizeof(*rw));
+  rw->window    = window;
+  rw->max_size  = max_size ? max_size : 1;
+  rw->nslots    = roundup_pow2(nslots < REPLAY_MAX_SLOTS ? (uint32_t) nslots : REPLAY_MAX_SLOTS);
+  rw->hash_mask = roundup_pow2(rw->max_size) - 1;
+  rw->expired   = time(NULL) - (time_t) window - 1;
+  tucrypto_randombytes_buf(&rw->seed, sizeof(rw->seed));
+  INIT_LIST_HEAD(&rw->free);
+
+  rw->pool  = calloc(rw->max_size, sizeof(*rw->pool));
+  rw->hash  = calloc((size_t) rw->hash_mask + 1, sizeof(*rw->hash));
+  rw->slots = calloc(rw->nslots, sizeof(*rw->slots));
+  if (!rw->pool || !rw->hash || !rw->slots) {
+    replay_window_free(rw);
+    return -ENOMEM;
   }
 
+  for (uint32_t i = 0; i < rw->nslots; i++)
+    INIT_LIST_HEAD(&rw->slots[i]);
+  for (uint32_t i = 0; i < rw->max_size; i++)
+    list_add_tail(&rw->pool[i].tlist, &rw->free);
+
+  return 0;
+}
+
+void replay_window_free(struct replay_window *rw) {
+  free(rw->pool);
+  free(rw->hash);
+  free(rw->slots);
+  rw->pool  = NULL;
+  rw->hash  = NULL;
+  rw->slots = NULL;
   rw->count = 0;
 }
 
 // 返回1=新包，0=重放/过期
 int replay_check(struct replay_window *rw, time_t ts, const uint8_t nonce[NONCE_LEN]) {
-  struct list_head *p, *n;
-  time_t            now = time(NULL);
+  struct replay_entry *e;
+  struct hlist_node   *pos;
+  time_t               now = time(NULL);
 
   if (llabs(now - ts) > rw->window)
     return 0;
 
-  // 查重
-  list_for_each_safe(p, n, &rw->head) {
-    struct replay_entry *e = list_entry(p, struct replay_entry, list);
+  replay_expire(rw, now);
 
-    // 过期清理
-    if (e->ts + rw->window < now) {
-      list_del(&e->list);
-      free(e);
-      rw->count--;
-      continue;
-    }
-    // 查重
-    if (e->ts == ts && !tucrypto_memcmp(e->nonce, nonce, NONCE_LEN)) {
+  hlist_for_each_entry(e, pos, &rw->hash[replay_hash(rw, ts, nonce)], hnode) {
+    if (e->ts == ts && !tucrypto_memcmp(e->nonce, nonce, NONCE_LEN))
       return 0;
-    }
   }
 
   return 1;
@@ -130,61 +382,74 @@ int replay_check(struct replay_window *rw, time_t ts, const uint8_t nonce[NONCE_
 
 // 加入
 int replay_add(struct replay_window *rw, time_t ts, const uint8_t nonce[NONCE_LEN]) {
-  struct replay_entry *e = malloc(sizeof(*e));
-  if (!e) {
+  struct replay_entry *e;
+
+  replay_expire(rw, time(NULL));
+
+  // 控制容量
+  if (list_empty(&rw->free))
+    replay_evict(rw);
+  if (list_empty(&rw->free))
     return -ENOMEM;
-  }
 
+  e     = list_first_entry(&rw->free, struct replay_entry, tlist);
   e->ts = ts;
   memcpy(e->nonce, nonce, NONCE_LEN);
-  list_add_tail(&e->list, &rw->head);
+  list_move_tail(&e->tlist, replay_slot(rw, ts));
+  hlist_add_head(&e->hnode, &rw->hash[replay_hash(rw, ts, nonce)]);
   rw->count++;
 
-  // 控制容量
-  while (rw->count > rw->max_size) {
-    struct replay_entry *old = list_first_entry(&rw->head, struct replay_entry, list);
-    list_del(&old->list);
-    free(old);
-    rw->count--;
-  }
-
   return 0;
 }
 
-int encrypt_and_send_packet(int sock, const struct sockaddr *cli, socklen_t clen, struct replay_window *rwin, const char *psk,
-                            const char *payload, size_t payload_len, size_t *out_packet_len) {
-  int                err = 0;
-  uint8_t            key[KEYB];
-  uint8_t           *packet     = NULL;
-  unsigned long long ct_len     = 0;
-  size_t             packet_len = SALT_LEN + TS_LEN + NONCE_LEN + payload_len + TAG;
-  packet                        = try2_p(malloc(packet_len), "malloc failed");
-  time_t ts                     = time(NULL);
-
-  uint8_t *salt  = packet;
-  uint8_t *ts_b  = salt + SALT_LEN;
-  uint8_t *nonce = ts_b + TS_LEN;
-  uint8_t *ct    = nonce + NONCE_LEN;
-
-  tucrypto_randombytes_buf(salt, SALT_LEN);
+int encrypt_packet(uint8_t *packet, size_t *packet_len, struct psk_ctx *ctx, const struct pkt_hdr *hdr, struct mac_ctx *mac,
+                   const char *payload, size_t payload_len) {
+  int      err = 0;
+  uint8_t  key[KEYB], ltk[KEYB];
+  size_t   ct_end = SALT_LEN + TS_LEN + NONCE_LEN + payload_len + TAG;
+  time_t   ts     = time(NULL);
+  uint8_t *salt   = packet;
+  uint8_t *ts_b   = salt + SALT_LEN;
+  uint8_t *nonce  = ts_b + TS_LEN;
+  uint8_t *ct     = nonce + NONCE_LEN;
+
+  if (hdr->version == PROTO_V1) {
+    tucrypto_randombytes_buf(salt, SALT_LEN);
+  } else {
+    memcpy(salt, hdr->salt, SALT_LEN);
+  }
   uint64_t ts_resp = htobe64((uint64_t) ts);
   memcpy(ts_b, &ts_resp, TS_LEN);
   tucrypto_randombytes_buf(nonce, NONCE_LEN);
 
-  try2(psk2key(psk, salt, key), "derive key failed: %ld", _ret);
-#ifdef USE_TUCRYPTO
-  size_t ct_len_t = (size_t) ct_len;
-  try2(tucrypto_crypto_aead_xchacha20poly1305_ietf_encrypt(ct, &ct_len_t, (const uint8_t *) payload, payload_len, salt,
-                                                           SALT_LEN + TS_LEN, nonce, key),
-       "encryption failed: %ld", _ret);
-  ct_len = (unsigned long long) ct_len_t;
-#elif defined(USE_SODIUM)
-  try2(crypto_aead_xchacha20poly1305_ietf_encrypt(ct, &ct_len, (const uint8_t *) payload, payload_len, salt, SALT_LEN + TS_LEN,
-                                                  NULL, nonce, key),
-       "encryption failed: %ld", _ret);
-#else
-#error Invalid configuration
-#endif
+  if (hdr->version == PROTO_V1) {
+    try2(psk_ctx_derive(ctx, salt, key), "derive key failed: %ld", _ret);
+  } else {
+    try2(psk_ctx_key(ctx, salt, ltk, true), "derive key failed: %ld", _ret);
+    try2(derive_subkey(ltk, ts_b, nonce, key), "derive subkey failed: %ld", _ret);
+  }
+  try2(aead_encrypt(ct, (const uint8_t *) payload, payload_len, salt, SALT_LEN + TS_LEN, nonce, key), "encryption failed: %ld",
+       _ret);
+  if (mac)
+    try2(mac_append(mac, packet, ct_end), "mac failed: %ld", _ret);
+
+  *packet_len = ct_end + (mac ? 2 * MAC_LEN : 0);
+  err         = 0;
+err_cleanup:
+  tucrypto_memzero(key, KEYB);
+  tucrypto_memzero(ltk, KEYB);
+  return err;
+}
+
+int encrypt_and_send_packet(int sock, const struct sockaddr *cli, socklen_t clen, struct replay_window *rwin,
+                            struct psk_ctx *ctx, const struct pkt_hdr *hdr, struct mac_ctx *mac, const char *payload,
+                            size_t payload_len, size_t *out_packet_len) {
+  int      err        = 0;
+  uint8_t *packet     = NULL;
+  size_t   packet_len = MIN_LEN + payload_len + 2 * MAC_LEN;
+  packet              = try2_p(malloc(packet_len), "malloc failed");
+
+  try2(encrypt_packet(packet, &packet_len, ctx, hdr, mac, payload, payload_len));
 
 #ifdef _WIN32
   err = sendto(sock, (void *) packet, packet_len, 0, cli, clen);
@@ -197,12 +462,17 @@ int encrypt_and_send_packet(int sock, const struct sockaddr *cli, socklen_t clen
   try2_e(sendto(sock, packet, packet_len, 0, cli, clen), "sendto: %s", strerrno);
 #endif
 
-  err = replay_add(rwin, ts, nonce);
-  if (err) {
-    char abuf[128];
-    try2(addr_to_str((struct sockaddr_storage *) cli, abuf, sizeof(abuf)));
-    log_error("cannot add to replay list: %s", abuf);
-    goto err_cleanup;
+  if (rwin) {
+    time_t ts;
+
+    memcpy(&ts, packet + SALT_LEN, sizeof(ts));
+    err = replay_add(rwin, be64toh(ts), packet + SALT_LEN + TS_LEN);
+    if (err) {
+      char abuf[128];
+      try2(addr_to_str((struct sockaddr_storage *) cli, abuf, sizeof(abuf)));
+      log_error("cannot add to replay list: %s", abuf);
+      goto err_cleanup;
+    }
   }
 
   if (out_packet_len)
@@ -210,7 +480,6 @@ int encrypt_and_send_packet(int sock, const struct sockaddr *cli, socklen_t clen
   err = 0;
 err_cleanup:
   free(packet);
-  tucrypto_memzero(key, KEYB);
   return err;
 }
 
@@ -219,15 +488,18 @@ err_cleanup:
  * @param[out] pt_out      Buffer to store the decrypted plaintext.
  * @param[out] pt_len_out  Pointer to store the length of the plaintext.
  * @param[in]  cli         Client address for logging purposes.
+ * @param[in]  rwin        Replay window, NULL if the caller checks for replay itself using hdr_out->ts/nonce.
+ * @param[out] hdr_out     Protocol version, salt, timestamp and nonce of the packet (may be NULL).
  * @return 0 on success, non-zero on any validation/decryption failure.
  */
 int decrypt_and_validate_packet(uint8_t *pt_out, unsigned long long *pt_len_out, const uint8_t *pkt_in, ssize_t pkt_len,
-                                struct replay_window *rwin, const char *psk, const struct sockaddr_storage *cli) {
+                                struct replay_window *rwin, struct psk_ctx *ctx, const struct sockaddr_storage *cli,
+                                struct pkt_hdr *hdr_out) {
   _Static_assert(sizeof(time_t) >= 8, "time_t must be at least 64 bit");
 
-  int     err = 0;
+  int     err = 0, cached, version;
   char    abuf[128];
-  uint8_t key[KEYB];
+  uint8_t key[KEYB], ltk[KEYB];
 
   if (pkt_len < (ssize_t) MIN_LEN) {
     try2(addr_to_str(cli, abuf, sizeof(abuf)));
@@ -246,24 +518,24 @@ int decrypt_and_validate_packet(uint8_t *pt_out, unsigned long long *pt_len_out,
   memcpy(&ts, ts_b, sizeof(ts));
   ts = be64toh(ts);
 
-  if (!replay_check(rwin, ts, nonce)) {
+  if (rwin && !replay_check(rwin, ts, nonce)) {
     try2(addr_to_str(cli, abuf, sizeof(abuf)));
     log_error("drop: replay/window from %s", abuf);
     err = -EACCES;
     goto err_cleanup;
   }
 
-  try2(psk2key(psk, salt, key), "derive key failed: %ld", _ret);
+  /* 长期密钥在认证通过后才放入缓存，伪造的 salt 不会挤掉有效条目 */
+  cached = try2(psk_ctx_key(ctx, salt, ltk, false), "derive key failed: %ld", _ret);
+  try2(derive_subkey(ltk, ts_b, nonce, key), "derive subkey failed: %ld", _ret);
 
-#ifdef USE_TUCRYPTO
-  size_t pt_len_t = 0;
-  err = tucrypto_crypto_aead_xchacha20poly1305_ietf_decrypt(pt_out, &pt_len_t, ct, ct_len, salt, SALT_LEN + TS_LEN, nonce, key);
-  *pt_len_out = (unsigned long long) pt_len_t;
-#elif defined(USE_SODIUM)
-  err = crypto_aead_xchacha20poly1305_ietf_decrypt(pt_out, pt_len_out, NULL, ct, ct_len, salt, SALT_LEN + TS_LEN, nonce, key);
-#else
-#error Invalid configuration
-#endif
+  version = PROTO_V2;
+  err     = aead_decrypt(pt_out, pt_len_out, ct, ct_len, salt, SALT_LEN + TS_LEN, nonce, key);
+  if (err) {
+    /* v1 的报文密钥就是长期密钥本身 */
+    version = PROTO_V1;
+    err     = aead_decrypt(pt_out, pt_len_out, ct, ct_len, salt, SALT_LEN + TS_LEN, nonce, ltk);
+  }
   if (err) {
     try2(addr_to_str(cli, abuf, sizeof(abuf)));
     log_error("drop: decrypt/auth fail from %s", abuf);
@@ -271,15 +543,28 @@ int decrypt_and_validate_packet(uint8_t *pt_out, unsigned long long *pt_len_out,
     goto err_cleanup;
   }
 
-  err = replay_add(rwin, ts, nonce);
-  if (err) {
-    try2(addr_to_str(cli, abuf, sizeof(abuf)));
-    log_error("cannot add to replay list: %s", abuf);
-    goto err_cleanup;
+  if (version == PROTO_V2 && !cached)
+    psk_ctx_insert(ctx, salt, ltk);
+
+  if (rwin) {
+    err = replay_add(rwin, ts, nonce);
+    if (err) {
+      try2(addr_to_str(cli, abuf, sizeof(abuf)));
+      log_error("cannot add to replay list: %s", abuf);
+      goto err_cleanup;
+    }
+  }
+
+  if (hdr_out) {
+    hdr_out->version = version;
+    hdr_out->ts      = ts;
+    memcpy(hdr_out->salt, salt, SALT_LEN);
+    memcpy(hdr_out->nonce, nonce, NONCE_LEN);
   }
 
 err_cleanup:
   tucrypto_memzero(key, KEYB);
+  tucrypto_memzero(ltk, KEYB);
   return err;
 }
 
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -20,38 +22,199 @@
 #define MAX_CT_SIZE 1444
 #define MAX_PT_SIZE (MAX_CT_SIZE - MIN_LEN)
 
+/*
+ * 协议版本，报文格式相同：salt | ts | nonce | ct+tag，AD 为 salt | ts。
+ * - v1: 每个报文随机 salt，Argon2id(psk, salt) 直接作为报文密钥
+ * - v2: salt 在进程内复用，Argon2id(psk, salt) 作为长期密钥缓存起来，
+ *       报文密钥为 BLAKE2b(key=长期密钥, "tutuicmptunnel v2" | ts | nonce)
+ * 接收方先按 v2 再按 v1 尝试解密，回复沿用请求的版本和 salt。
+ */
+#define PROTO_V1       1
+#define PROTO_V2       2
+#define PROTO_DEFAULT  PROTO_V2
+#define KEY_CACHE_SIZE 16
+#define SUBKEY_CONTEXT "tutuicmptunnel v2"
+
+/*
+ * mac1/cookie（cookie.c）：解密前的廉价检查，报文末尾追加 mac1 | mac2。
+ * cookie reply（nonce | AEAD(cookie)）比 MIN_LEN 短，不会与普通回复混淆。
+ */
+#define MAC_LEN               16
+#define COOKIE_LEN            16
+#define COOKIE_REPLY_LEN      (NONCE_LEN + COOKIE_LEN + TAG)
+#define MAC_SALT              "tutuicmptunnel-m"
+#define COOKIE_SECRET_TIMEOUT 120 // 秒，服务器更换 cookie secret 的周期
+#define COOKIE_LATENCY        5   // 秒，客户端提前丢弃 cookie 的余量
+
+#ifndef COOKIE_LOAD_THRESHOLD
+#define COOKIE_LOAD_THRESHOLD 4 // 每秒 Argon2id 次数达到此值即视为负载过高
+#endif
+
+/*
+ * 多报文消息（message.c，仅 v2）：一条消息拆成最多 MSG_MAX_FRAGMENTS 个报文，每个报文单独加密认证。
+ * 明文：MSG_MAGIC | type | index | count | len(2) | msg_id(8) | data | 填充
+ * 普通脚本不会以 '\0' 开头，服务器据此区分消息和旧的单报文请求。
+ */
+#define MSG_MAGIC         0x00
+#define MSG_DATA          'D' // 数据分片
+#define MSG_ACK           'A' // 已收到的分片位图，对方据此重传缺失的分片
+#define MSG_HDR_LEN       14
+#define MSG_ID_LEN        8
+#define MSG_MAX_FRAGMENTS 64                                        // 位图为 uint64_t
+#define MSG_FRAG_DATA     (MAX_PT_SIZE - 2 * MAC_LEN - MSG_HDR_LEN) // 每个分片的数据长度，客户端要给 MAC 尾部留出空间
+#define MSG_MAX_LEN       (MSG_MAX_FRAGMENTS * MSG_FRAG_DATA)
+
 #define DEFAULT_SERVER      "127.0.0.1"
 #define DEFAULT_SERVER_PORT 14801
 #define DEFAULT_WINDOW      30
 #define DEFAULT_REPLAY_MAX  32768
+#define CLIENT_REPLAY_MAX   256 // 客户端只会收到少量回复
+
+#ifndef REPLAY_MAX_SLOTS
+#define REPLAY_MAX_SLOTS 4096 // 时间桶数量上限，window 很大时一个桶包含多秒
+#endif
 
-// --- 重放窗口链表 ---
+// --- 重放缓存：哈希查重 + 环形时间桶过期，条目预先分配 ---
 struct replay_entry {
-  struct list_head list;
-  time_t           ts;
-  uint8_t          nonce[NONCE_LEN];
+  struct hlist_node hnode; // 哈希链
+  struct list_head  tlist; // 所在时间桶，空闲时在 free 链表上
+  time_t            ts;
+  uint8_t           nonce[NONCE_LEN];
 };
 
 struct replay_window {
-  uint32_t         window; // 秒
-  uint32_t         max_size;
-  uint32_t         count;
-  struct list_head head;
+  uint32_t             window; // 秒
+  uint32_t             max_size;
+  uint32_t             count;
+  uint32_t             hash_mask;
+  uint32_t             nslots;  // 2 的幂
+  time_t               expired; // 时间戳不晚于此的条目已回收
+  uint64_t             seed;
+  struct replay_entry *pool;
+  struct hlist_head   *hash;
+  struct list_head    *slots;
+  struct list_head     free;
+};
+
+// --- 长期密钥缓存 ---
+struct psk_key {
+  uint8_t  salt[SALT_LEN];
+  uint8_t  key[KEYB];
+  uint64_t used; // LRU 时钟，0 表示空槽
+};
+
+// 正在计算的长期密钥：同一 salt 的其他请求等待结果，不再各自运行 Argon2id
+#define PSK_INFLIGHT_MAX 8
+struct psk_inflight {
+  uint8_t  salt[SALT_LEN];
+  uint8_t  key[KEYB];
+  int      err;
+  unsigned refs; // 0 表示空槽
+  bool     done;
+};
+
+// 可在多个线程间共享：缓存由 lock 保护，Argon2id 在锁外运行
+struct psk_ctx {
+  const char         *psk;
+  pthread_mutex_t     lock;
+  pthread_cond_t      cond; // inflight 计算完成
+  uint64_t            clock;
+  uint64_t            derivations; // Argon2id 运行次数（原子访问），服务器据此判断负载
+  struct psk_key      keys[KEY_CACHE_SIZE];
+  struct psk_inflight inflight[PSK_INFLIGHT_MAX];
+};
+
+// 报文的协议版本和 salt：解密时填写，加密回复时沿用；ts/nonce 供调用者自行做重放检查
+struct pkt_hdr {
+  int     version;
+  uint8_t salt[SALT_LEN];
+  time_t  ts;
+  uint8_t nonce[NONCE_LEN];
+};
+
+struct mac_ctx {
+  uint8_t mac1_key[KEYB];
+  uint8_t cookie_key[KEYB];
+  // 服务器：生成 cookie 的随机 secret
+  uint8_t secret[KEYB];
+  time_t  secret_time;
+  // 客户端：最近收到的 cookie 和最近发送的 mac1
+  uint8_t cookie[COOKIE_LEN];
+  time_t  cookie_time;
+  uint8_t last_mac1[MAC_LEN];
+};
+
+// 解析后的分片，data 指向明文内部
+struct msg_frame {
+  uint8_t        type;
+  uint8_t        index;
+  uint8_t        count;
+  uint16_t       len;
+  uint64_t       id;
+  const uint8_t *data;
+};
+
+// 分片重组：除最后一个外每个分片都是 MSG_FRAG_DATA 字节，按序号直接放入 buf
+struct msg_asm {
+  uint64_t id;
+  uint8_t  count; // 0 表示还没有收到分片
+  uint64_t mask;  // 已收到的分片
+  size_t   len;   // 收齐后的消息长度
+  uint8_t *buf;   // count * MSG_FRAG_DATA + 1 字节，收齐后以 '\0' 结尾
 };
 
 struct sockaddr_storage;
-int addr_to_str(const struct sockaddr_storage *addr, char *out, size_t len);
-int psk2key(const char *psk, const uint8_t *salt, uint8_t *key);
-int remove_padding(uint8_t *pt, unsigned long long *pt_len);
-int encrypt_and_send_packet(int sock, const struct sockaddr *cli, socklen_t clen, struct replay_window *rwin, const char *psk,
-                            const char *payload, size_t payload_len, size_t *out_packet_len);
-int decrypt_and_validate_packet(uint8_t *pt_out, unsigned long long *pt_len_out, const uint8_t *pkt_in, ssize_t pkt_len,
-                                struct replay_window *rwin, const char *psk, const struct sockaddr_storage *cli);
+int  addr_to_str(const struct sockaddr_storage *addr, char *out, size_t len);
+int  psk2key(const char *psk, const uint8_t *salt, uint8_t *key);
+void psk_ctx_init(struct psk_ctx *ctx, const char *psk);
+void psk_ctx_free(struct psk_ctx *ctx);
+void pkt_hdr_init(struct pkt_hdr *hdr, int version);
+int  remove_padding(uint8_t *pt, unsigned long long *pt_len);
+int  aead_encrypt(uint8_t *ct, const uint8_t *m, size_t mlen, const uint8_t *ad, size_t adlen, const uint8_t *nonce,
+                  const uint8_t key[KEYB]);
+int  aead_decrypt(uint8_t *m, unsigned long long *mlen, const uint8_t *ct, size_t ct_len, const uint8_t *ad, size_t adlen,
+                  const uint8_t *nonce, const uint8_t key[KEYB]);
+// packet 至少 MIN_LEN + payload_len 字节（有 mac 时再加 2 * MAC_LEN），只加密不发送
+int  encrypt_packet(uint8_t *packet, size_t *packet_len, struct psk_ctx *ctx, const struct pkt_hdr *hdr, struct mac_ctx *mac,
+                    const char *payload, size_t payload_len);
+int  encrypt_and_send_packet(int sock, const struct sockaddr *cli, socklen_t clen, struct replay_window *rwin,
+                             struct psk_ctx *ctx, const struct pkt_hdr *hdr, struct mac_ctx *mac, const char *payload,
+                             size_t payload_len, size_t *out_packet_len);
+int  decrypt_and_validate_packet(uint8_t *pt_out, unsigned long long *pt_len_out, const uint8_t *pkt_in, ssize_t pkt_len,
+                                 struct replay_window *rwin, struct psk_ctx *ctx, const struct sockaddr_storage *cli,
+                                 struct pkt_hdr *hdr_out);
 
 void setup_pwhash_memlimit(void);
 
+// mac1/cookie
+int  mac_ctx_init(struct mac_ctx *m, const char *psk);
+void mac_ctx_free(struct mac_ctx *m);
+int  mac_append(struct mac_ctx *m, uint8_t *pkt, size_t len);
+int  mac1_verify(const struct mac_ctx *m, const uint8_t *pkt, size_t len);
+int  mac2_verify(struct mac_ctx *m, const uint8_t *pkt, size_t len, const struct sockaddr_storage *cli);
+int  cookie_reply_make(struct mac_ctx *m, const struct sockaddr_storage *cli, const uint8_t *pkt, size_t len,
+                       uint8_t reply[COOKIE_REPLY_LEN]);
+int  cookie_reply_open(struct mac_ctx *m, const uint8_t *pkt, size_t len);
+
+// 多报文消息
+static inline uint64_t msg_full_mask(unsigned count) {
+  return count >= 64 ? ~0ULL : (1ULL << count) - 1;
+}
+static inline unsigned msg_frag_count(size_t len) {
+  return len ? (unsigned) ((len + MSG_FRAG_DATA - 1) / MSG_FRAG_DATA) : 1;
+}
+int    msg_frame_parse(const uint8_t *pt, size_t pt_len, struct msg_frame *f);
+size_t msg_frame_build(uint8_t *pt, size_t size, uint8_t type, uint64_t id, uint8_t index, uint8_t count, const void *data,
+                       size_t len);
+size_t msg_data_frame(uint8_t *pt, size_t size, uint64_t id, const void *msg, size_t msg_len, unsigned index);
+size_t msg_ack_frame(uint8_t *pt, size_t size, uint64_t id, uint64_t mask);
+int    msg_ack_mask(const struct msg_frame *f, uint64_t *mask);
+void   msg_asm_init(struct msg_asm *m, uint64_t id);
+int    msg_asm_add(struct msg_asm *m, const struct msg_frame *f);
+void   msg_asm_free(struct msg_asm *m);
+
 // 重放相关
-void replay_window_init(struct replay_window *rw, uint32_t window, uint32_t max_size);
+int  replay_window_init(struct replay_window *rw, uint32_t window, uint32_t max_size);
 void replay_window_free(struct replay_window *rw);
 int  replay_check(struct replay_window *rw, time_t ts, const uint8_t nonce[NONCE_LEN]);
 int  replay_add(struct replay_window *rw, time_t ts, const uint8_t nonce[NONCE_LEN]);
@@ -0,0 +1,149 @@
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "log.h"
+#include "try.h"
+
+/*
+ * mac1/cookie：在任何 Argon2id 之前丢弃伪造报文（仿 WireGuard）。
+ *
+ * 带 MAC 的报文：salt | ts | nonce | ct+tag | mac1 | mac2
+ * - mac1 = BLAKE2b-128(mac1_key, mac1 之前的内容)，证明发送方知道 PSK；
+ * - mac2 = BLAKE2b-128(cookie, mac2 之前的内容)，没有 cookie 时全零。
+ *
+ * 服务器负载过高时还要求有效的 mac2，否则回复 cookie reply：nonce | AEAD(cookie_key, cookie, AD=mac1)。
+ * cookie = BLAKE2b-128(secret, 源地址)，secret 每 COOKIE_SECRET_TIMEOUT 秒更换一次，
+ * 能带回 cookie 说明发送方确实能收到发往该地址的报文，伪造源地址的洪泛无法通过。
+ *
+ * mac1_key/cookie_key 由 Argon2id(psk, MAC_SALT) 在启动时派生一次：
+ * 如果直接对 PSK 做哈希，截获的 mac1 就能以 BLAKE2b 的速度离线穷举 PSK。
+ */
+
+_Static_assert(sizeof(MAC_SALT) - 1 == SALT_LEN, "MAC_SALT must be SALT_LEN bytes");
+
+static int keyed_hash(uint8_t *out, size_t outlen, const void *in, size_t inlen, const uint8_t *key, size_t keylen) {
+  return tucrypto_generichash(out, outlen, in, inlen, key, keylen) ? -EINVAL : 0;
+}
+
+int mac_ctx_init(struct mac_ctx *m, const char *psk) {
+  uint8_t master[KEYB];
+  int     err;
+
+  memset(m, 0, sizeof(*m));
+  try2(psk2key(psk, (const uint8_t *) MAC_SALT, master), "derive mac key failed: %ld", _ret);
+  try2(keyed_hash(m->mac1_key, KEYB, "mac1", 4, master, KEYB));
+  try2(keyed_hash(m->cookie_key, KEYB, "cookie", 6, master, KEYB));
+  err = 0;
+
+err_cleanup:
+  tucrypto_memzero(master, KEYB);
+  return err;
+}
+
+void mac_ctx_free(struct mac_ctx *m) {
+  tucrypto_memzero(m, sizeof(*m));
+}
+
+// 在 pkt + len 处写入 mac1 | mac2，调用者保证有 2 * MAC_LEN 字节空间
+int mac_append(struct mac_ctx *m, uint8_t *pkt, size_t len) {
+  uint8_t *mac1 = pkt + len;
+  uint8_t *mac2 = mac1 + MAC_LEN;
+  time_t   now  = time(NULL);
+  int      err;
+
+  err = try(keyed_hash(mac1, MAC_LEN, pkt, len, m->mac1_key, KEYB));
+  memcpy(m->last_mac1, mac1, MAC_LEN);
+
+  if (m->cookie_time && now - m->cookie_time < COOKIE_SECRET_TIMEOUT - COOKIE_LATENCY) {
+    err = try(keyed_hash(mac2, MAC_LEN, pkt, len + MAC_LEN, m->cookie, COOKIE_LEN));
+  } else {
+    memset(mac2, 0, MAC_LEN);
+  }
+
+  return err;
+}
+
+// len 包含 MAC 尾部，返回 1 表示 mac1 有效
+int mac1_verify(const struct mac_ctx *m, const uint8_t *pkt, size_t len) {
+  uint8_t mac[MAC_LEN];
+
+  if (len < MIN_LEN + 2 * MAC_LEN)
+    return 0;
+
+  if (keyed_hash(mac, MAC_LEN, pkt, len - 2 * MAC_LEN, m->mac1_key, KEYB))
+    return 0;
+
+  return !tucrypto_memcmp(mac, pkt + len - 2 * MAC_LEN, MAC_LEN);
+}
+
+// cookie 只绑定源 IP，不含端口：客户端每次重试都会换一个 socket
+static int cookie_make(struct mac_ctx *m, const struct sockaddr_storage *cli, uint8_t cookie[COOKIE_LEN]) {
+  uint8_t addr[1 + sizeof(struct in6_addr)] = {};
+  time_t  now                               = time(NULL);
+
+  if (!m->secret_time || now - m->secret_time >= COOKIE_SECRET_TIMEOUT) {
+    tucrypto_randombytes_buf(m->secret, sizeof(m->secret));
+    m->secret_time = now;
+  }
+
+  addr[0] = (uint8_t) cli->ss_family;
+  if (cli->ss_family == AF_INET)
+    memcpy(addr + 1, &((const struct sockaddr_in *) cli)->sin_addr, sizeof(struct in_addr));
+  else if (cli->ss_family == AF_INET6)
+    memcpy(addr + 1, &((const struct sockaddr_in6 *) cli)->sin6_addr, sizeof(struct in6_addr));
+
+  return keyed_hash(cookie, COOKIE_LEN, addr, sizeof(addr), m->secret, sizeof(m->secret));
+}
+
+// len 包含 MAC 尾部，返回 1 表示 mac2 是用发给 cli 的当前 cookie 计算的
+int mac2_verify(struct mac_ctx *m, const uint8_t *pkt, size_t len, const struct sockaddr_storage *cli) {
+  uint8_t cookie[COOKIE_LEN], mac[MAC_LEN];
+  int     ok = 0;
+
+  if (len < MIN_LEN + 2 * MAC_LEN)
+    return 0;
+
+  if (!cookie_make(m, cli, cookie) && !keyed_hash(mac, MAC_LEN, pkt, len - MAC_LEN, cookie, COOKIE_LEN))
+    ok = !tucrypto_memcmp(mac, pkt + len - MAC_LEN, MAC_LEN);
+
+  tucrypto_memzero(cookie, COOKIE_LEN);
+  return ok;
+}
+
+// 生成 cookie reply，pkt/len 为触发它的请求（mac1 有效），由调用者批量发送
+int cookie_reply_make(struct mac_ctx *m, const struct sockaddr_storage *cli, const uint8_t *pkt, size_t len,
+                      uint8_t reply[COOKIE_REPLY_LEN]) {
+  uint8_t cookie[COOKIE_LEN];
+  int     err;
+
+  try2(cookie_make(m, cli, cookie));
+  tucrypto_randombytes_buf(reply, NONCE_LEN);
+  try2(aead_encrypt(reply + NONCE_LEN, cookie, COOKIE_LEN, pkt + len - 2 * MAC_LEN, MAC_LEN, reply, m->cookie_key),
+       "encryption failed: %ld", _ret);
+
+  err = 0;
+err_cleanup:
+  tucrypto_memzero(cookie, COOKIE_LEN);
+  return err;
+}
+
+// 客户端：解开 cookie reply 并保存 cookie，之后发送的报文带上 mac2
+int cookie_reply_open(struct mac_ctx *m, const uint8_t *pkt, size_t len) {
+  uint8_t            cookie[COOKIE_LEN];
+  unsigned long long cookie_len = 0;
+
+  if (len != COOKIE_REPLY_LEN)
+    return -EINVAL;
+
+  if (aead_decrypt(cookie, &cookie_len, pkt + NONCE_LEN, COOKIE_LEN + TAG, m->last_mac1, MAC_LEN, pkt, m->cookie_key))
+    return -EBADMSG;
+
+  memcpy(m->cookie, cookie, COOKIE_LEN);
+  m->cookie_time = time(NULL);
+  tucrypto_memzero(cookie, COOKIE_LEN);
+  return 0;
+}
+
+// vim: set sw=2 ts=2 expandtab:
@@ -0,0 +1,148 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "try.h"
+
+/*
+ * 多报文消息：脚本或回复超过一个报文时拆成多个分片，每个分片都是一个完整的加密报文，
+ * 单独认证、单独做重放检查，重组时只信任认证过的分片头。
+ *
+ * 选择性重传：
+ * - 接收方收到最后一个分片但消息仍不完整时回复 MSG_ACK（已收到的位图），发送方只重传缺失的分片；
+ * - 客户端超时后重发最后一个请求分片作为探测，或对不完整的回复发送 MSG_ACK；
+ * - 服务器按 msg_id 缓存已执行消息的回复，重传只重新加密回复，命令不会重复执行。
+ */
+
+_Static_assert(MSG_FRAG_DATA > 0 && MSG_FRAG_DATA <= 0xffff, "invalid MSG_FRAG_DATA");
+
+int msg_frame_parse(const uint8_t *pt, size_t pt_len, struct msg_frame *f) {
+  if (pt_len < MSG_HDR_LEN || pt[0] != MSG_MAGIC)
+    return -EINVAL;
+
+  f->type  = pt[1];
+  f->index = pt[2];
+  f->count = pt[3];
+  f->len   = (uint16_t) (pt[4] << 8 | pt[5]);
+  memcpy(&f->id, pt + 6, MSG_ID_LEN);
+  f->data = pt + MSG_HDR_LEN;
+
+  if (f->len > pt_len - MSG_HDR_LEN)
+    return -EINVAL;
+
+  switch (f->type) {
+  case MSG_DATA:
+    if (!f->count || f->count > MSG_MAX_FRAGMENTS || f->index >= f->count || f->len > MSG_FRAG_DATA)
+      return -EINVAL;
+    return 0;
+  case MSG_ACK:
+    return f->len == sizeof(uint64_t) ? 0 : -EINVAL;
+  default:
+    return -EINVAL;
+  }
+}
+
+// 返回明文长度，size 不足时返回 0；不满的分片加随机填充，掩盖消息长度
+size_t msg_frame_build(uint8_t *pt, size_t size, uint8_t type, uint64_t id, uint8_t index, uint8_t count, const void *data,
+                       size_t len) {
+  size_t pad_len = tucrypto_randombytes_uniform(256);
+
+  if (MSG_HDR_LEN + len > size || len > MSG_FRAG_DATA)
+    return 0;
+
+  pt[0] = MSG_MAGIC;
+  pt[1] = type;
+  pt[2] = index;
+  pt[3] = count;
+  pt[4] = (uint8_t) (len >> 8);
+  pt[5] = (uint8_t) len;
+  memcpy(pt + 6, &id, MSG_ID_LEN);
+  memcpy(pt + MSG_HDR_LEN, data, len);
+
+  len += MSG_HDR_LEN;
+  if (pad_len > size - len)
+    pad_len = size - len;
+  memset(pt + len, '#', pad_len);
+  return len + pad_len;
+}
+
+// 第 index 个数据分片
+size_t msg_data_frame(uint8_t *pt, size_t size, uint64_t id, const void *msg, size_t msg_len, unsigned index) {
+  unsigned count = msg_frag_count(msg_len);
+  size_t   off   = (size_t) index * MSG_FRAG_DATA;
+  size_t   len;
+
+  if (index >= count)
+    return 0;
+
+  len = msg_len - off < MSG_FRAG_DATA ? msg_len - off : MSG_FRAG_DATA;
+  return msg_frame_build(pt, size, MSG_DATA, id, (uint8_t) index, (uint8_t) count, (const uint8_t *) msg + off, len);
+}
+
+size_t msg_ack_frame(uint8_t *pt, size_t size, uint64_t id, uint64_t mask) {
+  uint64_t be = htobe64(mask);
+
+  return msg_frame_build(pt, size, MSG_ACK, id, 0, 0, &be, sizeof(be));
+}
+
+int msg_ack_mask(const struct msg_frame *f, uint64_t *mask) {
+  uint64_t be;
+
+  if (f->type != MSG_ACK)
+    return -EINVAL;
+
+  memcpy(&be, f->data, sizeof(be));
+  *mask = be64toh(be);
+  return 0;
+}
+
+void msg_asm_init(struct msg_asm *m, uint64_t id) {
+  memset(m, 0, sizeof(*m));
+  m->id = id;
+}
+
+/**
+ * @brief 放入一个数据分片。
+ * @return 1 消息已收齐，0 还缺分片，-EINVAL 分片与之前的不一致，-ENOMEM 内存不足。
+ */
+int msg_asm_add(struct msg_asm *m, const struct msg_frame *f) {
+  uint64_t bit = 1ULL << f->index;
+
+  if (f->type != MSG_DATA || f->id != m->id)
+    return -EINVAL;
+
+  if (!m->count) {
+    m->buf   = try_p(malloc((size_t) f->count * MSG_FRAG_DATA + 1));
+    m->count = f->count;
+  } else if (f->count != m->count) {
+    return -EINVAL;
+  }
+
+  /* 只有最后一个分片可以不满，偏移量因此只取决于序号 */
+  if (f->index + 1 < m->count && f->len != MSG_FRAG_DATA)
+    return -EINVAL;
+
+  if (!(m->mask & bit)) {
+    memcpy(m->buf + (size_t) f->index * MSG_FRAG_DATA, f->data, f->len);
+    if (f->index + 1 == m->count)
+      m->len = (size_t) f->index * MSG_FRAG_DATA + f->len;
+    m->mask |= bit;
+  }
+
+  if (m->mask != msg_full_mask(m->count))
+    return 0;
+
+  m->buf[m->len] = '\0';
+  return 1;
+}
+
+void msg_asm_free(struct msg_asm *m) {
+  if (m->buf) {
+    tucrypto_memzero(m->buf, (size_t) m->count * MSG_FRAG_DATA + 1);
+    free(m->buf);
+  }
+  memset(m, 0, sizeof(*m));
+}
+
+// vim: set sw=2 ts=2 expandtab:
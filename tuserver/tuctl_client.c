@@ -1,8 +1,14 @@
 #include <errno.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/rtnetlink.h>
+#include <poll.h>
+#endif
+
 #include "../tucrypto/tucrypto.h"
 #include "common.h"
 #include "log.h"
@@ -14,36 +20,194 @@
 
 #define DEFAULT_SERVER "127.0.0.1"
 
+#ifndef CLIENT_TIMEOUT_MS
+#define CLIENT_TIMEOUT_MS 5000 // 每次发送后等待回复的时间
+#endif
+
+/* 未指定 protocol：先用 v2，服务器没有回应或回复无法解密时对该服务器改用 v1 重试一次 */
+#define PROTO_AUTO 0
+
+/* 每个 PSK 一份：同一 PSK 的服务器共用 salt 和长期密钥，Argon2id 只运行一次 */
+struct key_ctx {
+  const char    *psk;
+  struct psk_ctx pctx;
+  struct pkt_hdr hdr;
+  struct mac_ctx mctx; // 只用到 mac1/cookie 密钥，cookie 按服务器保存
+};
+
+enum target_state {
+  TARGET_IDLE,    // 本轮不推送
+  TARGET_PENDING, // 已发送，等待回复
+  TARGET_DONE,
+  TARGET_FAILED,
+};
+
+struct target {
+  char               *host;
+  uint16_t            port; // 0 表示使用 server-port
+  char               *psk;  // NULL 表示使用全局 psk
+  struct key_ctx     *keys;
+  struct mac_ctx      mctx; // 复制自 keys->mctx，cookie 和最近的 mac1 因服务器而异
+  struct sockaddr_in6 addr;
+  enum target_state   state;
+  uint16_t            retries;
+  int64_t             deadline; // 毫秒
+  int                 err;
+  int                 version; // 本轮使用的协议版本
+  bool                legacy;  // PROTO_AUTO：已确认是只支持 v1 的服务器
+  bool                v2_seen; // 本轮收到过 v2 回复（ACK、分片或 cookie），不再回退
+  uint64_t            msg_id;  // v2：本轮请求的消息
+  uint64_t            acked;   // 服务器确认收到的请求分片
+  struct msg_asm      resp;    // 回复重组
+#ifdef __linux__
+  struct sockaddr_in6 last_src; // daemon：上次推送成功时的本地源地址
+  bool                synced;
+#endif
+};
+
 typedef struct {
-  char    *script;
-  char    *psk;
-  char    *server;
-  int      server_port;
-  int      family;
-  uint32_t window;
-  uint16_t max_retries;
+  char          *script;
+  size_t         script_len;
+  char          *psk;
+  struct target *targets;
+  size_t         ntargets;
+  int            server_port;
+  int            family;
+  uint32_t       window;
+  uint16_t       max_retries;
+  int            version;
+  bool           daemon;
 } args_t;
 
+/* 一次或多次请求之间保持不变的状态：daemon 模式下派生的密钥一直留在内存中 */
+struct client_ctx {
+  const args_t        *a;
+  struct replay_window rwin;
+  struct key_ctx      *keys;
+  size_t               nkeys;
+};
+
+#ifdef __linux__
+#ifndef DAEMON_SETTLE_MS
+#define DAEMON_SETTLE_MS 50 // 收到地址/路由事件后等待事件平息的时间
+#endif
+#ifndef DAEMON_BACKOFF_MIN_MS
+#define DAEMON_BACKOFF_MIN_MS 1000
+#endif
+#ifndef DAEMON_BACKOFF_MAX_MS
+#define DAEMON_BACKOFF_MAX_MS 60000
+#endif
+#endif
+
 static int print_client_usage(int argc, char **argv) {
   (void) argc;
   fprintf(stderr,
-          "Usage: %s psk PSK [script SCRIPT|-] [ server SERVER] [server-port SERVER_PORT] "
-          "[window WINDOW] [max-retries MAX_RETRIES] [-4] [-6]\n",
+          "Usage: %s psk PSK [script SCRIPT|-] [server SERVER]... [servers FILE] [server-port SERVER_PORT] "
+          "[window WINDOW] [max-retries MAX_RETRIES] [protocol 1|2] [daemon] [-4] [-6]\n"
+          "  server may be given several times; FILE has one \"HOST [PORT [PSK]]\" per line\n",
           argv[0]);
   return 0;
 }
 
+static int add_target(args_t *out, const char *host, uint16_t port, const char *psk) {
+  struct target *t;
+  int            err = 0;
+
+  t = try_p(realloc(out->targets, (out->ntargets + 1) * sizeof(*t)), "realloc: %s", strerrno);
+  out->targets = t;
+  t            = &t[out->ntargets];
+  memset(t, 0, sizeof(*t));
+  t->port = port;
+
+  try2(strdup_safe(host, &t->host), "strdup");
+  if (psk)
+    try2(strdup_safe(psk, &t->psk), "strdup");
+
+  out->ntargets++;
+  return 0;
+
+err_cleanup:
+  free(t->host);
+  return err;
+}
+
+/* 取出下一个以空白分隔的字段，行尾返回 NULL */
+static char *next_field(char **p) {
+  char *s = *p + strspn(*p, " \t\r");
+  char *e;
+
+  if (!*s || *s == '#')
+    return NULL;
+
+  e = s + strcspn(s, " \t\r");
+  if (*e)
+    *e++ = '\0';
+  *p = e;
+  return s;
+}
+
+/* 服务器列表文件：每行 HOST [PORT [PSK]]，# 开始注释 */
+static int parse_servers_file(args_t *out, const char *path) {
+  char  *content = NULL, *line, *next;
+  size_t size    = 0;
+  int    err     = 0, lineno = 0;
+
+  try2(read_script(path, &content, &size), "read %s", path);
+
+  for (line = content; line; line = next) {
+    char    *host, *port_s, *psk;
+    uint16_t port = 0;
+
+    next = strchr(line, '\n');
+    if (next)
+      *next++ = '\0';
+    lineno++;
+
+    host = next_field(&line);
+    if (!host)
+      continue;
+    port_s = next_field(&line);
+    psk    = port_s ? next_field(&line) : NULL;
+
+    if (port_s && parse_port(port_s, &port))
+      err_cleanup(-EINVAL, "%s:%d: invalid port: %s", path, lineno, port_s);
+    try2(add_target(out, host, port, psk));
+  }
+
+  err = 0;
+err_cleanup:
+  if (content)
+    tucrypto_memzero(content, size);
+  free(content);
+  return err;
+}
+
+static void free_args(args_t *a) {
+  for (size_t i = 0; i < a->ntargets; i++) {
+    free(a->targets[i].host);
+    free(a->targets[i].psk);
+    mac_ctx_free(&a->targets[i].mctx);
+    msg_asm_free(&a->targets[i].resp);
+  }
+  free(a->targets);
+  free(a->script);
+  free(a->psk);
+  a->targets  = NULL;
+  a->ntargets = 0;
+}
+
 static int parse_dsl_args(int argc, char **argv, args_t *out) {
   int         err          = -EINVAL;
   const char *psk          = NULL;
-  const char *server       = DEFAULT_SERVER;
   uint16_t    server_port  = DEFAULT_SERVER_PORT;
   const char *script       = "-";
   int         family       = AF_UNSPEC;
   size_t      content_size = 0;
   uint16_t    max_retries  = 3;
   uint32_t    window       = DEFAULT_WINDOW;
-  char       *psk_dup = NULL, *server_dup = NULL, *content = NULL;
+  uint32_t    version      = PROTO_AUTO;
+  bool        daemon       = false;
+  char       *psk_dup = NULL, *content = NULL;
 
   for (int i = 1; i < argc; ++i) {
     const char *tok = argv[i];
@@ -52,7 +216,7 @@ static int parse_dsl_args(int argc, char **argv, args_t *out) {
       if (++i >= argc)
         goto usage;
 
-      try(parse_port(argv[i], &server_port));
+      try2(parse_port(argv[i], &server_port));
     } else if (matches(tok, "script")) {
       if (++i >= argc)
         goto usage;
@@ -67,17 +231,39 @@ static int parse_dsl_args(int argc, char **argv, args_t *out) {
       if (++i >= argc)
         goto usage;
 
-      server = argv[i];
+      try2(add_target(out, argv[i], 0, NULL));
+    } else if (matches(tok, "servers")) {
+      if (++i >= argc)
+        goto usage;
+
+      try2(parse_servers_file(out, argv[i]));
     } else if (matches(tok, "window")) {
       if (++i >= argc)
         goto usage;
 
-      try(parse_window(argv[i], &window));
+      try2(parse_window(argv[i], &window));
     } else if (matches(tok, "max-retries")) {
       if (++i >= argc)
         goto usage;
 
-      try(parse_u16(argv[i], &max_retries));
+      try2(parse_u16(argv[i], &max_retries));
+    } else if (matches(tok, "protocol")) {
+      if (++i >= argc)
+        goto usage;
+
+      /* 1: 旧版服务器（每个报文一次 Argon2id）；2: 长期密钥 + BLAKE2b 报文密钥 */
+      try2(parse_u32(argv[i], &version));
+      if (version != PROTO_V1 && version != PROTO_V2) {
+        log_error("invalid protocol version: %s", argv[i]);
+        goto usage;
+      }
+    } else if (matches(tok, "daemon") || matches(tok, "--daemon")) {
+#ifdef __linux__
+      daemon = true;
+#else
+      log_error("daemon mode is only supported on Linux");
+      goto usage;
+#endif
     } else if (matches(tok, "-4")) {
       family = AF_INET;
     } else if (matches(tok, "-6")) {
@@ -88,106 +274,127 @@ static int parse_dsl_args(int argc, char **argv, args_t *out) {
       /* 未知关键字 */
       log_error("unknown keyword \"%s\"", tok);
     usage:
-      return print_client_usage(argc, argv), -EINVAL;
+      print_client_usage(argc, argv);
+      err_cleanup(-EINVAL);
     }
   }
 
-  if (!psk) {
-    log_error("psk must be specified");
-    goto usage;
-  }
+  if (!out->ntargets)
+    try2(add_target(out, DEFAULT_SERVER, 0, NULL));
+
+  for (size_t i = 0; i < out->ntargets; i++) {
+    struct target *t = &out->targets[i];
+    const char    *k = t->psk ? t->psk : psk;
 
-  if (strlen(psk) < 8) {
-    log_error("PSK must be at least 8 characters long");
-    goto usage;
+    if (!t->port)
+      t->port = server_port;
+
+    if (!k) {
+      log_error("psk must be specified");
+      goto usage;
+    }
+
+    if (strlen(k) < 8) {
+      log_error("PSK must be at least 8 characters long");
+      goto usage;
+    }
   }
 
   if (!script)
     script = "-";
 
   try2(read_script(script, &content, &content_size), "read_script");
-  try2(strdup_safe(psk, &psk_dup), "strdup");
-  try2(strdup_safe(server, &server_dup), "strdup");
+  if (version != PROTO_V1 && content_size > MSG_MAX_LEN)
+    err_cleanup(-E2BIG, "script too long: %zu bytes (max %d)", content_size, MSG_MAX_LEN);
+  if (psk)
+    try2(strdup_safe(psk, &psk_dup), "strdup");
 
   out->script      = content;
+  out->script_len  = content_size;
   out->psk         = psk_dup;
-  out->server      = server_dup;
   out->server_port = server_port;
   out->window      = window;
   out->family      = family;
   out->max_retries = max_retries;
+  out->version     = (int) version;
+  out->daemon      = daemon;
   err              = 0;
 
 err_cleanup:
   if (err) {
     free(content);
     free(psk_dup);
-    free(server_dup);
+    free_args(out);
   }
   return err;
 }
 
-static void free_args(args_t *a) {
-  free(a->script);
-  free(a->psk);
-  free(a->server);
-}
+static int64_t now_ms(void) {
+  struct timespec ts;
 
-static int set_sock_timeout(int sock, int timeout_sec) {
-  const char *blob     = NULL;
-  size_t      blob_len = 0;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-#ifdef _WIN32
-  DWORD timeout_ms = (DWORD) timeout_sec * 1000;
+/**
+ * @brief 为每个不同的 PSK 派生一次密钥，并分配给使用它的服务器。
+ * @return 成功返回 0，失败返回负错误码。
+ */
+static int client_ctx_init(struct client_ctx *c, args_t *a) {
+  c->a    = a;
+  c->keys = try_p(calloc(a->ntargets, sizeof(*c->keys)), "calloc: %s", strerrno);
+
+  for (size_t i = 0; i < a->ntargets; i++) {
+    struct target  *t   = &a->targets[i];
+    const char     *psk = t->psk ? t->psk : a->psk;
+    struct key_ctx *k   = NULL;
+
+    for (size_t j = 0; j < c->nkeys; j++) {
+      if (!strcmp(c->keys[j].psk, psk)) {
+        k = &c->keys[j];
+        break;
+      }
+    }
 
-  blob     = (const char *) &timeout_ms;
-  blob_len = sizeof(timeout_ms);
-#else
-  struct timeval tv = {
-    .tv_sec  = timeout_sec,
-    .tv_usec = 0,
-  };
+    if (!k) {
+      k      = &c->keys[c->nkeys++];
+      k->psk = psk;
+      /* v2: salt 在重试之间保持不变，Argon2id 只运行一次，服务器的回复也使用同一个 salt */
+      psk_ctx_init(&k->pctx, psk);
+      pkt_hdr_init(&k->hdr, PROTO_V2);
+      /* v2 报文带 mac1/mac2，v1 保持旧格式以便与旧服务器通信 */
+      if (a->version != PROTO_V1)
+        try(mac_ctx_init(&k->mctx, psk));
+    }
 
-  blob     = (const char *) &tv;
-  blob_len = sizeof(tv);
-#endif
+    t->keys = k;
+    t->mctx = k->mctx;
+  }
 
-  return setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, blob, blob_len);
+  return 0;
 }
 
-int main(int argc, char **argv) {
-  int     err = 0, sock = -1;
-  args_t  a          = {};
-  size_t  packet_len = 0;
-  char    cmd[MAX_PT_SIZE];
-  uint8_t pt[MAX_PT_SIZE];
-  int     timeout    = 5;
-  int     replay_max = DEFAULT_REPLAY_MAX;
-
-  struct replay_window rwin;
-  int                  rwin_inited = 0;
-
-#ifdef _WIN32
-  WSADATA wsa;
-  try2(WSAStartup(MAKEWORD(2, 2), &wsa), "WSAStartup failed: %ld", _ret);
-#endif
-  setup_pwhash_memlimit();
-
-#ifdef USE_SODIUM
-  try2(sodium_init(), "sodium initialize failed: %ld", _ret);
-#endif
-  try2(parse_dsl_args(argc, argv, &a));
+static void client_ctx_free(struct client_ctx *c) {
+  for (size_t i = 0; i < c->nkeys; i++) {
+    psk_ctx_free(&c->keys[i].pctx);
+    mac_ctx_free(&c->keys[i].mctx);
+  }
+  free(c->keys);
+  c->keys  = NULL;
+  c->nkeys = 0;
+}
 
-  replay_window_init(&rwin, a.window, replay_max);
-  rwin_inited = 1;
+/* v1：单报文请求，加随机填充 */
+static int send_legacy(struct client_ctx *c, int sock, struct target *t, size_t *sent) {
+  const args_t  *a = c->a;
+  char           cmd[MAX_PT_SIZE - 2 * MAC_LEN]; // 给 MAC 尾部留出空间
+  uint8_t        pad[256];
+  size_t         pad_len = tucrypto_randombytes_uniform(256);
+  struct pkt_hdr hdr     = {.version = PROTO_V1}; // v1 每个报文使用新的随机 salt
 
-  uint16_t retries = 0;
-retry:;
-  uint8_t pad[256];
-  size_t  pad_len = tucrypto_randombytes_uniform(256);
   memset(pad, '#', pad_len);
 
-  size_t cmd_len = (size_t) try2(scnprintf(cmd, sizeof(cmd), "%s", a.script), "scnprintf: %ld", _ret);
+  size_t cmd_len = (size_t) try(scnprintf(cmd, sizeof(cmd), "%s", a->script), "scnprintf: %ld", _ret);
   if (cmd_len + pad_len > sizeof(cmd) - 1) {
     pad_len = sizeof(cmd) - 1 - cmd_len;
   }
@@ -195,6 +402,243 @@ retry:;
   cmd_len += pad_len;
   cmd[cmd_len] = '\0';
 
+  try(encrypt_and_send_packet(sock, (const struct sockaddr *) &t->addr, sizeof(t->addr), &c->rwin, &t->keys->pctx, &hdr, NULL,
+                              cmd, cmd_len, sent),
+      "encrypt_and_send_packet: %s", strret);
+  return 0;
+}
+
+/* v2：发送一个消息分片，每次都重新加密，重传的报文不会被当作重放 */
+static int send_frame(struct client_ctx *c, int sock, struct target *t, const uint8_t *pt, size_t pt_len, size_t *sent) {
+  size_t packet_len = 0;
+
+  try(encrypt_and_send_packet(sock, (const struct sockaddr *) &t->addr, sizeof(t->addr), &c->rwin, &t->keys->pctx,
+                              &t->keys->hdr, &t->mctx, (const char *) pt, pt_len, &packet_len),
+      "encrypt_and_send_packet: %s", strret);
+  *sent += packet_len;
+  return 0;
+}
+
+/* 发送 mask 中的请求分片（v1 为整个请求），并设置等待回复的截止时间 */
+static int send_request(struct client_ctx *c, int sock, struct target *t, uint64_t mask) {
+  const args_t *a = c->a;
+  uint8_t       pt[MSG_HDR_LEN + MSG_FRAG_DATA];
+  size_t        sent = 0;
+  unsigned      n    = 0;
+  int           err  = 0;
+
+  t->deadline = now_ms() + CLIENT_TIMEOUT_MS;
+  if (t->version == PROTO_V1) {
+    try(send_legacy(c, sock, t, &sent));
+    log_info("sent %zu bytes to %s:%d", sent, t->host, t->port);
+    return 0;
+  }
+
+  mask &= msg_full_mask(msg_frag_count(a->script_len));
+  for (unsigned i = 0; i < MSG_MAX_FRAGMENTS; i++) {
+    if (!(mask & (1ULL << i)))
+      continue;
+
+    size_t pt_len = msg_data_frame(pt, sizeof(pt), t->msg_id, a->script, a->script_len, i);
+    try2(send_frame(c, sock, t, pt, pt_len, &sent));
+    n++;
+  }
+
+  log_info("sent %zu bytes to %s:%d (%u of %u fragments)", sent, t->host, t->port, n, msg_frag_count(a->script_len));
+  err = 0;
+err_cleanup:
+  tucrypto_memzero(pt, sizeof(pt));
+  return err;
+}
+
+/* 告诉服务器已收到哪些回复分片，服务器只重传缺失的 */
+static int send_ack(struct client_ctx *c, int sock, struct target *t) {
+  uint8_t pt[MSG_HDR_LEN + sizeof(uint64_t) + 256];
+  size_t  sent = 0;
+
+  t->deadline = now_ms() + CLIENT_TIMEOUT_MS;
+  try(send_frame(c, sock, t, pt, msg_ack_frame(pt, sizeof(pt), t->msg_id, t->resp.mask), &sent));
+  log_info("%s: response incomplete, ack %016" PRIx64, t->host, t->resp.mask);
+  return 0;
+}
+
+/* PROTO_AUTO：v2 请求没有得到任何 v2 回应，可能是旧服务器，可以改用 v1 从头发送一次；v1 只能发送单报文的脚本 */
+static bool can_fall_back(const struct client_ctx *c, const struct target *t) {
+  return c->a->version == PROTO_AUTO && t->version == PROTO_V2 && !t->v2_seen && c->a->script_len < MAX_PT_SIZE - 2 * MAC_LEN;
+}
+
+/**
+ * @brief 超时或收到 cookie reply 后重发，超过 max_retries 即失败。
+ *
+ * v2 不重发整个请求：回复不完整时发送 ACK；否则重发最后一个分片作为探测，
+ * 服务器据此回复 ACK（请求不完整）或重传回复（已执行）。
+ * cookie reply 说明服务器丢弃了之前的报文，重发所有未确认的分片。
+ * 未指定 protocol 时，v2 请求超时或回复无法解密先改用 v1 重发一次，不计入重试次数。
+ */
+static void retry_target(struct client_ctx *c, int sock, struct target *t, int reason) {
+  unsigned count = msg_frag_count(c->a->script_len);
+  int      err;
+
+  if ((reason == -ETIMEDOUT || reason == -EBADMSG) && can_fall_back(c, t)) {
+    log_warn("%s: no v2 response, retrying with protocol 1", t->host);
+    t->version = PROTO_V1;
+    if (send_request(c, sock, t, ~0ULL)) {
+      t->state = TARGET_FAILED;
+      t->err   = reason;
+    }
+    return;
+  }
+
+  if (t->retries++ >= c->a->max_retries) {
+    log_error("%s: giving up", t->host);
+    t->state = TARGET_FAILED;
+    t->err   = reason;
+    return;
+  }
+
+  log_info("%s: performing retries: %u / %u", t->host, t->retries, c->a->max_retries);
+  if (t->version == PROTO_V2 && t->resp.mask)
+    err = send_ack(c, sock, t);
+  else if (reason == -EBUSY)
+    err = send_request(c, sock, t, ~t->acked);
+  else
+    err = send_request(c, sock, t, 1ULL << (count - 1));
+
+  if (err) {
+    t->state = TARGET_FAILED;
+    t->err   = reason;
+  }
+}
+
+/* 回复按源地址对应到服务器 */
+static struct target *match_target(const args_t *a, const struct sockaddr_storage *from) {
+  const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) from;
+
+  if (from->ss_family != AF_INET6)
+    return NULL;
+
+  for (size_t i = 0; i < a->ntargets; i++) {
+    struct target *t = &a->targets[i];
+
+    if (t->state == TARGET_PENDING && t->addr.sin6_port == sin6->sin6_port &&
+        !memcmp(&t->addr.sin6_addr, &sin6->sin6_addr, sizeof(sin6->sin6_addr)))
+      return t;
+  }
+
+  return NULL;
+}
+
+/* v2 回复：ACK 时重传服务器缺少的请求分片，数据分片放入重组缓冲区 */
+static void handle_frame(struct client_ctx *c, int sock, struct target *t, const uint8_t *pt, size_t pt_len) {
+  struct msg_frame f;
+  uint64_t         mask;
+  int              r;
+
+  if (msg_frame_parse(pt, pt_len, &f) || f.id != t->msg_id) {
+    log_warn("%s: drop: unexpected message", t->host);
+    return;
+  }
+
+  if (!msg_ack_mask(&f, &mask)) {
+    t->acked = mask;
+    mask     = ~mask & msg_full_mask(msg_frag_count(c->a->script_len));
+    if (mask && send_request(c, sock, t, mask)) {
+      t->state = TARGET_FAILED;
+      t->err   = -EIO;
+    }
+    return;
+  }
+
+  r = msg_asm_add(&t->resp, &f);
+  if (r < 0) {
+    log_warn("%s: drop: inconsistent response fragment", t->host);
+    return;
+  }
+
+  /* 有进展就重新计时，大的回复不会因为总时间超过 CLIENT_TIMEOUT_MS 而失败 */
+  t->deadline = now_ms() + CLIENT_TIMEOUT_MS;
+  if (!r)
+    return;
+
+  log_info("response from %s:%d: %.*s", t->host, t->port, (int) t->resp.len, t->resp.buf);
+  t->state = TARGET_DONE;
+}
+
+static void handle_reply(struct client_ctx *c, int sock, const uint8_t *buf, ssize_t len, const struct sockaddr_storage *from) {
+  struct target     *t = match_target(c->a, from);
+  uint8_t            pt[MAX_PT_SIZE];
+  unsigned long long pt_len = 0;
+  struct pkt_hdr     hdr    = {};
+  char               abuf[128];
+
+  if (!t) {
+    if (addr_to_str(from, abuf, sizeof(abuf)) >= 0)
+      log_warn("drop: unexpected packet from %s", abuf);
+    return;
+  }
+
+  /* 服务器负载过高：保存 cookie 后立即重发，新报文带上 mac2 */
+  if (t->version == PROTO_V2 && len == COOKIE_REPLY_LEN) {
+    if (cookie_reply_open(&t->mctx, buf, (size_t) len)) {
+      log_error("%s: invalid cookie reply", t->host);
+      return;
+    }
+    t->v2_seen = true;
+    log_info("%s: server under load, retrying with cookie", t->host);
+    retry_target(c, sock, t, -EBUSY);
+    return;
+  }
+
+  if (len < (ssize_t) MIN_LEN) {
+    log_error("drop: short packet from %s", t->host);
+    return;
+  }
+
+  /* 认证失败的报文可能是伪造的，继续等待真正的回复；PROTO_AUTO 下也可能是不认识 v2 的旧服务器，立即改用 v1 */
+  if (decrypt_and_validate_packet(pt, &pt_len, buf, len, &c->rwin, &t->keys->pctx, from, &hdr)) {
+    if (can_fall_back(c, t))
+      retry_target(c, sock, t, -EBADMSG);
+    return;
+  }
+
+  if (hdr.version == PROTO_V2)
+    t->v2_seen = true;
+  if (t->version == PROTO_V2 && pt_len && pt[0] == MSG_MAGIC) {
+    handle_frame(c, sock, t, pt, (size_t) pt_len);
+    return;
+  }
+
+  if (remove_padding(pt, &pt_len))
+    return;
+
+  log_info("response from %s:%d: %.*s", t->host, t->port, (int) pt_len, pt);
+  t->state = TARGET_DONE;
+  /* 回退后由 v1 完成：之后的推送直接使用 v1 */
+  if (c->a->version == PROTO_AUTO && hdr.version == PROTO_V1 && t->version == PROTO_V1)
+    t->legacy = true;
+}
+
+static int wait_readable(int sock, int64_t timeout_ms) {
+  fd_set         rfds;
+  struct timeval tv = {.tv_sec = (long) (timeout_ms / 1000), .tv_usec = (long) (timeout_ms % 1000) * 1000};
+
+  FD_ZERO(&rfds);
+  FD_SET(sock, &rfds);
+  return select(sock + 1, &rfds, NULL, NULL, &tv);
+}
+
+/**
+ * @brief 向所有 TARGET_PENDING 状态的服务器并发发送脚本，从同一个 socket 收取回复。
+ *
+ * 每个服务器独立重试，总耗时约为最慢的一个往返，而不是所有往返之和。
+ *
+ * @return 全部成功返回 0，否则返回第一个失败的错误码。
+ */
+static int client_fanout(struct client_ctx *c) {
+  const args_t *a   = c->a;
+  int           err = 0, sock = -1;
+  size_t        ok = 0, total = 0;
+
   sock = try2_e(socket(AF_INET6, SOCK_DGRAM, 0), "socket: %s", strerrno);
 
   {
@@ -202,77 +646,304 @@ retry:;
     setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, (const char *) &off, sizeof(off));
   }
 
-  struct sockaddr_in6 dst = {
-    .sin6_family = AF_INET6,
-    .sin6_port   = htons(a.server_port),
-  };
+  for (size_t i = 0; i < a->ntargets; i++) {
+    struct target *t = &a->targets[i];
+
+    if (t->state != TARGET_PENDING)
+      continue;
+
+    t->retries = 0;
+    t->acked   = 0;
+    t->v2_seen = false;
+    t->version = a->version != PROTO_AUTO ? a->version : t->legacy ? PROTO_V1 : PROTO_V2;
+    tucrypto_randombytes_buf(&t->msg_id, sizeof(t->msg_id));
+    msg_asm_free(&t->resp);
+    msg_asm_init(&t->resp, t->msg_id);
+    t->addr = (struct sockaddr_in6) {.sin6_family = AF_INET6, .sin6_port = htons(t->port)};
+    t->err  = resolve_ip_addr(a->family, t->host, &t->addr.sin6_addr);
+    if (t->err) {
+      log_error("%s: resolve_ip_addr: %s", t->host, strerror(-t->err));
+      t->state = TARGET_FAILED;
+      continue;
+    }
 
-  try2(resolve_ip_addr(a.family, a.server, &dst.sin6_addr), "resolve_ip_addr: %s", strret);
-  try2(encrypt_and_send_packet(sock, (const struct sockaddr *) &dst, sizeof(dst), &rwin, a.psk, (char *) cmd, cmd_len,
-                               &packet_len),
-       "encrypt_and_send_packet: %s", strret);
-  log_info("sent %zu bytes to %s:%d", packet_len, a.server, a.server_port);
-  try2(set_sock_timeout(sock, timeout), "set_sock_timeout: %s", strret);
+    if (send_request(c, sock, t, ~0ULL))
+      retry_target(c, sock, t, -EIO);
+  }
 
-  uint8_t                 buf[MAX_CT_SIZE];
-  struct sockaddr_storage cli;
-  socklen_t               clen = sizeof(cli);
-  ssize_t                 len  = recvfrom(sock, (void *) buf, sizeof(buf), 0, (struct sockaddr *) &cli, &clen);
+  while (1) {
+    int64_t now = now_ms(), next = -1;
 
-  if (len < 0) {
-#ifdef _WIN32
-    if (WSAGetLastError() == WSAETIMEDOUT)
-#else
-    if (errno == EAGAIN || errno == EWOULDBLOCK)
-#endif
-    {
-      // 超时
-      log_error("recvfrom timeout");
-      if (retries++ < a.max_retries) {
-        sleep_ms(100);
-        log_info("performing retries: %u / %u", retries, a.max_retries);
-        close(sock);
-        sock = -1;
-        goto retry;
+    for (size_t i = 0; i < a->ntargets; i++) {
+      struct target *t = &a->targets[i];
+
+      if (t->state != TARGET_PENDING)
+        continue;
+
+      if (t->deadline <= now) {
+        log_error("%s: recv timeout", t->host);
+        retry_target(c, sock, t, -ETIMEDOUT);
+        if (t->state != TARGET_PENDING)
+          continue;
       }
-    } else {
-      // 其他错误
+      if (next < 0 || t->deadline < next)
+        next = t->deadline;
+    }
+
+    if (next < 0)
+      break;
+
+    int r = wait_readable(sock, next > now ? next - now : 0);
+    if (r < 0) {
+#ifndef _WIN32
+      if (errno == EINTR)
+        continue;
+#endif
+      err_cleanup(-EIO, "select: %s", strerrno);
+    }
+    if (r == 0)
+      continue;
+
+    uint8_t                 buf[MAX_CT_SIZE];
+    struct sockaddr_storage from;
+    socklen_t               flen = sizeof(from);
+    ssize_t                 len  = recvfrom(sock, (void *) buf, sizeof(buf), 0, (struct sockaddr *) &from, &flen);
+
+    if (len < 0) {
 #ifdef _WIN32
       log_error("recvfrom WSA error=%d", WSAGetLastError());
 #else
       log_error("recvfrom error: %s", strerror(errno));
 #endif
+      continue;
     }
 
-    err = -1;
-    goto err_cleanup;
+    handle_reply(c, sock, buf, len, &from);
   }
 
-  if (len < (ssize_t) MIN_LEN) {
-    char abuf[128];
-    addr_to_str(&cli, abuf, sizeof(abuf));
-    log_error("drop: short packet from %s", abuf);
-    err = -EINVAL;
-    goto err_cleanup;
+  err = 0;
+err_cleanup:
+  for (size_t i = 0; i < a->ntargets; i++) {
+    struct target *t = &a->targets[i];
+
+    if (t->state == TARGET_IDLE)
+      continue;
+    if (t->state == TARGET_PENDING) {
+      t->state = TARGET_FAILED;
+      t->err   = err;
+    }
+
+    total++;
+    if (t->state == TARGET_DONE)
+      ok++;
+    else if (!err)
+      err = t->err ? t->err : -EIO;
   }
 
-  unsigned long long pt_len = 0;
-  try2(decrypt_and_validate_packet(pt, &pt_len, buf, len, &rwin, a.psk, &cli), "decrypt_and_validate_packet: %s", strret);
+  if (total > 1)
+    log_info("%zu / %zu servers updated", ok, total);
 
-  {
-    char abuf[128];
+  if (sock >= 0)
+    close(sock);
+  return err;
+}
+
+#ifdef __linux__
+/* 订阅地址和路由变化，只用作触发，不解析消息内容 */
+static int open_rtnetlink(void) {
+  struct sockaddr_nl sa = {
+    .nl_family = AF_NETLINK,
+    .nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR | RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE,
+  };
+  int fd = try_e(socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE), "netlink socket: %s", strerrno);
+
+  if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0) {
+    int err = -errno;
+
+    log_error("netlink bind: %s", strerrno);
+    close(fd);
+    return err;
+  }
 
-    try2(addr_to_str(&cli, abuf, sizeof(abuf)));
-    try2(remove_padding(pt, &pt_len));
-    log_info("response from %s: %.*s", abuf, (int) pt_len, pt);
+  return fd;
+}
+
+/* 读空 netlink socket；ENOBUFS（事件溢出）同样视为有变化 */
+static bool drain_rtnetlink(int fd) {
+  char buf[8192];
+  bool changed = false;
+
+  while (1) {
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+
+    if (n > 0 || (n < 0 && errno == ENOBUFS)) {
+      changed = true;
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    return changed;
   }
+}
 
+/**
+ * @brief 查询访问服务器时内核选择的本地源地址。
+ *
+ * 对 UDP socket 调用 connect() 只做路由查找，不发送任何报文。
+ * 没有 NAT 时它就是服务器看到的 @client_ip@；有 NAT 时也能反映出口链路的变化。
+ *
+ * @return 0 成功，-ENETUNREACH 等表示当前没有到服务器的路由。
+ */
+static int local_source(const args_t *a, const struct target *t, struct sockaddr_in6 *out) {
+  struct sockaddr_in6 dst = {.sin6_family = AF_INET6, .sin6_port = htons(t->port)};
+  socklen_t           len = sizeof(*out);
+  int                 err = 0, off = 0;
+  int                 sock;
+
+  try(resolve_ip_addr(a->family, t->host, &dst.sin6_addr), "resolve_ip_addr: %s", strret);
+  sock = try_e(socket(AF_INET6, SOCK_DGRAM | SOCK_CLOEXEC, 0), "socket: %s", strerrno);
+  setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+
+  try2_e(connect(sock, (struct sockaddr *) &dst, sizeof(dst)));
+  try2_e(getsockname(sock, (struct sockaddr *) out, &len));
+  out->sin6_port = 0;
+  err            = 0;
 err_cleanup:
-  if (sock >= 0)
-    close(sock);
+  close(sock);
+  return err;
+}
+
+/**
+ * @brief 找出本地源地址变化了的服务器，标记为 TARGET_PENDING。
+ * @return 需要推送的服务器数量。
+ */
+static size_t select_changed(const args_t *a) {
+  size_t n = 0;
+
+  for (size_t i = 0; i < a->ntargets; i++) {
+    struct target      *t = &a->targets[i];
+    struct sockaddr_in6 cur;
+    char                abuf[128];
+
+    t->state = TARGET_IDLE;
+    if (local_source(a, t, &cur)) {
+      log_warn("no route to %s, waiting for network changes", t->host);
+      t->synced = false;
+      continue;
+    }
+
+    if (t->synced && !memcmp(&cur.sin6_addr, &t->last_src.sin6_addr, sizeof(cur.sin6_addr)) &&
+        cur.sin6_scope_id == t->last_src.sin6_scope_id)
+      continue;
+
+    if (addr_to_str((struct sockaddr_storage *) &cur, abuf, sizeof(abuf)) >= 0)
+      log_info("local address towards %s is %s, pushing", t->host, abuf);
+
+    t->last_src = cur;
+    t->state    = TARGET_PENDING;
+    n++;
+  }
+
+  return n;
+}
+
+/**
+ * @brief daemon 模式：启动时推送一次，之后每当到某个服务器的本地源地址变化时向它推送。
+ *
+ * 地址没有变化时不发送任何请求；推送失败时按指数退避重试，期间的新事件会立即触发重新检查。
+ */
+static int run_daemon(struct client_ctx *c) {
+  const args_t *a       = c->a;
+  unsigned      backoff = 0;
+  int64_t       next    = now_ms(); // 下一次检查的时间，-1 表示等待事件
+  int           nl      = try(open_rtnetlink());
+
+  log_info("daemon mode: watching address and route changes for %zu server(s)", a->ntargets);
+
+  while (1) {
+    struct pollfd pfd     = {.fd = nl, .events = POLLIN};
+    int64_t       timeout = next < 0 ? -1 : next - now_ms();
+
+    if (poll(&pfd, 1, next < 0 ? -1 : timeout < 0 ? 0 : (int) timeout) < 0) {
+      if (errno == EINTR)
+        continue;
+      log_error("poll: %s", strerrno);
+      break;
+    }
+
+    /* 网络有变化：等事件平息后立即检查，不受退避影响 */
+    if ((pfd.revents & POLLIN) && drain_rtnetlink(nl)) {
+      int64_t settle = now_ms() + DAEMON_SETTLE_MS;
+
+      if (next < 0 || next > settle)
+        next = settle;
+      backoff = 0;
+      continue;
+    }
+
+    if (next < 0 || now_ms() < next)
+      continue;
+    next = -1;
+
+    if (!select_changed(a))
+      continue;
+
+    if (client_fanout(c) == 0) {
+      backoff = 0;
+    } else {
+      backoff = backoff ? backoff * 2 : DAEMON_BACKOFF_MIN_MS;
+      if (backoff > DAEMON_BACKOFF_MAX_MS)
+        backoff = DAEMON_BACKOFF_MAX_MS;
+      next = now_ms() + backoff;
+      log_warn("push failed, retrying in %u ms", backoff);
+    }
+
+    for (size_t i = 0; i < a->ntargets; i++)
+      a->targets[i].synced = a->targets[i].state == TARGET_DONE || (a->targets[i].synced && a->targets[i].state == TARGET_IDLE);
+  }
+
+  close(nl);
+  return -EIO;
+}
+#endif
+
+int main(int argc, char **argv) {
+  int               err         = 0;
+  int               replay_max  = CLIENT_REPLAY_MAX;
+  int               rwin_inited = 0;
+  args_t            a           = {};
+  struct client_ctx c           = {};
+
+#ifdef _WIN32
+  WSADATA wsa;
+  try2(WSAStartup(MAKEWORD(2, 2), &wsa), "WSAStartup failed: %ld", _ret);
+#endif
+  setup_pwhash_memlimit();
+
+#ifdef USE_SODIUM
+  try2(sodium_init(), "sodium initialize failed: %ld", _ret);
+#endif
+  try2(parse_dsl_args(argc, argv, &a));
+
+  try2(replay_window_init(&c.rwin, a.window, replay_max), "replay_window_init: %s", strret);
+  rwin_inited = 1;
+  try2(client_ctx_init(&c, &a));
+
+#ifdef __linux__
+  if (a.daemon) {
+    err = run_daemon(&c);
+    goto err_cleanup;
+  }
+#endif
+  for (size_t i = 0; i < a.ntargets; i++)
+    a.targets[i].state = TARGET_PENDING;
+  err = client_fanout(&c);
+
+err_cleanup:
+  client_ctx_free(&c);
   free_args(&a);
   if (rwin_inited)
-    replay_window_free(&rwin);
+    replay_window_free(&c.rwin);
 #ifdef _WIN32
   WSACleanup();
 #endif
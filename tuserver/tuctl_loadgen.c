@@ -0,0 +1,360 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../tucrypto/tucrypto.h"
+#include "common.h"
+#include "log.h"
+#include "read_script.h"
+#include "resolve.h"
+#include "tuparser.h"
+
+#include "try.h"
+
+/*
+ * tuctl_server 压力测试：concurrency 个线程各自模拟一个客户端（独立的 salt、socket 和重放窗口），
+ * 合计发送 requests 个请求，统计每个请求从发送到收到回复的延迟分位数。
+ * 首个请求包含客户端自身的 Argon2id，相当于一批客户端在服务器重启后同时重新同步。
+ */
+
+#define MAX_CONCURRENCY 1024
+
+typedef struct {
+  char    *script;
+  size_t   script_len;
+  char    *psk;
+  char    *server;
+  int      server_port;
+  int      family;
+  uint32_t window;
+  uint32_t requests;
+  uint32_t concurrency;
+  uint32_t timeout_ms;
+  int      version;
+} args_t;
+
+struct loadgen {
+  const args_t *a;
+  union {
+    struct sockaddr_in6     dst;
+    struct sockaddr_storage dst_ss; // 解密失败时用于日志
+  };
+  struct mac_ctx mctx;      // 各线程复制一份，cookie 按线程保存
+  uint32_t       next;      // 下一个请求序号（原子访问）
+  int64_t       *latencies; // 纳秒，-1 表示超时或失败
+  uint32_t       timeouts;  // 原子访问
+  uint32_t       cookies;   // 原子访问
+};
+
+static int print_loadgen_usage(int argc, char **argv) {
+  (void) argc;
+  fprintf(stderr,
+          "Usage: %s psk PSK [script SCRIPT|-] [server SERVER] [server-port SERVER_PORT] [requests N] [concurrency C] "
+          "[timeout MS] [window WINDOW] [protocol 1|2] [-4] [-6]\n",
+          argv[0]);
+  return 0;
+}
+
+static int parse_dsl_args(int argc, char **argv, args_t *out) {
+  int         err          = -EINVAL;
+  const char *psk          = NULL;
+  const char *server       = DEFAULT_SERVER;
+  uint16_t    server_port  = DEFAULT_SERVER_PORT;
+  const char *script       = "-";
+  int         family       = AF_UNSPEC;
+  size_t      content_size = 0;
+  uint32_t    window       = DEFAULT_WINDOW;
+  uint32_t    requests     = 1000;
+  uint32_t    concurrency  = 16;
+  uint32_t    timeout_ms   = 2000;
+  uint32_t    version      = PROTO_DEFAULT;
+  char       *psk_dup = NULL, *server_dup = NULL, *content = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    const char *tok = argv[i];
+
+    if (matches(tok, "server-port")) {
+      if (++i >= argc)
+        goto usage;
+
+      try(parse_port(argv[i], &server_port));
+    } else if (matches(tok, "script")) {
+      if (++i >= argc)
+        goto usage;
+
+      script = argv[i];
+    } else if (matches(tok, "psk")) {
+      if (++i >= argc)
+        goto usage;
+
+      psk = argv[i];
+    } else if (matches(tok, "server")) {
+      if (++i >= argc)
+        goto usage;
+
+      server = argv[i];
+    } else if (matches(tok, "requests")) {
+      if (++i >= argc)
+        goto usage;
+
+      try(parse_u32(argv[i], &requests));
+    } else if (matches(tok, "concurrency")) {
+      if (++i >= argc)
+        goto usage;
+
+      try(parse_u32(argv[i], &concurrency));
+    } else if (matches(tok, "timeout")) {
+      if (++i >= argc)
+        goto usage;
+
+      try(parse_u32(argv[i], &timeout_ms));
+    } else if (matches(tok, "window")) {
+      if (++i >= argc)
+        goto usage;
+
+      try(parse_window(argv[i], &window));
+    } else if (matches(tok, "protocol")) {
+      if (++i >= argc)
+        goto usage;
+
+      try(parse_u32(argv[i], &version));
+      if (version != PROTO_V1 && version != PROTO_V2) {
+        log_error("invalid protocol version: %s", argv[i]);
+        goto usage;
+      }
+    } else if (matches(tok, "-4")) {
+      family = AF_INET;
+    } else if (matches(tok, "-6")) {
+      family = AF_INET6;
+    } else if (is_help_kw(tok)) {
+      goto usage;
+    } else {
+      /* 未知关键字 */
+      log_error("unknown keyword \"%s\"", tok);
+    usage:
+      return print_loadgen_usage(argc, argv), -EINVAL;
+    }
+  }
+
+  if (!psk) {
+    log_error("psk must be specified");
+    goto usage;
+  }
+
+  if (strlen(psk) < 8) {
+    log_error("PSK must be at least 8 characters long");
+    goto usage;
+  }
+
+  if (!requests || !concurrency || concurrency > MAX_CONCURRENCY || !timeout_ms) {
+    log_error("requests, concurrency (1-%d) and timeout must be positive", MAX_CONCURRENCY);
+    goto usage;
+  }
+
+  try2(read_script(script, &content, &content_size), "read_script");
+  try2(strdup_safe(psk, &psk_dup), "strdup");
+  try2(strdup_safe(server, &server_dup), "strdup");
+
+  out->script      = content;
+  out->script_len  = content_size;
+  out->psk         = psk_dup;
+  out->server      = server_dup;
+  out->server_port = server_port;
+  out->window      = window;
+  out->family      = family;
+  out->requests    = requests;
+  out->concurrency = concurrency < requests ? concurrency : requests;
+  out->timeout_ms  = timeout_ms;
+  out->version     = (int) version;
+  err              = 0;
+
+err_cleanup:
+  if (err) {
+    free(content);
+    free(psk_dup);
+    free(server_dup);
+  }
+  return err;
+}
+
+static void free_args(args_t *a) {
+  free(a->script);
+  free(a->psk);
+  free(a->server);
+}
+
+static int64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief 发送一个请求并等待回复，收到 cookie reply 时带上 cookie 重发（计入本次延迟）。
+ * @return 0 成功，-ETIMEDOUT 超时，其他负数为错误。
+ */
+static int one_request(struct loadgen *lg, int sock, struct psk_ctx *pctx, const struct pkt_hdr *hdr, struct mac_ctx *mctx,
+                       struct replay_window *rwin) {
+  const args_t      *a = lg->a;
+  uint8_t            pkt[MAX_CT_SIZE], pt[MAX_PT_SIZE];
+  size_t             pkt_len;
+  unsigned long long pt_len;
+  ssize_t            len;
+
+  for (int attempt = 0; attempt < 2; attempt++) {
+    try(encrypt_packet(pkt, &pkt_len, pctx, hdr, a->version == PROTO_V2 ? mctx : NULL, a->script, a->script_len));
+    try_e(send(sock, pkt, pkt_len, 0));
+
+    len = recv(sock, pkt, sizeof(pkt), 0);
+    if (len < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK ? -ETIMEDOUT : -errno;
+
+    if (a->version == PROTO_V2 && len == COOKIE_REPLY_LEN) {
+      try(cookie_reply_open(mctx, pkt, (size_t) len));
+      __atomic_add_fetch(&lg->cookies, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    return decrypt_and_validate_packet(pt, &pt_len, pkt, len, rwin, pctx, &lg->dst_ss, NULL) ? -EBADMSG : 0;
+  }
+
+  return -EBUSY;
+}
+
+static void *loadgen_thread(void *arg) {
+  struct loadgen      *lg = arg;
+  const args_t        *a  = lg->a;
+  struct replay_window rwin;
+  struct psk_ctx       pctx;
+  struct pkt_hdr       hdr;
+  struct mac_ctx       mctx = lg->mctx;
+  struct timeval       tv   = {.tv_sec = a->timeout_ms / 1000, .tv_usec = (a->timeout_ms % 1000) * 1000};
+  int                  sock = -1, off = 0;
+  uint32_t             idx;
+
+  psk_ctx_init(&pctx, a->psk);
+  pkt_hdr_init(&hdr, a->version);
+  if (replay_window_init(&rwin, a->window, CLIENT_REPLAY_MAX)) {
+    log_error("replay_window_init: out of memory");
+    goto out;
+  }
+
+  sock = socket(AF_INET6, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    log_error("socket: %s", strerrno);
+    goto out;
+  }
+  setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if (connect(sock, (const struct sockaddr *) &lg->dst, sizeof(lg->dst))) {
+    log_error("connect: %s", strerrno);
+    goto out;
+  }
+
+  while ((idx = __atomic_fetch_add(&lg->next, 1, __ATOMIC_RELAXED)) < a->requests) {
+    int64_t start = now_ns();
+    int     err   = one_request(lg, sock, &pctx, &hdr, &mctx, &rwin);
+
+    if (err == -ETIMEDOUT)
+      __atomic_add_fetch(&lg->timeouts, 1, __ATOMIC_RELAXED);
+    else if (err)
+      log_error("request %u failed: %s", idx, strerror(-err));
+
+    lg->latencies[idx] = err ? -1 : now_ns() - start;
+  }
+
+out:
+  if (sock >= 0)
+    close(sock);
+  replay_window_free(&rwin);
+  psk_ctx_free(&pctx);
+  mac_ctx_free(&mctx);
+  return NULL;
+}
+
+static int cmp_i64(const void *x, const void *y) {
+  int64_t a = *(const int64_t *) x, b = *(const int64_t *) y;
+
+  return (a > b) - (a < b);
+}
+
+/* 最近秩法取分位数，v 已排序 */
+static double percentile_ms(const int64_t *v, size_t n, double p) {
+  size_t rank = (size_t) (p / 100.0 * (double) n + 0.999999);
+
+  if (rank < 1)
+    rank = 1;
+  if (rank > n)
+    rank = n;
+  return (double) v[rank - 1] / 1e6;
+}
+
+static void report(const struct loadgen *lg, int64_t elapsed_ns) {
+  const args_t *a  = lg->a;
+  size_t        ok = 0;
+  int64_t      *v  = lg->latencies;
+
+  /* 把成功的延迟移到前面再排序 */
+  for (size_t i = 0; i < a->requests; i++) {
+    if (v[i] >= 0)
+      v[ok++] = v[i];
+  }
+  qsort(v, ok, sizeof(*v), cmp_i64);
+
+  printf("requests: %u, concurrency: %u, protocol: v%d\n", a->requests, a->concurrency, a->version);
+  printf("ok: %zu, timeouts: %u, errors: %zu, cookie replies: %u\n", ok, lg->timeouts, a->requests - ok - lg->timeouts,
+         lg->cookies);
+  printf("elapsed: %.3f s, throughput: %.1f req/s\n", (double) elapsed_ns / 1e9, (double) ok * 1e9 / (double) elapsed_ns);
+  if (!ok)
+    return;
+
+  printf("latency (ms): p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  max %.3f\n", percentile_ms(v, ok, 50),
+         percentile_ms(v, ok, 90), percentile_ms(v, ok, 99), percentile_ms(v, ok, 99.9), (double) v[ok - 1] / 1e6);
+}
+
+int main(int argc, char **argv) {
+  int            err      = 0;
+  args_t         a        = {};
+  struct loadgen lg       = {};
+  pthread_t     *tids     = NULL;
+  uint32_t       nthreads = 0;
+  int64_t        start    = 0;
+
+  setup_pwhash_memlimit();
+
+#ifdef USE_SODIUM
+  try2(sodium_init(), "sodium initialize failed: %ld", _ret);
+#endif
+  try2(parse_dsl_args(argc, argv, &a));
+
+  lg.a               = &a;
+  lg.dst.sin6_family = AF_INET6;
+  lg.dst.sin6_port   = htons(a.server_port);
+  lg.latencies       = try2_p(calloc(a.requests, sizeof(*lg.latencies)), "calloc: %s", strerrno);
+  tids               = try2_p(calloc(a.concurrency, sizeof(*tids)), "calloc: %s", strerrno);
+  try2(resolve_ip_addr(a.family, a.server, &lg.dst.sin6_addr), "resolve_ip_addr: %s", strret);
+  /* mac1/cookie 密钥只派生一次，各线程复制 */
+  if (a.version == PROTO_V2)
+    try2(mac_ctx_init(&lg.mctx, a.psk));
+
+  start = now_ns();
+  for (; nthreads < a.concurrency; nthreads++)
+    try2(-pthread_create(&tids[nthreads], NULL, loadgen_thread, &lg), "pthread_create: %s", strret);
+
+err_cleanup:
+  for (uint32_t i = 0; i < nthreads; i++)
+    pthread_join(tids[i], NULL);
+  if (!err)
+    report(&lg, now_ns() - start);
+
+  free(tids);
+  free(lg.latencies);
+  mac_ctx_free(&lg.mctx);
+  free_args(&a);
+  return err;
+}
+
+// vim: set sw=2 ts=2 expandtab:
@@ -1,9 +1,14 @@
 #include <errno.h>
 #include <getopt.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <time.h>
@@ -15,23 +20,74 @@
 #include "try.h"
 #include "tuparser.h"
 
+#ifdef HAVE_KTUCTL
+#include <linux/capability.h>
+#include <sys/syscall.h>
+
+#include "ktuctl.h"
+
+/* 通过 ktuctl 命令层执行脚本，不再 fork/exec */
+static bool ktuctl_inproc = false;
+#endif
+
+/*
+ * 处理流水线：
+ *   主线程   recvmmsg → 限速 → mac1/cookie → 重放预检 → 准入 → crypto_q
+ *   工作线程 crypto_q：解密 → apply_q；加密回复 → send_q
+ *   执行线程 apply_q：串行执行命令 → crypto_q
+ *   主线程   send_q → sendmmsg
+ * Argon2id 和 AEAD 在工作线程中并行，内核配置的修改始终串行。
+ */
+#ifndef SERVER_BATCH
+#define SERVER_BATCH 32 // recvmmsg/sendmmsg 每批报文数
+#endif
+#ifndef SERVER_MAX_WORKERS
+#define SERVER_MAX_WORKERS 64
+#endif
+#ifndef SERVER_MAX_INFLIGHT
+#define SERVER_MAX_INFLIGHT 256 // 已接收但未回复的请求上限，超过即丢弃新请求
+#endif
+#ifndef SERVER_APPLY_BACKLOG
+#define SERVER_APPLY_BACKLOG 64 // 等待执行的命令上限，超过即丢弃已解密的请求
+#endif
+#ifndef SERVER_MAX_MESSAGES
+#define SERVER_MAX_MESSAGES 32 // 正在重组或缓存着回复的多报文消息上限
+#endif
+
+/* 何时要求 cookie（mac2）：auto 为负载过高时 */
+enum cookie_mode {
+  COOKIE_AUTO,
+  COOKIE_ALWAYS,
+  COOKIE_OFF,
+};
+
+static void print_usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s -k <psk> [--bind addr] [--port port] [--window window] [--replay-max n] "
+          "[--cookie auto|always|off] [--require-mac] [--workers n]\n",
+          prog);
+}
+
 /**
  * @brief Parses command-line arguments.
  * @return 0 on success, -EINVAL on error or if help is requested.
  */
 static int parse_arguments(int argc, char **argv, const char **bind_addr, const char **port, char **psk, uint32_t *window,
-                           uint32_t *replay_max) {
+                           uint32_t *replay_max, enum cookie_mode *cookie, bool *require_mac, uint32_t *workers) {
   int                  err            = 0;
   static struct option long_options[] = {{"bind", required_argument, 0, 'b'},
                                          {"port", required_argument, 0, 'p'},
                                          {"psk", required_argument, 0, 'k'},
                                          {"window", required_argument, 0, 'w'},
                                          {"replay-max", required_argument, 0, 'm'},
+                                         {"cookie", required_argument, 0, 'c'},
+                                         {"require-mac", no_argument, 0, 'r'},
+                                         {"workers", required_argument, 0, 'j'},
                                          {"help", no_argument, 0, 'h'},
                                          {0, 0, 0, 0}};
 
   int opt;
-  while ((opt = getopt_long(argc, argv, "b:p:k:w:m:h", long_options, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "b:p:k:w:m:c:rj:h", long_options, NULL)) != -1) {
     switch (opt) {
     case 'b':
       *bind_addr = optarg;
@@ -49,9 +105,34 @@ static int parse_arguments(int argc, char **argv, const char **bind_addr, const
     case 'm':
       try(parse_window(optarg, replay_max));
       break;
+    case 'c':
+      if (!strcmp(optarg, "auto")) {
+        *cookie = COOKIE_AUTO;
+      } else if (!strcmp(optarg, "always")) {
+        *cookie = COOKIE_ALWAYS;
+      } else if (!strcmp(optarg, "off")) {
+        *cookie = COOKIE_OFF;
+      } else {
+        log_error("invalid cookie mode: %s", optarg);
+        print_usage(argv[0]);
+        err = -EINVAL;
+        goto err_cleanup;
+      }
+      break;
+    case 'r':
+      *require_mac = true;
+      break;
+    case 'j':
+      if (parse_u32(optarg, workers) || !*workers || *workers > SERVER_MAX_WORKERS) {
+        log_error("invalid workers: %s (1-%d)", optarg, SERVER_MAX_WORKERS);
+        print_usage(argv[0]);
+        err = -EINVAL;
+        goto err_cleanup;
+      }
+      break;
     case 'h':
     default:
-      fprintf(stderr, "Usage: %s -k <psk> [--bind addr] [--port port] [--window window] [--replay-max n]\n", argv[0]);
+      print_usage(argv[0]);
       err = -EINVAL;
       goto err_cleanup;
     }
@@ -59,14 +140,14 @@ static int parse_arguments(int argc, char **argv, const char **bind_addr, const
 
   if (!*psk) {
     log_error("Missing required argument -k <psk>");
-    fprintf(stderr, "Usage: %s -k <psk> [--bind addr] [--port port] [--window window] [--replay-max n]\n", argv[0]);
+    print_usage(argv[0]);
     err = -EINVAL;
     goto err_cleanup;
   }
 
   if (strlen(*psk) < 8) {
     log_error("PSK must be at least 8 characters long");
-    fprintf(stderr, "Usage: %s -k <psk> [--bind addr] [--port port] [--window window] [--replay-max n]\n", argv[0]);
+    print_usage(argv[0]);
     err = -EINVAL;
     goto err_cleanup;
   }
@@ -112,6 +193,15 @@ static int setup_socket(int *sock_out, const char *bind_addr, const char *port,
   try2(sock != -1 ? 0 : -errno, "cannot create and bind socket: %s", strerror(errno));
   try2(addr_to_str((struct sockaddr_storage *) rp->ai_addr, bindstr_out, bindstr_len));
 
+  /* 取得每个请求的目的地址，回复从同一地址发出；:: 上的 IPv4-mapped 请求使用 IP_PKTINFO */
+  {
+    int one = 1;
+
+    if (rp->ai_family == AF_INET6)
+      try2_e(setsockopt(sock, IPPROTO_IPV6, IPV6_RECVPKTINFO, &one, sizeof(one)), "IPV6_RECVPKTINFO: %s", strerrno);
+    try2_e(setsockopt(sock, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one)), "IP_PKTINFO: %s", strerrno);
+  }
+
   /* 成功后把 socket 所有权交给调用方，避免在统一清理路径中被关闭。 */
   *sock_out = sock;
   sock      = -1;
@@ -125,6 +215,64 @@ err_cleanup:
   return err;
 }
 
+/*
+ * 请求的目的地址。绑定 :: 的多地址主机上，内核按路由为回复选择源地址，可能与客户端发往的地址不同，
+ * 客户端按地址匹配回复时会把它丢弃；因此记录请求的目的地址，回复时用 pktinfo 指定源地址。
+ */
+struct pktinfo {
+  int level; // IPPROTO_IP / IPPROTO_IPV6，0 表示没有
+  union {
+    struct in_pktinfo  v4;
+    struct in6_pktinfo v6;
+  };
+};
+
+/* 一个 pktinfo 控制消息的缓冲区 */
+union pktinfo_cmsg {
+  uint8_t        buf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
+  struct cmsghdr align;
+};
+
+static void pktinfo_parse(const struct msghdr *mh, struct pktinfo *pi) {
+  pi->level = 0;
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(mh); c; c = CMSG_NXTHDR((struct msghdr *) mh, c)) {
+    if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_PKTINFO) {
+      memcpy(&pi->v4, CMSG_DATA(c), sizeof(pi->v4));
+      /* ipi_spec_dst 是发送时使用的源地址 */
+      pi->v4.ipi_spec_dst = pi->v4.ipi_addr;
+      pi->v4.ipi_ifindex  = 0;
+      pi->level           = IPPROTO_IP;
+      return;
+    }
+    if (c->cmsg_level == IPPROTO_IPV6 && c->cmsg_type == IPV6_PKTINFO) {
+      /* 保留接口号，链路本地地址需要它 */
+      memcpy(&pi->v6, CMSG_DATA(c), sizeof(pi->v6));
+      pi->level = IPPROTO_IPV6;
+      return;
+    }
+  }
+}
+
+/* 按 pi 填写 mh 的控制消息，没有 pktinfo 时由内核选择源地址 */
+static void pktinfo_set(struct msghdr *mh, const struct pktinfo *pi, union pktinfo_cmsg *cmsg) {
+  struct cmsghdr *c;
+  size_t          len = pi->level == IPPROTO_IP ? sizeof(pi->v4) : sizeof(pi->v6);
+
+  mh->msg_control    = NULL;
+  mh->msg_controllen = 0;
+  if (!pi->level)
+    return;
+
+  memset(cmsg, 0, sizeof(*cmsg));
+  mh->msg_control    = cmsg->buf;
+  mh->msg_controllen = CMSG_SPACE(len);
+  c                  = CMSG_FIRSTHDR(mh);
+  c->cmsg_level      = pi->level;
+  c->cmsg_type       = pi->level == IPPROTO_IP ? IP_PKTINFO : IPV6_PKTINFO;
+  c->cmsg_len        = CMSG_LEN(len);
+  memcpy(CMSG_DATA(c), pi->level == IPPROTO_IP ? (const void *) &pi->v4 : (const void *) &pi->v6, len);
+}
+
 static bool detect_ktuctl(void) {
   const char *val   = getenv("TUTUICMPTUNNEL_USE_KTUCTL");
   uint32_t    val_n = 0;
@@ -173,6 +321,63 @@ static int write_all(int fd, const void *buf, size_t len) {
   return 0;
 }
 
+/* 在 PATH 中查找可执行文件，效果与 execlp 相同；PATH 中的空项表示当前目录 */
+static int find_in_path(const char *name, char *out, size_t size) {
+  const char *path = getenv("PATH");
+
+  if (strchr(name, '/'))
+    return snprintf(out, size, "%s", name) < (int) size ? 0 : -ENAMETOOLONG;
+
+  if (!path)
+    path = "/usr/bin:/bin";
+
+  while (1) {
+    size_t len = strcspn(path, ":");
+    int    n   = len ? snprintf(out, size, "%.*s/%s", (int) len, path, name) : snprintf(out, size, "%s", name);
+
+    if (n < (int) size && !access(out, X_OK))
+      return 0;
+    if (!path[len])
+      return -ENOENT;
+    path += len + 1;
+  }
+}
+
+#ifdef HAVE_KTUCTL
+/* 有效权限集中是否有 CAP_NET_ADMIN，内核据此允许 genl 修改命令 */
+static bool has_cap_net_admin(void) {
+  struct __user_cap_header_struct hdr                            = {.version = _LINUX_CAPABILITY_VERSION_3};
+  struct __user_cap_data_struct   data[_LINUX_CAPABILITY_U32S_3] = {};
+
+  if (syscall(SYS_capget, &hdr, data))
+    return false;
+
+  return data[CAP_TO_INDEX(CAP_NET_ADMIN)].effective & CAP_TO_MASK(CAP_NET_ADMIN);
+}
+
+/**
+ * @brief 在进程内执行 ktuctl 脚本，输出捕获到 resp_buf，语义与 execute_command() 相同。
+ *
+ * 只由 applier 线程调用：命令层使用全局状态，必须串行执行；输出写入本线程的内存流，不会捕获其它线程的日志。
+ *
+ * @return 0 on success, non-zero on failure.
+ */
+static int execute_inproc(char *resp_buf, size_t *resp_len_out, size_t resp_buf_size, const uint8_t *cmd, size_t cmd_len) {
+  int status = ktuctl_exec_script((const char *) cmd, cmd_len, resp_buf, resp_buf_size, resp_len_out);
+
+  if (status != 0) {
+    log_warn("command exited with status %d, but response has %zu bytes", status, *resp_len_out);
+    /* 如果已经有输出（可能是错误信息），仍然尝试发送给客户端 */
+    if (*resp_len_out == 0) {
+      log_error("command failed with no output");
+      return -EIO;
+    }
+  }
+
+  return 0;
+}
+#endif
+
 /**
  * @brief Executes a command in a child process, capturing stdout/stderr.
  * @param[out] resp_buf      Buffer to store the command's output.
@@ -186,14 +391,36 @@ static int execute_command(char *resp_buf, size_t *resp_len_out, size_t resp_buf
   int   outpipe[2] = {-1, -1};
   pid_t pid;
   bool  sudo = sudo_enabled();
+  char  prog[PATH_MAX];
 
   const char *tuctl_prog = "tuctl";
 
   if (detect_ktuctl()) {
+#ifdef HAVE_KTUCTL
+    if (ktuctl_inproc)
+      return execute_inproc(resp_buf, resp_len_out, resp_buf_size, cmd, cmd_len);
+#endif
     log_info("Use ktuctl instead of tuctl");
     tuctl_prog = "ktuctl";
   }
 
+  /*
+   * 服务器是多线程进程，fork 之后子进程只能调用 async-signal-safe 函数：
+   * 在父进程中查找程序路径、准备参数和失败消息，子进程只做 dup2/close/execv/write/_exit
+   */
+  char *const argv_sudo[]  = {"sudo", (char *) tuctl_prog, "script", "-", NULL};
+  char *const argv_tuctl[] = {(char *) tuctl_prog, "script", "-", NULL};
+  char *const *exec_argv   = sudo ? argv_sudo : argv_tuctl;
+  const char  *exec_fail   = sudo ? "execv sudo failed, please check sudo setting\n" : "execv failed\n";
+  size_t       fail_len    = strlen(exec_fail);
+
+  if (find_in_path(exec_argv[0], prog, sizeof(prog))) {
+    /* 与 exec 失败时相同，把错误信息作为输出返回给客户端 */
+    log_error("%s not found in PATH", exec_argv[0]);
+    *resp_len_out = scnprintf(resp_buf, resp_buf_size, "%s not found in PATH\n", exec_argv[0]);
+    return 0;
+  }
+
   try2_e(pipe(inpipe), "pipe: %s", strerrno);
   try2_e(pipe(outpipe), "pipe: %s", strerrno);
 
@@ -215,17 +442,11 @@ static int execute_command(char *resp_buf, size_t *resp_len_out, size_t resp_buf
     close(outpipe[1]);
     outpipe[1] = -1;
 
-    if (sudo) {
-      execlp("sudo", "sudo", tuctl_prog, "script", "-", NULL);
-    } else {
-      execlp(tuctl_prog, tuctl_prog, "script", "-", NULL);
-    }
+    execv(prog, exec_argv);
 
-    perror("execlp"); // Should not be reached
-    if (sudo) {
-      log_error("sudo enabled, please check sudo setting");
-    }
-    exit(127);
+    /* Should not be reached；不能用 stdio/log_*，也不能用 exit() 运行父进程的 atexit 处理函数 */
+    (void) !write(2, exec_fail, fail_len);
+    _exit(127);
   } else {
     int status;
 
@@ -459,127 +680,849 @@ err_cleanup:
   return err;
 }
 
-int main(int argc, char **argv) {
-  const char *bind_addr  = "::";
-  const char *port       = STR(DEFAULT_SERVER_PORT);
-  char       *psk        = NULL;
-  uint32_t    window     = DEFAULT_WINDOW;
-  uint32_t    replay_max = DEFAULT_REPLAY_MAX;
-  int         err        = 0;
-  int         sock       = -1;
+/* 按秒统计 Argon2id 次数，上一秒或本秒达到 COOKIE_LOAD_THRESHOLD 即视为负载过高 */
+struct load_meter {
+  time_t   sec;
+  uint64_t base;
+  bool     loaded;
+};
 
+static bool under_load(struct load_meter *lm, uint64_t derivations) {
+  time_t now = time(NULL);
+
+  if (now != lm->sec) {
+    lm->loaded = now == lm->sec + 1 && derivations - lm->base >= COOKIE_LOAD_THRESHOLD;
+    lm->sec    = now;
+    lm->base   = derivations;
+  }
+
+  return lm->loaded || derivations - lm->base >= COOKIE_LOAD_THRESHOLD;
+}
+
+/**
+ * @brief 解密前的廉价检查，只用到 BLAKE2b，伪造报文在这里被丢弃。
+ *
+ * - mac1 有效：负载过高时还要求 mac2 有效，否则需要回复 cookie；通过后去掉 MAC 尾部；
+ * - 没有有效 mac1（旧客户端或伪造报文）：负载过高或 require_mac 时丢弃，否则交给后续解密。
+ *
+ * @return 0 表示继续处理（*len 已去掉 MAC 尾部），-EAGAIN 表示应回复 cookie，其他负数表示丢弃。
+ */
+static int precheck_packet(struct mac_ctx *mac, const uint8_t *buf, size_t *len, const struct sockaddr_storage *cli,
+                           bool loaded, bool require_mac) {
+  if (mac1_verify(mac, buf, *len)) {
+    if (loaded && !mac2_verify(mac, buf, *len, cli))
+      return -EAGAIN;
+
+    *len -= 2 * MAC_LEN;
+    return 0;
+  }
+
+  if (loaded || require_mac)
+    return -EACCES;
+
+  return 0;
+}
+
+enum job_stage {
+  JOB_DECRYPT, // 待解密的请求
+  JOB_ENCRYPT, // 命令已执行，待加密的回复
+};
+
+/* 一个回复报文 */
+struct out_pkt {
+  size_t  len;
+  uint8_t buf[MAX_CT_SIZE];
+};
+
+/* 一个请求从接收到回复的全部状态，依次经过各个队列 */
+struct job {
+  struct list_head        list;
+  enum job_stage          stage;
+  struct sockaddr_storage cli;
+  socklen_t               clen;
+  struct pktinfo          dst; // 请求的目的地址，回复从这里发出
+  struct pkt_hdr          hdr;
+  uint8_t                 pkt[MAX_CT_SIZE]; // 请求密文
+  size_t                  pkt_len;
+  uint8_t                *cmd; // 替换 @client_ip@ 后的命令
+  size_t                  cmd_len;
+  char                   *resp; // 回复明文，容量为 resp_size
+  size_t                  resp_len;
+  size_t                  resp_size;
+  bool                    framed; // 多报文消息，以下字段有效
+  uint8_t                 type;   // 回复 MSG_DATA 或 MSG_ACK
+  uint64_t                msg_id;
+  uint64_t                mask; // MSG_DATA：要发送的分片；MSG_ACK：已收到的请求分片
+  struct out_pkt         *out;  // 加密后的回复报文
+  unsigned                nout;
+};
+
+enum msg_state {
+  MSG_ASSEMBLING, // 等待分片
+  MSG_EXECUTING,  // 已收齐，等待执行
+  MSG_DONE,       // 已执行，缓存回复供重传
+};
+
+/* 多报文消息按 msg_id 记录，收齐后只执行一次，重传时重新加密缓存的回复 */
+struct msg_entry {
+  struct list_head list; // 按最近活动排序，队首最新
+  uint64_t         id;
+  enum msg_state   state;
+  time_t           last;
+  struct msg_asm   req;
+  char            *resp;
+  size_t           resp_len;
+};
+
+struct job_queue {
+  pthread_mutex_t  lock;
+  pthread_cond_t   cond;
+  struct list_head head;
+  unsigned         len;
+};
+
+struct server {
+  int                  sock;
+  int                  efd; // send_q 有数据时通知主线程
+  enum cookie_mode     cookie;
+  bool                 require_mac;
+  struct psk_ctx       pctx;
+  struct mac_ctx       mctx;
+  struct load_meter    meter;
+  rate_limiter_t       rl;
+  pthread_mutex_t      rwin_lock;
   struct replay_window rwin;
-  int                  rwin_inited = 0;
+  struct job_queue     crypto_q;
+  struct job_queue     apply_q;
+  struct job_queue     send_q;
+  unsigned             inflight; // 原子访问
+  pthread_mutex_t      msg_lock;
+  struct list_head     msgs;
+  unsigned             nmsgs;
+};
+
+/* recvmmsg/sendmmsg 一批报文的缓冲区 */
+struct mmsg_batch {
+  struct mmsghdr          msgs[SERVER_BATCH];
+  struct iovec            iovs[SERVER_BATCH];
+  struct sockaddr_storage addrs[SERVER_BATCH];
+  union pktinfo_cmsg      cmsgs[SERVER_BATCH];
+  uint8_t                 bufs[SERVER_BATCH][MAX_CT_SIZE];
+  unsigned                n;
+};
+
+static void queue_init(struct job_queue *q) {
+  pthread_mutex_init(&q->lock, NULL);
+  pthread_cond_init(&q->cond, NULL);
+  INIT_LIST_HEAD(&q->head);
+  q->len = 0;
+}
 
-  setup_pwhash_memlimit();
+/**
+ * @brief 入队，队列长度达到 max 时拒绝（max 为 0 表示不限）。
+ * @param[in] front  插到队首：回复优先于新请求，已执行的命令不会因新请求而饿死。
+ * @return 0 成功，-EAGAIN 队列已满。
+ */
+static int queue_push(struct job_queue *q, struct job *job, unsigned max, bool front) {
+  pthread_mutex_lock(&q->lock);
+  if (max && q->len >= max) {
+    pthread_mutex_unlock(&q->lock);
+    return -EAGAIN;
+  }
 
-#ifdef USE_SODIUM
-  try2(sodium_init(), "libsodium init failed: %s", "unknown error");
-#endif
-  try2(parse_arguments(argc, argv, &bind_addr, &port, &psk, &window, &replay_max));
+  if (front)
+    list_add(&job->list, &q->head);
+  else
+    list_add_tail(&job->list, &q->head);
+  q->len++;
+  pthread_cond_signal(&q->cond);
+  pthread_mutex_unlock(&q->lock);
+  return 0;
+}
 
-  {
-    char bindstr[128];
-    try2(setup_socket(&sock, bind_addr, port, bindstr, sizeof(bindstr)));
-    log_info("Server listen %s, replay window = %ds, max=%d", bindstr, window, replay_max);
+/* 阻塞直到队列非空 */
+static struct job *queue_pop(struct job_queue *q) {
+  struct job *job;
+
+  pthread_mutex_lock(&q->lock);
+  while (list_empty(&q->head))
+    pthread_cond_wait(&q->cond, &q->lock);
+
+  job = list_first_entry(&q->head, struct job, list);
+  list_del(&job->list);
+  q->len--;
+  pthread_mutex_unlock(&q->lock);
+  return job;
+}
+
+/* 取出全部任务，不阻塞 */
+static void queue_drain(struct job_queue *q, struct list_head *out) {
+  pthread_mutex_lock(&q->lock);
+  list_splice_init(&q->head, out);
+  q->len = 0;
+  pthread_mutex_unlock(&q->lock);
+}
+
+static void job_free(struct server *s, struct job *job) {
+  free(job->cmd);
+  free(job->resp);
+  free(job->out);
+  free(job);
+  __atomic_sub_fetch(&s->inflight, 1, __ATOMIC_RELAXED);
+}
+
+static void msg_entry_free(struct server *s, struct msg_entry *e) {
+  list_del(&e->list);
+  s->nmsgs--;
+  msg_asm_free(&e->req);
+  if (e->resp)
+    tucrypto_memzero(e->resp, e->resp_len);
+  free(e->resp);
+  free(e);
+}
+
+/* 调用者持有 msg_lock */
+static struct msg_entry *msg_lookup(struct server *s, uint64_t id) {
+  struct msg_entry *e;
+
+  list_for_each_entry(e, &s->msgs, list) {
+    if (e->id == id)
+      return e;
+  }
+
+  return NULL;
+}
+
+/**
+ * @brief 为新消息分配记录，调用者持有 msg_lock。
+ *
+ * 超过重放窗口没有活动的记录先回收：此后该消息的旧报文会被重放检查拒绝。
+ * 记录数达到 SERVER_MAX_MESSAGES 时淘汰最久没有活动的记录，等待执行的除外。
+ *
+ * @return 新记录，没有可淘汰的记录或内存不足时返回 NULL。
+ */
+static struct msg_entry *msg_entry_new(struct server *s, uint64_t id, time_t now) {
+  struct msg_entry *e, *tmp;
+
+  list_for_each_entry_safe_reverse(e, tmp, &s->msgs, list) {
+    if (e->state != MSG_EXECUTING && (now - e->last > (time_t) s->rwin.window || s->nmsgs >= SERVER_MAX_MESSAGES))
+      msg_entry_free(s, e);
+  }
+
+  if (s->nmsgs >= SERVER_MAX_MESSAGES)
+    return NULL;
+
+  e = calloc(1, sizeof(*e));
+  if (!e)
+    return NULL;
+
+  e->id    = id;
+  e->state = MSG_ASSEMBLING;
+  msg_asm_init(&e->req, id);
+  list_add(&e->list, &s->msgs);
+  s->nmsgs++;
+  return e;
+}
+
+/* 执行失败或无法排队：删除记录，客户端重试时重新执行 */
+static void msg_forget(struct server *s, uint64_t id) {
+  struct msg_entry *e;
+
+  pthread_mutex_lock(&s->msg_lock);
+  e = msg_lookup(s, id);
+  if (e)
+    msg_entry_free(s, e);
+  pthread_mutex_unlock(&s->msg_lock);
+}
+
+/* 命令已执行：缓存回复，之后的探测和 ACK 只重传，不再执行 */
+static void msg_done(struct server *s, const struct job *job) {
+  struct msg_entry *e;
+  char             *resp = malloc(job->resp_len + 1);
+
+  pthread_mutex_lock(&s->msg_lock);
+  e = msg_lookup(s, job->msg_id);
+  if (e && resp) {
+    memcpy(resp, job->resp, job->resp_len);
+    e->resp     = resp;
+    e->resp_len = job->resp_len;
+    e->state    = MSG_DONE;
+    e->last     = time(NULL);
+    resp        = NULL;
+  } else if (e) {
+    /* 无法缓存回复：删除记录，重传时重新执行 */
+    msg_entry_free(s, e);
+  }
+  pthread_mutex_unlock(&s->msg_lock);
+  free(resp);
+}
+
+/* 复制缓存的回复到 job，调用者持有 msg_lock */
+static int msg_copy_resp(struct job *job, const struct msg_entry *e) {
+  job->resp = malloc(e->resp_len + 1);
+  if (!job->resp)
+    return -ENOMEM;
+
+  memcpy(job->resp, e->resp, e->resp_len);
+  job->resp_len  = e->resp_len;
+  job->resp_size = e->resp_len + 1;
+  return 0;
+}
+
+static int handle_encrypt(struct server *s, struct job *job);
+
+enum msg_action {
+  MSG_IGNORE,  // 等待更多分片或等待执行
+  MSG_EXECUTE, // 已收齐，交给执行线程
+  MSG_REPLY,   // 回复 ACK 或重传缓存的回复
+};
+
+/**
+ * @brief 处理一个已认证的消息分片。
+ *
+ * - 数据分片：放入重组缓冲区，收齐后执行；收到最后一个分片但仍不完整时回复 ACK，客户端只重传缺失的分片；
+ * - 已执行的消息再次收到最后一个分片（客户端的探测）：重传全部回复；
+ * - ACK：重传客户端还没有收到的回复分片。
+ *
+ * @return 0 job 已交给其他队列，负数表示丢弃（由调用者释放 job）。
+ */
+static int handle_message(struct server *s, struct job *job, const uint8_t *pt, size_t pt_len) {
+  struct msg_frame  f;
+  struct msg_entry *e;
+  enum msg_action   action  = MSG_IGNORE;
+  uint8_t          *msg     = NULL;
+  size_t            msg_len = 0;
+  time_t            now     = time(NULL);
+  uint64_t          mask;
+  char              abuf[128];
+  int               err = 0;
+
+  if (msg_frame_parse(pt, pt_len, &f)) {
+    if (addr_to_str(&job->cli, abuf, sizeof(abuf)) >= 0)
+      log_error("drop: malformed message from %s", abuf);
+    return -EINVAL;
+  }
+
+  job->framed = true;
+  job->msg_id = f.id;
+
+  pthread_mutex_lock(&s->msg_lock);
+  e = msg_lookup(s, f.id);
+  if (f.type == MSG_ACK) {
+    if (e && e->state == MSG_DONE && !msg_ack_mask(&f, &mask)) {
+      job->type = MSG_DATA;
+      job->mask = msg_full_mask(msg_frag_count(e->resp_len)) & ~mask;
+      action    = job->mask && !msg_copy_resp(job, e) ? MSG_REPLY : MSG_IGNORE;
+    }
+  } else {
+    if (!e) {
+      e = msg_entry_new(s, f.id, now);
+      if (!e)
+        log_warn("too many pending messages, dropping fragment");
+    }
+
+    if (e && e->state == MSG_ASSEMBLING) {
+      int r = msg_asm_add(&e->req, &f);
+
+      if (r > 0) {
+        /* 取走重组缓冲区，替换 @client_ip@ 在锁外进行 */
+        msg          = e->req.buf;
+        msg_len      = e->req.len;
+        e->req.buf   = NULL;
+        e->req.count = 0;
+        e->state     = MSG_EXECUTING;
+        action       = MSG_EXECUTE;
+      } else if (r == 0 && f.index + 1 == f.count) {
+        job->type = MSG_ACK;
+        job->mask = e->req.mask;
+        action    = MSG_REPLY;
+      } else if (r < 0) {
+        log_error("drop: inconsistent message fragment");
+      }
+    } else if (e && e->state == MSG_DONE && f.index + 1 == f.count) {
+      job->type = MSG_DATA;
+      job->mask = msg_full_mask(msg_frag_count(e->resp_len));
+      action    = msg_copy_resp(job, e) ? MSG_IGNORE : MSG_REPLY;
+    }
+  }
+  if (e)
+    e->last = now;
+  pthread_mutex_unlock(&s->msg_lock);
+
+  switch (action) {
+  case MSG_REPLY:
+    return handle_encrypt(s, job);
+  case MSG_IGNORE:
+    return -EINPROGRESS;
+  case MSG_EXECUTE:
+    break;
+  }
+
+  if (addr_to_str(&job->cli, abuf, sizeof(abuf)) >= 0) {
+    log_info("command from %s (%zu bytes in %u fragments, v%d)", abuf, msg_len, msg_frag_count(msg_len), job->hdr.version);
+    log_info("  %.*s", (int) msg_len, msg);
+  }
+
+  err = replace_client_ip(msg, msg_len, &job->cli, job->clen, &job->cmd, &job->cmd_len);
+  if (err)
+    log_error("client ip replacement failed");
+  else if ((err = queue_push(&s->apply_q, job, SERVER_APPLY_BACKLOG, false)))
+    log_error("apply queue full, dropping command");
+  if (err)
+    msg_forget(s, f.id);
+
+  tucrypto_memzero(msg, msg_len);
+  free(msg);
+  return err;
+}
+
+/**
+ * @brief 解密请求并准备命令，成功后放入 apply_q。
+ * @return 0 成功，负数表示丢弃（由调用者释放 job）。
+ */
+static int handle_decrypt(struct server *s, struct job *job) {
+  int                err    = 0;
+  unsigned long long pt_len = 0;
+  uint8_t            pt[MAX_PT_SIZE];
+  char               abuf[128];
+  bool               fresh;
+
+  try2(decrypt_and_validate_packet(pt, &pt_len, job->pkt, (ssize_t) job->pkt_len, NULL, &s->pctx, &job->cli, &job->hdr));
+
+  /* 认证通过后才记录 nonce；检查与插入在同一临界区内，同一报文并发解密时只有一个能通过 */
+  pthread_mutex_lock(&s->rwin_lock);
+  fresh = replay_check(&s->rwin, job->hdr.ts, job->hdr.nonce) && !replay_add(&s->rwin, job->hdr.ts, job->hdr.nonce);
+  pthread_mutex_unlock(&s->rwin_lock);
+  if (!fresh) {
+    if (addr_to_str(&job->cli, abuf, sizeof(abuf)) >= 0)
+      log_error("drop: replay/window from %s", abuf);
+    err_cleanup(-EACCES);
+  }
+
+  /* 多报文消息只用于 v2，旧客户端的单报文请求照常处理 */
+  if (job->hdr.version == PROTO_V2 && pt_len && pt[0] == MSG_MAGIC) {
+    err = handle_message(s, job, pt, (size_t) pt_len);
+    goto err_cleanup;
+  }
+
+  try2(remove_padding(pt, &pt_len));
+
+  if (addr_to_str(&job->cli, abuf, sizeof(abuf)) >= 0) {
+    log_info("command from %s (%llu bytes, v%d)", abuf, pt_len, job->hdr.version);
+    log_info("  %.*s", (int) pt_len, pt);
+  }
+
+  /* 替换 @client_ip@ 占位符 */
+  try2(replace_client_ip(pt, pt_len, &job->cli, job->clen, &job->cmd, &job->cmd_len), "client ip replacement failed");
+  try2(queue_push(&s->apply_q, job, SERVER_APPLY_BACKLOG, false), "apply queue full, dropping command");
+  err = 0;
+
+err_cleanup:
+  tucrypto_memzero(pt, sizeof(pt));
+  return err;
+}
+
+/* 加密一个回复报文，并记录其 nonce，防止回复被反射回服务器 */
+static int seal_reply(struct server *s, struct job *job, const void *pt, size_t pt_len, struct out_pkt *out) {
+  uint64_t ts;
+  int      err;
+
+  /* 回复沿用请求的协议版本和 salt，v2 的长期密钥此时已在缓存中 */
+  try(encrypt_packet(out->buf, &out->len, &s->pctx, &job->hdr, NULL, pt, pt_len), "failed to encrypt response: %s", strret);
+
+  memcpy(&ts, out->buf + SALT_LEN, sizeof(ts));
+  pthread_mutex_lock(&s->rwin_lock);
+  err = replay_add(&s->rwin, (time_t) be64toh(ts), out->buf + SALT_LEN + TS_LEN);
+  pthread_mutex_unlock(&s->rwin_lock);
+  if (err)
+    log_error("cannot add to replay list");
+
+  return 0;
+}
+
+/* 多报文消息的回复：一个 ACK，或 mask 中的数据分片，每个分片单独加密 */
+static int encrypt_message(struct server *s, struct job *job) {
+  uint8_t  pt[MSG_HDR_LEN + MSG_FRAG_DATA];
+  size_t   pt_len;
+  uint64_t mask = job->type == MSG_ACK ? 1 : job->mask & msg_full_mask(msg_frag_count(job->resp_len));
+  int      err  = 0;
+
+  job->nout = 0;
+  job->out  = try_p(calloc((size_t) __builtin_popcountll(mask), sizeof(*job->out)));
+
+  for (unsigned i = 0; i < MSG_MAX_FRAGMENTS; i++) {
+    if (!(mask & (1ULL << i)))
+      continue;
+
+    if (job->type == MSG_ACK)
+      pt_len = msg_ack_frame(pt, sizeof(pt), job->msg_id, job->mask);
+    else
+      pt_len = msg_data_frame(pt, sizeof(pt), job->msg_id, job->resp, job->resp_len, i);
+    try2(seal_reply(s, job, pt, pt_len, &job->out[job->nout]));
+    job->nout++;
   }
 
-  replay_window_init(&rwin, window, replay_max);
-  rwin_inited = 1;
+  if (job->type == MSG_ACK)
+    log_info("message incomplete, ack %016" PRIx64, job->mask);
+  else
+    log_info("response: %zu bytes, %u of %u fragments", job->resp_len, job->nout, msg_frag_count(job->resp_len));
+  err = 0;
+
+err_cleanup:
+  tucrypto_memzero(pt, sizeof(pt));
+  return err;
+}
+
+/**
+ * @brief 填充并加密回复，成功后放入 send_q 并通知主线程。
+ * @return 0 成功，负数表示丢弃（由调用者释放 job）。
+ */
+static int handle_encrypt(struct server *s, struct job *job) {
+  const uint64_t one = 1;
+
+  if (job->framed) {
+    try(encrypt_message(s, job));
+  } else {
+    /* Add random padding to response to obscure its length */
+    size_t padding_len;
+
+    if (job->resp_len < job->resp_size - 2) {
+      padding_len = tucrypto_randombytes_uniform(256);
+      if (job->resp_len + padding_len >= job->resp_size) {
+        padding_len = job->resp_size - job->resp_len - 1;
+      }
+      memset(job->resp + job->resp_len, '#', padding_len);
+      job->resp_len += padding_len;
+    }
 
-  rate_limiter_t rl;
-  rl_init(&rl);
+    if (job->resp_len >= job->resp_size) {
+      job->resp_len = job->resp_size - 1;
+    }
+
+    job->resp[job->resp_len] = '\0';
+    log_info("response: %zu bytes", job->resp_len);
+
+    job->out  = try_p(calloc(1, sizeof(*job->out)));
+    job->nout = 1;
+    try(seal_reply(s, job, job->resp, job->resp_len, job->out));
+  }
+
+  queue_push(&s->send_q, job, 0, false);
+  if (write(s->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    log_error("eventfd write: %s", strerrno);
+  return 0;
+}
+
+static void *worker_main(void *arg) {
+  struct server *s = arg;
 
-  // Main processing loop
   while (1) {
-    struct sockaddr_storage cli;
-    socklen_t               clen = sizeof(cli);
-    uint8_t                 buf[MAX_CT_SIZE], pt[MAX_PT_SIZE];
-    unsigned long long      pt_len = 0;
-
-    ssize_t len = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *) &cli, &clen);
-    if (len < 0) {
-      perror("recvfrom");
+    struct job *job = queue_pop(&s->crypto_q);
+    int         err = job->stage == JOB_DECRYPT ? handle_decrypt(s, job) : handle_encrypt(s, job);
+
+    if (err)
+      job_free(s, job);
+  }
+
+  return NULL;
+}
+
+/* 唯一执行命令的线程：内核配置的修改按解密完成的顺序串行进行 */
+static void *applier_main(void *arg) {
+  struct server *s = arg;
+
+  while (1) {
+    struct job *job = queue_pop(&s->apply_q);
+
+    /* 单报文的回复仍然不能超过一个报文 */
+    job->resp_size = job->framed ? MSG_MAX_LEN + 1 : MAX_PT_SIZE;
+    job->resp      = malloc(job->resp_size);
+    if (!job->resp || execute_command(job->resp, &job->resp_len, job->resp_size - 1, job->cmd, job->cmd_len) != 0) {
+      log_error("command execution failed");
+      if (job->framed)
+        msg_forget(s, job->msg_id);
+      job_free(s, job);
       continue;
     }
 
+    if (job->framed) {
+      job->type = MSG_DATA;
+      job->mask = msg_full_mask(msg_frag_count(job->resp_len));
+      msg_done(s, job);
+    }
+
+    free(job->cmd);
+    job->cmd   = NULL;
+    job->stage = JOB_ENCRYPT;
+    queue_push(&s->crypto_q, job, 0, true);
+  }
+
+  return NULL;
+}
+
+/* 发送 msgs 中的全部报文，出错的报文跳过 */
+static void send_batch(int sock, struct mmsghdr *msgs, unsigned n) {
+  unsigned sent = 0;
+
+  while (sent < n) {
+    int r = sendmmsg(sock, msgs + sent, n - sent, 0);
+
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      log_error("sendmmsg: %s", strerrno);
+      sent++;
+      continue;
+    }
+    sent += (unsigned) r;
+  }
+}
+
+/**
+ * @brief 主线程对一批请求做廉价检查，通过的请求复制到 job 交给工作线程。
+ *
+ * 这里的检查都不涉及 Argon2id：限速、mac1/cookie、重放窗口（时间戳和已见过的 nonce）。
+ * 在途请求达到 SERVER_MAX_INFLIGHT 时直接丢弃，客户端会重试。
+ * 需要的 cookie reply 写入 tx，在本批处理完后一次发送。
+ */
+static void admit_requests(struct server *s, struct mmsg_batch *rx, struct mmsg_batch *tx) {
+  unsigned shed = 0;
+  char     abuf[128];
+
+  tx->n = 0;
+  for (unsigned i = 0; i < rx->n; i++) {
+    const struct sockaddr_storage *cli  = &rx->addrs[i];
+    socklen_t                      clen = rx->msgs[i].msg_hdr.msg_namelen;
+    uint8_t                       *buf  = rx->bufs[i];
+    size_t                         len  = rx->msgs[i].msg_len;
+    struct job                    *job;
+    struct pktinfo                 dst;
+    uint64_t                       ts;
+    bool                           loaded, seen;
+    int                            err;
+
+    pktinfo_parse(&rx->msgs[i].msg_hdr, &dst);
+
     // 先按来源限速，超过速率直接丢包
-    if (!rl_allow(&rl, &cli)) {
-      char abuf[128];
-      if (addr_to_str(&cli, abuf, sizeof(abuf)) == 0) {
+    if (!rl_allow(&s->rl, cli)) {
+      if (addr_to_str(cli, abuf, sizeof(abuf)) == 0) {
         log_info("too many requests from %s, dropping", abuf);
       }
       continue;
     }
 
-    if (decrypt_and_validate_packet(pt, &pt_len, buf, len, &rwin, psk, &cli) != 0) {
+    loaded = s->cookie == COOKIE_ALWAYS ||
+             (s->cookie == COOKIE_AUTO && under_load(&s->meter, __atomic_load_n(&s->pctx.derivations, __ATOMIC_RELAXED)));
+
+    /* 不记录日志：洪泛时逐包写日志的开销比检查本身还大 */
+    err = precheck_packet(&s->mctx, buf, &len, cli, loaded, s->require_mac);
+    if (err == -EAGAIN) {
+      if (!cookie_reply_make(&s->mctx, cli, buf, len, tx->bufs[tx->n])) {
+        tx->iovs[tx->n] = (struct iovec) {.iov_base = tx->bufs[tx->n], .iov_len = COOKIE_REPLY_LEN};
+        tx->msgs[tx->n] = (struct mmsghdr) {
+          .msg_hdr = {.msg_name = (void *) cli, .msg_namelen = clen, .msg_iov = &tx->iovs[tx->n], .msg_iovlen = 1}};
+        pktinfo_set(&tx->msgs[tx->n].msg_hdr, &dst, &tx->cmsgs[tx->n]);
+        tx->n++;
+      }
       continue;
     }
+    if (err || len < MIN_LEN)
+      continue;
+
+    /* 重放预检：过期或已处理过的报文不必再派生密钥；认证后工作线程还会再检查一次 */
+    memcpy(&ts, buf + SALT_LEN, sizeof(ts));
+    pthread_mutex_lock(&s->rwin_lock);
+    seen = !replay_check(&s->rwin, (time_t) be64toh(ts), buf + SALT_LEN + TS_LEN);
+    pthread_mutex_unlock(&s->rwin_lock);
+    if (seen)
+      continue;
 
-    if (remove_padding(pt, &pt_len)) {
+    if (__atomic_load_n(&s->inflight, __ATOMIC_RELAXED) >= SERVER_MAX_INFLIGHT) {
+      shed++;
       continue;
     }
 
-    {
-      char abuf[128];
-      if (addr_to_str(&cli, abuf, sizeof(abuf)) == 0) {
-        log_info("command from %s (%llu bytes)", abuf, pt_len);
-        log_info("  %.*s", (int) pt_len, pt);
-      }
+    job = calloc(1, sizeof(*job));
+    if (!job) {
+      shed++;
+      continue;
     }
+    job->stage   = JOB_DECRYPT;
+    job->cli     = *cli;
+    job->clen    = clen;
+    job->dst     = dst;
+    job->pkt_len = len;
+    memcpy(job->pkt, buf, len);
+    __atomic_add_fetch(&s->inflight, 1, __ATOMIC_RELAXED);
+    queue_push(&s->crypto_q, job, 0, false);
+  }
 
-    {
-      uint8_t *cmd     = pt;
-      size_t   cmd_len = pt_len;
-      uint8_t *new_cmd = NULL;
-      char     resp[MAX_PT_SIZE];
-      size_t   resp_len = 0;
+  if (shed)
+    log_warn("server busy, dropped %u requests", shed);
 
-      /* 替换 @client_ip@ 占位符 */
-      if (replace_client_ip(pt, pt_len, &cli, clen, &new_cmd, &cmd_len) != 0) {
-        log_error("client ip replacement failed");
-        continue;
+  if (tx->n)
+    send_batch(s->sock, tx->msgs, tx->n);
+}
+
+/* 发送工作线程加密好的回复，一个 job 可能有多个报文 */
+static void send_replies(struct server *s) {
+  struct mmsghdr     msgs[SERVER_BATCH];
+  struct iovec       iovs[SERVER_BATCH];
+  union pktinfo_cmsg cmsgs[SERVER_BATCH];
+  struct list_head   done;
+  struct job        *job, *tmp;
+  uint64_t           cnt;
+  unsigned           n = 0;
+
+  if (read(s->efd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+    log_error("eventfd read: %s", strerrno);
+
+  INIT_LIST_HEAD(&done);
+  queue_drain(&s->send_q, &done);
+
+  list_for_each_entry(job, &done, list) {
+    for (unsigned i = 0; i < job->nout; i++) {
+      iovs[n] = (struct iovec) {.iov_base = job->out[i].buf, .iov_len = job->out[i].len};
+      msgs[n] = (struct mmsghdr) {
+        .msg_hdr = {.msg_name = &job->cli, .msg_namelen = job->clen, .msg_iov = &iovs[n], .msg_iovlen = 1}};
+      pktinfo_set(&msgs[n].msg_hdr, &job->dst, &cmsgs[n]);
+
+      if (++n == SERVER_BATCH) {
+        send_batch(s->sock, msgs, n);
+        n = 0;
       }
-      cmd = new_cmd;
+    }
+  }
 
-      if (execute_command(resp, &resp_len, sizeof(resp), cmd, cmd_len) != 0) {
-        log_error("command execution failed");
-        free(new_cmd);
+  if (n)
+    send_batch(s->sock, msgs, n);
+
+  list_for_each_entry_safe(job, tmp, &done, list) {
+    list_del(&job->list);
+    job_free(s, job);
+  }
+}
+
+/* 主循环：接收请求、发送回复 */
+static int serve(struct server *s) {
+  static struct mmsg_batch rx, tx;
+  struct pollfd            pfd[2] = {{.fd = s->sock, .events = POLLIN}, {.fd = s->efd, .events = POLLIN}};
+
+  while (1) {
+    if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+      if (errno == EINTR)
         continue;
-      }
-      free(new_cmd);
-
-      /* Add random padding to response to obscure its length */
-      {
-        size_t padding_len;
-        if (resp_len < sizeof(resp) - 2) {
-          padding_len = tucrypto_randombytes_uniform(256);
-          if (resp_len + padding_len >= sizeof(resp)) {
-            padding_len = sizeof(resp) - resp_len - 1;
-          }
-          memset(resp + resp_len, '#', padding_len);
-          resp_len += padding_len;
-        }
-
-        if (resp_len >= sizeof(resp)) {
-          resp_len = sizeof(resp) - 1;
-        }
-      }
+      ret(-errno, "poll: %s", strerrno);
+    }
 
-      resp[resp_len] = '\0';
-      log_info("response: %zu bytes", resp_len);
+    if (pfd[1].revents & POLLIN)
+      send_replies(s);
 
-      if (encrypt_and_send_packet(sock, (struct sockaddr *) &cli, clen, &rwin, psk, resp, resp_len, NULL)) {
-        log_error("failed to send response");
-      }
+    if (!(pfd[0].revents & POLLIN))
+      continue;
+
+    for (unsigned i = 0; i < SERVER_BATCH; i++) {
+      rx.iovs[i] = (struct iovec) {.iov_base = rx.bufs[i], .iov_len = sizeof(rx.bufs[i])};
+      rx.msgs[i] = (struct mmsghdr) {
+        .msg_hdr = {.msg_name       = &rx.addrs[i],
+                    .msg_namelen    = sizeof(rx.addrs[i]),
+                    .msg_iov        = &rx.iovs[i],
+                    .msg_iovlen     = 1,
+                    .msg_control    = rx.cmsgs[i].buf,
+                    .msg_controllen = sizeof(rx.cmsgs[i].buf)}};
     }
+
+    int n = recvmmsg(s->sock, rx.msgs, SERVER_BATCH, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EINTR)
+        log_error("recvmmsg: %s", strerrno);
+      continue;
+    }
+
+    rx.n = (unsigned) n;
+    admit_requests(s, &rx, &tx);
+  }
+
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  static struct server srv;
+  const char          *bind_addr   = "::";
+  const char          *port        = STR(DEFAULT_SERVER_PORT);
+  char                *psk         = NULL;
+  uint32_t             window      = DEFAULT_WINDOW;
+  uint32_t             replay_max  = DEFAULT_REPLAY_MAX;
+  uint32_t             workers     = 0;
+  int                  err         = 0;
+  int                  rwin_inited = 0;
+  pthread_t            tid;
+
+  srv.sock   = -1;
+  srv.efd    = -1;
+  srv.cookie = COOKIE_AUTO;
+  psk_ctx_init(&srv.pctx, NULL);
+  setup_pwhash_memlimit();
+
+#ifdef USE_SODIUM
+  try2(sodium_init(), "libsodium init failed: %s", "unknown error");
+#endif
+  try2(parse_arguments(argc, argv, &bind_addr, &port, &psk, &window, &replay_max, &srv.cookie, &srv.require_mac, &workers));
+  if (!workers) {
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    workers    = nproc < 1 ? 1 : nproc > SERVER_MAX_WORKERS ? SERVER_MAX_WORKERS : (uint32_t) nproc;
   }
 
+#ifdef HAVE_KTUCTL
+  /* 以 root 或 AmbientCapabilities=CAP_NET_ADMIN 运行时无需 sudo；禁用 sudo 时内核按本进程的 uid/gid 鉴权 */
+  ktuctl_inproc = has_cap_net_admin() || !sudo_enabled();
+  if (!ktuctl_inproc)
+    log_warn("CAP_NET_ADMIN not available, ktuctl commands will be run through sudo");
+#endif
+
+  /* mac1/cookie 密钥在启动时派生一次 */
+  try2(mac_ctx_init(&srv.mctx, psk));
+
+  {
+    char bindstr[128];
+    try2(setup_socket(&srv.sock, bind_addr, port, bindstr, sizeof(bindstr)));
+    log_info("Server listen %s, replay window = %ds, max=%d, workers=%u", bindstr, window, replay_max, workers);
+  }
+
+  try2(replay_window_init(&srv.rwin, window, replay_max), "replay_window_init: %s", strret);
+  rwin_inited  = 1;
+  srv.pctx.psk = psk;
+  rl_init(&srv.rl);
+
+  srv.efd = try2_e(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC), "eventfd: %s", strerrno);
+  pthread_mutex_init(&srv.rwin_lock, NULL);
+  queue_init(&srv.crypto_q);
+  queue_init(&srv.apply_q);
+  queue_init(&srv.send_q);
+  pthread_mutex_init(&srv.msg_lock, NULL);
+  INIT_LIST_HEAD(&srv.msgs);
+
+  for (uint32_t i = 0; i < workers; i++) {
+    try2(-pthread_create(&tid, NULL, worker_main, &srv), "pthread_create: %s", strret);
+    pthread_detach(tid);
+  }
+  try2(-pthread_create(&tid, NULL, applier_main, &srv), "pthread_create: %s", strret);
+  pthread_detach(tid);
+
+  err = serve(&srv);
+
 err_cleanup:
+#ifdef HAVE_KTUCTL
+  ktuctl_exit();
+#endif
   if (rwin_inited)
-    replay_window_free(&rwin);
-  if (sock != -1)
-    close(sock);
+    replay_window_free(&srv.rwin);
+  psk_ctx_free(&srv.pctx);
+  mac_ctx_free(&srv.mctx);
+  if (srv.efd != -1)
+    close(srv.efd);
+  if (srv.sock != -1)
+    close(srv.sock);
   free(psk);
   return err;
 }